@@ -50,10 +50,10 @@ fork do
   mmap[3_000_000, 3] = "zz\n"
 end
 
-line = ""
+line = String.new(capacity: 3)
 index = 0
 loop do
-  line = mmap[index, 3]
+  mmap.read_into(line, index, 3)
   index += 3
 
   if line == "\0\0\0"
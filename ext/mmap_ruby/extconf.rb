@@ -7,4 +7,12 @@ require "mkmf"
 # selectively, or entirely remove this flag.
 append_cflags("-fvisibility=hidden")
 
+have_func("memrchr", "string.h")
+have_func("mremap", "sys/mman.h")
+have_func("mlock2", "sys/mman.h")
+have_func("pthread_mutex_timedlock", "pthread.h")
+have_func("pthread_mutexattr_setrobust", "pthread.h")
+have_func("pthread_mutex_consistent", "pthread.h")
+have_struct_member("struct stat", "st_mtim", "sys/stat.h")
+
 create_makefile("mmap_ruby/mmap_ruby")
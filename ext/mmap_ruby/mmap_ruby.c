@@ -6,36 +6,165 @@
 #define MMAP_RUBY_ORIGIN  2
 #define MMAP_RUBY_CHANGE  (MMAP_RUBY_MODIFY | 4)
 #define MMAP_RUBY_PROTECT 8
+#define MMAP_RUBY_WINDOWED 16
 
 #define MMAP_RUBY_FIXED (1<<1)
 #define MMAP_RUBY_ANON  (1<<2)
 #define MMAP_RUBY_LOCK  (1<<3)
 #define MMAP_RUBY_IPC   (1<<4)
 #define MMAP_RUBY_TMP   (1<<5)
+#define MMAP_RUBY_POPULATE (1<<6)
+#define MMAP_RUBY_DIRTY    (1<<7)
+
+#define MMAP_RUBY_ONFAULT  (1<<8)
+#define MMAP_RUBY_WINDOW   (1<<9)
+#define MMAP_RUBY_BORROWED (1<<10)
+
+#define MMAP_DIRTY_MAX 256
+
+/*
+ * Kinds of per-range state set by the ranged forms of madvise, mlock and
+ * mprotect. Records of one kind never overlap; advice is split by the VMA
+ * flag it controls so that, say, MADV_RANDOM and MADV_DONTDUMP coexist.
+ */
+#define MMAP_RANGE_ACCESS 0
+#define MMAP_RANGE_HUGE   1
+#define MMAP_RANGE_DUMP   2
+#define MMAP_RANGE_FORK   3
+#define MMAP_RANGE_LOCK   4
+#define MMAP_RANGE_PROT   5
+
+typedef struct {
+  int kind;
+  int arg;
+  size_t beg;
+  size_t end;
+} mmap_range_t;
+
+#define MMAP_GROWTH_LINEAR    0
+#define MMAP_GROWTH_GEOMETRIC 1
+
+#define MMAP_HUGE_NONE        0
+#define MMAP_HUGE_TRANSPARENT 1
+#define MMAP_HUGE_TLB         2
+
+#define MMAP_HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+/*
+ * Windowed maps (window: bytes) never map the whole file. Reads go through
+ * a small LRU of aligned windows, each mapped with MMAP_WINDOW_OVERLAP
+ * extra bytes so that a needle straddling two windows is still found in
+ * the first one.
+ */
+#define MMAP_WINDOWS        4
+#define MMAP_WINDOW_OVERLAP ((size_t)64 << 10)
+
+typedef struct {
+  char *base;
+  size_t maplen;
+  off_t fbeg;
+  unsigned long used;
+} mmap_window_t;
+
+#define MMAP_GROWTH_FACTOR 2.0
+#define MMAP_GROWTH_CAP    ((size_t)1 << 30)
+
+/*
+ * Maps may start at any file offset: the mapping itself starts +shift+
+ * bytes earlier, at the page boundary below. Syscalls work on the
+ * mapping, everything else on the content at addr.
+ */
+#define MMAP_BASE(mmap)   ((char *)(mmap)->addr - (mmap)->shift)
+#define MMAP_MAPLEN(mmap) ((mmap)->len + (mmap)->shift)
 
 #define GET_MMAP(self, mmap, t_modify) \
   TypedData_Get_Struct(self, mmap_t, &mmap_type, mmap); \
   if (!mmap->path) { \
     rb_raise(rb_eIOError, "unmapped file"); \
   } \
+  if ((mmap->flag & MMAP_RUBY_WINDOW) && !((t_modify) & MMAP_RUBY_WINDOWED)) { \
+    rb_raise(rb_eNotImpError, "not supported by windowed maps"); \
+  } \
   if (t_modify & MMAP_RUBY_MODIFY) { \
     rb_check_frozen(self); \
   }
 
 static char template[1024];
 
-#if defined(__linux__) || defined(__GNU__) || defined(__GLIBC__)
-union semun
-{
-  int val;
-  struct semid_ds *buf;
-  unsigned short int *array;
-};
+static ID mmap_each_line_kwargs[2];
+
+/*
+ * Type codes of the typed scalar accessors (see lib/mmap-ruby/mmap.rb):
+ * the width in bytes, plus whether the value is signed or a float.
+ */
+#define MMAP_SCALAR_WIDTH  0x0f
+#define MMAP_SCALAR_SIGNED 0x10
+#define MMAP_SCALAR_FLOAT  0x20
+
+static VALUE mmap_sym_little, mmap_sym_big, mmap_sym_native;
+static VALUE mmap_sym_seq_cst, mmap_sym_relaxed, mmap_sym_acquire, mmap_sym_release, mmap_sym_acq_rel;
+
+/* The bytes of a uint64_t that hold a value +width+ bytes wide. */
+#ifdef WORDS_BIGENDIAN
+#define MMAP_SCALAR_LOW(v, width) ((char *)&(v) + sizeof(v) - (width))
+#else
+#define MMAP_SCALAR_LOW(v, width) ((char *)&(v))
 #endif
 
+/*
+ * Lock shared between the processes of an ipc map: a process-shared mutex,
+ * robust where the platform has robust mutexes, so that the kernel hands the
+ * lock over when its owner dies, whatever pid namespace the owner lived in.
+ * +init+ goes from 0 to MMAP_IPC_READY once the first process to attach has
+ * initialized +lock+; +recovered+ counts the locks taken over from dead owners.
+ */
+#define MMAP_IPC_INITIALIZING 1U
+#define MMAP_IPC_READY        2U
+
+typedef struct {
+  uint32_t init;
+  uint32_t recovered;
+  pthread_mutex_t lock;
+} mmap_ipc_t;
+
+/*
+ * State of the background thread started by Mmap#warm. +done+ and +cancel+
+ * are accessed atomically; +state+ is protected by +lock+.
+ */
+#define MMAP_WARM_IDLE     0
+#define MMAP_WARM_RUNNING  1
+#define MMAP_WARM_FINISHED 2
+
+typedef struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pid_t pid;
+  char *addr;
+  size_t len;
+  int write;
+  size_t done;
+  int state;
+  int cancel;
+  int wakeup;
+} mmap_warm_t;
+
+/*
+ * Line index built by Mmap#build_line_index: the offsets of the newlines
+ * in [0, scanned), in order. Offsets are 4 bytes wide while the map is
+ * below 4 GiB and 8 bytes past that.
+ */
+typedef struct {
+  char *offs;
+  size_t count;
+  size_t capa;
+  size_t scanned;
+  int width;
+} mmap_lines_t;
+
 typedef struct {
   char *path;
-  char *template;
+  int fd;
 
   void *addr;
   size_t len;
@@ -51,11 +180,44 @@ typedef struct {
   size_t incr;
   int advice;
 
-  VALUE key;
-  int semid;
-  VALUE shmid;
+  int growth;
+  double growth_factor;
+  size_t growth_cap;
+
+  int huge;
+  size_t huge_size;
+
+  size_t shift;
+
+  size_t window;
+  mmap_window_t windows[MMAP_WINDOWS];
+  unsigned long window_tick;
 
+  key_t key;
+  int shmid;
+  VALUE ipc_opts;
+  mmap_ipc_t *ipc;
+
+  VALUE mutex;
+  VALUE lock_thread;
+  pid_t lock_pid;
   int count;
+  int busy;
+  unsigned long generation;
+  VALUE exports;
+  VALUE buffer;
+
+  mmap_warm_t warm;
+
+  size_t *dirty;
+  long ndirty;
+  long dirty_capa;
+
+  mmap_range_t *ranges;
+  long nranges;
+  long ranges_capa;
+
+  mmap_lines_t lines;
 } mmap_t;
 
 typedef struct {
@@ -78,13 +240,22 @@ static void mmap_update(mmap_t *str, long beg, long len, VALUE val);
 static void mmap_subpat_set(VALUE obj, VALUE re, int offset, VALUE val);
 static void mmap_realloc(mmap_t *mmap, size_t len);
 static void mmap_expandf(mmap_t *mmap, size_t len);
+static void mmap_warm_stop(mmap_t *mmap);
+static void mmap_touch(mmap_t *mmap, size_t beg, size_t len);
+static void mmap_unlock(mmap_t *mmap);
+static void mmap_populate(char *addr, size_t len, int write, int *cancel, size_t *done);
+static void mmap_window_release(mmap_t *mmap);
 
 static void
 mmap_mark(void *ptr)
 {
   mmap_t *mmap = (mmap_t *)ptr;
 
-  rb_gc_mark_movable(mmap->key);
+  rb_gc_mark_movable(mmap->ipc_opts);
+  rb_gc_mark_movable(mmap->mutex);
+  rb_gc_mark_movable(mmap->lock_thread);
+  rb_gc_mark_movable(mmap->exports);
+  rb_gc_mark_movable(mmap->buffer);
 }
 
 static void
@@ -92,15 +263,238 @@ mmap_free(void *ptr)
 {
   mmap_t *mmap = (mmap_t *)ptr;
 
+  if (mmap->ipc) {
+    shmdt(mmap->ipc);
+  }
+  if (mmap->fd >= 0) {
+    close(mmap->fd);
+  }
+  mmap_window_release(mmap);
+  mmap_warm_stop(mmap);
+  pthread_mutex_destroy(&mmap->warm.lock);
+  pthread_cond_destroy(&mmap->warm.cond);
+  xfree(mmap->dirty);
+  xfree(mmap->ranges);
+  xfree(mmap->lines.offs);
   xfree(mmap);
 }
 
 static size_t
 mmap_memsize(const void *ptr)
 {
-  (void)ptr;
+  const mmap_t *mmap = (const mmap_t *)ptr;
+
+  return sizeof(mmap_t) + mmap->dirty_capa * 2 * sizeof(size_t) +
+    mmap->ranges_capa * sizeof(mmap_range_t) + mmap->lines.capa * mmap->lines.width;
+}
+
+static inline size_t
+mmap_lines_get(const mmap_lines_t *lines, size_t i)
+{
+  if (lines->width == 4) return ((const uint32_t *)lines->offs)[i];
+  return (size_t)((const uint64_t *)lines->offs)[i];
+}
+
+static inline void
+mmap_lines_put(char *offs, int width, size_t i, size_t pos)
+{
+  if (width == 4) ((uint32_t *)offs)[i] = (uint32_t)pos;
+  else ((uint64_t *)offs)[i] = (uint64_t)pos;
+}
+
+/* Forgets the indexed newlines at or after +pos+, which are rescanned on the next lookup. */
+static void
+mmap_lines_truncate(mmap_lines_t *lines, size_t pos)
+{
+  size_t lo = 0, hi = lines->count, mid;
+
+  if (!lines->offs || pos >= lines->scanned) return;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (mmap_lines_get(lines, mid) < pos) lo = mid + 1;
+    else hi = mid;
+  }
+  lines->count = lo;
+  lines->scanned = pos;
+}
+
+/*
+ * Dirty range tracking (track_dirty: true). Every write path reports the
+ * bytes it changed to mmap_touch, which keeps them as a sorted array of
+ * disjoint, page aligned [beg, end) offsets. Overlapping and adjacent
+ * ranges are merged; past MMAP_DIRTY_MAX ranges the two closest ones are
+ * merged, trading a little extra msync for bounded memory. Like the
+ * per-range state below, offsets are relative to MMAP_BASE.
+ */
+static void
+mmap_touch(mmap_t *mmap, size_t beg, size_t len)
+{
+  size_t page, b, e, *d, gap, best;
+  long lo, hi, mid, i, j, n, k;
+
+  if (!len) return;
+  mmap_lines_truncate(&mmap->lines, beg);
+  if (!(mmap->flag & MMAP_RUBY_DIRTY)) return;
+
+  page = (size_t)sysconf(_SC_PAGESIZE);
+  beg += mmap->shift;
+  b = beg & ~(page - 1);
+  e = (beg + len + page - 1) & ~(page - 1);
+  d = mmap->dirty;
+  n = mmap->ndirty;
+
+  lo = 0;
+  hi = n;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (d[2 * mid + 1] < b) lo = mid + 1;
+    else hi = mid;
+  }
+  for (i = j = lo; j < n && d[2 * j] <= e; j++) {
+    if (d[2 * j] < b) b = d[2 * j];
+    if (d[2 * j + 1] > e) e = d[2 * j + 1];
+  }
+
+  if (i == j) {
+    if (n == mmap->dirty_capa) {
+      mmap->dirty_capa = n ? n * 2 : 8;
+      REALLOC_N(mmap->dirty, size_t, mmap->dirty_capa * 2);
+      d = mmap->dirty;
+    }
+    MEMMOVE(d + 2 * (i + 1), d + 2 * i, size_t, 2 * (n - i));
+    n++;
+  }
+  else {
+    MEMMOVE(d + 2 * (i + 1), d + 2 * j, size_t, 2 * (n - j));
+    n -= j - i - 1;
+  }
+  d[2 * i] = b;
+  d[2 * i + 1] = e;
+
+  if (n > MMAP_DIRTY_MAX) {
+    best = SIZE_MAX;
+    k = 0;
+    for (i = 0; i + 1 < n; i++) {
+      gap = d[2 * (i + 1)] - d[2 * i + 1];
+      if (gap < best) {
+        best = gap;
+        k = i;
+      }
+    }
+    d[2 * k + 1] = d[2 * (k + 1) + 1];
+    MEMMOVE(d + 2 * (k + 1), d + 2 * (k + 2), size_t, 2 * (n - k - 2));
+    n--;
+  }
+  mmap->ndirty = n;
+}
+
+static void
+mmap_ranges_push(mmap_t *mmap, int kind, int arg, size_t beg, size_t end)
+{
+  mmap_range_t *r;
+
+  if (mmap->nranges == mmap->ranges_capa) {
+    mmap->ranges_capa = mmap->ranges_capa ? mmap->ranges_capa * 2 : 4;
+    REALLOC_N(mmap->ranges, mmap_range_t, mmap->ranges_capa);
+  }
+  r = &mmap->ranges[mmap->nranges++];
+  r->kind = kind;
+  r->arg = arg;
+  r->beg = beg;
+  r->end = end;
+}
+
+/*
+ * Records that [beg, end) now has state +arg+ of +kind+, cutting it out of
+ * older records of the same kind. With +add+ false the range is just
+ * cleared, which is what the neutral values (MADV_NORMAL, munlock, the map's
+ * own protection) do.
+ */
+static void
+mmap_ranges_set(mmap_t *mmap, int kind, size_t beg, size_t end, int arg, int add)
+{
+  mmap_range_t *r;
+  long i;
+
+  for (i = mmap->nranges - 1; i >= 0; i--) {
+    r = &mmap->ranges[i];
+    if (r->kind != kind || r->end <= beg || r->beg >= end) continue;
+    if (r->beg < beg && r->end > end) {
+      size_t tail = r->end;
+
+      r->end = beg;
+      mmap_ranges_push(mmap, kind, r->arg, end, tail);
+    }
+    else if (r->beg < beg) {
+      r->end = beg;
+    }
+    else if (r->end > end) {
+      r->beg = end;
+    }
+    else {
+      *r = mmap->ranges[--mmap->nranges];
+    }
+  }
+  if (add) {
+    mmap_ranges_push(mmap, kind, arg, beg, end);
+  }
+}
+
+/* Drops the recorded state past +len+ after the map shrank. */
+static void
+mmap_ranges_clip(mmap_t *mmap, size_t len)
+{
+  long i;
+
+  len += mmap->shift;
+  for (i = mmap->nranges - 1; i >= 0; i--) {
+    if (mmap->ranges[i].beg >= len) {
+      mmap->ranges[i] = mmap->ranges[--mmap->nranges];
+    }
+    else if (mmap->ranges[i].end > len) {
+      mmap->ranges[i].end = len;
+    }
+  }
+}
+
+static void
+mmap_ranges_clear(mmap_t *mmap, int kind)
+{
+  mmap_ranges_set(mmap, kind, 0, SIZE_MAX, 0, 0);
+}
+
+/*
+ * Raises before a write into a range that a ranged #mprotect made
+ * read-only, which would otherwise kill the process with SIGSEGV.
+ */
+static void
+mmap_check_write(mmap_t *mmap, size_t beg, size_t len)
+{
+  mmap_range_t *r;
+  long i;
+
+  beg += mmap->shift;
+  for (i = 0; i < mmap->nranges; i++) {
+    r = &mmap->ranges[i];
+    if (r->kind == MMAP_RANGE_PROT && !(r->arg & PROT_WRITE) &&
+        r->beg < beg + len && beg < r->end) {
+      mmap_unlock(mmap);
+      rb_raise(rb_eIOError, "write to a protected range (%zu...%zu)", r->beg, r->end);
+    }
+  }
+}
 
-  return sizeof(mmap_t);
+/* Drops the dirty ranges past +len+ after the map shrank. */
+static void
+mmap_dirty_clip(mmap_t *mmap, size_t len)
+{
+  len += mmap->shift;
+  while (mmap->ndirty && mmap->dirty[2 * (mmap->ndirty - 1)] >= len) {
+    mmap->ndirty--;
+  }
+  if (mmap->ndirty && mmap->dirty[2 * mmap->ndirty - 1] > len) {
+    mmap->dirty[2 * mmap->ndirty - 1] = len;
+  }
 }
 
 static void
@@ -108,7 +502,11 @@ mmap_compact(void *ptr)
 {
   mmap_t *mmap = (mmap_t *)ptr;
 
-  mmap->key = rb_gc_location(mmap->key);
+  mmap->ipc_opts = rb_gc_location(mmap->ipc_opts);
+  mmap->mutex = rb_gc_location(mmap->mutex);
+  mmap->lock_thread = rb_gc_location(mmap->lock_thread);
+  mmap->exports = rb_gc_location(mmap->exports);
+  mmap->buffer = rb_gc_location(mmap->buffer);
 }
 
 static const rb_data_type_t mmap_type = {
@@ -123,373 +521,2451 @@ static const rb_data_type_t mmap_type = {
 };
 
 /*
- * call-seq:
- *   lockall(flag) -> nil
- *   mlockall(flag) -> nil
- *
- * Disables paging of all pages mapped into the address space of the calling
- * process. The +flag+ parameter can be MCL_CURRENT (lock all currently mapped
- * pages) or MCL_FUTURE (lock all pages that become mapped in the future).
+ * Search, count and sum kernels used by index, rindex, include?, count,
+ * sum and the line iterators. The generic versions lean on the C library, whose memchr
+ * and memrchr are already vectorized. On x86_64 the SSE2 and AVX2 versions
+ * compare the first and last byte of the needle against a whole vector of
+ * candidate positions at once and only memcmp the survivors. The variant is
+ * picked once by mmap_cpu_init when the extension is loaded.
  */
-static VALUE
-rb_cMmap_mlockall(VALUE self, VALUE flag)
+
+typedef const char *(*mmap_search_func)(const char *, size_t, const char *, size_t);
+typedef size_t (*mmap_count_func)(const char *, size_t, unsigned char);
+typedef uint64_t (*mmap_sum_func)(const char *, size_t);
+typedef size_t (*mmap_newlines_func)(const char *, size_t, size_t, char *, int, size_t);
+
+/*
+ * A set of bytes for mmap_byteset_find. +lo_clear+ and +lo_set+ are the
+ * shuffle tables of the AVX2 version: entry n has bit h set when byte
+ * (h << 4 | n), resp. ((h + 8) << 4 | n), is in the set.
+ */
+typedef struct {
+  unsigned char member[256];
+  unsigned char lo_clear[16];
+  unsigned char lo_set[16];
+  int size;
+  unsigned char only;
+} mmap_byteset_t;
+
+typedef const char *(*mmap_byteset_func)(const char *, size_t, const mmap_byteset_t *);
+
+static const char *
+mmap_search_generic(const char *hay, size_t hlen, const char *needle, size_t nlen)
 {
-  if (mlockall(NUM2INT(flag)) == -1) {
-    rb_raise(rb_eArgError, "mlockall(%d)", errno);
+  const char *p, *end;
+
+  if (nlen == 0) return hay;
+  if (nlen > hlen) return NULL;
+  if (nlen == 1) return memchr(hay, needle[0], hlen);
+
+  p = hay;
+  end = hay + hlen - nlen + 1;
+  while (p < end && (p = memchr(p, needle[0], end - p))) {
+    if (p[nlen - 1] == needle[nlen - 1] && memcmp(p + 1, needle + 1, nlen - 2) == 0) {
+      return p;
+    }
+    p++;
   }
-  return Qnil;
+  return NULL;
+}
+
+static const char *
+mmap_rsearch_generic(const char *hay, size_t hlen, const char *needle, size_t nlen)
+{
+  size_t n;
+
+  if (nlen == 0) return hay + hlen;
+  if (nlen > hlen) return NULL;
+
+  n = hlen - nlen + 1;
+#ifdef HAVE_MEMRCHR
+  {
+    const char *p;
+
+    while (n > 0 && (p = memrchr(hay, needle[0], n))) {
+      if (memcmp(p, needle, nlen) == 0) return p;
+      n = p - hay;
+    }
+  }
+#else
+  while (n-- > 0) {
+    if (hay[n] == needle[0] && memcmp(hay + n, needle, nlen) == 0) return hay + n;
+  }
+#endif
+  return NULL;
+}
+
+static size_t
+mmap_count_byte_generic(const char *ptr, size_t len, unsigned char c)
+{
+  const unsigned char *p = (const unsigned char *)ptr;
+  size_t i, n = 0;
+
+  for (i = 0; i < len; i++) {
+    n += (p[i] == c);
+  }
+  return n;
+}
+
+static uint64_t
+mmap_sum_bytes_generic(const char *ptr, size_t len)
+{
+  const unsigned char *p = (const unsigned char *)ptr;
+  uint64_t sum = 0;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    sum += p[i];
+  }
+  return sum;
 }
 
 /*
- * call-seq:
- *   unlockall -> nil
- *   munlockall -> nil
- *
- * Re-enables paging for all pages mapped into the address space of the
- * calling process.
+ * Stores the offset, plus +base+, of every newline of ptr[0, len) at
+ * index k onwards of +offs+ and returns the index past the last one.
  */
-static VALUE
-rb_cMmap_munlockall(VALUE self)
+static size_t
+mmap_newlines_generic(const char *ptr, size_t len, size_t base, char *offs, int width, size_t k)
 {
-  (void)self;
-  if (munlockall() == -1) {
-    rb_raise(rb_eArgError, "munlockall(%d)", errno);
+  const char *p = ptr, *end = ptr + len;
+
+  while (p < end && (p = memchr(p, '\n', end - p))) {
+    mmap_lines_put(offs, width, k++, base + (size_t)(p - ptr));
+    p++;
   }
-  return Qnil;
+  return k;
 }
 
-static VALUE
-rb_cMmap_allocate(VALUE klass)
+/* Returns the first byte of ptr[0, len) that is in +set+, or NULL. */
+static const char *
+mmap_byteset_find_generic(const char *ptr, size_t len, const mmap_byteset_t *set)
 {
-  mmap_t *mmap;
-  VALUE obj;
+  const unsigned char *p = (const unsigned char *)ptr, *end = p + len;
 
-  obj = TypedData_Make_Struct(klass, mmap_t, &mmap_type, mmap);
-  MEMZERO(mmap, mmap_t, 1);
-  mmap->incr = EXP_INCR_SIZE;
+  if (set->size == 1) return memchr(ptr, set->only, len);
+  for (; p < end; p++) {
+    if (set->member[*p]) return (const char *)p;
+  }
+  return NULL;
+}
 
-  return obj;
+#ifdef MMAP_RUBY_X86
+static const char *
+mmap_search_sse2(const char *hay, size_t hlen, const char *needle, size_t nlen)
+{
+  __m128i first, last;
+  size_t i;
+
+  if (nlen < 2 || nlen > hlen) return mmap_search_generic(hay, hlen, needle, nlen);
+
+  first = _mm_set1_epi8(needle[0]);
+  last = _mm_set1_epi8(needle[nlen - 1]);
+  for (i = 0; i + nlen + 15 <= hlen; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + nlen - 1));
+    unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                                        _mm_cmpeq_epi8(b, last)));
+    while (mask) {
+      unsigned int bit = __builtin_ctz(mask);
+      if (memcmp(hay + i + bit + 1, needle + 1, nlen - 2) == 0) return hay + i + bit;
+      mask &= mask - 1;
+    }
+  }
+  return mmap_search_generic(hay + i, hlen - i, needle, nlen);
 }
 
-static VALUE
-mmap_ipc_initialize(VALUE pair, VALUE self, int argc, const VALUE *argv, VALUE blockarg)
+static const char *
+mmap_rsearch_sse2(const char *hay, size_t hlen, const char *needle, size_t nlen)
 {
-  mmap_t *mmap;
-  VALUE key, value;
-  const char *options;
+  __m128i first, last;
+  size_t n;
+
+  if (nlen < 2 || nlen > hlen) return mmap_rsearch_generic(hay, hlen, needle, nlen);
+
+  first = _mm_set1_epi8(needle[0]);
+  last = _mm_set1_epi8(needle[nlen - 1]);
+  n = hlen - nlen + 1;
+  while (n >= 16) {
+    size_t i = n - 16;
+    __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + nlen - 1));
+    unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                                        _mm_cmpeq_epi8(b, last)));
+    while (mask) {
+      unsigned int bit = 31 - __builtin_clz(mask);
+      if (memcmp(hay + i + bit + 1, needle + 1, nlen - 2) == 0) return hay + i + bit;
+      mask &= ~(1U << bit);
+    }
+    n = i;
+  }
+  return mmap_rsearch_generic(hay, n + nlen - 1, needle, nlen);
+}
 
-  (void)argc;
-  (void)argv;
-  (void)blockarg;
+static size_t
+mmap_count_byte_sse2(const char *p, size_t len, unsigned char c)
+{
+  const __m128i needle = _mm_set1_epi8((char)c);
+  __m128i total = _mm_setzero_si128();
+  uint64_t lanes[2];
+  size_t i = 0, n;
+
+  while (i + 16 <= len) {
+    __m128i acc = _mm_setzero_si128();
+    size_t stop = i + 255 * 16 < len ? i + 255 * 16 : len;
+
+    for (; i + 16 <= stop; i += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+      acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(v, needle));
+    }
+    total = _mm_add_epi64(total, _mm_sad_epu8(acc, _mm_setzero_si128()));
+  }
+  _mm_storeu_si128((__m128i *)lanes, total);
+  n = lanes[0] + lanes[1];
+  return n + mmap_count_byte_generic(p + i, len - i, c);
+}
 
-  TypedData_Get_Struct(self, mmap_t, &mmap_type, mmap);
-  key = rb_obj_as_string(rb_ary_entry(pair, 0));
-  value = rb_ary_entry(pair, 1);
-  options = StringValuePtr(key);
+static uint64_t
+mmap_sum_bytes_sse2(const char *p, size_t len)
+{
+  __m128i total = _mm_setzero_si128();
+  uint64_t lanes[2];
+  size_t i;
 
-  if (strcmp(options, "key") == 0) {
-    mmap->key = rb_funcall2(value, rb_intern("to_int"), 0, 0);
+  for (i = 0; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+    total = _mm_add_epi64(total, _mm_sad_epu8(v, _mm_setzero_si128()));
   }
-  else if (strcmp(options, "permanent") == 0) {
-    if (RTEST(value)) {
-      mmap->flag &= ~MMAP_RUBY_TMP;
+  _mm_storeu_si128((__m128i *)lanes, total);
+  return lanes[0] + lanes[1] + mmap_sum_bytes_generic(p + i, len - i);
+}
+
+static size_t
+mmap_newlines_sse2(const char *p, size_t len, size_t base, char *offs, int width, size_t k)
+{
+  const __m128i nl = _mm_set1_epi8('\n');
+  unsigned int mask;
+  size_t i;
+
+  for (i = 0; i + 16 <= len; i += 16) {
+    mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), nl));
+    while (mask) {
+      mmap_lines_put(offs, width, k++, base + i + __builtin_ctz(mask));
+      mask &= mask - 1;
     }
   }
-  else if (strcmp(options, "mode") == 0) {
-    mmap->semid = NUM2INT(value);
+  return mmap_newlines_generic(p + i, len - i, base + i, offs, width, k);
+}
+
+__attribute__((target("avx2")))
+static const char *
+mmap_search_avx2(const char *hay, size_t hlen, const char *needle, size_t nlen)
+{
+  __m256i first, last;
+  size_t i;
+
+  if (nlen < 2 || nlen > hlen) return mmap_search_generic(hay, hlen, needle, nlen);
+
+  first = _mm256_set1_epi8(needle[0]);
+  last = _mm256_set1_epi8(needle[nlen - 1]);
+  for (i = 0; i + nlen + 31 <= hlen; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(hay + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(hay + i + nlen - 1));
+    unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                                                              _mm256_cmpeq_epi8(b, last)));
+    while (mask) {
+      unsigned int bit = __builtin_ctz(mask);
+      if (memcmp(hay + i + bit + 1, needle + 1, nlen - 2) == 0) return hay + i + bit;
+      mask &= mask - 1;
+    }
   }
-  else {
-    rb_warning("Unknown option `%s'", options);
+  return mmap_search_sse2(hay + i, hlen - i, needle, nlen);
+}
+
+__attribute__((target("avx2")))
+static const char *
+mmap_rsearch_avx2(const char *hay, size_t hlen, const char *needle, size_t nlen)
+{
+  __m256i first, last;
+  size_t n;
+
+  if (nlen < 2 || nlen > hlen) return mmap_rsearch_generic(hay, hlen, needle, nlen);
+
+  first = _mm256_set1_epi8(needle[0]);
+  last = _mm256_set1_epi8(needle[nlen - 1]);
+  n = hlen - nlen + 1;
+  while (n >= 32) {
+    size_t i = n - 32;
+    __m256i a = _mm256_loadu_si256((const __m256i *)(hay + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(hay + i + nlen - 1));
+    unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                                                              _mm256_cmpeq_epi8(b, last)));
+    while (mask) {
+      unsigned int bit = 31 - __builtin_clz(mask);
+      if (memcmp(hay + i + bit + 1, needle + 1, nlen - 2) == 0) return hay + i + bit;
+      mask &= ~(1U << bit);
+    }
+    n = i;
   }
+  return mmap_rsearch_sse2(hay, n + nlen - 1, needle, nlen);
+}
 
-  return Qnil;
+__attribute__((target("avx2")))
+static size_t
+mmap_count_byte_avx2(const char *p, size_t len, unsigned char c)
+{
+  const __m256i needle = _mm256_set1_epi8((char)c);
+  __m256i total = _mm256_setzero_si256();
+  uint64_t lanes[4];
+  size_t i = 0, n;
+
+  while (i + 32 <= len) {
+    __m256i acc = _mm256_setzero_si256();
+    size_t stop = i + 255 * 32 < len ? i + 255 * 32 : len;
+
+    for (; i + 32 <= stop; i += 32) {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+      acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(v, needle));
+    }
+    total = _mm256_add_epi64(total, _mm256_sad_epu8(acc, _mm256_setzero_si256()));
+  }
+  _mm256_storeu_si256((__m256i *)lanes, total);
+  n = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  return n + mmap_count_byte_sse2(p + i, len - i, c);
+}
+
+__attribute__((target("avx2")))
+static uint64_t
+mmap_sum_bytes_avx2(const char *p, size_t len)
+{
+  __m256i total = _mm256_setzero_si256();
+  uint64_t lanes[4];
+  size_t i;
+
+  for (i = 0; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+    total = _mm256_add_epi64(total, _mm256_sad_epu8(v, _mm256_setzero_si256()));
+  }
+  _mm256_storeu_si256((__m256i *)lanes, total);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] + mmap_sum_bytes_sse2(p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t
+mmap_newlines_avx2(const char *p, size_t len, size_t base, char *offs, int width, size_t k)
+{
+  const __m256i nl = _mm256_set1_epi8('\n');
+  uint64_t mask;
+  size_t i;
+
+  for (i = 0; i + 64 <= len; i += 64) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(p + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(p + i + 32));
+
+    mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, nl)) |
+      (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, nl)) << 32;
+    while (mask) {
+      mmap_lines_put(offs, width, k++, base + i + __builtin_ctzll(mask));
+      mask &= mask - 1;
+    }
+  }
+  return mmap_newlines_sse2(p + i, len - i, base + i, offs, width, k);
 }
 
 /*
- * call-seq:
- *   new(file, mode = "r", protection = Mmap::MAP_SHARED, options = {})
- *
- * Returns a new MmapRuby object.
- *
- * * +file+
- *
- *   Pathname of the file. If +nil+ is given, an anonymous map
- *   is created (+Mmap::MAP_ANON+).
- *
- * * +mode+
- *
- *   Mode to open the file. Can be "r", "w", "rw", or "a".
- *
- * * +protection+
- *
- *   Specifies the nature of the mapping:
- *
- *   * +Mmap::MAP_SHARED+
- *
- *     Creates a mapping that's shared with all other processes
- *     mapping the same areas of the file.
- *     This is the default value.
- *
- *   * +Mmap::MAP_PRIVATE+
- *
- *     Creates a private copy-on-write mapping, so changes to the
- *     contents of the mmap object will be private to this process.
- *
- * * +options+
- *
- *   Hash. If one of the options +length+ or +offset+
- *   is specified, it will not be possible to modify the size of
- *   the mapped file.
- *
- *   length:: Maps +length+ bytes from the file.
- *
- *   offset:: The mapping begins at +offset+.
- *
- *   advice:: The type of access (see #madvise).
+ * Byte set membership of 32 bytes at a time with two table lookups on the
+ * low nibble, one per half of the high nibbles, and a mask selecting the
+ * bit of the high nibble.
  */
-static VALUE
-rb_cMmap_initialize(int argc, VALUE *argv, VALUE self)
+__attribute__((target("avx2")))
+static const char *
+mmap_byteset_find_avx2(const char *p, size_t len, const mmap_byteset_t *set)
 {
-  mmap_t *mmap;
-  struct stat st;
+  const __m256i clear = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->lo_clear));
+  const __m256i high = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->lo_set));
+  const __m256i bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0,
+                                        1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m256i flip = _mm256_set1_epi8(-128), seven = _mm256_set1_epi8(7);
+  const __m256i zero = _mm256_setzero_si256();
+  unsigned int mask;
+  size_t i;
+
+  if (set->size == 1) return memchr(p, set->only, len);
+  for (i = 0; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+    __m256i t = _mm256_or_si256(_mm256_shuffle_epi8(clear, v),
+                                _mm256_shuffle_epi8(high, _mm256_xor_si256(v, flip)));
+    __m256i b = _mm256_shuffle_epi8(bits, _mm256_and_si256(_mm256_srli_epi16(v, 4), seven));
+
+    mask = ~(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(t, b), zero));
+    if (mask) return p + i + __builtin_ctz(mask);
+  }
+  return mmap_byteset_find_generic(p + i, len - i, set);
+}
+#endif
 
-  VALUE fname, vmode, scope, options;
-  VALUE fdv = Qnil;
+/*
+ * Reduction kernels of Mmap::View. One pass computes the sum, the minimum
+ * and the maximum of a typed column in MMAP_VIEW_LANES independent lanes,
+ * which the compiler turns into packed adds, mins and maxes; the AVX2
+ * builds of the same loops are picked by mmap_cpu_init. Integer sums are
+ * exact: columns of up to 32 bits are summed in 64-bit lanes over blocks
+ * of MMAP_VIEW_BLOCK elements, which can't overflow, and each block is
+ * folded into a mmap_isum_t. Without a 128-bit integer type, 64-bit adds
+ * are checked instead and an overflowing sum is redone with Ruby
+ * Integers. Float sums are accumulated in double.
+ */
+#define MMAP_VIEW_LANES 8
+#define MMAP_VIEW_BLOCK (1 << 20)
+
+#ifdef __SIZEOF_INT128__
+typedef __int128 mmap_isum_t;
+#define MMAP_VIEW_ADD64(sum, v) ((sum) += (v))
+#else
+typedef int64_t mmap_isum_t;
+#define MMAP_VIEW_ADD64(sum, v) (over |= __builtin_add_overflow((sum), (v), &(sum)))
+#endif
+#define MMAP_VIEW_ADD(sum, v) ((sum) += (v))
 
-  const char *path = 0, *mode = 0;
-  int fd = -1, perm = 0666;
+typedef struct {
+  mmap_isum_t isum;
+  double fsum;
+  uint64_t min;
+  uint64_t max;
+  int overflow;
+} mmap_view_acc;
 
-  caddr_t addr;
-  size_t size = 0;
-  off_t offset = 0;
-  int smode = 0, pmode = 0, vscope = 0;
+typedef void (*mmap_view_func)(const char *, size_t, mmap_view_acc *);
 
-  int anonymous = 0, init = 0;
+static inline void
+mmap_view_fold_int(mmap_view_acc *out, mmap_isum_t sum)
+{
+#ifdef __SIZEOF_INT128__
+  out->isum += sum;
+#else
+  out->overflow |= __builtin_add_overflow(out->isum, sum, &out->isum);
+#endif
+}
 
-  options = Qnil;
-  argc = rb_scan_args(argc, argv, "12:", &fname, &vmode, &scope, &options);
+static inline void
+mmap_view_fold_float(mmap_view_acc *out, double sum)
+{
+  out->fsum += sum;
+}
 
-  if (NIL_P(fname)) {
-    vscope = MAP_ANON | MAP_SHARED;
-    anonymous = 1;
+#define MMAP_VIEW_KERNEL(attr, fname, type, acc_t, add, fold) \
+  attr static void \
+  fname(const char *ptr, size_t n, mmap_view_acc *out) \
+  { \
+    const type *p = (const type *)ptr; \
+    type lo[MMAP_VIEW_LANES], hi[MMAP_VIEW_LANES], v; \
+    size_t i, j, end; \
+    int over = 0; \
+    \
+    for (j = 0; j < MMAP_VIEW_LANES; j++) lo[j] = hi[j] = n ? p[0] : 0; \
+    for (i = 0; i < n;) { \
+      acc_t sum[MMAP_VIEW_LANES] = {0}; \
+      \
+      end = n - i > MMAP_VIEW_BLOCK ? i + MMAP_VIEW_BLOCK : n; \
+      for (; i + MMAP_VIEW_LANES <= end; i += MMAP_VIEW_LANES) { \
+        for (j = 0; j < MMAP_VIEW_LANES; j++) { \
+          v = p[i + j]; \
+          add(sum[j], v); \
+          lo[j] = v < lo[j] ? v : lo[j]; \
+          hi[j] = v > hi[j] ? v : hi[j]; \
+        } \
+      } \
+      for (; i < end; i++) { \
+        v = p[i]; \
+        add(sum[0], v); \
+        lo[0] = v < lo[0] ? v : lo[0]; \
+        hi[0] = v > hi[0] ? v : hi[0]; \
+      } \
+      for (j = 1; j < MMAP_VIEW_LANES; j++) add(sum[0], sum[j]); \
+      fold(out, sum[0]); \
+    } \
+    for (j = 1; j < MMAP_VIEW_LANES; j++) { \
+      lo[0] = lo[j] < lo[0] ? lo[j] : lo[0]; \
+      hi[0] = hi[j] > hi[0] ? hi[j] : hi[0]; \
+    } \
+    out->overflow |= over; \
+    memcpy(&out->min, &lo[0], sizeof(type)); \
+    memcpy(&out->max, &hi[0], sizeof(type)); \
+  }
+
+#define MMAP_VIEW_KERNELS(attr, suffix) \
+  MMAP_VIEW_KERNEL(attr, mmap_view_u8_##suffix, uint8_t, int64_t, MMAP_VIEW_ADD, mmap_view_fold_int) \
+  MMAP_VIEW_KERNEL(attr, mmap_view_u16_##suffix, uint16_t, int64_t, MMAP_VIEW_ADD, mmap_view_fold_int) \
+  MMAP_VIEW_KERNEL(attr, mmap_view_u32_##suffix, uint32_t, int64_t, MMAP_VIEW_ADD, mmap_view_fold_int) \
+  MMAP_VIEW_KERNEL(attr, mmap_view_u64_##suffix, uint64_t, mmap_isum_t, MMAP_VIEW_ADD64, mmap_view_fold_int) \
+  MMAP_VIEW_KERNEL(attr, mmap_view_i8_##suffix, int8_t, int64_t, MMAP_VIEW_ADD, mmap_view_fold_int) \
+  MMAP_VIEW_KERNEL(attr, mmap_view_i16_##suffix, int16_t, int64_t, MMAP_VIEW_ADD, mmap_view_fold_int) \
+  MMAP_VIEW_KERNEL(attr, mmap_view_i32_##suffix, int32_t, int64_t, MMAP_VIEW_ADD, mmap_view_fold_int) \
+  MMAP_VIEW_KERNEL(attr, mmap_view_i64_##suffix, int64_t, mmap_isum_t, MMAP_VIEW_ADD64, mmap_view_fold_int) \
+  MMAP_VIEW_KERNEL(attr, mmap_view_f32_##suffix, float, double, MMAP_VIEW_ADD, mmap_view_fold_float) \
+  MMAP_VIEW_KERNEL(attr, mmap_view_f64_##suffix, double, double, MMAP_VIEW_ADD, mmap_view_fold_float)
+
+MMAP_VIEW_KERNELS(, generic)
+#ifdef MMAP_RUBY_X86
+MMAP_VIEW_KERNELS(__attribute__((target("avx2"))), avx2)
+#endif
+
+#define MMAP_VIEW_TABLE(suffix) { \
+    [0x01] = mmap_view_u8_##suffix, [0x02] = mmap_view_u16_##suffix, \
+    [0x04] = mmap_view_u32_##suffix, [0x08] = mmap_view_u64_##suffix, \
+    [0x11] = mmap_view_i8_##suffix, [0x12] = mmap_view_i16_##suffix, \
+    [0x14] = mmap_view_i32_##suffix, [0x18] = mmap_view_i64_##suffix, \
+    [0x24] = mmap_view_f32_##suffix, [0x28] = mmap_view_f64_##suffix \
   }
-  else
-  {
-    if (rb_respond_to(fname, rb_intern("fileno"))) {
-      fdv = rb_funcall2(fname, rb_intern("fileno"), 0, 0);
-    }
 
-    if (NIL_P(fdv)) {
-      fname = rb_str_to_str(fname);
-      StringValue(fname);
-      path = StringValuePtr(fname);
-    }
-    else {
-      fd = NUM2INT(fdv);
-      if (fd < 0) {
-        rb_raise(rb_eArgError, "invalid file descriptor %d", fd);
-      }
-    }
+static mmap_view_func mmap_view_reduce[0x29] = MMAP_VIEW_TABLE(generic);
 
-    if (!NIL_P(scope)) {
-      vscope = NUM2INT(scope);
-      if (vscope & MAP_ANON) {
-        rb_raise(rb_eArgError, "filename specified for an anonymous map");
-      }
-    }
-  }
+/*
+ * Checksum kernels of Mmap#checksum: CRC32C (Castagnoli), with the SSE4.2
+ * crc32 instruction when the CPU has it and slicing-by-8 tables otherwise,
+ * and the 64-bit xxHash variants XXH64 and XXH3 (seed 0, default secret).
+ * The xxHash loops poll *cancel now and then so that a long hash running
+ * without the GVL can be interrupted.
+ */
+#define MMAP_CRC32C_POLY 0x82F63B78U
 
-  vscope |= NIL_P(scope) ? MAP_SHARED : NUM2INT(scope);
+typedef uint32_t (*mmap_crc32c_func)(uint32_t, const char *, size_t);
 
-  if (!anonymous) {
-    if (NIL_P(vmode)) {
-      mode = "r";
-    }
-    else if (rb_respond_to(vmode, rb_intern("to_ary"))) {
-      VALUE tmp;
+static uint32_t mmap_crc32c_table[8][256];
 
-      vmode = rb_convert_type(vmode, T_ARRAY, "Array", "to_ary");
-      if (RARRAY_LEN(vmode) != 2) {
-        rb_raise(rb_eArgError, "invalid length %ld (expected 2)",
-                 RARRAY_LEN(vmode));
-      }
-      tmp = rb_ary_entry(vmode, 0);
-      mode = StringValuePtr(tmp);
-      perm = NUM2INT(rb_ary_entry(vmode, 1));
-    }
-    else {
-      mode = StringValuePtr(vmode);
-    }
+static uint64_t
+mmap_read64(const char *p)
+{
+  uint64_t v;
 
-    if (strcmp(mode, "r") == 0) {
-      smode = O_RDONLY;
-      pmode = PROT_READ;
-    }
-    else if (strcmp(mode, "w") == 0) {
-      smode = O_RDWR | O_TRUNC;
-      pmode = PROT_READ | PROT_WRITE;
-    }
-    else if (strcmp(mode, "rw") == 0 || strcmp(mode, "wr") == 0) {
-      smode = O_RDWR;
-      pmode = PROT_READ | PROT_WRITE;
-    }
-    else if (strcmp(mode, "a") == 0) {
-      smode = O_RDWR | O_CREAT;
-      pmode = PROT_READ | PROT_WRITE;
-    }
-    else {
-      rb_raise(rb_eArgError, "invalid mode %s", mode);
-    }
+  memcpy(&v, p, 8);
+#ifdef WORDS_BIGENDIAN
+  v = __builtin_bswap64(v);
+#endif
+  return v;
+}
 
-    if (NIL_P(fdv)) {
-      if ((fd = open(path, smode, perm)) == -1) {
-        rb_raise(rb_eArgError, "can't open %s", path);
-      }
-    }
-    if (fstat(fd, &st) == -1) {
-      rb_raise(rb_eArgError, "can't stat %s", path);
+static uint32_t
+mmap_read32(const char *p)
+{
+  uint32_t v;
+
+  memcpy(&v, p, 4);
+#ifdef WORDS_BIGENDIAN
+  v = __builtin_bswap32(v);
+#endif
+  return v;
+}
+
+static void
+mmap_crc32c_init(void)
+{
+  uint32_t c;
+  int i, j;
+
+  for (i = 0; i < 256; i++) {
+    c = i;
+    for (j = 0; j < 8; j++) {
+      c = c & 1 ? (c >> 1) ^ MMAP_CRC32C_POLY : c >> 1;
     }
-    size = st.st_size;
+    mmap_crc32c_table[0][i] = c;
   }
-  else {
-    fd = -1;
-    if (!NIL_P(vmode) && TYPE(vmode) != T_STRING) {
-      size = NUM2INT(vmode);
+  for (i = 0; i < 256; i++) {
+    for (j = 1; j < 8; j++) {
+      c = mmap_crc32c_table[j - 1][i];
+      mmap_crc32c_table[j][i] = (c >> 8) ^ mmap_crc32c_table[0][c & 0xff];
     }
   }
+}
 
-  TypedData_Get_Struct(self, mmap_t, &mmap_type, mmap);
-  rb_check_frozen(self);
-  mmap->shmid = 0;
-  mmap->semid = 0;
+static uint32_t
+mmap_crc32c_generic(uint32_t crc, const char *p, size_t len)
+{
+  const unsigned char *s = (const unsigned char *)p;
+  uint64_t v;
 
-  if (options != Qnil) {
-    rb_funcall(self, rb_intern("process_options"), 1, options);
-    if (path && (mmap->len + mmap->offset) > (size_t)st.st_size) {
-      rb_raise(rb_eArgError, "invalid value for length (%ld) or offset (%ld)",
-               (long)mmap->len, (long)mmap->offset);
-    }
-    if (mmap->len) size = mmap->len;
-    offset = mmap->offset;
+  crc = ~crc;
+  for (; len >= 8; len -= 8, s += 8) {
+    v = mmap_read64((const char *)s) ^ crc;
+    crc = mmap_crc32c_table[7][v & 0xff] ^ mmap_crc32c_table[6][(v >> 8) & 0xff] ^
+          mmap_crc32c_table[5][(v >> 16) & 0xff] ^ mmap_crc32c_table[4][(v >> 24) & 0xff] ^
+          mmap_crc32c_table[3][(v >> 32) & 0xff] ^ mmap_crc32c_table[2][(v >> 40) & 0xff] ^
+          mmap_crc32c_table[1][(v >> 48) & 0xff] ^ mmap_crc32c_table[0][v >> 56];
+  }
+  while (len--) {
+    crc = (crc >> 8) ^ mmap_crc32c_table[0][(crc ^ *s++) & 0xff];
+  }
+  return ~crc;
+}
 
-    if (mmap->flag & MMAP_RUBY_IPC) {
-      key_t key;
-      int shmid, semid, mode;
-      union semun sem_val;
-      struct shmid_ds buf;
+#ifdef MMAP_RUBY_X86
+__attribute__((target("sse4.2")))
+static uint32_t
+mmap_crc32c_sse42(uint32_t crc, const char *p, size_t len)
+{
+  uint64_t c = ~crc;
 
-      if (!(vscope & MAP_SHARED)) {
-        rb_warning("Probably it will not do what you expect ...");
-      }
-      mmap->key = -1;
-      mmap->semid = 0;
-      if (TYPE(mmap->shmid) == T_HASH) {
-        rb_block_call(mmap->shmid, rb_intern("each"), 0, NULL, mmap_ipc_initialize, self);
-      }
-      mmap->shmid = 0;
+  for (; len >= 8; len -= 8, p += 8) {
+    c = _mm_crc32_u64(c, mmap_read64(p));
+  }
+  for (; len; len--, p++) {
+    c = _mm_crc32_u8((uint32_t)c, (unsigned char)*p);
+  }
+  return ~(uint32_t)c;
+}
+#endif
 
-      if (mmap->semid) {
-        mode = mmap->semid;
-        mmap->semid = 0;
-      }
-      else {
-        mode = 0644;
-      }
+static mmap_crc32c_func mmap_crc32c = mmap_crc32c_generic;
 
-      if ((int)mmap->key <= 0) {
-        mode |= IPC_CREAT;
-        strcpy(template, "/tmp/ruby_mmap.XXXXXX");
-        if (mkstemp(template) == -1) {
-          rb_sys_fail("mkstemp()");
-        }
-        if ((key = ftok(template, 'R')) == -1) {
-          rb_sys_fail("ftok()");
-        }
-      }
-      else {
-        key = (key_t)mmap->key;
-      }
+static uint32_t
+mmap_gf2_times(const uint32_t *mat, uint32_t vec)
+{
+  uint32_t sum = 0;
 
-      if ((shmid = shmget(key, sizeof(mmap_t), mode)) == -1) {
-        rb_sys_fail("shmget()");
-      }
-      mmap = shmat(shmid, (void *)0, 0);
-      if (mmap == (mmap_t *)-1) {
-        rb_sys_fail("shmat()");
-      }
-      if (mmap->flag & MMAP_RUBY_TMP) {
-        if (shmctl(shmid, IPC_RMID, &buf) == -1) {
-          rb_sys_fail("shmctl()");
-        }
-      }
+  for (; vec; vec >>= 1, mat++) {
+    if (vec & 1) sum ^= *mat;
+  }
+  return sum;
+}
 
-      if ((semid = semget(key, 1, mode)) == -1) {
-        rb_sys_fail("semget()");
-      }
-      if (mode & IPC_CREAT) {
-        sem_val.val = 1;
-        if (semctl(semid, 0, SETVAL, sem_val) == -1) {
-          rb_sys_fail("semctl()");
-        }
-      }
+static void
+mmap_gf2_square(uint32_t *square, const uint32_t *mat)
+{
+  int n;
 
-      mmap->key = key;
-      mmap->semid = semid;
-      mmap->shmid = shmid;
-      if (mmap->flag & MMAP_RUBY_TMP) {
-        mmap->template = ALLOC_N(char, strlen(template) + 1);
-        strcpy(mmap->template, template);
-      }
-    }
+  for (n = 0; n < 32; n++) {
+    square[n] = mmap_gf2_times(mat, mat[n]);
   }
+}
 
-  if (anonymous) {
-    if (size <= 0) {
-      rb_raise(rb_eArgError, "length not specified for an anonymous map");
-    }
-    if (offset) {
-      rb_warning("Ignoring offset for an anonymous map");
-      offset = 0;
+/* Returns the CRC32C of A + B from the CRC32C of A, of B and the length of B. */
+static uint32_t
+mmap_crc32c_combine(uint32_t crc1, uint32_t crc2, size_t len2)
+{
+  uint32_t even[32], odd[32], row = 1;
+  int n;
+
+  if (len2 == 0) return crc1;
+  odd[0] = MMAP_CRC32C_POLY;
+  for (n = 1; n < 32; n++, row <<= 1) {
+    odd[n] = row;
+  }
+  mmap_gf2_square(even, odd);
+  mmap_gf2_square(odd, even);
+  for (;;) {
+    mmap_gf2_square(even, odd);
+    if (len2 & 1) crc1 = mmap_gf2_times(even, crc1);
+    if (!(len2 >>= 1)) break;
+    mmap_gf2_square(odd, even);
+    if (len2 & 1) crc1 = mmap_gf2_times(odd, crc1);
+    if (!(len2 >>= 1)) break;
+  }
+  return crc1 ^ crc2;
+}
+
+#define MMAP_XXH_P32_1 0x9E3779B1U
+#define MMAP_XXH_P32_2 0x85EBCA77U
+#define MMAP_XXH_P32_3 0xC2B2AE3DU
+#define MMAP_XXH_P64_1 0x9E3779B185EBCA87ULL
+#define MMAP_XXH_P64_2 0xC2B2AE3D27D4EB4FULL
+#define MMAP_XXH_P64_3 0x165667B19E3779F9ULL
+#define MMAP_XXH_P64_4 0x85EBCA77C2B2AE63ULL
+#define MMAP_XXH_P64_5 0x27D4EB2F165667C5ULL
+#define MMAP_XXH_MX1   0x165667919E3779F9ULL
+#define MMAP_XXH_MX2   0x9FB21C651E98DF25ULL
+
+/* Bytes hashed between two looks at the cancel flag. */
+#define MMAP_XXH_POLL ((size_t)1 << 20)
+
+static const unsigned char mmap_xxh3_secret[192] = {
+  0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+  0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+  0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+  0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+  0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+  0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+  0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+  0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+  0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+  0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+  0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+  0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e
+};
+
+static uint64_t
+mmap_rotl64(uint64_t v, int r)
+{
+  return (v << r) | (v >> (64 - r));
+}
+
+static uint64_t
+mmap_xxh64_round(uint64_t acc, uint64_t input)
+{
+  acc += input * MMAP_XXH_P64_2;
+  return mmap_rotl64(acc, 31) * MMAP_XXH_P64_1;
+}
+
+static uint64_t
+mmap_xxh64_merge(uint64_t acc, uint64_t v)
+{
+  acc ^= mmap_xxh64_round(0, v);
+  return acc * MMAP_XXH_P64_1 + MMAP_XXH_P64_4;
+}
+
+static uint64_t
+mmap_xxh64_avalanche(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= MMAP_XXH_P64_2;
+  h ^= h >> 29;
+  h *= MMAP_XXH_P64_3;
+  return h ^ (h >> 32);
+}
+
+static uint64_t
+mmap_xxh64(const char *p, size_t len, const int *cancel)
+{
+  const char *end = p + len, *stop;
+  uint64_t h, v1, v2, v3, v4;
+
+  if (len >= 32) {
+    v1 = MMAP_XXH_P64_1 + MMAP_XXH_P64_2;
+    v2 = MMAP_XXH_P64_2;
+    v3 = 0;
+    v4 = -MMAP_XXH_P64_1;
+    while (end - p >= 32) {
+      stop = (size_t)(end - p) > MMAP_XXH_POLL ? p + MMAP_XXH_POLL : end - 31;
+      for (; p < stop; p += 32) {
+        v1 = mmap_xxh64_round(v1, mmap_read64(p));
+        v2 = mmap_xxh64_round(v2, mmap_read64(p + 8));
+        v3 = mmap_xxh64_round(v3, mmap_read64(p + 16));
+        v4 = mmap_xxh64_round(v4, mmap_read64(p + 24));
+      }
+      if (cancel && __atomic_load_n(cancel, __ATOMIC_RELAXED)) return 0;
     }
-    smode = O_RDWR;
-    pmode = PROT_READ | PROT_WRITE;
-    mmap->flag |= MMAP_RUBY_FIXED | MMAP_RUBY_ANON;
+    h = mmap_rotl64(v1, 1) + mmap_rotl64(v2, 7) + mmap_rotl64(v3, 12) + mmap_rotl64(v4, 18);
+    h = mmap_xxh64_merge(h, v1);
+    h = mmap_xxh64_merge(h, v2);
+    h = mmap_xxh64_merge(h, v3);
+    h = mmap_xxh64_merge(h, v4);
   }
   else {
-    if (size == 0 && (smode & O_RDWR)) {
-      if (lseek(fd, mmap->incr - 1, SEEK_END) == -1) {
-        rb_raise(rb_eIOError, "can't lseek %lu", mmap->incr - 1);
-      }
-      if (write(fd, "\000", 1) != 1) {
-        rb_raise(rb_eIOError, "can't extend %s", path);
-      }
-      init = 1;
-      size = mmap->incr;
-    }
-    if (!NIL_P(fdv)) {
-      mmap->flag |= MMAP_RUBY_FIXED;
-    }
+    h = MMAP_XXH_P64_5;
   }
 
-  addr = mmap_func(0, size, pmode, vscope, fd, offset);
-  if (NIL_P(fdv) && !anonymous) {
-    close(fd);
+  h += len;
+  for (; end - p >= 8; p += 8) {
+    h ^= mmap_xxh64_round(0, mmap_read64(p));
+    h = mmap_rotl64(h, 27) * MMAP_XXH_P64_1 + MMAP_XXH_P64_4;
   }
-  if (addr == MAP_FAILED || !addr) {
-    rb_raise(rb_eArgError, "mmap failed (%d)", errno);
+  if (end - p >= 4) {
+    h ^= (uint64_t)mmap_read32(p) * MMAP_XXH_P64_1;
+    h = mmap_rotl64(h, 23) * MMAP_XXH_P64_2 + MMAP_XXH_P64_3;
+    p += 4;
   }
-
-#ifdef MADV_NORMAL
-  if (mmap->advice && madvise(addr, size, mmap->advice) == -1) {
-    rb_raise(rb_eArgError, "madvise(%d)", errno);
+  for (; p < end; p++) {
+    h ^= (unsigned char)*p * MMAP_XXH_P64_5;
+    h = mmap_rotl64(h, 11) * MMAP_XXH_P64_1;
   }
+  return mmap_xxh64_avalanche(h);
+}
+
+static uint64_t
+mmap_mul128_fold64(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+  unsigned __int128 r = (unsigned __int128)a * b;
+
+  return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+  uint64_t lo_lo = (a & 0xffffffff) * (b & 0xffffffff);
+  uint64_t hi_lo = (a >> 32) * (b & 0xffffffff);
+  uint64_t lo_hi = (a & 0xffffffff) * (b >> 32);
+  uint64_t hi_hi = (a >> 32) * (b >> 32);
+  uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xffffffff) + lo_hi;
+  uint64_t upper = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+  uint64_t lower = (cross << 32) | (lo_lo & 0xffffffff);
+
+  return lower ^ upper;
 #endif
+}
 
-  if (anonymous && TYPE(options) == T_HASH) {
-    VALUE val;
-    char *ptr;
+static uint64_t
+mmap_xxh3_avalanche(uint64_t h)
+{
+  h ^= h >> 37;
+  h *= MMAP_XXH_MX1;
+  return h ^ (h >> 32);
+}
 
-    val = rb_hash_aref(options, rb_str_new2("initialize"));
+static uint64_t
+mmap_xxh3_mix16(const char *p, const unsigned char *secret)
+{
+  return mmap_mul128_fold64(mmap_read64(p) ^ mmap_read64((const char *)secret),
+                            mmap_read64(p + 8) ^ mmap_read64((const char *)secret + 8));
+}
+
+static uint64_t
+mmap_xxh3_short(const char *p, size_t len)
+{
+  const char *s = (const char *)mmap_xxh3_secret;
+  uint64_t acc, lo, hi;
+  size_t i;
+
+  if (len > 240) return 0;
+  if (len > 128) {
+    acc = len * MMAP_XXH_P64_1;
+    for (i = 0; i < 8; i++) {
+      acc += mmap_xxh3_mix16(p + 16 * i, mmap_xxh3_secret + 16 * i);
+    }
+    acc = mmap_xxh3_avalanche(acc);
+    for (i = 8; i < len / 16; i++) {
+      acc += mmap_xxh3_mix16(p + 16 * i, mmap_xxh3_secret + 16 * (i - 8) + 3);
+    }
+    acc += mmap_xxh3_mix16(p + len - 16, mmap_xxh3_secret + 136 - 17);
+    return mmap_xxh3_avalanche(acc);
+  }
+  if (len > 16) {
+    acc = len * MMAP_XXH_P64_1;
+    if (len > 32) {
+      if (len > 64) {
+        if (len > 96) {
+          acc += mmap_xxh3_mix16(p + 48, mmap_xxh3_secret + 96);
+          acc += mmap_xxh3_mix16(p + len - 64, mmap_xxh3_secret + 112);
+        }
+        acc += mmap_xxh3_mix16(p + 32, mmap_xxh3_secret + 64);
+        acc += mmap_xxh3_mix16(p + len - 48, mmap_xxh3_secret + 80);
+      }
+      acc += mmap_xxh3_mix16(p + 16, mmap_xxh3_secret + 32);
+      acc += mmap_xxh3_mix16(p + len - 32, mmap_xxh3_secret + 48);
+    }
+    acc += mmap_xxh3_mix16(p, mmap_xxh3_secret);
+    acc += mmap_xxh3_mix16(p + len - 16, mmap_xxh3_secret + 16);
+    return mmap_xxh3_avalanche(acc);
+  }
+  if (len > 8) {
+    lo = mmap_read64(p) ^ (mmap_read64(s + 24) ^ mmap_read64(s + 32));
+    hi = mmap_read64(p + len - 8) ^ (mmap_read64(s + 40) ^ mmap_read64(s + 48));
+    acc = len + __builtin_bswap64(lo) + hi + mmap_mul128_fold64(lo, hi);
+    return mmap_xxh3_avalanche(acc);
+  }
+  if (len >= 4) {
+    acc = ((uint64_t)mmap_read32(p + len - 4) + ((uint64_t)mmap_read32(p) << 32)) ^
+          (mmap_read64(s + 8) ^ mmap_read64(s + 16));
+    acc ^= mmap_rotl64(acc, 49) ^ mmap_rotl64(acc, 24);
+    acc *= MMAP_XXH_MX2;
+    acc ^= (acc >> 35) + len;
+    acc *= MMAP_XXH_MX2;
+    return acc ^ (acc >> 28);
+  }
+  if (len > 0) {
+    uint32_t combined = ((uint32_t)(unsigned char)p[0] << 16) |
+                        ((uint32_t)(unsigned char)p[len >> 1] << 24) |
+                        (uint32_t)(unsigned char)p[len - 1] | ((uint32_t)len << 8);
+
+    return mmap_xxh64_avalanche(combined ^ (uint64_t)(mmap_read32(s) ^ mmap_read32(s + 4)));
+  }
+  return mmap_xxh64_avalanche(mmap_read64(s + 56) ^ mmap_read64(s + 64));
+}
+
+static void
+mmap_xxh3_stripe(uint64_t *acc, const char *p, const unsigned char *secret)
+{
+  uint64_t v, k;
+  int i;
+
+  for (i = 0; i < 8; i++) {
+    v = mmap_read64(p + 8 * i);
+    k = v ^ mmap_read64((const char *)secret + 8 * i);
+    acc[i ^ 1] += v;
+    acc[i] += (k & 0xffffffff) * (k >> 32);
+  }
+}
+
+static void
+mmap_xxh3_scramble(uint64_t *acc)
+{
+  const char *s = (const char *)mmap_xxh3_secret + 192 - 64;
+  int i;
+
+  for (i = 0; i < 8; i++) {
+    acc[i] ^= acc[i] >> 47;
+    acc[i] ^= mmap_read64(s + 8 * i);
+    acc[i] *= MMAP_XXH_P32_1;
+  }
+}
+
+static uint64_t
+mmap_xxh3(const char *p, size_t len, const int *cancel)
+{
+  uint64_t acc[8] = {
+    MMAP_XXH_P32_3, MMAP_XXH_P64_1, MMAP_XXH_P64_2, MMAP_XXH_P64_3,
+    MMAP_XXH_P64_4, MMAP_XXH_P32_2, MMAP_XXH_P64_5, MMAP_XXH_P32_1
+  };
+  const size_t block = 64 * 16;
+  size_t n, nblocks, s, nstripes;
+  const char *sec = (const char *)mmap_xxh3_secret;
+  uint64_t h;
+  int i;
+
+  if (len <= 240) return mmap_xxh3_short(p, len);
+
+  nblocks = (len - 1) / block;
+  for (n = 0; n < nblocks; n++) {
+    for (s = 0; s < 16; s++) {
+      mmap_xxh3_stripe(acc, p + n * block + s * 64, mmap_xxh3_secret + s * 8);
+    }
+    mmap_xxh3_scramble(acc);
+    if (cancel && (n + 1) % (MMAP_XXH_POLL / block) == 0 && __atomic_load_n(cancel, __ATOMIC_RELAXED)) {
+      return 0;
+    }
+  }
+  nstripes = ((len - 1) - block * nblocks) / 64;
+  for (s = 0; s < nstripes; s++) {
+    mmap_xxh3_stripe(acc, p + nblocks * block + s * 64, mmap_xxh3_secret + s * 8);
+  }
+  mmap_xxh3_stripe(acc, p + len - 64, mmap_xxh3_secret + 192 - 64 - 7);
+
+  h = len * MMAP_XXH_P64_1;
+  for (i = 0; i < 4; i++) {
+    h += mmap_mul128_fold64(acc[2 * i] ^ mmap_read64(sec + 11 + 16 * i),
+                            acc[2 * i + 1] ^ mmap_read64(sec + 11 + 16 * i + 8));
+  }
+  return mmap_xxh3_avalanche(h);
+}
+
+static mmap_search_func mmap_search = mmap_search_generic;
+static mmap_search_func mmap_rsearch = mmap_rsearch_generic;
+static mmap_count_func mmap_count_byte = mmap_count_byte_generic;
+static mmap_sum_func mmap_sum_bytes = mmap_sum_bytes_generic;
+static mmap_newlines_func mmap_newlines = mmap_newlines_generic;
+static mmap_byteset_func mmap_byteset_find = mmap_byteset_find_generic;
+
+static void
+mmap_cpu_init(void)
+{
+  mmap_crc32c_init();
+#ifdef MMAP_RUBY_X86
+  mmap_search = mmap_search_sse2;
+  mmap_rsearch = mmap_rsearch_sse2;
+  mmap_count_byte = mmap_count_byte_sse2;
+  mmap_sum_bytes = mmap_sum_bytes_sse2;
+  mmap_newlines = mmap_newlines_sse2;
+
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+    mmap_crc32c = mmap_crc32c_sse42;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    mmap_search = mmap_search_avx2;
+    mmap_rsearch = mmap_rsearch_avx2;
+    mmap_count_byte = mmap_count_byte_avx2;
+    mmap_sum_bytes = mmap_sum_bytes_avx2;
+    mmap_newlines = mmap_newlines_avx2;
+    mmap_byteset_find = mmap_byteset_find_avx2;
+    {
+      static const mmap_view_func avx2[0x29] = MMAP_VIEW_TABLE(avx2);
+
+      MEMCPY(mmap_view_reduce, avx2, mmap_view_func, 0x29);
+    }
+  }
+#endif
+}
+
+/*
+ * Counts the bytes of +ptr+ that are members of +table+. Sets of one byte
+ * (or all but one) use the vectorized byte counter, anything else goes
+ * through a four-way interleaved histogram.
+ */
+static size_t
+mmap_count_set(const char *ptr, size_t len, const unsigned char table[256])
+{
+  const unsigned char *p = (const unsigned char *)ptr;
+  size_t hist[4][256];
+  size_t i, n = 0;
+  int members = 0, member = 0, outsider = 0;
+
+  for (i = 0; i < 256; i++) {
+    if (table[i]) {
+      members++;
+      member = (int)i;
+    }
+    else {
+      outsider = (int)i;
+    }
+  }
+  if (members == 0) return 0;
+  if (members == 256) return len;
+  if (members == 1) return mmap_count_byte(ptr, len, (unsigned char)member);
+  if (members == 255) return len - mmap_count_byte(ptr, len, (unsigned char)outsider);
+
+  MEMZERO(hist, size_t, 4 * 256);
+  for (i = 0; i + 4 <= len; i += 4) {
+    hist[0][p[i]]++;
+    hist[1][p[i + 1]]++;
+    hist[2][p[i + 2]]++;
+    hist[3][p[i + 3]]++;
+  }
+  for (; i < len; i++) {
+    hist[0][p[i]]++;
+  }
+  for (i = 0; i < 256; i++) {
+    if (table[i]) n += hist[0][i] + hist[1][i] + hist[2][i] + hist[3][i];
+  }
+  return n;
+}
+
+/*
+ * Returns true when +str+ can be matched byte for byte against the
+ * mapping, which String always treats as binary.
+ */
+static int
+mmap_byte_string_p(VALUE str)
+{
+  return RB_TYPE_P(str, T_STRING) &&
+         (rb_enc_get_index(str) == rb_ascii8bit_encindex() || rb_enc_str_asciionly_p(str));
+}
+
+/*
+ * Builds the byte set described by String#count style arguments: ranges,
+ * a leading ^ for negation, backslash escapes, and the intersection of all
+ * the arguments. Returns 0 when an argument isn't a byte string, so the
+ * caller can fall back to String#count.
+ */
+static int
+mmap_count_setup(int argc, VALUE *argv, unsigned char table[256])
+{
+  int i, c;
+
+  if (argc < 1) return 0;
+  for (i = 0; i < argc; i++) {
+    if (!mmap_byte_string_p(argv[i])) return 0;
+  }
+
+  memset(table, 1, 256);
+  for (i = 0; i < argc; i++) {
+    const unsigned char *p = (const unsigned char *)RSTRING_PTR(argv[i]);
+    const unsigned char *e = p + RSTRING_LEN(argv[i]);
+    unsigned char set[256];
+    int negate = 0;
+
+    MEMZERO(set, unsigned char, 256);
+    if (e - p > 1 && *p == '^') {
+      negate = 1;
+      p++;
+    }
+    while (p < e) {
+      int lo, hi;
+
+      if (*p == '\\' && p + 1 < e) p++;
+      lo = hi = *p++;
+      if (p + 1 < e && *p == '-') {
+        hi = p[1];
+        p += 2;
+        if (lo > hi) {
+          rb_raise(rb_eArgError, "invalid range \"%c-%c\" in string transliteration", lo, hi);
+        }
+      }
+      for (c = lo; c <= hi; c++) set[c] = 1;
+    }
+    for (c = 0; c < 256; c++) {
+      if (set[c] == negate) table[c] = 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Multi-literal search of Mmap#find_any and Mmap#each_match_any: an
+ * Aho-Corasick automaton compiled to a DFA over byte classes, the bytes
+ * that occur in no pattern sharing a single class. +next+ holds nclasses
+ * transitions per state. +out+ is the lowest id of the patterns ending at
+ * a state, or -1, +dict+ the nearest state along the failure links with
+ * an output, or 0, and +dup+ chains the ids of identical patterns. While
+ * the automaton is in the root state, the input is skipped ahead to the
+ * next byte that starts a pattern with mmap_byteset_find.
+ */
+typedef struct {
+  int32_t *next;
+  int32_t *out;
+  int32_t *dict;
+  int32_t *dup;
+  size_t *plen;
+  size_t nstates;
+  size_t npatterns;
+  size_t maxlen;
+  int nclasses;
+  unsigned char classes[256];
+  mmap_byteset_t first;
+  VALUE patterns;
+} mmap_matcher_t;
+
+/* Matches found in one chunk of a parallel scan, as (id, start) pairs. */
+typedef struct {
+  size_t *items;
+  size_t len;
+  size_t capa;
+  int failed;
+} mmap_matches_t;
+
+static void
+mmap_matches_push(mmap_matches_t *list, size_t id, size_t start)
+{
+  if (list->failed) return;
+  if (list->len == list->capa) {
+    size_t capa = list->capa ? list->capa * 2 : 64;
+    size_t *items = realloc(list->items, capa * 2 * sizeof(size_t));
+
+    if (!items) {
+      list->failed = 1;
+      return;
+    }
+    list->items = items;
+    list->capa = capa;
+  }
+  list->items[2 * list->len] = id;
+  list->items[2 * list->len + 1] = start;
+  list->len++;
+}
+
+static int
+mmap_matches_cmp(const void *a, const void *b)
+{
+  const size_t *x = (const size_t *)a, *y = (const size_t *)b;
+
+  if (x[1] != y[1]) return x[1] < y[1] ? -1 : 1;
+  return x[0] < y[0] ? -1 : x[0] > y[0];
+}
+
+/*
+ * Runs +m+ over ptr[beg, stop), starting from the root state at +beg+, and
+ * considers the matches that start before +end+. With +list+, all of them
+ * are appended, ordered by start then id, and SIZE_MAX is returned.
+ * Otherwise the leftmost start is returned, or SIZE_MAX, and *id is set to
+ * the longest pattern found there.
+ */
+static size_t
+mmap_matcher_run(const mmap_matcher_t *m, const char *ptr, size_t beg, size_t end, size_t stop,
+                 mmap_matches_t *list, size_t *id)
+{
+  const unsigned char *p = (const unsigned char *)ptr;
+  const char *hit;
+  size_t i, start, best = SIZE_MAX, sorted = list ? list->len : 0;
+  int32_t s = 0, t, k;
+
+  for (i = beg; i < stop; i++) {
+    if (best != SIZE_MAX && i >= best + m->maxlen) break;
+    if (s == 0) {
+      if (i >= end) break;
+      if (!(hit = mmap_byteset_find(ptr + i, end - i, &m->first))) break;
+      i = (size_t)(hit - ptr);
+    }
+    s = m->next[(size_t)s * m->nclasses + m->classes[p[i]]];
+    for (t = m->out[s] >= 0 ? s : m->dict[s]; t; t = m->dict[t]) {
+      start = i + 1 - m->plen[m->out[t]];
+      if (start >= end) continue;
+      if (list) {
+        for (k = m->out[t]; k >= 0; k = m->dup[k]) mmap_matches_push(list, (size_t)k, start);
+      }
+      else if (start < best || (start == best && m->plen[m->out[t]] > m->plen[*id])) {
+        best = start;
+        *id = (size_t)m->out[t];
+      }
+    }
+  }
+  if (list && list->len > sorted + 1) {
+    qsort(list->items + 2 * sorted, list->len - sorted, 2 * sizeof(size_t), mmap_matches_cmp);
+  }
+  return best;
+}
+
+/*
+ * Parallel scans. Read-only scans over maps of at least
+ * mmap_parallel_threshold bytes release the GVL, split the range into
+ * chunks and let a small pool of native threads (plus the calling thread)
+ * claim chunks until none are left. Each chunk writes its own slot in
+ * +results+, so the caller merges them in order afterwards. A chunk owns
+ * the positions in [beg, end) but may read past +end+, which is how
+ * matches that straddle a boundary are still found.
+ */
+
+#define MMAP_SCAN_MAX_CHUNKS 1024
+#define MMAP_SCAN_MIN_CHUNK (1 << 20)
+#define MMAP_POOL_MAX_THREADS 256
+
+typedef struct mmap_scan mmap_scan;
+
+struct mmap_scan {
+  int (*func)(mmap_scan *scan, size_t beg, size_t end, size_t *result);
+  const char *ptr;
+  const char *other;
+  size_t len;
+  const char *needle;
+  size_t nlen;
+  const unsigned char *table;
+  mmap_t *other_mmap;
+  mmap_lines_t *lines;
+  const size_t *starts;
+  size_t stride;
+  const mmap_matcher_t *matcher;
+  mmap_matches_t *matches;
+  size_t reach;
+
+  int reverse;
+  int workers;
+  size_t chunk;
+  size_t nchunks;
+  size_t next;
+  size_t limit;
+  int cancel;
+  size_t results[MMAP_SCAN_MAX_CHUNKS];
+};
+
+static size_t mmap_parallel_threshold = 64 << 20;
+static int mmap_parallel_threads = 1;
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_mutex_t run;
+  pthread_cond_t work;
+  pthread_cond_t idle;
+  int size;
+  int active;
+  unsigned long seq;
+  mmap_scan *scan;
+} mmap_pool = {
+  PTHREAD_MUTEX_INITIALIZER,
+  PTHREAD_MUTEX_INITIALIZER,
+  PTHREAD_COND_INITIALIZER,
+  PTHREAD_COND_INITIALIZER,
+  0, 0, 0, NULL
+};
+
+/*
+ * Returns whether an IO::Buffer from #to_io_buffer still shares the
+ * mapping. Buffers are held weakly, so one that was freed or collected no
+ * longer counts.
+ */
+static int
+mmap_exported(mmap_t *mmap)
+{
+  VALUE buffers, buffer;
+  long i;
+  int live = 0;
+
+  if (NIL_P(mmap->exports)) return 0;
+  buffers = rb_funcall(mmap->exports, rb_intern("keys"), 0);
+  for (i = 0; i < RARRAY_LEN(buffers); i++) {
+    buffer = RARRAY_AREF(buffers, i);
+    if (RTEST(rb_funcall(buffer, rb_intern("null?"), 0))) {
+      rb_funcall(mmap->exports, rb_intern("delete"), 1, buffer);
+    }
+    else {
+      live++;
+    }
+  }
+  return live;
+}
+
+/* Raises while a scan of another thread reads the mapping. */
+static void
+mmap_check_busy(mmap_t *mmap)
+{
+  if (mmap->busy) {
+    rb_raise(rb_eIOError, "mapping is in use by another thread");
+  }
+}
+
+/* Raises when the mapping can't move or go away: resizes and unmap. */
+static void
+mmap_check_remap(mmap_t *mmap)
+{
+  mmap_check_busy(mmap);
+  if (mmap_exported(mmap)) {
+    rb_raise(rb_eIOError, "mapping is shared with a live IO::Buffer");
+  }
+}
+
+/* Raises for maps over the memory of an IO::Buffer, which no syscall may touch. */
+static void
+mmap_check_owned(mmap_t *mmap)
+{
+  if (mmap->flag & MMAP_RUBY_BORROWED) {
+    rb_raise(rb_eNotImpError, "not supported by maps of an IO::Buffer");
+  }
+}
+
+static void
+mmap_scan_chunks(mmap_scan *scan)
+{
+  size_t i, c, beg, end;
+
+  for (;;) {
+    i = __atomic_fetch_add(&scan->next, 1, __ATOMIC_RELAXED);
+    if (i >= __atomic_load_n(&scan->limit, __ATOMIC_RELAXED) ||
+        __atomic_load_n(&scan->cancel, __ATOMIC_RELAXED)) {
+      break;
+    }
+
+    c = scan->reverse ? scan->nchunks - 1 - i : i;
+    beg = c * scan->chunk;
+    end = beg + scan->chunk < scan->len ? beg + scan->chunk : scan->len;
+    if (scan->func(scan, beg, end, &scan->results[i])) {
+      size_t limit = __atomic_load_n(&scan->limit, __ATOMIC_RELAXED);
+      while (i + 1 < limit &&
+             !__atomic_compare_exchange_n(&scan->limit, &limit, i + 1, 0,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+  }
+}
+
+static void *
+mmap_pool_worker(void *arg)
+{
+  unsigned long seen = 0;
+  mmap_scan *scan;
+
+  (void)arg;
+  pthread_mutex_lock(&mmap_pool.lock);
+  for (;;) {
+    while (mmap_pool.seq == seen) {
+      pthread_cond_wait(&mmap_pool.work, &mmap_pool.lock);
+    }
+    seen = mmap_pool.seq;
+    scan = mmap_pool.scan;
+    if (!scan || mmap_pool.active >= scan->workers) continue;
+
+    mmap_pool.active++;
+    pthread_mutex_unlock(&mmap_pool.lock);
+    mmap_scan_chunks(scan);
+    pthread_mutex_lock(&mmap_pool.lock);
+    if (--mmap_pool.active == 0) {
+      pthread_cond_signal(&mmap_pool.idle);
+    }
+  }
+  return NULL;
+}
+
+static void
+mmap_pool_grow(int size)
+{
+  sigset_t all, old;
+  pthread_attr_t attr;
+  pthread_t thread;
+
+  if (mmap_pool.size >= size) return;
+
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  while (mmap_pool.size < size) {
+    if (pthread_create(&thread, &attr, mmap_pool_worker, NULL) != 0) break;
+    mmap_pool.size++;
+  }
+  pthread_attr_destroy(&attr);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void
+mmap_pool_atfork_child(void)
+{
+  pthread_mutex_init(&mmap_pool.lock, NULL);
+  pthread_mutex_init(&mmap_pool.run, NULL);
+  pthread_cond_init(&mmap_pool.work, NULL);
+  pthread_cond_init(&mmap_pool.idle, NULL);
+  mmap_pool.size = 0;
+  mmap_pool.active = 0;
+  mmap_pool.scan = NULL;
+}
+
+static void *
+mmap_scan_nogvl(void *data)
+{
+  mmap_scan *scan = (mmap_scan *)data;
+
+  pthread_mutex_lock(&mmap_pool.run);
+  pthread_mutex_lock(&mmap_pool.lock);
+  mmap_pool_grow(scan->workers);
+  mmap_pool.scan = scan;
+  mmap_pool.seq++;
+  pthread_cond_broadcast(&mmap_pool.work);
+  pthread_mutex_unlock(&mmap_pool.lock);
+
+  mmap_scan_chunks(scan);
+
+  pthread_mutex_lock(&mmap_pool.lock);
+  while (mmap_pool.active > 0) {
+    pthread_cond_wait(&mmap_pool.idle, &mmap_pool.lock);
+  }
+  mmap_pool.scan = NULL;
+  pthread_mutex_unlock(&mmap_pool.lock);
+  pthread_mutex_unlock(&mmap_pool.run);
+  return NULL;
+}
+
+static void
+mmap_scan_ubf(void *data)
+{
+  mmap_scan *scan = (mmap_scan *)data;
+
+  __atomic_store_n(&scan->cancel, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Runs +scan+ over scan->len bytes and returns the number of leading
+ * entries of scan->results that are valid. Small scans, or any scan when
+ * parallelism is disabled, run as a single chunk while holding the GVL.
+ * Otherwise the map is pinned so that other Ruby threads can't remap or
+ * unmap it while the GVL is released.
+ */
+static size_t
+mmap_scan_run(mmap_t *mmap, mmap_scan *scan)
+{
+  size_t nchunks;
+
+  if (scan->len < mmap_parallel_threshold || mmap_parallel_threads < 2 || scan->len == 0) {
+    scan->chunk = scan->len;
+    scan->nchunks = 1;
+    scan->func(scan, 0, scan->len, &scan->results[0]);
+    return 1;
+  }
+
+  nchunks = (size_t)mmap_parallel_threads * 4;
+  if (nchunks > MMAP_SCAN_MAX_CHUNKS) nchunks = MMAP_SCAN_MAX_CHUNKS;
+  scan->chunk = (scan->len + nchunks - 1) / nchunks;
+  if (scan->chunk < MMAP_SCAN_MIN_CHUNK) scan->chunk = MMAP_SCAN_MIN_CHUNK;
+  scan->nchunks = (scan->len + scan->chunk - 1) / scan->chunk;
+  scan->workers = mmap_parallel_threads - 1;
+
+  do {
+    scan->next = 0;
+    scan->limit = scan->nchunks;
+    scan->cancel = 0;
+
+    mmap->busy++;
+    if (scan->other_mmap) scan->other_mmap->busy++;
+    rb_thread_call_without_gvl(mmap_scan_nogvl, scan, mmap_scan_ubf, scan);
+    mmap->busy--;
+    if (scan->other_mmap) scan->other_mmap->busy--;
+
+    if (scan->cancel) {
+      rb_thread_check_ints();
+    }
+  } while (scan->cancel);
+
+  return scan->limit;
+}
+
+static int
+mmap_scan_search(mmap_scan *scan, size_t beg, size_t end, size_t *result)
+{
+  size_t stop = end + scan->nlen - 1 < scan->len ? end + scan->nlen - 1 : scan->len;
+  const char *hit;
+
+  if (scan->reverse) {
+    hit = mmap_rsearch(scan->ptr + beg, stop - beg, scan->needle, scan->nlen);
+  }
+  else {
+    hit = mmap_search(scan->ptr + beg, stop - beg, scan->needle, scan->nlen);
+  }
+  *result = hit ? (size_t)(hit - scan->ptr) : SIZE_MAX;
+  return hit != NULL;
+}
+
+static int
+mmap_scan_count(mmap_scan *scan, size_t beg, size_t end, size_t *result)
+{
+  *result = mmap_count_set(scan->ptr + beg, end - beg, scan->table);
+  return 0;
+}
+
+static int
+mmap_scan_sum(mmap_scan *scan, size_t beg, size_t end, size_t *result)
+{
+  *result = mmap_sum_bytes(scan->ptr + beg, end - beg);
+  return 0;
+}
+
+static int
+mmap_scan_crc32c(mmap_scan *scan, size_t beg, size_t end, size_t *result)
+{
+  *result = mmap_crc32c(0, scan->ptr + beg, end - beg);
+  return 0;
+}
+
+static int
+mmap_scan_newlines_count(mmap_scan *scan, size_t beg, size_t end, size_t *result)
+{
+  *result = mmap_count_byte(scan->ptr + beg, end - beg, '\n');
+  return 0;
+}
+
+/*
+ * Fills the index entries of the newlines in [beg, end). scan->starts holds
+ * the index of the first newline of each chunk of the counting pass, which
+ * were scan->stride bytes long; the newlines between the start of that
+ * chunk and +beg+ are counted again in case this pass was split differently.
+ */
+static int
+mmap_scan_newlines_fill(mmap_scan *scan, size_t beg, size_t end, size_t *result)
+{
+  size_t c = beg / scan->stride, k = scan->starts[c];
+
+  if (beg > c * scan->stride) {
+    k += mmap_count_byte(scan->ptr + c * scan->stride, beg - c * scan->stride, '\n');
+  }
+  *result = mmap_newlines(scan->ptr + beg, end - beg, scan->lines->scanned + beg,
+                          scan->lines->offs, scan->lines->width, k);
+  return 0;
+}
+
+static int
+mmap_scan_any_first(mmap_scan *scan, size_t beg, size_t end, size_t *result)
+{
+  size_t stop = end + scan->matcher->maxlen - 1 < scan->len ? end + scan->matcher->maxlen - 1 : scan->len;
+  size_t id;
+
+  *result = mmap_matcher_run(scan->matcher, scan->ptr, beg, end, stop, NULL, &id);
+  return *result != SIZE_MAX;
+}
+
+static int
+mmap_scan_any_each(mmap_scan *scan, size_t beg, size_t end, size_t *result)
+{
+  size_t stop = end + scan->matcher->maxlen - 1 < scan->reach ? end + scan->matcher->maxlen - 1 : scan->reach;
+  mmap_matches_t *list = &scan->matches[beg / scan->chunk];
+
+  list->len = 0;
+  list->failed = 0;
+  mmap_matcher_run(scan->matcher, scan->ptr, beg, end, stop, list, NULL);
+  *result = 0;
+  return 0;
+}
+
+static int
+mmap_scan_compare(mmap_scan *scan, size_t beg, size_t end, size_t *result)
+{
+  *result = memcmp(scan->ptr + beg, scan->other + beg, end - beg) != 0;
+  return (int)*result;
+}
+
+static void
+mmap_window_release(mmap_t *mmap)
+{
+  int i;
+
+  for (i = 0; i < MMAP_WINDOWS; i++) {
+    if (mmap->windows[i].base) {
+      munmap(mmap->windows[i].base, mmap->windows[i].maplen);
+      mmap->windows[i].base = NULL;
+    }
+  }
+}
+
+/*
+ * Returns the address of content byte +pos+ of a windowed map, mapping its
+ * window if needed. *avail is the number of bytes readable from there,
+ * overlap included, and *primary the number left before the next window
+ * starts, which is where a sequential reader should move on.
+ */
+static char *
+mmap_window_at(mmap_t *mmap, size_t pos, size_t *avail, size_t *primary)
+{
+  mmap_window_t *w = NULL;
+  off_t at = mmap->offset + (off_t)pos, end = mmap->offset + (off_t)mmap->real;
+  off_t fbeg = at - at % (off_t)mmap->window;
+  size_t maplen;
+  char *base;
+  int i;
+
+  for (i = 0; i < MMAP_WINDOWS; i++) {
+    if (mmap->windows[i].base && mmap->windows[i].fbeg == fbeg) {
+      w = &mmap->windows[i];
+      break;
+    }
+    if (!w || (w->base && (!mmap->windows[i].base || mmap->windows[i].used < w->used))) {
+      w = &mmap->windows[i];
+    }
+  }
+
+  if (!w->base || w->fbeg != fbeg) {
+    if (w->base) {
+      munmap(w->base, w->maplen);
+      w->base = NULL;
+    }
+    maplen = mmap->window + MMAP_WINDOW_OVERLAP;
+    if ((off_t)maplen > end - fbeg) maplen = (size_t)(end - fbeg);
+    base = mmap_func(NULL, maplen, PROT_READ, mmap->vscope, mmap->fd, fbeg);
+    if (base == MAP_FAILED) {
+      rb_raise(rb_eIOError, "can't map window at %lld (%d)", (long long)fbeg, errno);
+    }
+#ifdef MADV_NORMAL
+    if (mmap->advice) madvise(base, maplen, mmap->advice);
+#endif
+    w->base = base;
+    w->maplen = maplen;
+    w->fbeg = fbeg;
+  }
+  w->used = ++mmap->window_tick;
+
+  *avail = w->maplen - (size_t)(at - fbeg);
+  *primary = mmap->window - (size_t)(at - fbeg);
+  if (*primary > *avail) *primary = *avail;
+  return w->base + (at - fbeg);
+}
+
+/* Copies +len+ content bytes at +pos+ of a windowed map into +dst+. */
+static void
+mmap_window_copy(mmap_t *mmap, size_t pos, size_t len, char *dst)
+{
+  size_t avail, primary;
+  char *src;
+
+  while (len) {
+    src = mmap_window_at(mmap, pos, &avail, &primary);
+    if (primary > len) primary = len;
+    memcpy(dst, src, primary);
+    dst += primary;
+    pos += primary;
+    len -= primary;
+  }
+}
+
+static VALUE
+mmap_window_str(mmap_t *mmap, size_t pos, size_t len)
+{
+  VALUE str = rb_str_new(NULL, (long)len);
+
+  mmap_window_copy(mmap, pos, len, RSTRING_PTR(str));
+  return str;
+}
+
+/*
+ * Returns the content offset of the first +needle+ at or after +pos+ in a
+ * windowed map, or -1. Each window is searched together with its overlap,
+ * so needles up to MMAP_WINDOW_OVERLAP + 1 bytes long are never missed.
+ */
+static long
+mmap_window_find(mmap_t *mmap, size_t pos, const char *needle, size_t nlen)
+{
+  size_t avail, primary;
+  const char *p, *hit;
+
+  if (nlen > MMAP_WINDOW_OVERLAP + 1) {
+    rb_raise(rb_eArgError, "pattern longer than the window overlap (%zu bytes)",
+             MMAP_WINDOW_OVERLAP + 1);
+  }
+  if (nlen == 0) return (long)pos;
+  while (pos < mmap->real) {
+    p = mmap_window_at(mmap, pos, &avail, &primary);
+    if ((hit = mmap_search(p, avail, needle, nlen)) != NULL) {
+      return (long)(pos + (size_t)(hit - p));
+    }
+    if (avail == primary) break;
+    pos += primary;
+  }
+  return -1;
+}
+
+/*
+ * Returns the offset of the first (or with +reverse+ the last) occurrence
+ * of +needle+ in +ptr+, or -1.
+ */
+static long
+mmap_find(mmap_t *mmap, const char *ptr, size_t len, const char *needle, size_t nlen, int reverse)
+{
+  mmap_scan scan;
+  size_t i, n;
+
+  if (nlen == 0) return reverse ? (long)len : 0;
+  if (nlen > len) return -1;
+
+  MEMZERO(&scan, mmap_scan, 1);
+  scan.func = mmap_scan_search;
+  scan.ptr = ptr;
+  scan.len = len;
+  scan.needle = needle;
+  scan.nlen = nlen;
+  scan.reverse = reverse;
+  n = mmap_scan_run(mmap, &scan);
+  for (i = 0; i < n; i++) {
+    if (scan.results[i] != SIZE_MAX) return (long)scan.results[i];
+  }
+  return -1;
+}
+
+static size_t
+mmap_count(mmap_t *mmap, const char *ptr, size_t len, const unsigned char table[256])
+{
+  mmap_scan scan;
+  size_t i, n, total = 0;
+
+  MEMZERO(&scan, mmap_scan, 1);
+  scan.func = mmap_scan_count;
+  scan.ptr = ptr;
+  scan.len = len;
+  scan.table = table;
+  n = mmap_scan_run(mmap, &scan);
+  for (i = 0; i < n; i++) {
+    total += scan.results[i];
+  }
+  return total;
+}
+
+static uint64_t
+mmap_sum(mmap_t *mmap, const char *ptr, size_t len)
+{
+  mmap_scan scan;
+  size_t i, n;
+  uint64_t total = 0;
+
+  MEMZERO(&scan, mmap_scan, 1);
+  scan.func = mmap_scan_sum;
+  scan.ptr = ptr;
+  scan.len = len;
+  n = mmap_scan_run(mmap, &scan);
+  for (i = 0; i < n; i++) {
+    total += scan.results[i];
+  }
+  return total;
+}
+
+/*
+ * Continues the CRC32C +crc+ over +ptr+. Large ranges are split into
+ * chunks checksummed in parallel, then folded together in order.
+ */
+static uint32_t
+mmap_checksum_crc32c(mmap_t *mmap, uint32_t crc, const char *ptr, size_t len)
+{
+  mmap_scan scan;
+  size_t i, n, chunk;
+
+  MEMZERO(&scan, mmap_scan, 1);
+  scan.func = mmap_scan_crc32c;
+  scan.ptr = ptr;
+  scan.len = len;
+  n = mmap_scan_run(mmap, &scan);
+  for (i = 0; i < n; i++) {
+    chunk = i + 1 < n ? scan.chunk : len - i * scan.chunk;
+    crc = mmap_crc32c_combine(crc, (uint32_t)scan.results[i], chunk);
+  }
+  return crc;
+}
+
+#define MMAP_DIGEST_XXH64 1
+#define MMAP_DIGEST_XXH3  2
+
+typedef struct {
+  int algo;
+  const char *ptr;
+  size_t len;
+  int cancel;
+  uint64_t result;
+} mmap_digest;
+
+static void *
+mmap_digest_nogvl(void *data)
+{
+  mmap_digest *digest = (mmap_digest *)data;
+  const int *cancel = &digest->cancel;
+
+  if (digest->algo == MMAP_DIGEST_XXH64) {
+    digest->result = mmap_xxh64(digest->ptr, digest->len, cancel);
+  }
+  else {
+    digest->result = mmap_xxh3(digest->ptr, digest->len, cancel);
+  }
+  return NULL;
+}
+
+static void
+mmap_digest_ubf(void *data)
+{
+  mmap_digest *digest = (mmap_digest *)data;
+
+  __atomic_store_n(&digest->cancel, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Returns the XXH64 or XXH3 hash of +ptr+. Neither splits into chunks that
+ * can be merged afterwards, so a large range is hashed by one thread, but
+ * without the GVL.
+ */
+static uint64_t
+mmap_digest_run(mmap_t *mmap, int algo, const char *ptr, size_t len)
+{
+  mmap_digest digest;
+
+  digest.algo = algo;
+  digest.ptr = ptr;
+  digest.len = len;
+  digest.cancel = 0;
+  if (len < mmap_parallel_threshold) {
+    mmap_digest_nogvl(&digest);
+    return digest.result;
+  }
+
+  do {
+    digest.cancel = 0;
+    mmap->busy++;
+    rb_thread_call_without_gvl(mmap_digest_nogvl, &digest, mmap_digest_ubf, &digest);
+    mmap->busy--;
+    if (digest.cancel) {
+      rb_thread_check_ints();
+    }
+  } while (digest.cancel);
+  return digest.result;
+}
+
+static int
+mmap_memeq(mmap_t *mmap, mmap_t *other)
+{
+  mmap_scan scan;
+  size_t i, n;
+
+  if (mmap->real != other->real) return 0;
+
+  MEMZERO(&scan, mmap_scan, 1);
+  scan.func = mmap_scan_compare;
+  scan.ptr = mmap->addr;
+  scan.other = other->addr;
+  scan.other_mmap = other;
+  scan.len = mmap->real;
+  n = mmap_scan_run(mmap, &scan);
+  for (i = 0; i < n; i++) {
+    if (scan.results[i]) return 0;
+  }
+  return 1;
+}
+
+/*
+ * call-seq:
+ *   lockall(flag) -> nil
+ *   mlockall(flag) -> nil
+ *
+ * Disables paging of all pages mapped into the address space of the calling
+ * process. The +flag+ parameter can be MCL_CURRENT (lock all currently mapped
+ * pages) or MCL_FUTURE (lock all pages that become mapped in the future).
+ */
+static VALUE
+rb_cMmap_mlockall(VALUE self, VALUE flag)
+{
+  if (mlockall(NUM2INT(flag)) == -1) {
+    rb_raise(rb_eArgError, "mlockall(%d)", errno);
+  }
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *   unlockall -> nil
+ *   munlockall -> nil
+ *
+ * Re-enables paging for all pages mapped into the address space of the
+ * calling process.
+ */
+static VALUE
+rb_cMmap_munlockall(VALUE self)
+{
+  (void)self;
+  if (munlockall() == -1) {
+    rb_raise(rb_eArgError, "munlockall(%d)", errno);
+  }
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *   parallel_threshold -> integer
+ *
+ * Returns the size in bytes from which read-only scans (+count+, +index+,
+ * +rindex+, <tt>include?</tt>, +sum+, <tt>eql?</tt> and <tt>==</tt>)
+ * release the GVL and run on multiple threads.
+ */
+static VALUE
+rb_cMmap_s_parallel_threshold(VALUE klass)
+{
+  (void)klass;
+  return SIZET2NUM(mmap_parallel_threshold);
+}
+
+/*
+ * call-seq:
+ *   parallel_threshold = bytes
+ *
+ * Sets the size from which scans run in parallel.
+ */
+static VALUE
+rb_cMmap_s_set_parallel_threshold(VALUE klass, VALUE value)
+{
+  (void)klass;
+  mmap_parallel_threshold = NUM2SIZET(value);
+  return value;
+}
+
+/*
+ * call-seq:
+ *   parallel_threads -> integer
+ *
+ * Returns the number of threads used by parallel scans, including the
+ * calling thread. Defaults to the number of online processors.
+ */
+static VALUE
+rb_cMmap_s_parallel_threads(VALUE klass)
+{
+  (void)klass;
+  return INT2NUM(mmap_parallel_threads);
+}
+
+/*
+ * call-seq:
+ *   parallel_threads = count
+ *
+ * Sets the number of threads used by parallel scans. A value of 1
+ * disables parallel scanning.
+ */
+static VALUE
+rb_cMmap_s_set_parallel_threads(VALUE klass, VALUE value)
+{
+  int threads = NUM2INT(value);
+
+  (void)klass;
+  if (threads < 1 || threads > MMAP_POOL_MAX_THREADS) {
+    rb_raise(rb_eArgError, "invalid number of threads %d", threads);
+  }
+  mmap_parallel_threads = threads;
+  return value;
+}
+
+static VALUE
+rb_cMmap_allocate(VALUE klass)
+{
+  mmap_t *mmap;
+  VALUE obj;
+
+  obj = TypedData_Make_Struct(klass, mmap_t, &mmap_type, mmap);
+  MEMZERO(mmap, mmap_t, 1);
+  mmap->fd = -1;
+  mmap->incr = EXP_INCR_SIZE;
+  mmap->huge_size = MMAP_HUGE_PAGE_SIZE;
+  pthread_mutex_init(&mmap->warm.lock, NULL);
+  pthread_cond_init(&mmap->warm.cond, NULL);
+  mmap->ipc_opts = Qnil;
+  mmap->mutex = Qnil;
+  mmap->lock_thread = Qnil;
+  mmap->exports = Qnil;
+  mmap->buffer = Qnil;
+
+  return obj;
+}
+
+typedef struct {
+  mmap_t *mmap;
+  int mode;
+} mmap_ipc_st;
+
+static VALUE
+mmap_ipc_initialize(VALUE pair, VALUE data, int argc, const VALUE *argv, VALUE blockarg)
+{
+  mmap_ipc_st *ipc_st = (mmap_ipc_st *)data;
+  VALUE key, value;
+  const char *options;
+
+  (void)argc;
+  (void)argv;
+  (void)blockarg;
+
+  key = rb_obj_as_string(rb_ary_entry(pair, 0));
+  value = rb_ary_entry(pair, 1);
+  options = StringValuePtr(key);
+
+  if (strcmp(options, "key") == 0) {
+    ipc_st->mmap->key = (key_t)NUM2INT(rb_funcall2(value, rb_intern("to_int"), 0, 0));
+  }
+  else if (strcmp(options, "permanent") == 0) {
+    if (RTEST(value)) {
+      ipc_st->mmap->flag &= ~MMAP_RUBY_TMP;
+    }
+  }
+  else if (strcmp(options, "mode") == 0) {
+    ipc_st->mode = NUM2INT(value);
+  }
+  else {
+    rb_warning("Unknown option `%s'", options);
+  }
+
+  return Qnil;
+}
+
+/*
+ * Initializes the shared mutex of a segment the first time any process
+ * attaches it; later processes wait until it is ready.
+ */
+static void
+mmap_ipc_init(mmap_ipc_t *ipc)
+{
+  pthread_mutexattr_t attr;
+  struct timespec ts = { 0, 1000 * 1000 };
+  uint32_t val = 0;
+  int err;
+
+  if (!__atomic_compare_exchange_n(&ipc->init, &val, MMAP_IPC_INITIALIZING, 0,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+    while (__atomic_load_n(&ipc->init, __ATOMIC_ACQUIRE) != MMAP_IPC_READY) {
+      nanosleep(&ts, NULL);
+    }
+    return;
+  }
+
+  pthread_mutexattr_init(&attr);
+  err = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETROBUST
+  if (!err) err = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#endif
+  if (!err) err = pthread_mutex_init(&ipc->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  if (err) {
+    __atomic_store_n(&ipc->init, 0, __ATOMIC_RELEASE);
+    shmdt(ipc);
+    rb_syserr_fail(err, "pthread_mutex_init()");
+  }
+  __atomic_store_n(&ipc->init, MMAP_IPC_READY, __ATOMIC_RELEASE);
+}
+
+/*
+ * Attaches the shared lock of an ipc map. Only the lock is shared: each
+ * process keeps its own mmap_t, so lengths, reentrancy counts and pointers
+ * never leak between processes.
+ */
+static void
+mmap_ipc_attach(mmap_t *mmap, int vscope)
+{
+  mmap_ipc_st ipc_st;
+  mmap_ipc_t *ipc;
+  key_t key;
+  int fd, shmid, mode;
+  struct shmid_ds buf;
+
+  if (!(vscope & MAP_SHARED)) {
+    rb_warning("Probably it will not do what you expect ...");
+  }
+  mmap->key = -1;
+  ipc_st.mmap = mmap;
+  ipc_st.mode = 0644;
+  if (TYPE(mmap->ipc_opts) == T_HASH) {
+    rb_block_call(mmap->ipc_opts, rb_intern("each"), 0, NULL, mmap_ipc_initialize, (VALUE)&ipc_st);
+  }
+  mmap->ipc_opts = Qnil;
+  mode = ipc_st.mode;
+
+  if (mmap->key <= 0) {
+    mode |= IPC_CREAT;
+    strcpy(template, "/tmp/ruby_mmap.XXXXXX");
+    if ((fd = mkstemp(template)) == -1) {
+      rb_sys_fail("mkstemp()");
+    }
+    close(fd);
+    if ((key = ftok(template, 'R')) == -1) {
+      rb_sys_fail("ftok()");
+    }
+  }
+  else {
+    key = mmap->key;
+  }
+
+  shmid = shmget(key, sizeof(mmap_ipc_t), mode);
+  if ((mmap->flag & MMAP_RUBY_TMP) && (mode & IPC_CREAT)) {
+    unlink(template);
+  }
+  if (shmid == -1) {
+    rb_sys_fail("shmget()");
+  }
+  ipc = shmat(shmid, (void *)0, 0);
+  if (ipc == (mmap_ipc_t *)-1) {
+    rb_sys_fail("shmat()");
+  }
+  if (mmap->flag & MMAP_RUBY_TMP) {
+    if (shmctl(shmid, IPC_RMID, &buf) == -1) {
+      shmdt(ipc);
+      rb_sys_fail("shmctl()");
+    }
+  }
+  mmap_ipc_init(ipc);
+
+  mmap->key = key;
+  mmap->shmid = shmid;
+  mmap->ipc = ipc;
+  mmap->mutex = rb_mutex_new();
+  mmap->lock_pid = getpid();
+}
+
+/*
+ * Reserves +len+ bytes of address space aligned on +align+, so that a map
+ * placed there with MAP_FIXED starts on a huge page boundary.
+ */
+static void *
+mmap_reserve_aligned(size_t len, size_t align)
+{
+  char *base, *aligned;
+
+  base = mmap(NULL, len + align, PROT_NONE, MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED) {
+    return MAP_FAILED;
+  }
+  aligned = (char *)(((uintptr_t)base + align - 1) & ~(uintptr_t)(align - 1));
+  if (aligned > base) {
+    munmap(base, aligned - base);
+  }
+  if (base + align > aligned) {
+    munmap(aligned + len, base + align - aligned);
+  }
+  return aligned;
+}
+
+static void
+mmap_advise_huge(mmap_t *mmap, void *addr, size_t len)
+{
+#ifdef MADV_HUGEPAGE
+  if (mmap->huge == MMAP_HUGE_TRANSPARENT && madvise(addr, len, MADV_HUGEPAGE) == -1) {
+    rb_warning("madvise(MADV_HUGEPAGE) failed (%d)", errno);
+  }
+#else
+  (void)mmap;
+  (void)addr;
+  (void)len;
+#endif
+}
+
+/*
+ * Maps +*len+ bytes honouring the huge_pages option. MAP_HUGETLB rounds the
+ * length up to the huge page size and falls back to transparent huge pages
+ * when the kernel has no pool for it or the file is not on hugetlbfs.
+ */
+static void *
+mmap_map(mmap_t *mmap, size_t *len, int pmode, int vscope, int fd, off_t offset)
+{
+  void *addr, *hint;
+
+#ifdef MAP_HUGETLB
+  if (mmap->huge == MMAP_HUGE_TLB) {
+    size_t hlen = (*len + mmap->huge_size - 1) & ~(mmap->huge_size - 1);
+    int flags = vscope | MAP_HUGETLB;
+
+#ifdef MAP_HUGE_SHIFT
+    flags |= (__builtin_ctzl(mmap->huge_size) << MAP_HUGE_SHIFT);
+#endif
+    addr = mmap_func(0, hlen, pmode, flags, fd, offset);
+    if (addr != MAP_FAILED) {
+      *len = hlen;
+      return addr;
+    }
+    rb_warn("MAP_HUGETLB failed (%d), falling back to transparent huge pages", errno);
+  }
+#endif
+  if (mmap->huge != MMAP_HUGE_NONE) {
+    mmap->huge = MMAP_HUGE_TRANSPARENT;
+    hint = mmap_reserve_aligned(*len, mmap->huge_size);
+    if (hint != MAP_FAILED) {
+      addr = mmap_func(hint, *len, pmode, vscope | MAP_FIXED, fd, offset);
+      if (addr != MAP_FAILED) {
+        mmap_advise_huge(mmap, addr, *len);
+        return addr;
+      }
+      munmap(hint, *len);
+    }
+  }
+  return mmap_func(0, *len, pmode, vscope, fd, offset);
+}
+
+/*
+ * call-seq:
+ *   new(file, mode = "r", protection = Mmap::MAP_SHARED, options = {})
+ *
+ * Returns a new MmapRuby object.
+ *
+ * * +file+
+ *
+ *   Pathname of the file. If +nil+ is given, an anonymous map
+ *   is created (+Mmap::MAP_ANON+).
+ *
+ * * +mode+
+ *
+ *   Mode to open the file. Can be "r", "w", "rw", or "a".
+ *
+ * * +protection+
+ *
+ *   Specifies the nature of the mapping:
+ *
+ *   * +Mmap::MAP_SHARED+
+ *
+ *     Creates a mapping that's shared with all other processes
+ *     mapping the same areas of the file.
+ *     This is the default value.
+ *
+ *   * +Mmap::MAP_PRIVATE+
+ *
+ *     Creates a private copy-on-write mapping, so changes to the
+ *     contents of the mmap object will be private to this process.
+ *
+ * * +options+
+ *
+ *   Hash. If one of the options +length+ or +offset+
+ *   is specified, it will not be possible to modify the size of
+ *   the mapped file.
+ *
+ *   length:: Maps +length+ bytes from the file.
+ *
+ *   offset:: The mapping begins at +offset+.
+ *
+ *   advice:: The type of access (see #madvise).
+ *
+ *   growth:: How the map grows when appending or inserting past its
+ *            reserved size. +:linear+ (the default) grows by
+ *            +increment+ bytes at most. +:geometric+ reserves twice the
+ *            current size, and a Hash such as
+ *            <tt>{ factor: 1.5, cap: 64 << 20 }</tt> picks the factor
+ *            and caps a single reservation step. The unused tail is
+ *            trimmed by #msync and #unmap.
+ *
+ *   huge_pages:: +:transparent+ aligns the map on a huge page boundary and
+ *                asks for transparent huge pages (MADV_HUGEPAGE).
+ *                +:hugetlb+ maps with MAP_HUGETLB, which needs reserved
+ *                huge pages and an anonymous map or a hugetlbfs file, and
+ *                falls back to +:transparent+ with a warning otherwise.
+ *
+ *   huge_page_size:: Huge page size in bytes, 2 MiB by default.
+ *
+ *   populate:: Faults the whole map in when it is created or grown
+ *              (MAP_POPULATE), instead of page by page on first touch.
+ *              See also #warm.
+ *
+ *   track_dirty:: Records the pages written through this object so that a
+ *                 plain #msync only flushes those (see #dirty_ranges).
+ *
+ *   window:: Maps the file lazily, +window+ bytes at a time, for files larger
+ *            than the address space one is willing to spend on them. Up to
+ *            four windows stay mapped. Windowed maps are read-only views
+ *            that support #size, #empty?, #[] with indexes and ranges,
+ *            #index and #include? with strings, #count, #sum, #each_byte and
+ *            #each_line; other methods raise NotImplementedError.
+ *
+ * +offset+ may be any byte offset: the mapping starts at the page boundary
+ * below it and the content at +offset+.
+ */
+static VALUE
+rb_cMmap_initialize(int argc, VALUE *argv, VALUE self)
+{
+  mmap_t *mmap;
+  struct stat st;
+
+  VALUE fname, vmode, scope, options;
+  VALUE fdv = Qnil;
+
+  const char *path = 0, *mode = 0;
+  int fd = -1, perm = 0666;
+
+  caddr_t addr;
+  size_t size = 0, len, shift;
+  off_t offset = 0;
+  int smode = 0, pmode = 0, vscope = 0;
+
+  int anonymous = 0, init = 0;
+
+  options = Qnil;
+  argc = rb_scan_args(argc, argv, "12:", &fname, &vmode, &scope, &options);
+
+  if (NIL_P(fname)) {
+    vscope = MAP_ANON | MAP_SHARED;
+    anonymous = 1;
+  }
+  else
+  {
+    if (rb_respond_to(fname, rb_intern("fileno"))) {
+      fdv = rb_funcall2(fname, rb_intern("fileno"), 0, 0);
+    }
+
+    if (NIL_P(fdv)) {
+      fname = rb_str_to_str(fname);
+      StringValue(fname);
+      path = StringValuePtr(fname);
+    }
+    else {
+      fd = NUM2INT(fdv);
+      if (fd < 0) {
+        rb_raise(rb_eArgError, "invalid file descriptor %d", fd);
+      }
+    }
+
+    if (!NIL_P(scope)) {
+      vscope = NUM2INT(scope);
+      if (vscope & MAP_ANON) {
+        rb_raise(rb_eArgError, "filename specified for an anonymous map");
+      }
+    }
+  }
+
+  vscope |= NIL_P(scope) ? MAP_SHARED : NUM2INT(scope);
+
+  if (!anonymous) {
+    if (NIL_P(vmode)) {
+      mode = "r";
+    }
+    else if (rb_respond_to(vmode, rb_intern("to_ary"))) {
+      VALUE tmp;
+
+      vmode = rb_convert_type(vmode, T_ARRAY, "Array", "to_ary");
+      if (RARRAY_LEN(vmode) != 2) {
+        rb_raise(rb_eArgError, "invalid length %ld (expected 2)",
+                 RARRAY_LEN(vmode));
+      }
+      tmp = rb_ary_entry(vmode, 0);
+      mode = StringValuePtr(tmp);
+      perm = NUM2INT(rb_ary_entry(vmode, 1));
+    }
+    else {
+      mode = StringValuePtr(vmode);
+    }
+
+    if (strcmp(mode, "r") == 0) {
+      smode = O_RDONLY;
+      pmode = PROT_READ;
+    }
+    else if (strcmp(mode, "w") == 0) {
+      smode = O_RDWR | O_TRUNC;
+      pmode = PROT_READ | PROT_WRITE;
+    }
+    else if (strcmp(mode, "rw") == 0 || strcmp(mode, "wr") == 0) {
+      smode = O_RDWR;
+      pmode = PROT_READ | PROT_WRITE;
+    }
+    else if (strcmp(mode, "a") == 0) {
+      smode = O_RDWR | O_CREAT;
+      pmode = PROT_READ | PROT_WRITE;
+    }
+    else {
+      rb_raise(rb_eArgError, "invalid mode %s", mode);
+    }
+
+    if (NIL_P(fdv)) {
+      if ((fd = open(path, smode | O_CLOEXEC, perm)) == -1) {
+        rb_raise(rb_eArgError, "can't open %s", path);
+      }
+    }
+    if (fstat(fd, &st) == -1) {
+      rb_raise(rb_eArgError, "can't stat %s", path);
+    }
+    size = st.st_size;
+  }
+  else {
+    fd = -1;
+    if (!NIL_P(vmode) && TYPE(vmode) != T_STRING) {
+      size = NUM2INT(vmode);
+    }
+  }
+
+  TypedData_Get_Struct(self, mmap_t, &mmap_type, mmap);
+  rb_check_frozen(self);
+
+  if (options != Qnil) {
+    rb_funcall(self, rb_intern("process_options"), 1, options);
+    if (!anonymous && (mmap->len + mmap->offset) > (size_t)st.st_size) {
+      rb_raise(rb_eArgError, "invalid value for length (%zu) or offset (%lld)",
+               mmap->len, (long long)mmap->offset);
+    }
+    if (mmap->len) size = mmap->len;
+    else if (!anonymous) size -= mmap->offset;
+    offset = mmap->offset;
+
+    if (mmap->window && (anonymous || (mmap->flag & MMAP_RUBY_IPC))) {
+      rb_raise(rb_eArgError, "window is only supported for file maps");
+    }
+
+    if (mmap->flag & MMAP_RUBY_IPC) {
+      mmap_ipc_attach(mmap, vscope);
+    }
+  }
+
+  if (mmap->window) {
+    if (NIL_P(fdv)) {
+      mmap->fd = fd;
+    }
+    else if ((mmap->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) == -1) {
+      rb_raise(rb_eArgError, "can't dup descriptor %d", fd);
+    }
+    mmap->real = mmap->len = size;
+    mmap->pmode = pmode;
+    mmap->vscope = vscope;
+    mmap->smode = smode & ~O_TRUNC;
+    mmap->flag |= MMAP_RUBY_FIXED | MMAP_RUBY_WINDOW;
+    mmap->path = (path) ? strdup(path) : (char *)(intptr_t)-1;
+    return smode == O_RDONLY ? rb_obj_freeze(self) : self;
+  }
+
+  if (anonymous) {
+    if (size <= 0) {
+      rb_raise(rb_eArgError, "length not specified for an anonymous map");
+    }
+    if (offset) {
+      rb_warning("Ignoring offset for an anonymous map");
+      offset = 0;
+    }
+    smode = O_RDWR;
+    pmode = PROT_READ | PROT_WRITE;
+    mmap->flag |= MMAP_RUBY_FIXED | MMAP_RUBY_ANON;
+  }
+  else {
+    if (size == 0 && (smode & O_RDWR)) {
+      if (lseek(fd, mmap->incr - 1, SEEK_END) == -1) {
+        rb_raise(rb_eIOError, "can't lseek %lu", mmap->incr - 1);
+      }
+      if (write(fd, "\000", 1) != 1) {
+        rb_raise(rb_eIOError, "can't extend %s", path);
+      }
+      init = 1;
+      size = mmap->incr;
+    }
+    if (!NIL_P(fdv)) {
+      mmap->flag |= MMAP_RUBY_FIXED;
+    }
+  }
+
+  shift = (size_t)(offset % sysconf(_SC_PAGESIZE));
+  len = size + shift;
+  addr = mmap_map(mmap, &len, pmode,
+#ifdef MAP_POPULATE
+                  vscope | ((mmap->flag & MMAP_RUBY_POPULATE) ? MAP_POPULATE : 0),
+#else
+                  vscope,
+#endif
+                  fd, offset - shift);
+  if (NIL_P(fdv) && !anonymous) {
+    /* Keep the descriptor of maps that can be resized later. */
+    if (addr != MAP_FAILED && (smode & O_ACCMODE) == O_RDWR && (vscope & MAP_SHARED) &&
+        !(mmap->flag & MMAP_RUBY_FIXED)) {
+      mmap->fd = fd;
+    }
+    else {
+      close(fd);
+    }
+  }
+  if (addr == MAP_FAILED || !addr) {
+    rb_raise(rb_eArgError, "mmap failed (%d)", errno);
+  }
+
+#ifdef MADV_NORMAL
+  if (mmap->advice && madvise(addr, len, mmap->advice) == -1) {
+    rb_raise(rb_eArgError, "madvise(%d)", errno);
+  }
+#endif
+  addr += shift;
+  len -= shift;
+  mmap->shift = shift;
+
+  if (anonymous && TYPE(options) == T_HASH) {
+    VALUE val;
+    char *ptr;
+
+    val = rb_hash_aref(options, rb_str_new2("initialize"));
     if (NIL_P(val)) val = rb_hash_aref(options, ID2SYM(rb_intern("initialize")));
     if (!NIL_P(val)) {
       ptr = StringValuePtr(val);
@@ -497,726 +2973,3482 @@ rb_cMmap_initialize(int argc, VALUE *argv, VALUE self)
     }
   }
 
-  mmap->addr = addr;
-  mmap->len = size;
-  if (!init) mmap->real = size;
-  mmap->pmode = pmode;
-  mmap->vscope = vscope;
-  mmap->smode = smode & ~O_TRUNC;
-  mmap->path = (path) ? strdup(path) : (char *)(intptr_t)-1;
+  mmap->addr = addr;
+  mmap->len = len;
+  if (!init) mmap->real = size;
+  mmap->pmode = pmode;
+  mmap->vscope = vscope;
+  mmap->smode = smode & ~O_TRUNC;
+  mmap->path = (path) ? strdup(path) : (char *)(intptr_t)-1;
+
+  if (smode == O_RDONLY) {
+    self = rb_obj_freeze(self);
+  }
+  else {
+    if (smode == O_WRONLY) {
+      mmap->flag |= MMAP_RUBY_FIXED;
+    }
+  }
+
+  return self;
+}
+
+static VALUE
+mmap_str(VALUE self, int modify)
+{
+  mmap_t *mmap;
+
+  GET_MMAP(self, mmap, modify & ~MMAP_RUBY_ORIGIN);
+  if (modify & MMAP_RUBY_MODIFY) {
+    rb_check_frozen(self);
+  }
+
+  VALUE string = rb_obj_alloc(rb_cString);
+  RSTRING(string)->len = mmap->real;
+  RSTRING(string)->as.heap.ptr = mmap->addr;
+  RSTRING(string)->as.heap.aux.capa = mmap->len;
+  if (modify & MMAP_RUBY_ORIGIN) {
+    RSTRING(string)->as.heap.aux.shared = self;
+    FL_SET(string, RSTRING_NOEMBED);
+    FL_SET(string, FL_USER18);
+  }
+
+  if (RB_OBJ_FROZEN(self)) {
+    string = rb_obj_freeze(string);
+  }
+
+  return string;
+}
+
+/*
+ * call-seq:
+ *   to_str
+ *
+ * Convert object to a string.
+ */
+static VALUE
+rb_cMmap_to_str(VALUE self)
+{
+  return mmap_str(self, MMAP_RUBY_ORIGIN);
+}
+
+/*
+ * call-seq:
+ *   hash -> integer
+ *
+ * Returns the hash value for the mapped memory content. Objects with the
+ * same content will have the same hash value. The content is hashed in
+ * place with XXH3.
+ */
+static VALUE
+rb_cMmap_hash(VALUE self)
+{
+  mmap_t *mmap;
+  uint64_t digest;
+
+  GET_MMAP(self, mmap, 0);
+  digest = mmap_digest_run(mmap, MMAP_DIGEST_XXH3, mmap->addr, mmap->real);
+  return ST2FIX(rb_hash_end(rb_hash_start((st_index_t)digest)));
+}
+
+/*
+ * call-seq:
+ *   eql?(other) -> true or false
+ *
+ * Returns +true+ if the content and type of the mapped memory is equal to +other+.
+ * Unlike +==+, this method only returns +true+ for other Mmap objects, not strings.
+ */
+static VALUE
+rb_cMmap_eql(VALUE self, VALUE other)
+{
+  mmap_t *mmap, *other_mmap;
+
+  if (self == other) return Qtrue;
+  if (!rb_typeddata_is_kind_of(other, &mmap_type)) return Qfalse;
+
+  GET_MMAP(self, mmap, 0);
+  GET_MMAP(other, other_mmap, 0);
+  return mmap_memeq(mmap, other_mmap) ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   ==(other) -> true or false
+ *   ===(other) -> true or false
+ *
+ * Returns +true+ if the content of the mapped memory is equal to +other+.
+ * Compares with other Mmap objects or strings.
+ */
+static VALUE
+rb_cMmap_equal(VALUE self, VALUE other)
+{
+  mmap_t *mmap, *other_mmap;
+
+  if (self == other) return Qtrue;
+  if (!rb_typeddata_is_kind_of(other, &mmap_type)) return Qfalse;
+
+  GET_MMAP(self, mmap, 0);
+  GET_MMAP(other, other_mmap, 0);
+  return mmap_memeq(mmap, other_mmap) ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   <=>(other) -> -1, 0, 1, or nil
+ *
+ * Compares the mapped memory with +other+. Returns -1 if the mapped memory
+ * is less than +other+, 0 if they are equal, 1 if the mapped memory is
+ * greater than +other+, or +nil+ if the values are incomparable.
+ */
+static VALUE
+rb_cMmap_cmp(VALUE self, VALUE other)
+{
+  VALUE self_str, other_str;
+  VALUE result;
+
+  self_str = mmap_str(self, MMAP_RUBY_ORIGIN);
+  other_str = rb_str_to_str(other);
+  result = rb_funcall2(self_str, rb_intern("<=>"), 1, &other_str);
+  RB_GC_GUARD(self_str);
+  RB_GC_GUARD(other_str);
+  return result;
+}
+
+/*
+ * call-seq:
+ *   casecmp(other) -> -1, 0, 1, or nil
+ *
+ * Performs a case-insensitive comparison of the mapped memory with +other+.
+ * Returns -1, 0, or 1 depending on whether the mapped memory is less than,
+ * equal to, or greater than +other+. Returns +nil+ if the two values are
+ * incomparable.
+ */
+static VALUE
+rb_cMmap_casecmp(VALUE self, VALUE other)
+{
+  VALUE result;
+  VALUE self_str, other_str;
+
+  self_str = mmap_str(self, MMAP_RUBY_ORIGIN);
+  other_str = rb_str_to_str(other);
+  result = rb_funcall2(self_str, rb_intern("casecmp"), 1, &other_str);
+  RB_GC_GUARD(self_str);
+  RB_GC_GUARD(other_str);
+  return result;
+}
+
+/*
+ * call-seq:
+ *   =~(other) -> integer or nil
+ *
+ * Returns the index of the first match of +other+ in the mapped memory,
+ * or +nil+ if no match is found. The +other+ parameter can be a Regexp,
+ * String, or any object that responds to +=~+.
+ */
+static VALUE
+rb_cMmap_match(VALUE self, VALUE other)
+{
+  VALUE reg, res, self_str;
+  long start;
+
+  self_str = mmap_str(self, MMAP_RUBY_ORIGIN);
+  if (rb_typeddata_is_kind_of(other, &mmap_type)) {
+    other = rb_cMmap_to_str(other);
+  }
+
+  switch (TYPE(other)) {
+    case T_REGEXP:
+      res = rb_reg_match(other, self_str);
+      break;
+
+    case T_STRING:
+      reg = rb_reg_regcomp(other);
+      start = rb_reg_search(reg, self_str, 0, 0);
+      if (start == -1) {
+        res = Qnil;
+      }
+      else {
+        res = LONG2NUM(start);
+      }
+      break;
+
+    default:
+      res = rb_funcall(other, rb_intern("=~"), 1, self_str);
+      break;
+  }
+
+  RB_GC_GUARD(self_str);
+  return res;
+}
+
+static VALUE
+mmap_bang_protect(VALUE tmp)
+{
+  VALUE *t = (VALUE *)tmp;
+
+  return rb_funcall2(t[0], (ID)t[1], (int)t[2], (VALUE *)t[3]);
+}
+
+static VALUE
+mmap_bang_exec(VALUE data)
+{
+  mmap_bang *bang_st = (mmap_bang *)data;
+  VALUE str, res;
+  mmap_t *mmap;
+
+  str = mmap_str(bang_st->obj, (int)bang_st->flag);
+  if (bang_st->flag & MMAP_RUBY_PROTECT) {
+    VALUE tmp[4];
+    tmp[0] = str;
+    tmp[1] = (VALUE)bang_st->id;
+    tmp[2] = (VALUE)bang_st->argc;
+    tmp[3] = (VALUE)bang_st->argv;
+    res = rb_ensure(mmap_bang_protect, (VALUE)tmp, 0, str);
+  }
+  else {
+    res = rb_funcall2(str, bang_st->id, bang_st->argc, bang_st->argv);
+    RB_GC_GUARD(res);
+  }
+
+  if (res != Qnil) {
+    GET_MMAP(bang_st->obj, mmap, 0);
+    mmap->real = RSTRING_LEN(str);
+  }
+
+  return res;
+}
+
+typedef struct {
+  mmap_t *mmap;
+  int wait_lock;
+  int held;
+} mmap_lock_st;
+
+typedef struct {
+  pthread_mutex_t *lock;
+  volatile int cancel;
+} mmap_ipc_wait_st;
+
+/*
+ * Waits a bounded time for the shared mutex, so that the caller gets the GVL
+ * back often enough to run interrupts. Returns the pthread error code.
+ */
+static void *
+mmap_ipc_wait_nogvl(void *ptr)
+{
+  mmap_ipc_wait_st *wait_st = (mmap_ipc_wait_st *)ptr;
+  int err = ETIMEDOUT;
+#ifdef HAVE_PTHREAD_MUTEX_TIMEDLOCK
+  struct timespec ts;
+
+  if (wait_st->cancel) return (void *)(intptr_t)err;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_nsec += 100 * 1000 * 1000;
+  if (ts.tv_nsec >= 1000 * 1000 * 1000) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000 * 1000 * 1000;
+  }
+  err = pthread_mutex_timedlock(wait_st->lock, &ts);
+#else
+  struct timespec ts = { 0, 1000 * 1000 };
+  int i;
+
+  for (i = 0; i < 100 && !wait_st->cancel; i++) {
+    if ((err = pthread_mutex_trylock(wait_st->lock)) != EBUSY) break;
+    nanosleep(&ts, NULL);
+    err = ETIMEDOUT;
+  }
+#endif
+  return (void *)(intptr_t)err;
+}
+
+static void
+mmap_ipc_wait_ubf(void *ptr)
+{
+  ((mmap_ipc_wait_st *)ptr)->cancel = 1;
+}
+
+/*
+ * Takes the shared mutex, waiting for it without the GVL while another
+ * process holds it. A lock whose owner died is made consistent and taken
+ * over, with a warning. Returns Qfalse if the lock is busy and +wait_lock+
+ * is false.
+ */
+static VALUE
+mmap_ipc_acquire(VALUE data)
+{
+  mmap_lock_st *lock_st = (mmap_lock_st *)data;
+  mmap_ipc_t *ipc = lock_st->mmap->ipc;
+  mmap_ipc_wait_st wait_st;
+  int err;
+
+  err = pthread_mutex_trylock(&ipc->lock);
+  if (err == EBUSY && lock_st->wait_lock) {
+    wait_st.lock = &ipc->lock;
+    do {
+      wait_st.cancel = 0;
+      rb_thread_check_ints();
+      err = (int)(intptr_t)rb_thread_call_without_gvl(mmap_ipc_wait_nogvl, &wait_st,
+                                                     mmap_ipc_wait_ubf, &wait_st);
+    } while (err == ETIMEDOUT);
+  }
+  if (err == EBUSY) {
+    return Qfalse;
+  }
+#ifdef HAVE_PTHREAD_MUTEX_CONSISTENT
+  if (err == EOWNERDEAD) {
+    lock_st->held = 1;
+    pthread_mutex_consistent(&ipc->lock);
+    rb_warn("recovered an ipc lock held by a dead process (%u recoveries)",
+            __atomic_add_fetch(&ipc->recovered, 1, __ATOMIC_RELAXED));
+    return Qtrue;
+  }
+#endif
+  if (err) {
+    rb_syserr_fail(err, "pthread_mutex_lock()");
+  }
+  lock_st->held = 1;
+  return Qtrue;
+}
+
+/*
+ * The lock is reentrant per thread. Threads of the same process queue on a
+ * Thread::Mutex first, so only one of them ever waits on the shared mutex.
+ */
+static void
+mmap_lock(mmap_t *mmap, int wait_lock)
+{
+  mmap_lock_st lock_st;
+  VALUE thread, acquired;
+  int state = 0;
+
+  if (!(mmap->flag & MMAP_RUBY_IPC) || !mmap->ipc) return;
+
+  if (mmap->lock_pid != getpid()) {
+    /* Forked: the parent's hold and its mutex do not carry over. */
+    mmap->mutex = rb_mutex_new();
+    mmap->lock_thread = Qnil;
+    mmap->lock_pid = getpid();
+    mmap->count = 0;
+  }
+  thread = rb_thread_current();
+  if (mmap->count > 0 && mmap->lock_thread == thread) {
+    mmap->count++;
+    return;
+  }
+
+  if (wait_lock) {
+    rb_mutex_lock(mmap->mutex);
+  }
+  else if (!RTEST(rb_mutex_trylock(mmap->mutex))) {
+    rb_raise(rb_const_get(rb_mErrno, rb_intern("EAGAIN")), "EAGAIN");
+  }
+
+  lock_st.mmap = mmap;
+  lock_st.wait_lock = wait_lock;
+  lock_st.held = 0;
+  acquired = rb_protect(mmap_ipc_acquire, (VALUE)&lock_st, &state);
+  if (state || !RTEST(acquired)) {
+    if (lock_st.held) pthread_mutex_unlock(&mmap->ipc->lock);
+    rb_mutex_unlock(mmap->mutex);
+    if (state) rb_jump_tag(state);
+    rb_raise(rb_const_get(rb_mErrno, rb_intern("EAGAIN")), "EAGAIN");
+  }
+  mmap->lock_thread = thread;
+  mmap->count = 1;
+}
+
+static void
+mmap_unlock(mmap_t *mmap)
+{
+  if (!(mmap->flag & MMAP_RUBY_IPC) || !mmap->ipc) return;
+  if (mmap->lock_pid != getpid() || mmap->count <= 0) return;
+  if (--mmap->count) return;
+
+  pthread_mutex_unlock(&mmap->ipc->lock);
+  mmap->lock_thread = Qnil;
+  rb_mutex_unlock(mmap->mutex);
+}
+
+static VALUE
+mmap_vunlock(VALUE obj)
+{
+  mmap_t *mmap;
+
+  GET_MMAP(obj, mmap, 0);
+  mmap_unlock(mmap);
+  return Qnil;
+}
+
+static VALUE
+mmap_bang_initialize(VALUE obj, int flag, ID id, int argc, VALUE *argv)
+{
+  VALUE res;
+  mmap_t *mmap;
+  mmap_bang bang_st;
+
+  GET_MMAP(obj, mmap, 0);
+  if ((flag & MMAP_RUBY_CHANGE) && (mmap->flag & MMAP_RUBY_FIXED)) {
+    rb_raise(rb_eTypeError, "can't change the size of a fixed map");
+  }
+
+  bang_st.obj = obj;
+  bang_st.flag = flag;
+  bang_st.id = id;
+  bang_st.argc = argc;
+  bang_st.argv = argv;
+
+  if (mmap->flag & MMAP_RUBY_IPC) {
+    mmap_lock(mmap, Qtrue);
+    res = rb_ensure(mmap_bang_exec, (VALUE)&bang_st, mmap_vunlock, obj);
+  }
+  else {
+    res = mmap_bang_exec((VALUE)&bang_st);
+  }
+
+  if (res == Qnil) return res;
+  return (flag & MMAP_RUBY_ORIGIN) ? res : obj;
+}
+
+/*
+ * call-seq:
+ *   match(pattern) -> MatchData or nil
+ *
+ * Converts +pattern+ to a Regexp (if it isn't already one) and returns a
+ * MatchData object describing the match, or +nil+ if there was no match.
+ * This is equivalent to calling +pattern.match+ on the mapped memory content.
+ */
+static VALUE
+rb_cMmap_match_m(VALUE self, VALUE pattern)
+{
+  return mmap_bang_initialize(self, MMAP_RUBY_ORIGIN, rb_intern("match"), 1, &pattern);
+}
+
+/*
+ * call-seq:
+ *   length -> integer
+ *   size -> integer
+ *
+ * Returns the size of the file.
+ */
+static VALUE
+rb_cMmap_size(VALUE self)
+{
+  mmap_t *mmap;
+
+  GET_MMAP(self, mmap, MMAP_RUBY_WINDOWED);
+  return SIZET2NUM(mmap->real);
+}
+
+/*
+ * call-seq:
+ *   empty? -> true or false
+ *
+ * Returns +true+ if the file is empty, +false+ otherwise.
+ */
+static VALUE
+rb_cMmap_empty(VALUE self)
+{
+  mmap_t *mmap;
+
+  GET_MMAP(self, mmap, MMAP_RUBY_WINDOWED);
+  if (mmap->real == 0) return Qtrue;
+  return Qfalse;
+}
+
+/*
+ * call-seq:
+ *   [](nth) -> string or nil
+ *   [](start, length) -> string or nil
+ *   [](start..last) -> string or nil
+ *   [](pattern) -> string or nil
+ *   slice(nth) -> string or nil
+ *   slice(start, length) -> string or nil
+ *   slice(start..last) -> string or nil
+ *   slice(pattern) -> string or nil
+ *
+ * Element reference with the following syntax:
+ *
+ *   self[nth]
+ *
+ * Retrieves the +nth+ character.
+ *
+ *   self[start..last]
+ *
+ * Returns a substring from +start+ to +last+.
+ *
+ *   self[start, length]
+ *
+ * Returns a substring of +length+ characters from +start+.
+ *
+ *   self[pattern]
+ *
+ * Returns the first match of +pattern+ (String or Regexp).
+ */
+static VALUE
+mmap_window_aref(mmap_t *mmap, int argc, VALUE *argv)
+{
+  long beg, len, real = (long)mmap->real;
+
+  if (argc == 2) {
+    beg = NUM2LONG(argv[0]);
+    len = NUM2LONG(argv[1]);
+    if (len < 0) return Qnil;
+    if (beg < 0) beg += real;
+    if (beg < 0 || beg > real) return Qnil;
+    if (len > real - beg) len = real - beg;
+  }
+  else if (argc == 1 && RB_INTEGER_TYPE_P(argv[0])) {
+    beg = NUM2LONG(argv[0]);
+    if (beg < 0) beg += real;
+    if (beg < 0 || beg >= real) return Qnil;
+    len = 1;
+  }
+  else if (argc == 1 && rb_obj_is_kind_of(argv[0], rb_cRange)) {
+    if (!RTEST(rb_range_beg_len(argv[0], &beg, &len, real, 0))) return Qnil;
+  }
+  else if (argc == 1) {
+    rb_raise(rb_eNotImpError, "windowed maps are indexed by position only");
+  }
+  else {
+    rb_error_arity(argc, 1, 2);
+  }
+  return mmap_window_str(mmap, (size_t)beg, (size_t)len);
+}
+
+static VALUE
+rb_cMmap_aref(int argc, VALUE *argv, VALUE self)
+{
+  mmap_t *mmap;
+
+  GET_MMAP(self, mmap, MMAP_RUBY_WINDOWED);
+  if (mmap->flag & MMAP_RUBY_WINDOW) {
+    return mmap_window_aref(mmap, argc, argv);
+  }
+  return mmap_bang_initialize(self, MMAP_RUBY_ORIGIN, rb_intern("[]"), argc, argv);
+}
+
+static VALUE
+mmap_aset_m(VALUE self, VALUE indx, VALUE val)
+{
+  long idx;
+  mmap_t *mmap;
+
+  GET_MMAP(self, mmap, MMAP_RUBY_MODIFY);
+  switch (TYPE(indx)) {
+    case T_FIXNUM:
+num_index:
+      idx = NUM2INT(indx);
+      if (idx < 0) {
+        idx += mmap->real;
+      }
+      if (idx < 0 || mmap->real <= (size_t)idx) {
+        rb_raise(rb_eIndexError, "index %ld out of string", idx);
+      }
+      if (FIXNUM_P(val)) {
+        if (mmap->real == (size_t)idx) {
+          mmap->real += 1;
+          if (mmap->flag & MMAP_RUBY_FIXED) {
+            rb_raise(rb_eTypeError, "can't change the size of a fixed map");
+          }
+        }
+        mmap_check_write(mmap, idx, 1);
+        ((char *)mmap->addr)[idx] = NUM2INT(val) & 0xff;
+        mmap_touch(mmap, idx, 1);
+      }
+      else {
+        mmap_update(mmap, idx, 1, val);
+      }
+      return val;
+
+    case T_REGEXP:
+      mmap_subpat_set(self, indx, 0, val);
+      return val;
+
+    case T_STRING:
+      {
+        VALUE res;
+
+        res = rb_cMmap_index(1, &indx, self);
+        if (!NIL_P(res)) {
+          mmap_update(mmap, NUM2LONG(res), RSTRING_LEN(indx), val);
+        }
+        return val;
+      }
+
+    default:
+      {
+        long beg, len;
+        if (rb_range_beg_len(indx, &beg, &len, mmap->real, 2)) {
+          mmap_update(mmap, beg, len, val);
+          return val;
+        }
+      }
+      idx = NUM2LONG(indx);
+      goto num_index;
+  }
+}
+
+static void
+mmap_update(mmap_t *str, long beg, long len, VALUE val)
+{
+  char *valp;
+  long vall;
+
+  if (len < 0) rb_raise(rb_eIndexError, "negative length %ld", len);
+  mmap_lock(str, Qtrue);
+  if (beg < 0) {
+    beg += str->real;
+  }
+  if (beg < 0 || str->real < (size_t)beg) {
+    if (beg < 0) {
+      beg -= str->real;
+    }
+    mmap_unlock(str);
+    rb_raise(rb_eIndexError, "index %ld out of string", beg);
+  }
+  if (str->real < (size_t)(beg + len)) {
+    len = str->real - beg;
+  }
+
+  mmap_unlock(str);
+  valp = StringValuePtr(val);
+  vall = RSTRING_LEN(val);
+  mmap_lock(str, Qtrue);
+
+  if ((str->flag & MMAP_RUBY_FIXED) && vall != len) {
+    mmap_unlock(str);
+    rb_raise(rb_eTypeError, "try to change the size of a fixed map");
+  }
+  mmap_check_write(str, beg, vall != len ? str->real - beg + (vall > len ? vall - len : 0) : (size_t)vall);
+  if (len < vall) {
+    mmap_realloc(str, str->real + vall - len);
+  }
+
+  if (vall != len) {
+    memmove((char *)str->addr + beg + vall,
+            (char *)str->addr + beg + len,
+            str->real - (beg + len));
+  }
+  if (str->real < (size_t)beg && len < 0) {
+    MEMZERO((char *)str->addr + str->real, char, -len);
+  }
+  if (vall > 0) {
+    memmove((char *)str->addr + beg, valp, vall);
+  }
+  str->real += vall - len;
+  mmap_touch(str, beg, vall != len ? str->real - beg : (size_t)vall);
+  mmap_unlock(str);
+}
+
+static void
+mmap_subpat_set(VALUE obj, VALUE re, int offset, VALUE val)
+{
+  VALUE str, match;
+  OnigPosition start, end;
+  int len;
+  mmap_t *mmap;
+  struct re_registers *regs;
+
+  str = mmap_str(obj, MMAP_RUBY_MODIFY | MMAP_RUBY_ORIGIN);
+  if (rb_reg_search(re, str, 0, 0) < 0) {
+    rb_raise(rb_eIndexError, "regexp not matched");
+  }
+
+  match = rb_backref_get();
+  regs = RMATCH_REGS(match);
+  if (offset >= regs->num_regs) {
+    rb_raise(rb_eIndexError, "index %d out of regexp", offset);
+  }
+
+  start = regs->beg[offset];
+  if (start == -1) {
+    rb_raise(rb_eIndexError, "regexp group %d not matched", offset);
+  }
+  end = regs->end[offset];
+  len = (int)(end - start);
+
+  GET_MMAP(obj, mmap, MMAP_RUBY_MODIFY);
+  mmap_update(mmap, start, len, val);
+}
+
+/*
+ * call-seq:
+ *   []=(nth, val) -> val
+ *   []=(start, length, val) -> val
+ *   []=(start..last, val) -> val
+ *   []=(pattern, val) -> val
+ *   []=(pattern, nth, val) -> val
+ *
+ * Element assignment with the following syntax:
+ *
+ *   self[nth] = val
+ *
+ * Changes the +nth+ character with +val+.
+ *
+ *   self[start..last] = val
+ *
+ * Changes substring from +start+ to +last+ with +val+.
+ *
+ *   self[start, length] = val
+ *
+ * Replaces +length+ characters from +start+ with +val+.
+ *
+ *   self[pattern] = val
+ *
+ * Replaces the first match of +pattern+ with +val+.
+ *
+ *   self[pattern, nth] = val
+ *
+ * Replaces the +nth+ match of +pattern+ with +val+.
+ */
+static VALUE
+rb_cMmap_aset(int argc, VALUE *argv, VALUE self)
+{
+  mmap_t *mmap;
+
+  GET_MMAP(self, mmap, MMAP_RUBY_MODIFY);
+  if (argc == 3) {
+    long beg, len;
+
+    if (TYPE(argv[0]) == T_REGEXP) {
+      mmap_subpat_set(self, argv[0], NUM2INT(argv[1]), argv[2]);
+    }
+    else {
+      beg = NUM2INT(argv[0]);
+      len = NUM2INT(argv[1]);
+      mmap_update(mmap, beg, len, argv[2]);
+    }
+    return argv[2];
+  }
+  if (argc != 2) {
+    rb_raise(rb_eArgError, "wrong # of arguments(%d for 2)", argc);
+  }
+  return mmap_aset_m(self, argv[0], argv[1]);
+}
+
+typedef struct {
+  size_t beg;
+  size_t len;
+  const char *ptr;
+  ptrdiff_t inner;
+} mmap_batch_write;
+
+static int
+mmap_batch_cmp(const void *a, const void *b)
+{
+  const mmap_batch_write *x = a, *y = b;
+
+  return x->beg < y->beg ? -1 : x->beg > y->beg;
+}
+
+/*
+ * Backs write_batch: writes every [offset, string] pair of +writes+ under
+ * a single lock. The writes are sorted and checked for overlaps first, the
+ * map grows at most once, to the furthest end, and the dirty pages of
+ * writes closer than a page apart are recorded as one range. Bytes past
+ * the old end that no write covers are zeroed.
+ */
+static VALUE
+rb_cMmap_batch_write(VALUE self, VALUE writes)
+{
+  mmap_t *mmap;
+  mmap_batch_write *w;
+  VALUE entry, str, tmp;
+  long i, n, off;
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t end = 0, b, e;
+  char *base;
+
+  GET_MMAP(self, mmap, MMAP_RUBY_MODIFY);
+  writes = rb_ary_dup(rb_Array(writes));
+  n = RARRAY_LEN(writes);
+  w = ALLOCV_N(mmap_batch_write, tmp, n);
+
+  for (i = 0; i < n; i++) {
+    entry = rb_check_array_type(RARRAY_AREF(writes, i));
+    if (NIL_P(entry) || RARRAY_LEN(entry) != 2) {
+      rb_raise(rb_eArgError, "expected [offset, string] pairs");
+    }
+    off = NUM2LONG(RARRAY_AREF(entry, 0));
+    str = rb_str_to_str(RARRAY_AREF(entry, 1));
+    rb_ary_store(writes, i, str);
+    if (off < 0) off += (long)mmap->real;
+    if (off < 0) {
+      rb_raise(rb_eIndexError, "offset %ld out of map", NUM2LONG(RARRAY_AREF(entry, 0)));
+    }
+    w[i].beg = (size_t)off;
+    w[i].len = RSTRING_LEN(str);
+    w[i].ptr = RSTRING_PTR(str);
+    w[i].inner = 0;
+    if (w[i].beg + w[i].len > end) end = w[i].beg + w[i].len;
+  }
+
+  qsort(w, n, sizeof(*w), mmap_batch_cmp);
+  for (i = 1; i < n; i++) {
+    if (w[i - 1].beg + w[i - 1].len > w[i].beg) {
+      rb_raise(rb_eArgError, "overlapping writes at offsets %zu and %zu", w[i - 1].beg, w[i].beg);
+    }
+  }
+
+  mmap_lock(mmap, Qtrue);
+  if (end > mmap->real && (mmap->flag & MMAP_RUBY_FIXED)) {
+    mmap_unlock(mmap);
+    rb_raise(rb_eTypeError, "can't change the size of a fixed map");
+  }
+  for (i = 0; i < n; i++) {
+    mmap_check_write(mmap, w[i].beg, w[i].len);
+  }
+  if (end > mmap->real) {
+    base = mmap->addr;
+    for (i = 0; i < n; i++) {
+      if (base <= w[i].ptr && w[i].ptr < base + mmap->len) {
+        w[i].inner = w[i].ptr - base + 1;
+      }
+    }
+    mmap_realloc(mmap, end);
+    for (i = 0; i < n; i++) {
+      if (w[i].inner) w[i].ptr = (char *)mmap->addr + w[i].inner - 1;
+    }
+    MEMZERO((char *)mmap->addr + mmap->real, char, end - mmap->real);
+  }
+
+  base = mmap->addr;
+  for (i = 0; i < n; i++) {
+    memmove(base + w[i].beg, w[i].ptr, w[i].len);
+  }
+  if (end > mmap->real) mmap->real = end;
+
+  i = 0;
+  while (i < n) {
+    b = w[i].beg;
+    e = b + w[i].len;
+    for (i++; i < n && w[i].beg < e + page; i++) {
+      e = w[i].beg + w[i].len;
+    }
+    mmap_touch(mmap, b, e - b);
+  }
+  mmap_unlock(mmap);
+
+  ALLOCV_END(tmp);
+  RB_GC_GUARD(writes);
+  return self;
+}
+
+/*
+ * Returns the bytes of +buffer+, a String or an IO::Buffer, for reading or
+ * for writing.
+ */
+static char *
+mmap_buffer_bytes(VALUE buffer, int write, size_t *size)
+{
+  void *base;
+  const void *cbase;
+
+  if (RB_TYPE_P(buffer, T_STRING)) {
+    if (write) rb_str_modify(buffer);
+    *size = RSTRING_LEN(buffer);
+    return RSTRING_PTR(buffer);
+  }
+  if (rb_obj_is_kind_of(buffer, rb_cIOBuffer)) {
+    if (write) {
+      rb_io_buffer_get_bytes_for_writing(buffer, &base, size);
+      return base;
+    }
+    rb_io_buffer_get_bytes_for_reading(buffer, &cbase, size);
+    return (char *)cbase;
+  }
+  rb_raise(rb_eTypeError, "wrong argument type %"PRIsVALUE" (expected String or IO::Buffer)",
+           rb_obj_class(buffer));
+}
+
+/* Checks +offset+ (negative counts from the end) against the map. */
+static size_t
+mmap_buffer_offset(mmap_t *mmap, VALUE offset)
+{
+  long off = NUM2LONG(offset);
+
+  if (off < 0) off += (long)mmap->real;
+  if (off < 0 || (size_t)off > mmap->real) {
+    rb_raise(rb_eIndexError, "offset %ld out of map", NUM2LONG(offset));
+  }
+  return (size_t)off;
+}
+
+/*
+ * call-seq:
+ *   read_into(buffer, offset = 0, length = nil) -> integer
+ *
+ * Copies up to +length+ bytes of the mapped memory from +offset+ into
+ * +buffer+ and returns the number of bytes copied, which is less than
+ * +length+ at the end of the map. A String +buffer+ is resized to the bytes
+ * read, reusing its capacity, and +length+ defaults to the rest of the map.
+ * An IO::Buffer is filled from its start, and +length+ defaults to its size.
+ * Nothing is allocated once the String is large enough.
+ *
+ *   buf = String.new(capacity: 4096)
+ *   mmap.read_into(buf, pos, 3) # => 3
+ */
+static VALUE
+rb_cMmap_read_into(int argc, VALUE *argv, VALUE self)
+{
+  mmap_t *mmap;
+  VALUE buffer, voffset, vlength;
+  size_t off = 0, len, size;
+  char *dst;
+
+  rb_scan_args(argc, argv, "12", &buffer, &voffset, &vlength);
+  GET_MMAP(self, mmap, MMAP_RUBY_WINDOWED);
+  if (!NIL_P(voffset)) off = mmap_buffer_offset(mmap, voffset);
+  len = mmap->real - off;
+  if (!NIL_P(vlength)) {
+    long l = NUM2LONG(vlength);
+
+    if (l < 0) rb_raise(rb_eArgError, "negative length %ld", l);
+    if ((size_t)l < len) len = (size_t)l;
+  }
+
+  if (RB_TYPE_P(buffer, T_STRING)) {
+    if (rb_str_capacity(buffer) < len) {
+      rb_str_modify_expand(buffer, (long)len - RSTRING_LEN(buffer));
+    }
+    else {
+      rb_str_modify(buffer);
+    }
+    dst = RSTRING_PTR(buffer);
+  }
+  else {
+    dst = mmap_buffer_bytes(buffer, 1, &size);
+    if (!NIL_P(vlength) && (size_t)NUM2LONG(vlength) > size) {
+      rb_raise(rb_eArgError, "length %ld out of the buffer (%zu bytes)", NUM2LONG(vlength), size);
+    }
+    if (len > size) len = size;
+  }
+
+  if (mmap->flag & MMAP_RUBY_WINDOW) {
+    mmap_window_copy(mmap, off, len, dst);
+  }
+  else {
+    memmove(dst, (char *)mmap->addr + off, len);
+  }
+  if (RB_TYPE_P(buffer, T_STRING)) {
+    rb_str_set_len(buffer, (long)len);
+  }
+  return SIZET2NUM(len);
+}
+
+/*
+ * call-seq:
+ *   write_from(buffer, offset = 0, length = nil) -> integer
+ *
+ * Copies the first +length+ bytes (by default all) of +buffer+, a String or
+ * an IO::Buffer, into the mapped memory at +offset+ and returns +length+.
+ * A write past the end grows the map, as #[]= does.
+ */
+static VALUE
+rb_cMmap_write_from(int argc, VALUE *argv, VALUE self)
+{
+  mmap_t *mmap;
+  VALUE buffer, voffset, vlength;
+  size_t off = 0, len, size;
+  const char *src;
+  ptrdiff_t inner = -1;
+
+  rb_scan_args(argc, argv, "12", &buffer, &voffset, &vlength);
+  GET_MMAP(self, mmap, MMAP_RUBY_MODIFY);
+  if (!NIL_P(voffset)) off = mmap_buffer_offset(mmap, voffset);
+  src = mmap_buffer_bytes(buffer, 0, &size);
+  len = size;
+  if (!NIL_P(vlength)) {
+    long l = NUM2LONG(vlength);
+
+    if (l < 0 || (size_t)l > size) {
+      rb_raise(rb_eArgError, "length %ld out of the buffer (%zu bytes)", l, size);
+    }
+    len = (size_t)l;
+  }
+
+  mmap_lock(mmap, Qtrue);
+  if (off + len > mmap->real) {
+    if (mmap->flag & MMAP_RUBY_FIXED) {
+      mmap_unlock(mmap);
+      rb_raise(rb_eTypeError, "can't change the size of a fixed map");
+    }
+    if ((const char *)mmap->addr <= src && src < (const char *)mmap->addr + mmap->len) {
+      inner = src - (const char *)mmap->addr;
+    }
+  }
+  mmap_check_write(mmap, off, len);
+  if (off + len > mmap->real) {
+    mmap_realloc(mmap, off + len);
+    if (inner >= 0) src = (const char *)mmap->addr + inner;
+  }
+  memmove((char *)mmap->addr + off, src, len);
+  if (off + len > mmap->real) mmap->real = off + len;
+  mmap_touch(mmap, off, len);
+  mmap_unlock(mmap);
+  RB_GC_GUARD(buffer);
+  return SIZET2NUM(len);
+}
+
+static VALUE
+mmap_io_buffer_free(VALUE buffer)
+{
+  return rb_funcall(buffer, rb_intern("free"), 0);
+}
+
+/*
+ * call-seq:
+ *   to_io_buffer(offset = 0, length = nil) -> buffer
+ *   to_io_buffer(offset = 0, length = nil) { |buffer| ... } -> object
+ *
+ * Returns an IO::Buffer over +length+ bytes (by default up to the end) of
+ * the mapped memory at +offset+, without copying them. The buffer is
+ * read-only when the map is frozen or not writable. With a block, the
+ * buffer is yielded and freed when the block returns, and the block's
+ * value is returned.
+ *
+ * While the buffer is alive, resizing or unmapping the map raises IOError.
+ * Release it with IO::Buffer#free, or use the block form: a buffer that is
+ * merely dropped keeps the map pinned until it is garbage collected.
+ *
+ *   mmap.to_io_buffer { |buffer| buffer.write(socket) }
+ */
+static VALUE
+rb_cMmap_to_io_buffer(int argc, VALUE *argv, VALUE self)
+{
+  mmap_t *mmap;
+  VALUE voffset, vlength, buffer;
+  size_t off = 0, len;
+  enum rb_io_buffer_flags flags = RB_IO_BUFFER_EXTERNAL;
+
+  rb_scan_args(argc, argv, "02", &voffset, &vlength);
+  GET_MMAP(self, mmap, 0);
+  if (!NIL_P(voffset)) off = mmap_buffer_offset(mmap, voffset);
+  len = mmap->real - off;
+  if (!NIL_P(vlength)) {
+    long l = NUM2LONG(vlength);
+
+    if (l < 0 || (size_t)l > len) {
+      rb_raise(rb_eIndexError, "range %zu, %ld out of map", off, l);
+    }
+    len = (size_t)l;
+  }
+
+  if (OBJ_FROZEN(self) || !(mmap->pmode & PROT_WRITE)) {
+    flags |= RB_IO_BUFFER_READONLY;
+  }
+  buffer = rb_io_buffer_new((char *)mmap->addr + off, len, flags);
+  if (!(flags & RB_IO_BUFFER_READONLY)) {
+    /* Writes through the buffer are not seen, so count the range as dirty. */
+    mmap_touch(mmap, off, len);
+  }
+
+  if (NIL_P(mmap->exports)) {
+    RB_OBJ_WRITE(self, &mmap->exports, rb_class_new_instance(0, 0, rb_path2class("ObjectSpace::WeakMap")));
+  }
+  rb_funcall(mmap->exports, rb_intern("[]="), 2, buffer, Qtrue);
+
+  if (rb_block_given_p()) {
+    return rb_ensure(rb_yield, buffer, mmap_io_buffer_free, buffer);
+  }
+  return buffer;
+}
+
+/*
+ * Unlocks the IO::Buffer of a map, if it still holds one. +holder+ is the
+ * one element Array kept in mmap->buffer, shared with the finalizer that
+ * unlocks the buffer of a map collected without #unmap.
+ */
+static void
+mmap_io_buffer_release(VALUE holder)
+{
+  VALUE buffer = rb_ary_pop(holder);
+
+  if (!NIL_P(buffer)) rb_io_buffer_unlock(buffer);
+}
+
+static VALUE
+mmap_io_buffer_finalize(RB_BLOCK_CALL_FUNC_ARGLIST(id, holder))
+{
+  mmap_io_buffer_release(holder);
+  return Qnil;
+}
+
+static VALUE
+mmap_io_buffer_unmap(VALUE obj)
+{
+  mmap_t *mmap;
+
+  TypedData_Get_Struct(obj, mmap_t, &mmap_type, mmap);
+  if (mmap->path) rb_funcall(obj, rb_intern("unmap"), 0);
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *   Mmap.from_io_buffer(buffer, offset = 0, length = nil) -> mmap
+ *   Mmap.from_io_buffer(buffer, offset = 0, length = nil) { |mmap| ... } -> object
+ *
+ * Returns a map over +length+ bytes (by default up to the end) of the
+ * memory of +buffer+ at +offset+, without copying them. The buffer is
+ * locked until the map is unmapped, or collected. The map is frozen when
+ * the buffer is read-only, and can't change size or use #mprotect,
+ * #madvise, #msync, #mlock or #munlock. With a block, the map is yielded
+ * and unmapped when the block returns, and the block's value is returned.
+ */
+static VALUE
+rb_cMmap_s_from_io_buffer(int argc, VALUE *argv, VALUE klass)
+{
+  mmap_t *mmap;
+  VALUE buffer, voffset, vlength, obj, holder;
+  void *base;
+  size_t size, off = 0, len;
+  enum rb_io_buffer_flags flags;
+
+  rb_scan_args(argc, argv, "12", &buffer, &voffset, &vlength);
+  if (!RTEST(rb_obj_is_kind_of(buffer, rb_cIOBuffer))) {
+    rb_raise(rb_eTypeError, "wrong argument type %"PRIsVALUE" (expected IO::Buffer)", rb_obj_class(buffer));
+  }
+  flags = rb_io_buffer_get_bytes(buffer, &base, &size);
+  if (!base) {
+    rb_raise(rb_eArgError, "buffer is not allocated");
+  }
+  if (!NIL_P(voffset)) {
+    long o = NUM2LONG(voffset);
+
+    if (o < 0) o += (long)size;
+    if (o < 0 || (size_t)o > size) {
+      rb_raise(rb_eIndexError, "offset %ld out of the buffer", NUM2LONG(voffset));
+    }
+    off = (size_t)o;
+  }
+  len = size - off;
+  if (!NIL_P(vlength)) {
+    long l = NUM2LONG(vlength);
+
+    if (l < 0 || (size_t)l > len) {
+      rb_raise(rb_eIndexError, "range %zu, %ld out of the buffer", off, l);
+    }
+    len = (size_t)l;
+  }
+
+  obj = rb_cMmap_allocate(klass);
+  TypedData_Get_Struct(obj, mmap_t, &mmap_type, mmap);
+  rb_io_buffer_lock(buffer);
+  holder = rb_ary_new_from_args(1, buffer);
+  RB_OBJ_WRITE(obj, &mmap->buffer, holder);
+  rb_define_finalizer(obj, rb_proc_new(mmap_io_buffer_finalize, holder));
+  mmap->addr = (char *)base + off;
+  mmap->len = mmap->real = len;
+  mmap->path = (char *)(intptr_t)-1;
+  mmap->flag = MMAP_RUBY_FIXED | MMAP_RUBY_BORROWED;
+  mmap->vscope = MAP_SHARED;
+  if (flags & RB_IO_BUFFER_READONLY) {
+    mmap->pmode = PROT_READ;
+    mmap->smode = O_RDONLY;
+    rb_obj_freeze(obj);
+  }
+  else {
+    mmap->pmode = PROT_READ | PROT_WRITE;
+    mmap->smode = O_RDWR;
+  }
+  if (rb_block_given_p()) {
+    return rb_ensure(rb_yield, obj, mmap_io_buffer_unmap, obj);
+  }
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   slice!(nth) -> string or nil
+ *   slice!(start, length) -> string or nil
+ *   slice!(start..last) -> string or nil
+ *   slice!(pattern) -> string or nil
+ *
+ * Deletes the specified portion of the mapped memory and returns it.
+ * Returns +nil+ if the portion is not found.
+ */
+static VALUE
+rb_cMmap_slice_bang(int argc, VALUE *argv, VALUE self)
+{
+  VALUE result;
+  VALUE buf[3];
+  int i;
+
+  if (argc < 1 || 2 < argc) {
+    rb_raise(rb_eArgError, "wrong # of arguments(%d for 1)", argc);
+  }
+
+  for (i = 0; i < argc; i++) {
+    buf[i] = argv[i];
+  }
+  buf[i] = rb_str_new(0, 0);
+  result = rb_cMmap_aref(argc, buf, self);
+  if (!NIL_P(result)) {
+    rb_cMmap_aset(argc + 1, buf, self);
+  }
+
+  return result;
+}
+
+/*
+ * call-seq:
+ *   include?(other) -> true or false
+ *
+ * Returns +true+ if +other+ is found in the mapped memory, +false+ otherwise.
+ * The +other+ parameter can be a string or regular expression.
+ */
+static VALUE
+rb_cMmap_include(VALUE self, VALUE other)
+{
+  mmap_t *mmap;
+  long pos;
+
+  if (!mmap_byte_string_p(other)) {
+    return mmap_bang_initialize(self, MMAP_RUBY_ORIGIN, rb_intern("include?"), 1, &other);
+  }
+
+  GET_MMAP(self, mmap, MMAP_RUBY_WINDOWED);
+  if (mmap->flag & MMAP_RUBY_WINDOW) {
+    return mmap_window_find(mmap, 0, RSTRING_PTR(other), RSTRING_LEN(other)) >= 0 ? Qtrue : Qfalse;
+  }
+  mmap_lock(mmap, Qtrue);
+  pos = mmap_find(mmap, mmap->addr, mmap->real, RSTRING_PTR(other), RSTRING_LEN(other), 0);
+  mmap_unlock(mmap);
+  return pos >= 0 ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   index(substr, offset = 0) -> integer or nil
+ *   index(pattern, offset = 0) -> integer or nil
+ *
+ * Returns the index of +substr+ or +pattern+, or +nil+ if not found.
+ * Byte strings are searched for directly in the mapping.
+ */
+static VALUE
+rb_cMmap_index(int argc, VALUE *argv, VALUE self)
+{
+  mmap_t *mmap;
+  long pos = 0, found;
+
+  if (argc < 1 || argc > 2 || !mmap_byte_string_p(argv[0]) ||
+      (argc == 2 && !RB_INTEGER_TYPE_P(argv[1]))) {
+    return mmap_bang_initialize(self, MMAP_RUBY_ORIGIN, rb_intern("index"), argc, argv);
+  }
+
+  GET_MMAP(self, mmap, MMAP_RUBY_WINDOWED);
+  if (argc == 2) {
+    pos = NUM2LONG(argv[1]);
+    if (pos < 0) pos += mmap->real;
+    if (pos < 0 || (size_t)pos > mmap->real) return Qnil;
+  }
+
+  if (mmap->flag & MMAP_RUBY_WINDOW) {
+    found = mmap_window_find(mmap, pos, RSTRING_PTR(argv[0]), RSTRING_LEN(argv[0]));
+    return found >= 0 ? LONG2NUM(found) : Qnil;
+  }
+  mmap_lock(mmap, Qtrue);
+  found = mmap_find(mmap, (char *)mmap->addr + pos, mmap->real - pos,
+                    RSTRING_PTR(argv[0]), RSTRING_LEN(argv[0]), 0);
+  mmap_unlock(mmap);
+  return found >= 0 ? LONG2NUM(pos + found) : Qnil;
+}
+
+/*
+ * call-seq:
+ *   rindex(substr, pos = nil) -> integer or nil
+ *   rindex(pattern, pos = nil) -> integer or nil
+ *
+ * Returns the index of the last occurrence of +substr+ or +pattern+, or +nil+ if not found.
+ * Byte strings are searched for directly in the mapping.
+ */
+static VALUE
+rb_cMmap_rindex(int argc, VALUE *argv, VALUE self)
+{
+  mmap_t *mmap;
+  long pos, len, found;
+
+  if (argc < 1 || argc > 2 || !mmap_byte_string_p(argv[0]) ||
+      (argc == 2 && !RB_INTEGER_TYPE_P(argv[1]))) {
+    return mmap_bang_initialize(self, MMAP_RUBY_ORIGIN, rb_intern("rindex"), argc, argv);
+  }
+
+  GET_MMAP(self, mmap, 0);
+  pos = mmap->real;
+  if (argc == 2) {
+    pos = NUM2LONG(argv[1]);
+    if (pos < 0) pos += mmap->real;
+    if (pos < 0) return Qnil;
+    if ((size_t)pos > mmap->real) pos = mmap->real;
+  }
+
+  len = pos + RSTRING_LEN(argv[0]);
+  if ((size_t)len > mmap->real) len = mmap->real;
+
+  mmap_lock(mmap, Qtrue);
+  found = mmap_find(mmap, mmap->addr, len, RSTRING_PTR(argv[0]), RSTRING_LEN(argv[0]), 1);
+  mmap_unlock(mmap);
+  return found >= 0 ? LONG2NUM(found) : Qnil;
+}
+
+/*
+ * call-seq:
+ *   count(o1, *args) -> integer
+ *
+ * Each parameter defines a set of characters to count in the mapped memory.
+ * Returns the total count. Byte string sets are counted directly in the
+ * mapping.
+ */
+static VALUE
+rb_cMmap_count(int argc, VALUE *argv, VALUE self)
+{
+  mmap_t *mmap;
+  unsigned char table[256];
+  size_t n, pos, avail, primary;
+  char *p;
+
+  GET_MMAP(self, mmap, MMAP_RUBY_WINDOWED);
+  if (!mmap_count_setup(argc, argv, table)) {
+    return mmap_bang_initialize(self, MMAP_RUBY_ORIGIN, rb_intern("count"), argc, argv);
+  }
+
+  if (mmap->flag & MMAP_RUBY_WINDOW) {
+    for (n = pos = 0; pos < mmap->real; pos += primary) {
+      p = mmap_window_at(mmap, pos, &avail, &primary);
+      n += mmap_count(mmap, p, primary, table);
+    }
+    return SIZET2NUM(n);
+  }
+  mmap_lock(mmap, Qtrue);
+  n = mmap_count(mmap, mmap->addr, mmap->real, table);
+  mmap_unlock(mmap);
+  return SIZET2NUM(n);
+}
+
+/*
+ * call-seq:
+ *   sum(bits = 16) -> integer
+ *
+ * Returns a basic +bits+-bit checksum of the mapped memory content, as
+ * String#sum does.
+ */
+static VALUE
+rb_cMmap_sum(int argc, VALUE *argv, VALUE self)
+{
+  mmap_t *mmap;
+  VALUE vbits;
+  int bits = 16;
+  uint64_t sum;
+  size_t pos, avail, primary;
+  char *p;
+
+  if (rb_scan_args(argc, argv, "01", &vbits) == 1) {
+    bits = NUM2INT(vbits);
+    if (bits < 0) bits = 0;
+  }
+
+  GET_MMAP(self, mmap, MMAP_RUBY_WINDOWED);
+  if (mmap->flag & MMAP_RUBY_WINDOW) {
+    for (sum = 0, pos = 0; pos < mmap->real; pos += primary) {
+      p = mmap_window_at(mmap, pos, &avail, &primary);
+      sum += mmap_sum(mmap, p, primary);
+    }
+  }
+  else {
+    mmap_lock(mmap, Qtrue);
+    sum = mmap_sum(mmap, mmap->addr, mmap->real);
+    mmap_unlock(mmap);
+  }
+  if (bits > 0 && bits < 64) {
+    sum &= ((uint64_t)1 << bits) - 1;
+  }
+  return ULL2NUM(sum);
+}
+
+/*
+ * call-seq:
+ *   checksum(algo, offset = 0, length = nil) -> integer
+ *
+ * Returns the checksum of +length+ bytes (by default up to the end) of the
+ * mapped memory from +offset+ (negative counts from the end), computed in
+ * place. +algo+ is one of:
+ *
+ * +:crc32c+:: the 32-bit CRC32C (Castagnoli), using the SSE4.2 instruction
+ *             when available. Large ranges are checksummed in parallel.
+ * +:xxh64+::  the 64-bit XXH64 hash, seed 0.
+ * +:xxh3+::   the 64-bit XXH3 hash, seed 0.
+ *
+ * Windowed maps only support +:crc32c+.
+ *
+ *   mmap.checksum(:crc32c)            # => 3808858755
+ *   mmap.checksum(:xxh3, 4096, 8192)
+ *   mmap.checksum(:crc32c, -4096)     # the last 4096 bytes
+ */
+static VALUE
+rb_cMmap_checksum(int argc, VALUE *argv, VALUE self)
+{
+  mmap_t *mmap;
+  VALUE valgo, voffset, vlength;
+  ID algo;
+  size_t off = 0, pos, end, avail, primary, n;
+  long len;
+  uint32_t crc;
+  uint64_t digest;
+  char *p;
+
+  rb_scan_args(argc, argv, "12", &valgo, &voffset, &vlength);
+  algo = rb_to_id(valgo);
+  if (algo != rb_intern("crc32c") && algo != rb_intern("xxh64") && algo != rb_intern("xxh3")) {
+    rb_raise(rb_eArgError, "unknown checksum algorithm %"PRIsVALUE, valgo);
+  }
+
+  GET_MMAP(self, mmap, MMAP_RUBY_WINDOWED);
+  if (!NIL_P(voffset)) off = mmap_buffer_offset(mmap, voffset);
+  len = NIL_P(vlength) ? (long)(mmap->real - off) : NUM2LONG(vlength);
+  if (len < 0 || (size_t)len > mmap->real - off) {
+    rb_raise(rb_eIndexError, "length %ld out of map", len);
+  }
+
+  if (algo == rb_intern("crc32c")) {
+    if (mmap->flag & MMAP_RUBY_WINDOW) {
+      crc = 0;
+      for (pos = off, end = off + len; pos < end; pos += n) {
+        p = mmap_window_at(mmap, pos, &avail, &primary);
+        n = primary < end - pos ? primary : end - pos;
+        crc = mmap_checksum_crc32c(mmap, crc, p, n);
+      }
+    }
+    else {
+      mmap_lock(mmap, Qtrue);
+      crc = mmap_checksum_crc32c(mmap, 0, (char *)mmap->addr + off, len);
+      mmap_unlock(mmap);
+    }
+    return UINT2NUM(crc);
+  }
+
+  if (mmap->flag & MMAP_RUBY_WINDOW) {
+    rb_raise(rb_eNotImpError, "%"PRIsVALUE" is not supported on windowed maps", valgo);
+  }
+  mmap_lock(mmap, Qtrue);
+  digest = mmap_digest_run(mmap, algo == rb_intern("xxh64") ? MMAP_DIGEST_XXH64 : MMAP_DIGEST_XXH3,
+                           (char *)mmap->addr + off, len);
+  mmap_unlock(mmap);
+  return ULL2NUM(digest);
+}
+
+static int
+mmap_scalar_swap(VALUE endian)
+{
+#ifdef WORDS_BIGENDIAN
+  if (endian == mmap_sym_little) return 1;
+  if (endian == mmap_sym_big || endian == mmap_sym_native) return 0;
+#else
+  if (endian == mmap_sym_big) return 1;
+  if (endian == mmap_sym_little || endian == mmap_sym_native) return 0;
+#endif
+  rb_raise(rb_eArgError, "invalid endian %+"PRIsVALUE" (expected :little, :big or :native)", endian);
+}
+
+static uint64_t
+mmap_scalar_bswap(uint64_t v, int width)
+{
+  switch (width) {
+    case 2: return __builtin_bswap16((uint16_t)v);
+    case 4: return __builtin_bswap32((uint32_t)v);
+    case 8: return __builtin_bswap64(v);
+    default: return v;
+  }
+}
+
+/* Checks that +width+ bytes at +offset+ (negative counts from the end) are in the map. */
+static size_t
+mmap_scalar_offset(mmap_t *mmap, VALUE offset, int width)
+{
+  long off = NUM2LONG(offset);
+
+  if (off < 0) off += (long)mmap->real;
+  if (off < 0 || (size_t)off > mmap->real || mmap->real - (size_t)off < (size_t)width) {
+    rb_raise(rb_eIndexError, "offset %ld out of map for a %d byte value", NUM2LONG(offset), width);
+  }
+  return (size_t)off;
+}
+
+/* Converts the native bits +v+ of a scalar of type +code+ to a Ruby number. */
+static VALUE
+mmap_scalar_value(int code, uint64_t v)
+{
+  int width = code & MMAP_SCALAR_WIDTH;
+  union { uint32_t u; float f; } f32;
+  union { uint64_t u; double f; } f64;
+
+  if (code & MMAP_SCALAR_FLOAT) {
+    if (width == 4) {
+      f32.u = (uint32_t)v;
+      return DBL2NUM(f32.f);
+    }
+    f64.u = v;
+    return DBL2NUM(f64.f);
+  }
+  if (code & MMAP_SCALAR_SIGNED) {
+    switch (width) {
+      case 1: return INT2FIX((int8_t)v);
+      case 2: return INT2FIX((int16_t)v);
+      case 4: return INT2NUM((int32_t)v);
+      default: return LL2NUM((int64_t)v);
+    }
+  }
+  return width == 8 ? ULL2NUM(v) : UINT2NUM((uint32_t)v);
+}
+
+/*
+ * Backs get_u8 ... get_f64: reads the scalar of type +code+ at +offset+
+ * straight from the mapping, without building a String.
+ */
+static VALUE
+rb_cMmap_scalar_get(VALUE self, VALUE offset, VALUE vcode, VALUE endian)
+{
+  mmap_t *mmap;
+  int code = NUM2INT(vcode), width = code & MMAP_SCALAR_WIDTH;
+  uint64_t v = 0;
+  size_t off;
+
+  GET_MMAP(self, mmap, MMAP_RUBY_WINDOWED);
+  off = mmap_scalar_offset(mmap, offset, width);
+  if (mmap->flag & MMAP_RUBY_WINDOW) {
+    mmap_window_copy(mmap, off, width, MMAP_SCALAR_LOW(v, width));
+  }
+  else {
+    mmap_lock(mmap, Qtrue);
+    memcpy(MMAP_SCALAR_LOW(v, width), (char *)mmap->addr + off, width);
+    mmap_unlock(mmap);
+  }
+  if (width > 1 && mmap_scalar_swap(endian)) {
+    v = mmap_scalar_bswap(v, width);
+  }
+  return mmap_scalar_value(code, v);
+}
+
+/*
+ * Backs put_u8 ... put_f64: writes +value+ as the scalar of type +code+ at
+ * +offset+. Integers that don't fit the type raise RangeError.
+ */
+static VALUE
+rb_cMmap_scalar_put(VALUE self, VALUE offset, VALUE vcode, VALUE endian, VALUE value)
+{
+  mmap_t *mmap;
+  int code = NUM2INT(vcode), width = code & MMAP_SCALAR_WIDTH;
+  uint64_t v;
+  size_t off;
+  union { uint32_t u; float f; } f32;
+  union { uint64_t u; double f; } f64;
+
+  if (code & MMAP_SCALAR_FLOAT) {
+    if (width == 4) {
+      f32.f = (float)NUM2DBL(value);
+      v = f32.u;
+    }
+    else {
+      f64.f = NUM2DBL(value);
+      v = f64.u;
+    }
+  }
+  else if (code & MMAP_SCALAR_SIGNED) {
+    int64_t i = NUM2LL(value);
+
+    if (width < 8 && (i < -((int64_t)1 << (width * 8 - 1)) || i >= ((int64_t)1 << (width * 8 - 1)))) {
+      rb_raise(rb_eRangeError, "%"PRIsVALUE" out of range for a %d bit signed integer", value, width * 8);
+    }
+    v = (uint64_t)i;
+  }
+  else {
+    if ((FIXNUM_P(value) && FIX2LONG(value) < 0) ||
+        (RB_TYPE_P(value, T_BIGNUM) && !rb_big_sign(value))) {
+      rb_raise(rb_eRangeError, "%"PRIsVALUE" out of range for a %d bit unsigned integer", value, width * 8);
+    }
+    v = NUM2ULL(value);
+    if (width < 8 && v >> (width * 8)) {
+      rb_raise(rb_eRangeError, "%"PRIsVALUE" out of range for a %d bit unsigned integer", value, width * 8);
+    }
+  }
+  if (width > 1 && mmap_scalar_swap(endian)) {
+    v = mmap_scalar_bswap(v, width);
+  }
 
-  if (smode == O_RDONLY) {
-    self = rb_obj_freeze(self);
+  GET_MMAP(self, mmap, MMAP_RUBY_MODIFY);
+  off = mmap_scalar_offset(mmap, offset, width);
+  mmap_lock(mmap, Qtrue);
+  mmap_check_write(mmap, off, width);
+  memcpy((char *)mmap->addr + off, MMAP_SCALAR_LOW(v, width), width);
+  mmap_touch(mmap, off, width);
+  mmap_unlock(mmap);
+  return value;
+}
+
+/* Operations of the private atomic_op primitive (see lib/mmap-ruby/mmap.rb). */
+#define MMAP_ATOMIC_LOAD  0
+#define MMAP_ATOMIC_STORE 1
+#define MMAP_ATOMIC_ADD   2
+#define MMAP_ATOMIC_CAS   3
+#define MMAP_ATOMIC_OR    4
+#define MMAP_ATOMIC_AND   5
+
+static int
+mmap_atomic_order(VALUE order, int op)
+{
+  int mo;
+
+  if (order == mmap_sym_seq_cst) mo = __ATOMIC_SEQ_CST;
+  else if (order == mmap_sym_relaxed) mo = __ATOMIC_RELAXED;
+  else if (order == mmap_sym_acquire) mo = __ATOMIC_ACQUIRE;
+  else if (order == mmap_sym_release) mo = __ATOMIC_RELEASE;
+  else if (order == mmap_sym_acq_rel) mo = __ATOMIC_ACQ_REL;
+  else {
+    rb_raise(rb_eArgError, "invalid memory order %+"PRIsVALUE, order);
+  }
+  if ((op == MMAP_ATOMIC_LOAD && (mo == __ATOMIC_RELEASE || mo == __ATOMIC_ACQ_REL)) ||
+      (op == MMAP_ATOMIC_STORE && (mo == __ATOMIC_ACQUIRE || mo == __ATOMIC_ACQ_REL))) {
+    rb_raise(rb_eArgError, "memory order %+"PRIsVALUE" is not valid for this operation", order);
+  }
+  return mo;
+}
+
+/* Converts +value+ to the bits of a +width+ byte word, signed or not. */
+static uint64_t
+mmap_atomic_value(VALUE value, int width)
+{
+  int64_t i;
+
+  if (RB_TYPE_P(value, T_BIGNUM) && rb_big_sign(value)) {
+    uint64_t u = NUM2ULL(value);
+
+    if (width < 8 && u >> (width * 8)) goto range;
+    return u;
+  }
+  i = NUM2LL(value);
+  if (width < 8 && (i < -((int64_t)1 << (width * 8 - 1)) || i >= ((int64_t)1 << (width * 8)))) goto range;
+  return (uint64_t)i;
+
+range:
+  rb_raise(rb_eRangeError, "%"PRIsVALUE" out of range for a %d bit word", value, width * 8);
+}
+
+#define MMAP_ATOMIC_DO(type) do { \
+    type *p = (type *)ptr, x = (type)va, y = (type)vb; \
+    switch (op) { \
+      case MMAP_ATOMIC_LOAD: \
+        res = __atomic_load_n(p, mo); \
+        break; \
+      case MMAP_ATOMIC_STORE: \
+        __atomic_store_n(p, x, mo); \
+        break; \
+      case MMAP_ATOMIC_ADD: \
+        res = __atomic_add_fetch(p, x, mo); \
+        break; \
+      case MMAP_ATOMIC_CAS: \
+        res = __atomic_compare_exchange_n(p, &x, y, 0, mo, fail); \
+        break; \
+      case MMAP_ATOMIC_OR: \
+        res = __atomic_fetch_or(p, x, mo); \
+        break; \
+      default: \
+        res = __atomic_fetch_and(p, x, mo); \
+        break; \
+    } \
+  } while (0)
+
+/*
+ * Backs atomic_load, atomic_store, atomic_add, compare_and_swap, fetch_or
+ * and fetch_and: runs +op+ on the naturally aligned signed word of +width+
+ * bytes at +offset+, without taking the map lock.
+ */
+static VALUE
+rb_cMmap_atomic_op(VALUE self, VALUE vop, VALUE offset, VALUE vwidth, VALUE order, VALUE a, VALUE b)
+{
+  mmap_t *mmap;
+  int op = NUM2INT(vop), width = NUM2INT(vwidth), mo, fail;
+  uint64_t va = 0, vb = 0;
+  int64_t res = 0;
+  size_t off;
+  char *ptr;
+
+  if (width != 1 && width != 2 && width != 4 && width != 8) {
+    rb_raise(rb_eArgError, "invalid width %d (expected 1, 2, 4 or 8)", width);
+  }
+  mo = mmap_atomic_order(order, op);
+  fail = mo == __ATOMIC_ACQ_REL ? __ATOMIC_ACQUIRE : mo == __ATOMIC_RELEASE ? __ATOMIC_RELAXED : mo;
+  if (op != MMAP_ATOMIC_LOAD) va = mmap_atomic_value(a, width);
+  if (op == MMAP_ATOMIC_CAS) vb = mmap_atomic_value(b, width);
+
+  GET_MMAP(self, mmap, op == MMAP_ATOMIC_LOAD ? 0 : MMAP_RUBY_MODIFY);
+  off = mmap_scalar_offset(mmap, offset, width);
+  ptr = (char *)mmap->addr + off;
+  if ((uintptr_t)ptr % width) {
+    rb_raise(rb_eArgError, "offset %zu is not aligned on %d bytes", off, width);
+  }
+  if (op != MMAP_ATOMIC_LOAD) {
+    mmap_check_write(mmap, off, width);
+  }
+
+  switch (width) {
+    case 1: MMAP_ATOMIC_DO(int8_t); break;
+    case 2: MMAP_ATOMIC_DO(int16_t); break;
+    case 4: MMAP_ATOMIC_DO(int32_t); break;
+    default: MMAP_ATOMIC_DO(int64_t); break;
+  }
+
+  if (op == MMAP_ATOMIC_STORE) {
+    mmap_touch(mmap, off, width);
+    return a;
+  }
+  if (op == MMAP_ATOMIC_CAS) {
+    if (!res) return Qfalse;
+    mmap_touch(mmap, off, width);
+    return Qtrue;
+  }
+  if (op != MMAP_ATOMIC_LOAD) {
+    mmap_touch(mmap, off, width);
+  }
+  return LL2NUM(res);
+}
+
+/*
+ * Mmap::View, a typed array over +count+ elements at +offset+ of a map.
+ * Views keep offsets rather than addresses and check them against the map
+ * on every call, so a view stays valid while the map is remapped by a
+ * resize and raises once its elements no longer fit.
+ */
+typedef struct {
+  VALUE mmap;
+  VALUE type;
+  int code;
+  size_t offset;
+  size_t count;
+} mmap_view_t;
+
+static VALUE mmap_cView;
+
+static void
+mmap_view_mark(void *ptr)
+{
+  mmap_view_t *view = (mmap_view_t *)ptr;
+
+  rb_gc_mark_movable(view->mmap);
+  rb_gc_mark_movable(view->type);
+}
+
+static void
+mmap_view_compact(void *ptr)
+{
+  mmap_view_t *view = (mmap_view_t *)ptr;
+
+  view->mmap = rb_gc_location(view->mmap);
+  view->type = rb_gc_location(view->type);
+}
+
+static const rb_data_type_t mmap_view_type = {
+  .wrap_struct_name = "MmapRuby::Mmap::View",
+  .function = {
+    .dmark = mmap_view_mark,
+    .dfree = RUBY_TYPED_DEFAULT_FREE,
+    .dcompact = mmap_view_compact
+  },
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+/* Returns the address of the first element of +view+, checking that they all fit. */
+static const char *
+mmap_view_ptr(mmap_view_t *view, mmap_t **pmmap)
+{
+  mmap_t *mmap;
+  size_t width = view->code & MMAP_SCALAR_WIDTH;
+
+  GET_MMAP(view->mmap, mmap, 0);
+  if (view->offset > mmap->real || (mmap->real - view->offset) / width < view->count) {
+    rb_raise(rb_eIndexError, "view of %zu elements at %zu no longer fits the map", view->count, view->offset);
+  }
+  if (pmmap) *pmmap = mmap;
+  return (const char *)mmap->addr + view->offset;
+}
+
+static VALUE
+mmap_view_elt(mmap_view_t *view, const char *ptr, size_t i)
+{
+  int width = view->code & MMAP_SCALAR_WIDTH;
+  uint64_t v = 0;
+
+  memcpy(MMAP_SCALAR_LOW(v, width), ptr + i * width, width);
+  return mmap_scalar_value(view->code, v);
+}
+
+/* Backs Mmap#view. */
+static VALUE
+rb_cMmap_view_new(VALUE self, VALUE type, VALUE vcode, VALUE offset, VALUE count)
+{
+  mmap_t *mmap;
+  mmap_view_t *view;
+  VALUE obj;
+  int code = NUM2INT(vcode), width = code & MMAP_SCALAR_WIDTH;
+  long off = NUM2LONG(offset);
+
+  GET_MMAP(self, mmap, 0);
+  if (off < 0 || (size_t)off > mmap->real) {
+    rb_raise(rb_eIndexError, "offset %ld out of map", off);
+  }
+  if (((uintptr_t)mmap->addr + off) % width) {
+    rb_raise(rb_eArgError, "offset %ld is not aligned on %d bytes", off, width);
+  }
+
+  obj = TypedData_Make_Struct(mmap_cView, mmap_view_t, &mmap_view_type, view);
+  RB_OBJ_WRITE(obj, &view->mmap, self);
+  RB_OBJ_WRITE(obj, &view->type, type);
+  view->code = code;
+  view->offset = (size_t)off;
+  view->count = NIL_P(count) ? (mmap->real - off) / width : NUM2SIZET(count);
+  mmap_view_ptr(view, NULL);
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   size -> integer
+ *
+ * Returns the number of elements.
+ */
+static VALUE
+rb_cMmapView_size(VALUE self)
+{
+  mmap_view_t *view;
+
+  TypedData_Get_Struct(self, mmap_view_t, &mmap_view_type, view);
+  return SIZET2NUM(view->count);
+}
+
+/*
+ * call-seq:
+ *   type -> symbol
+ *
+ * Returns the element type, such as +:int32+ or +:float64+.
+ */
+static VALUE
+rb_cMmapView_type(VALUE self)
+{
+  mmap_view_t *view;
+
+  TypedData_Get_Struct(self, mmap_view_t, &mmap_view_type, view);
+  return view->type;
+}
+
+/*
+ * call-seq:
+ *   offset -> integer
+ *
+ * Returns the byte offset of the first element in the map.
+ */
+static VALUE
+rb_cMmapView_offset(VALUE self)
+{
+  mmap_view_t *view;
+
+  TypedData_Get_Struct(self, mmap_view_t, &mmap_view_type, view);
+  return SIZET2NUM(view->offset);
+}
+
+static VALUE
+mmap_view_ary(mmap_view_t *view, size_t beg, size_t len)
+{
+  const char *ptr = mmap_view_ptr(view, NULL);
+  VALUE ary = rb_ary_new_capa((long)len);
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    rb_ary_push(ary, mmap_view_elt(view, ptr, beg + i));
+  }
+  return ary;
+}
+
+/*
+ * call-seq:
+ *   [](index) -> number or nil
+ *   [](start, length) -> array or nil
+ *   [](range) -> array or nil
+ *
+ * Returns the element at +index+, or an Array of elements, with the
+ * semantics of Array#[].
+ */
+static VALUE
+rb_cMmapView_aref(int argc, VALUE *argv, VALUE self)
+{
+  mmap_view_t *view;
+  const char *ptr;
+  long beg, len, count;
+
+  TypedData_Get_Struct(self, mmap_view_t, &mmap_view_type, view);
+  count = (long)view->count;
+  if (argc == 1 && !rb_obj_is_kind_of(argv[0], rb_cRange)) {
+    beg = NUM2LONG(argv[0]);
+    if (beg < 0) beg += count;
+    ptr = mmap_view_ptr(view, NULL);
+    if (beg < 0 || beg >= count) return Qnil;
+    return mmap_view_elt(view, ptr, (size_t)beg);
+  }
+  if (argc == 1) {
+    if (!RTEST(rb_range_beg_len(argv[0], &beg, &len, count, 0))) return Qnil;
+  }
+  else if (argc == 2) {
+    beg = NUM2LONG(argv[0]);
+    len = NUM2LONG(argv[1]);
+    if (beg < 0) beg += count;
+    if (beg < 0 || beg > count || len < 0) return Qnil;
+    if (len > count - beg) len = count - beg;
+  }
+  else {
+    rb_error_arity(argc, 1, 2);
+  }
+  return mmap_view_ary(view, (size_t)beg, (size_t)len);
+}
+
+static VALUE
+mmap_view_size_enum(VALUE self, VALUE args, VALUE eobj)
+{
+  (void)args;
+  (void)eobj;
+
+  return rb_cMmapView_size(self);
+}
+
+/*
+ * call-seq:
+ *   each {|element| block } -> self
+ *   each -> enumerator
+ *
+ * Calls the given block with each element.
+ */
+static VALUE
+rb_cMmapView_each(VALUE self)
+{
+  mmap_view_t *view;
+  size_t i;
+
+  RETURN_SIZED_ENUMERATOR(self, 0, 0, mmap_view_size_enum);
+  TypedData_Get_Struct(self, mmap_view_t, &mmap_view_type, view);
+  for (i = 0; i < view->count; i++) {
+    /* The block may resize or unmap the map: look it up again every time. */
+    rb_yield(mmap_view_elt(view, mmap_view_ptr(view, NULL), i));
+  }
+  return self;
+}
+
+/*
+ * call-seq:
+ *   to_a -> array
+ *
+ * Returns all the elements as an Array.
+ */
+static VALUE
+rb_cMmapView_to_a(VALUE self)
+{
+  mmap_view_t *view;
+
+  TypedData_Get_Struct(self, mmap_view_t, &mmap_view_type, view);
+  return mmap_view_ary(view, 0, view->count);
+}
+
+static void
+mmap_view_run(VALUE self, mmap_view_t **pview, mmap_view_acc *acc)
+{
+  mmap_view_t *view;
+  mmap_t *mmap;
+  const char *ptr;
+
+  TypedData_Get_Struct(self, mmap_view_t, &mmap_view_type, view);
+  ptr = mmap_view_ptr(view, &mmap);
+  MEMZERO(acc, mmap_view_acc, 1);
+  mmap_lock(mmap, Qtrue);
+  mmap_view_reduce[view->code](ptr, view->count, acc);
+  mmap_unlock(mmap);
+  *pview = view;
+}
+
+static VALUE
+mmap_view_sum(mmap_view_t *view, mmap_view_acc *acc)
+{
+  if (view->code & MMAP_SCALAR_FLOAT) return DBL2NUM(acc->fsum);
+  if (acc->overflow) {
+    VALUE sum = INT2FIX(0);
+    size_t i;
+
+    for (i = 0; i < view->count; i++) {
+      sum = rb_funcall(sum, '+', 1, mmap_view_elt(view, mmap_view_ptr(view, NULL), i));
+    }
+    return sum;
+  }
+  if (acc->isum >= INT64_MIN && acc->isum <= INT64_MAX) return LL2NUM((int64_t)acc->isum);
+  return rb_integer_unpack(&acc->isum, 1, sizeof(acc->isum), 0,
+                           INTEGER_PACK_LSWORD_FIRST | INTEGER_PACK_NATIVE_BYTE_ORDER | INTEGER_PACK_2COMP);
+}
+
+/*
+ * call-seq:
+ *   sum -> number
+ *
+ * Returns the sum of the elements: an exact Integer for integer types, a
+ * Float for float types.
+ */
+static VALUE
+rb_cMmapView_sum(VALUE self)
+{
+  mmap_view_t *view;
+  mmap_view_acc acc;
+
+  mmap_view_run(self, &view, &acc);
+  return mmap_view_sum(view, &acc);
+}
+
+/*
+ * call-seq:
+ *   mean -> float or nil
+ *
+ * Returns the arithmetic mean of the elements, or +nil+ for an empty view.
+ */
+static VALUE
+rb_cMmapView_mean(VALUE self)
+{
+  mmap_view_t *view;
+  mmap_view_acc acc;
+
+  mmap_view_run(self, &view, &acc);
+  if (!view->count) return Qnil;
+  if (view->code & MMAP_SCALAR_FLOAT) return DBL2NUM(acc.fsum / view->count);
+  if (acc.overflow) return DBL2NUM(NUM2DBL(mmap_view_sum(view, &acc)) / view->count);
+  return DBL2NUM((double)acc.isum / view->count);
+}
+
+/*
+ * call-seq:
+ *   min -> number or nil
+ *
+ * Returns the smallest element, or +nil+ for an empty view.
+ */
+static VALUE
+rb_cMmapView_min(VALUE self)
+{
+  mmap_view_t *view;
+  mmap_view_acc acc;
+
+  mmap_view_run(self, &view, &acc);
+  return view->count ? mmap_scalar_value(view->code, acc.min) : Qnil;
+}
+
+/*
+ * call-seq:
+ *   max -> number or nil
+ *
+ * Returns the largest element, or +nil+ for an empty view.
+ */
+static VALUE
+rb_cMmapView_max(VALUE self)
+{
+  mmap_view_t *view;
+  mmap_view_acc acc;
+
+  mmap_view_run(self, &view, &acc);
+  return view->count ? mmap_scalar_value(view->code, acc.max) : Qnil;
+}
+
+/*
+ * call-seq:
+ *   minmax -> [min, max]
+ *
+ * Returns the smallest and the largest element, computed in one pass.
+ */
+static VALUE
+rb_cMmapView_minmax(VALUE self)
+{
+  mmap_view_t *view;
+  mmap_view_acc acc;
+
+  mmap_view_run(self, &view, &acc);
+  if (!view->count) return rb_assoc_new(Qnil, Qnil);
+  return rb_assoc_new(mmap_scalar_value(view->code, acc.min), mmap_scalar_value(view->code, acc.max));
+}
+
+/*
+ * Mmap::Slice, a byte range of a map that is read in place. Like views,
+ * slices keep an offset rather than an address. The address is cached
+ * together with the map generation, which every remap and unmap bumps, so
+ * a slice only looks the map up again after it moved or shrank.
+ */
+typedef struct {
+  VALUE mmap;
+  size_t offset;
+  size_t len;
+  unsigned long generation;
+  const char *ptr;
+} mmap_slice_t;
+
+static VALUE mmap_cSlice;
+
+static void
+mmap_slice_mark(void *ptr)
+{
+  mmap_slice_t *slice = (mmap_slice_t *)ptr;
+
+  rb_gc_mark_movable(slice->mmap);
+}
+
+static void
+mmap_slice_compact(void *ptr)
+{
+  mmap_slice_t *slice = (mmap_slice_t *)ptr;
+
+  slice->mmap = rb_gc_location(slice->mmap);
+}
+
+static const rb_data_type_t mmap_slice_type = {
+  .wrap_struct_name = "MmapRuby::Mmap::Slice",
+  .function = {
+    .dmark = mmap_slice_mark,
+    .dfree = RUBY_TYPED_DEFAULT_FREE,
+    .dcompact = mmap_slice_compact
+  },
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+/* Returns the address of the bytes of +self+, checking them again after a remap. */
+static const char *
+mmap_slice_ptr(VALUE self, mmap_slice_t **pslice)
+{
+  mmap_slice_t *slice;
+  mmap_t *mmap;
+
+  TypedData_Get_Struct(self, mmap_slice_t, &mmap_slice_type, slice);
+  if (pslice) *pslice = slice;
+  mmap = RTYPEDDATA_DATA(slice->mmap);
+  if (mmap->generation == slice->generation && slice->offset + slice->len <= mmap->real) {
+    return slice->ptr;
   }
-  else {
-    if (smode == O_WRONLY) {
-      mmap->flag |= MMAP_RUBY_FIXED;
-    }
+
+  GET_MMAP(slice->mmap, mmap, 0);
+  if (slice->offset > mmap->real || mmap->real - slice->offset < slice->len) {
+    rb_raise(rb_eIndexError, "slice of %zu bytes at %zu no longer fits the map", slice->len, slice->offset);
   }
+  slice->ptr = (const char *)mmap->addr + slice->offset;
+  slice->generation = mmap->generation;
+  return slice->ptr;
+}
 
-  return self;
+/*
+ * Returns the bytes of +other+ if it is a String or an Mmap::Slice, else
+ * NULL.
+ */
+static const char *
+mmap_slice_other(VALUE other, size_t *len)
+{
+  mmap_slice_t *slice;
+  const char *ptr;
+
+  if (RB_TYPE_P(other, T_STRING)) {
+    *len = RSTRING_LEN(other);
+    return RSTRING_PTR(other);
+  }
+  if (rb_typeddata_is_kind_of(other, &mmap_slice_type)) {
+    ptr = mmap_slice_ptr(other, &slice);
+    *len = slice->len;
+    return ptr;
+  }
+  return NULL;
 }
 
+/*
+ * call-seq:
+ *   slice_ref(offset, length) -> slice
+ *
+ * Returns an Mmap::Slice over +length+ bytes at +offset+ (negative counts
+ * from the end), without copying them.
+ *
+ *   key = mmap.slice_ref(0, 8)
+ *   counts[key] += 1
+ */
 static VALUE
-mmap_str(VALUE self, int modify)
+rb_cMmap_slice_ref(VALUE self, VALUE offset, VALUE length)
 {
   mmap_t *mmap;
+  mmap_slice_t *slice;
+  VALUE obj;
+  long off = NUM2LONG(offset), len = NUM2LONG(length);
 
-  GET_MMAP(self, mmap, modify & ~MMAP_RUBY_ORIGIN);
-  if (modify & MMAP_RUBY_MODIFY) {
-    rb_check_frozen(self);
+  GET_MMAP(self, mmap, 0);
+  if (off < 0) off += (long)mmap->real;
+  if (off < 0 || len < 0 || (size_t)off > mmap->real || mmap->real - off < (size_t)len) {
+    rb_raise(rb_eIndexError, "range %ld, %ld out of map", NUM2LONG(offset), len);
   }
 
-  VALUE string = rb_obj_alloc(rb_cString);
-  RSTRING(string)->len = mmap->real;
-  RSTRING(string)->as.heap.ptr = mmap->addr;
-  RSTRING(string)->as.heap.aux.capa = mmap->len;
-  if (modify & MMAP_RUBY_ORIGIN) {
-    RSTRING(string)->as.heap.aux.shared = self;
-    FL_SET(string, RSTRING_NOEMBED);
-    FL_SET(string, FL_USER18);
-  }
+  obj = TypedData_Make_Struct(mmap_cSlice, mmap_slice_t, &mmap_slice_type, slice);
+  RB_OBJ_WRITE(obj, &slice->mmap, self);
+  slice->offset = (size_t)off;
+  slice->len = (size_t)len;
+  slice->generation = mmap->generation;
+  slice->ptr = (const char *)mmap->addr + off;
+  return obj;
+}
 
-  if (RB_OBJ_FROZEN(self)) {
-    string = rb_obj_freeze(string);
-  }
+/*
+ * call-seq:
+ *   size -> integer
+ *
+ * Returns the number of bytes.
+ */
+static VALUE
+rb_cMmapSlice_size(VALUE self)
+{
+  mmap_slice_t *slice;
 
-  return string;
+  TypedData_Get_Struct(self, mmap_slice_t, &mmap_slice_type, slice);
+  return SIZET2NUM(slice->len);
 }
 
 /*
  * call-seq:
- *   to_str
+ *   offset -> integer
  *
- * Convert object to a string.
+ * Returns the byte offset of the slice in the map.
  */
 static VALUE
-rb_cMmap_to_str(VALUE self)
+rb_cMmapSlice_offset(VALUE self)
 {
-  return mmap_str(self, MMAP_RUBY_ORIGIN);
+  mmap_slice_t *slice;
+
+  TypedData_Get_Struct(self, mmap_slice_t, &mmap_slice_type, slice);
+  return SIZET2NUM(slice->offset);
 }
 
 /*
  * call-seq:
- *   hash -> integer
+ *   to_s -> string
  *
- * Returns the hash value for the mapped memory content. Objects with the
- * same content will have the same hash value.
+ * Returns a copy of the bytes as a binary String.
  */
 static VALUE
-rb_cMmap_hash(VALUE self)
+rb_cMmapSlice_to_s(VALUE self)
 {
-  VALUE str;
-  VALUE result;
+  mmap_slice_t *slice;
+  const char *ptr = mmap_slice_ptr(self, &slice);
 
-  str = mmap_str(self, MMAP_RUBY_ORIGIN);
-  result = rb_funcall(str, rb_intern("hash"), 0);
-  RB_GC_GUARD(str);
-  return result;
+  return rb_str_new(ptr, (long)slice->len);
 }
 
 /*
  * call-seq:
+ *   ==(other) -> true or false
  *   eql?(other) -> true or false
  *
- * Returns +true+ if the content and type of the mapped memory is equal to +other+.
- * Unlike +==+, this method only returns +true+ for other Mmap objects, not strings.
+ * Returns +true+ if +other+ is a String or a slice with the same bytes.
  */
 static VALUE
-rb_cMmap_eql(VALUE self, VALUE other)
+rb_cMmapSlice_equal(VALUE self, VALUE other)
 {
-  mmap_t *mmap, *other_mmap;
+  mmap_slice_t *slice;
+  const char *ptr, *optr;
+  size_t olen = 0;
 
   if (self == other) return Qtrue;
-  if (!rb_typeddata_is_kind_of(other, &mmap_type)) return Qfalse;
+  optr = mmap_slice_other(other, &olen);
+  if (!optr) return Qfalse;
+  ptr = mmap_slice_ptr(self, &slice);
+  return slice->len == olen && memcmp(ptr, optr, olen) == 0 ? Qtrue : Qfalse;
+}
 
-  GET_MMAP(self, mmap, 0);
-  GET_MMAP(other, other_mmap, 0);
-  if (mmap->real != other_mmap->real) {
-    return Qfalse;
-  }
+/*
+ * call-seq:
+ *   hash -> integer
+ *
+ * Returns a hash of the bytes. It matches String#hash for binary and ASCII
+ * only strings, so a slice finds the entry of such a String key in a Hash.
+ * Like a String key, a slice used as a key must not change afterwards.
+ */
+static VALUE
+rb_cMmapSlice_hash(VALUE self)
+{
+  mmap_slice_t *slice;
+  const char *ptr = mmap_slice_ptr(self, &slice);
+
+  return ST2FIX(rb_memhash(ptr, (long)slice->len));
+}
+
+static VALUE
+mmap_slice_affix(int argc, VALUE *argv, VALUE self, int suffix)
+{
+  mmap_slice_t *slice;
+  const char *ptr, *optr;
+  VALUE affix;
+  size_t olen = 0;
+  int i;
 
-  if (memcmp(mmap->addr, other_mmap->addr, mmap->real) == 0) return Qtrue;
+  for (i = 0; i < argc; i++) {
+    affix = argv[i];
+    if (!rb_typeddata_is_kind_of(affix, &mmap_slice_type)) {
+      affix = rb_str_to_str(affix);
+    }
+    optr = mmap_slice_other(affix, &olen);
+    ptr = mmap_slice_ptr(self, &slice);
+    if (olen <= slice->len &&
+        memcmp(ptr + (suffix ? slice->len - olen : 0), optr, olen) == 0) {
+      return Qtrue;
+    }
+  }
+  RB_GC_GUARD(affix);
   return Qfalse;
 }
 
 /*
  * call-seq:
- *   ==(other) -> true or false
- *   ===(other) -> true or false
+ *   start_with?(*prefixes) -> true or false
  *
- * Returns +true+ if the content of the mapped memory is equal to +other+.
- * Compares with other Mmap objects or strings.
+ * Returns +true+ if the bytes start with any of +prefixes+.
  */
 static VALUE
-rb_cMmap_equal(VALUE self, VALUE other)
+rb_cMmapSlice_start_with(int argc, VALUE *argv, VALUE self)
 {
-  VALUE result;
-  mmap_t *mmap, *other_mmap;
+  return mmap_slice_affix(argc, argv, self, 0);
+}
 
-  if (self == other) return Qtrue;
-  if (!rb_typeddata_is_kind_of(other, &mmap_type)) return Qfalse;
+/*
+ * call-seq:
+ *   end_with?(*suffixes) -> true or false
+ *
+ * Returns +true+ if the bytes end with any of +suffixes+.
+ */
+static VALUE
+rb_cMmapSlice_end_with(int argc, VALUE *argv, VALUE self)
+{
+  return mmap_slice_affix(argc, argv, self, 1);
+}
 
-  GET_MMAP(self, mmap, 0);
-  GET_MMAP(other, other_mmap, 0);
-  if (mmap->real != other_mmap->real) {
-    return Qfalse;
-  }
+/*
+ * call-seq:
+ *   index(substr, offset = 0) -> integer or nil
+ *
+ * Returns the byte offset of the first +substr+ at or after +offset+, or
+ * +nil+.
+ */
+static VALUE
+rb_cMmapSlice_index(int argc, VALUE *argv, VALUE self)
+{
+  mmap_slice_t *slice;
+  const char *ptr, *needle, *hit;
+  VALUE sub, voffset;
+  size_t nlen = 0;
+  long off = 0;
+
+  rb_scan_args(argc, argv, "11", &sub, &voffset);
+  if (!rb_typeddata_is_kind_of(sub, &mmap_slice_type)) {
+    sub = rb_str_to_str(sub);
+  }
+  needle = mmap_slice_other(sub, &nlen);
+  ptr = mmap_slice_ptr(self, &slice);
+  if (!NIL_P(voffset)) {
+    off = NUM2LONG(voffset);
+    if (off < 0) off += (long)slice->len;
+    if (off < 0 || (size_t)off > slice->len) return Qnil;
+  }
+  if (nlen == 0) return LONG2NUM(off);
+  if (nlen > slice->len - off) return Qnil;
+  hit = mmap_search(ptr + off, slice->len - off, needle, nlen);
+  RB_GC_GUARD(sub);
+  return hit ? LONG2NUM(hit - ptr) : Qnil;
+}
 
-  self = mmap_str(self, MMAP_RUBY_ORIGIN);
-  other = mmap_str(other, MMAP_RUBY_ORIGIN);
-  result = rb_funcall2(self, rb_intern("=="), 1, &other);
-  RB_GC_GUARD(self);
-  RB_GC_GUARD(other);
-  return result;
+/*
+ * call-seq:
+ *   include?(substr) -> true or false
+ *
+ * Returns +true+ if the bytes contain +substr+.
+ */
+static VALUE
+rb_cMmapSlice_include(VALUE self, VALUE sub)
+{
+  return NIL_P(rb_cMmapSlice_index(1, &sub, self)) ? Qfalse : Qtrue;
 }
 
 /*
  * call-seq:
- *   <=>(other) -> -1, 0, 1, or nil
+ *   inspect -> string
  *
- * Compares the mapped memory with +other+. Returns -1 if the mapped memory
- * is less than +other+, 0 if they are equal, 1 if the mapped memory is
- * greater than +other+, or +nil+ if the values are incomparable.
+ * Returns the bytes of the slice as String#inspect shows them.
  */
 static VALUE
-rb_cMmap_cmp(VALUE self, VALUE other)
+rb_cMmapSlice_inspect(VALUE self)
 {
-  VALUE self_str, other_str;
-  VALUE result;
+  return rb_sprintf("#<%"PRIsVALUE" %"PRIsVALUE">", rb_obj_class(self),
+                    rb_str_inspect(rb_cMmapSlice_to_s(self)));
+}
 
-  self_str = mmap_str(self, MMAP_RUBY_ORIGIN);
-  other_str = rb_str_to_str(other);
-  result = rb_funcall2(self_str, rb_intern("<=>"), 1, &other_str);
-  RB_GC_GUARD(self_str);
-  RB_GC_GUARD(other_str);
-  return result;
+static VALUE
+mmap_size_enum(VALUE self, VALUE args, VALUE eobj)
+{
+  (void)args;
+  (void)eobj;
+
+  return rb_cMmap_size(self);
 }
 
 /*
  * call-seq:
- *   casecmp(other) -> -1, 0, 1, or nil
+ *   each_byte {|byte| block } -> self
+ *   each {|byte| block } -> self
+ *   each_byte -> enumerator
  *
- * Performs a case-insensitive comparison of the mapped memory with +other+.
- * Returns -1, 0, or 1 depending on whether the mapped memory is less than,
- * equal to, or greater than +other+. Returns +nil+ if the two values are
- * incomparable.
+ * Calls the given block once for each byte of the mapped memory, passing
+ * the byte as an integer.
  */
 static VALUE
-rb_cMmap_casecmp(VALUE self, VALUE other)
+rb_cMmap_each_byte(VALUE self)
 {
-  VALUE result;
-  VALUE self_str, other_str;
-
-  self_str = mmap_str(self, MMAP_RUBY_ORIGIN);
-  other_str = rb_str_to_str(other);
-  result = rb_funcall2(self_str, rb_intern("casecmp"), 1, &other_str);
-  RB_GC_GUARD(self_str);
-  RB_GC_GUARD(other_str);
-  return result;
+  mmap_t *mmap;
+  size_t i, pos, n;
+  unsigned char buf[4096];
+
+  RETURN_SIZED_ENUMERATOR(self, 0, 0, mmap_size_enum);
+  GET_MMAP(self, mmap, MMAP_RUBY_WINDOWED);
+  if (mmap->flag & MMAP_RUBY_WINDOW) {
+    /* The block may move or unmap the windows, so yield from a copy. */
+    for (pos = 0; mmap->path && pos < mmap->real; pos += n) {
+      n = mmap->real - pos < sizeof(buf) ? mmap->real - pos : sizeof(buf);
+      mmap_window_copy(mmap, pos, n, (char *)buf);
+      for (i = 0; i < n; i++) {
+        rb_yield(INT2FIX(buf[i]));
+      }
+    }
+    return self;
+  }
+  for (i = 0; mmap->path && i < mmap->real; i++) {
+    rb_yield(INT2FIX(((unsigned char *)mmap->addr)[i]));
+  }
+  return self;
 }
 
 /*
  * call-seq:
- *   =~(other) -> integer or nil
+ *   each_line(separator = $/, chomp: false) {|line| block } -> self
+ *   each_line(separator = $/, chomp: false, offsets: true) {|offset, length| block } -> self
+ *   each_line(separator = $/, chomp: false) -> enumerator
  *
- * Returns the index of the first match of +other+ in the mapped memory,
- * or +nil+ if no match is found. The +other+ parameter can be a Regexp,
- * String, or any object that responds to +=~+.
+ * Splits the mapped memory using +separator+ and calls the given block for
+ * each line. Lines are located directly in the mapping; with
+ * <tt>offsets: true</tt> the block receives the byte offset and length of
+ * each line instead of a String, so no object is allocated per line.
+ *
+ * If +chomp+ is +true+, the separator is removed from each line. A +nil+
+ * separator yields the whole content, and an empty separator selects
+ * paragraph mode as with String#each_line.
  */
 static VALUE
-rb_cMmap_match(VALUE self, VALUE other)
+rb_cMmap_each_line(int argc, VALUE *argv, VALUE self)
 {
-  VALUE reg, res, self_str;
-  long start;
+  mmap_t *mmap;
+  VALUE rs, opts, kwargs[2];
+  const char *base, *sep, *hit;
+  long seplen;
+  size_t pos, end, len;
+  int chomp = 0, offsets = 0, newline = 0;
+
+  RETURN_ENUMERATOR(self, argc, argv);
+  if (rb_scan_args(argc, argv, "01:", &rs, &opts) == 0) {
+    rs = rb_rs;
+  }
+  if (!NIL_P(opts)) {
+    rb_get_kwargs(opts, mmap_each_line_kwargs, 0, 2, kwargs);
+    chomp = kwargs[0] != Qundef && RTEST(kwargs[0]);
+    offsets = kwargs[1] != Qundef && RTEST(kwargs[1]);
+  }
 
-  self_str = mmap_str(self, MMAP_RUBY_ORIGIN);
-  if (rb_typeddata_is_kind_of(other, &mmap_type)) {
-    other = rb_cMmap_to_str(other);
+  GET_MMAP(self, mmap, MMAP_RUBY_WINDOWED);
+  if (NIL_P(rs)) {
+    if (offsets) {
+      rb_yield_values(2, INT2FIX(0), SIZET2NUM(mmap->real));
+    }
+    else if (mmap->flag & MMAP_RUBY_WINDOW) {
+      rb_yield(mmap_window_str(mmap, 0, mmap->real));
+    }
+    else {
+      rb_yield(rb_str_new(mmap->addr, mmap->real));
+    }
+    return self;
   }
 
-  switch (TYPE(other)) {
-    case T_REGEXP:
-      res = rb_reg_match(other, self_str);
-      break;
+  StringValue(rs);
+  sep = RSTRING_PTR(rs);
+  seplen = RSTRING_LEN(rs);
+  if (seplen == 0) {
+    VALUE str;
 
-    case T_STRING:
-      reg = rb_reg_regcomp(other);
-      start = rb_reg_search(reg, self_str, 0, 0);
-      if (start == -1) {
-        res = Qnil;
+    if (mmap->flag & MMAP_RUBY_WINDOW) {
+      rb_raise(rb_eNotImpError, "paragraph mode is not supported by windowed maps");
+    }
+    if (offsets) {
+      rb_raise(rb_eArgError, "offsets are not supported in paragraph mode");
+    }
+    str = mmap_str(self, MMAP_RUBY_ORIGIN);
+    rb_funcall_with_block_kw(str, rb_intern("each_line"), argc, argv,
+                             rb_block_proc(), RB_PASS_CALLED_KEYWORDS);
+    RB_GC_GUARD(str);
+    return self;
+  }
+  newline = (seplen == 1 && sep[0] == '\n');
+
+  if (mmap->flag & MMAP_RUBY_WINDOW) {
+    long found;
+    char last;
+
+    for (pos = 0; mmap->path && pos < mmap->real; pos = end) {
+      found = mmap_window_find(mmap, pos, sep, seplen);
+      end = found >= 0 ? (size_t)found + seplen : mmap->real;
+      len = end - pos;
+      if (chomp && found >= 0) {
+        len -= seplen;
+        if (newline && len > 0) {
+          mmap_window_copy(mmap, pos + len - 1, 1, &last);
+          if (last == '\r') len--;
+        }
+      }
+      if (offsets) {
+        rb_yield_values(2, SIZET2NUM(pos), SIZET2NUM(len));
       }
       else {
-        res = LONG2NUM(start);
+        rb_yield(mmap_window_str(mmap, pos, len));
       }
-      break;
-
-    default:
-      res = rb_funcall(other, rb_intern("=~"), 1, self_str);
-      break;
+    }
+    return self;
   }
 
-  RB_GC_GUARD(self_str);
-  return res;
+  pos = 0;
+  while (mmap->path && pos < mmap->real) {
+    base = (const char *)mmap->addr;
+    hit = mmap_search(base + pos, mmap->real - pos, sep, seplen);
+    end = hit ? (size_t)(hit - base) + seplen : mmap->real;
+    len = end - pos;
+
+    if (chomp && hit) {
+      len -= seplen;
+      if (newline && len > 0 && base[pos + len - 1] == '\r') {
+        len--;
+      }
+    }
+
+    if (offsets) {
+      rb_yield_values(2, SIZET2NUM(pos), SIZET2NUM(len));
+    }
+    else {
+      rb_yield(rb_str_new(base + pos, len));
+    }
+    pos = end;
+  }
+  return self;
 }
 
-static VALUE
-mmap_bang_protect(VALUE tmp)
+/*
+ * Brings the line index up to date with the first mmap->real bytes,
+ * scanning only what was appended or rewritten since the last lookup.
+ * Newlines are counted first so the index grows once to its final size,
+ * then their offsets are stored; both passes run in parallel over large
+ * ranges.
+ */
+static void
+mmap_lines_extend(mmap_t *mmap)
 {
-  VALUE *t = (VALUE *)tmp;
+  mmap_lines_t *lines = &mmap->lines;
+  mmap_scan scan;
+  size_t starts[MMAP_SCAN_MAX_CHUNKS];
+  size_t i, n, from, total = 0, need, capa;
+  int width = mmap->real > UINT32_MAX ? 8 : 4;
+
+  if (lines->scanned > mmap->real) mmap_lines_truncate(lines, mmap->real);
+  from = lines->scanned;
+  if (lines->offs && from == mmap->real) return;
+  mmap_check_busy(mmap);
+
+  MEMZERO(&scan, mmap_scan, 1);
+  scan.func = mmap_scan_newlines_count;
+  scan.ptr = (const char *)mmap->addr + from;
+  scan.len = mmap->real - from;
+  n = mmap_scan_run(mmap, &scan);
+  for (i = 0; i < n; i++) {
+    starts[i] = lines->count + total;
+    total += scan.results[i];
+  }
+
+  need = lines->count + total;
+  if (!lines->offs || width > lines->width) {
+    char *offs = ALLOC_N(char, (need ? need : 1) * width);
+
+    for (i = 0; i < lines->count; i++) {
+      mmap_lines_put(offs, width, i, mmap_lines_get(lines, i));
+    }
+    xfree(lines->offs);
+    lines->offs = offs;
+    lines->capa = need ? need : 1;
+    lines->width = width;
+  }
+  else if (need > lines->capa) {
+    capa = lines->capa + lines->capa / 2;
+    if (capa < need) capa = need;
+    REALLOC_N(lines->offs, char, capa * lines->width);
+    lines->capa = capa;
+  }
+
+  if (total) {
+    scan.func = mmap_scan_newlines_fill;
+    scan.lines = lines;
+    scan.starts = starts;
+    scan.stride = scan.chunk;
+    mmap_scan_run(mmap, &scan);
+  }
+  /* A write from another thread while the GVL was released rewinds the index. */
+  if (lines->scanned == from) {
+    lines->count = need;
+    lines->scanned = mmap->real;
+  }
+}
 
-  return rb_funcall2(t[0], (ID)t[1], (int)t[2], (VALUE *)t[3]);
+static void
+mmap_lines_sync(mmap_t *mmap)
+{
+  while (!mmap->lines.offs || mmap->lines.scanned != mmap->real) {
+    mmap_lines_extend(mmap);
+  }
 }
 
-static VALUE
-mmap_bang_exec(VALUE data)
+static size_t
+mmap_lines_count(mmap_t *mmap)
 {
-  mmap_bang *bang_st = (mmap_bang *)data;
-  VALUE str, res;
-  mmap_t *mmap;
+  const mmap_lines_t *lines = &mmap->lines;
+  size_t last = lines->count ? mmap_lines_get(lines, lines->count - 1) + 1 : 0;
 
-  str = mmap_str(bang_st->obj, (int)bang_st->flag);
-  if (bang_st->flag & MMAP_RUBY_PROTECT) {
-    VALUE tmp[4];
-    tmp[0] = str;
-    tmp[1] = (VALUE)bang_st->id;
-    tmp[2] = (VALUE)bang_st->argc;
-    tmp[3] = (VALUE)bang_st->argv;
-    res = rb_ensure(mmap_bang_protect, (VALUE)tmp, 0, str);
-  }
-  else {
-    res = rb_funcall2(str, bang_st->id, bang_st->argc, bang_st->argv);
-    RB_GC_GUARD(res);
-  }
+  return lines->count + (mmap->real > last);
+}
 
-  if (res != Qnil) {
-    GET_MMAP(bang_st->obj, mmap, 0);
-    mmap->real = RSTRING_LEN(str);
-  }
+static VALUE
+mmap_lines_str(mmap_t *mmap, size_t i)
+{
+  const mmap_lines_t *lines = &mmap->lines;
+  size_t beg = i ? mmap_lines_get(lines, i - 1) + 1 : 0;
+  size_t end = i < lines->count ? mmap_lines_get(lines, i) + 1 : mmap->real;
 
-  return res;
+  return rb_str_new((const char *)mmap->addr + beg, end - beg);
 }
 
+/*
+ * Sidecar file of Mmap#build_line_index. The header records the size and
+ * modification time of the mapped file and the part of it that was
+ * mapped; an index whose header doesn't match is rebuilt.
+ */
+#define MMAP_LINES_MAGIC "MMAPLIX1"
+
+typedef struct {
+  char magic[8];
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t offset;
+  uint64_t real;
+  uint64_t count;
+  uint32_t width;
+  uint32_t reserved;
+} mmap_lines_header_t;
+
 static void
-mmap_lock(mmap_t *mmap, int wait_lock)
+mmap_lines_header(mmap_t *mmap, mmap_lines_header_t *header)
 {
-  struct sembuf sem_op;
+  struct stat st;
 
-  if (mmap->flag & MMAP_RUBY_IPC) {
-    mmap->count++;
-    if (mmap->count == 1) {
-retry:
-      sem_op.sem_num = 0;
-      sem_op.sem_op = -1;
-      sem_op.sem_flg = IPC_NOWAIT;
-      if (semop(mmap->semid, &sem_op, 1) == -1) {
-        if (errno == EAGAIN) {
-          if (!wait_lock) {
-            rb_raise(rb_const_get(rb_mErrno, rb_intern("EAGAIN")), "EAGAIN");
-          }
-          rb_thread_sleep(1);
-          goto retry;
-        }
-        rb_sys_fail("semop()");
-      }
-    }
+  if (stat(mmap->path, &st) == -1) {
+    rb_sys_fail(mmap->path);
   }
+  MEMZERO(header, mmap_lines_header_t, 1);
+  memcpy(header->magic, MMAP_LINES_MAGIC, 8);
+  header->size = (uint64_t)st.st_size;
+  header->mtime_sec = (int64_t)st.st_mtime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+  header->mtime_nsec = (int64_t)st.st_mtim.tv_nsec;
+#endif
+  header->offset = (uint64_t)mmap->offset;
+  header->real = (uint64_t)mmap->real;
 }
 
-static void
-mmap_unlock(mmap_t *mmap)
+static int
+mmap_lines_read(int fd, void *buf, size_t len)
 {
-  struct sembuf sem_op;
+  ssize_t n;
 
-  if (mmap->flag & MMAP_RUBY_IPC) {
-    mmap->count--;
-    if (!mmap->count) {
-retry:
-      sem_op.sem_num = 0;
-      sem_op.sem_op = 1;
-      sem_op.sem_flg = IPC_NOWAIT;
-      if (semop(mmap->semid, &sem_op, 1) == -1) {
-        if (errno == EAGAIN) {
-          rb_thread_sleep(1);
-          goto retry;
-        }
-        rb_sys_fail("semop()");
-      }
+  while (len > 0) {
+    n = read(fd, buf, len);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) continue;
+      return -1;
     }
+    buf = (char *)buf + n;
+    len -= (size_t)n;
   }
+  return 0;
 }
 
-static VALUE
-mmap_vunlock(VALUE obj)
+static int
+mmap_lines_write(int fd, const void *buf, size_t len)
 {
-  mmap_t *mmap;
+  ssize_t n;
 
-  GET_MMAP(obj, mmap, 0);
-  mmap_unlock(mmap);
-  return Qnil;
+  while (len > 0) {
+    n = write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    buf = (const char *)buf + n;
+    len -= (size_t)n;
+  }
+  return 0;
 }
 
-static VALUE
-mmap_bang_initialize(VALUE obj, int flag, ID id, int argc, VALUE *argv)
+/* Loads the index from +path+ if it is there and matches +expect+. */
+static int
+mmap_lines_load(mmap_t *mmap, const char *path, const mmap_lines_header_t *expect)
 {
-  VALUE res;
-  mmap_t *mmap;
-  mmap_bang bang_st;
+  mmap_lines_header_t header;
+  mmap_lines_t lines;
+  struct stat st;
+  char *offs;
+  size_t bytes, i, prev = 0;
+  int fd;
 
-  GET_MMAP(obj, mmap, 0);
-  if ((flag & MMAP_RUBY_CHANGE) && (mmap->flag & MMAP_RUBY_FIXED)) {
-    rb_raise(rb_eTypeError, "can't change the size of a fixed map");
+  if ((fd = open(path, O_RDONLY)) == -1) return 0;
+  if (fstat(fd, &st) == -1 || mmap_lines_read(fd, &header, sizeof(header)) == -1 ||
+      memcmp(header.magic, expect->magic, 8) != 0 || header.size != expect->size ||
+      header.mtime_sec != expect->mtime_sec || header.mtime_nsec != expect->mtime_nsec ||
+      header.offset != expect->offset || header.real != expect->real ||
+      (header.width != 4 && header.width != 8) || header.count > header.real ||
+      (uint64_t)st.st_size != sizeof(header) + header.count * header.width) {
+    close(fd);
+    return 0;
   }
 
-  bang_st.obj = obj;
-  bang_st.flag = flag;
-  bang_st.id = id;
-  bang_st.argc = argc;
-  bang_st.argv = argv;
+  bytes = (size_t)header.count * header.width;
+  offs = ALLOC_N(char, bytes ? bytes : 1);
+  if (mmap_lines_read(fd, offs, bytes) == -1) {
+    close(fd);
+    xfree(offs);
+    return 0;
+  }
+  close(fd);
 
-  if (mmap->flag & MMAP_RUBY_IPC) {
-    mmap_lock(mmap, Qtrue);
-    res = rb_ensure(mmap_bang_exec, (VALUE)&bang_st, mmap_vunlock, obj);
+  /* A damaged or edited file must not send line reads out of the map. */
+  lines.offs = offs;
+  lines.width = (int)header.width;
+  for (i = 0; i < (size_t)header.count; i++) {
+    size_t off = mmap_lines_get(&lines, i);
+
+    if (off >= mmap->real || (i && off <= prev)) {
+      xfree(offs);
+      return 0;
+    }
+    prev = off;
   }
-  else {
-    res = mmap_bang_exec((VALUE)&bang_st);
+
+  xfree(mmap->lines.offs);
+  mmap->lines.offs = offs;
+  mmap->lines.count = mmap->lines.capa = (size_t)header.count;
+  if (!mmap->lines.capa) mmap->lines.capa = 1;
+  mmap->lines.width = (int)header.width;
+  mmap->lines.scanned = mmap->real;
+  return 1;
+}
+
+static void
+mmap_lines_save(mmap_t *mmap, const char *path, mmap_lines_header_t *header)
+{
+  int fd;
+
+  header->count = mmap->lines.count;
+  header->width = (uint32_t)mmap->lines.width;
+  if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+    rb_sys_fail(path);
   }
+  if (mmap_lines_write(fd, header, sizeof(*header)) == -1 ||
+      mmap_lines_write(fd, mmap->lines.offs, mmap->lines.count * mmap->lines.width) == -1) {
+    int e = errno;
 
-  if (res == Qnil) return res;
-  return (flag & MMAP_RUBY_ORIGIN) ? res : obj;
+    close(fd);
+    errno = e;
+    rb_sys_fail(path);
+  }
+  close(fd);
 }
 
 /*
  * call-seq:
- *   match(pattern) -> MatchData or nil
+ *   build_line_index(path = nil) -> self
  *
- * Converts +pattern+ to a Regexp (if it isn't already one) and returns a
- * MatchData object describing the match, or +nil+ if there was no match.
- * This is equivalent to calling +pattern.match+ on the mapped memory content.
+ * Indexes the offsets of the newlines of the mapped memory, which makes
+ * #line_at, #lines and #line_count constant time. The index is otherwise
+ * built on the first of those calls.
+ *
+ * With +path+, the index is loaded from that sidecar file when it was
+ * built for the current size and modification time of the mapped file,
+ * and built and written there otherwise.
+ *
+ * Writes through the map are tracked: appends only index the new bytes,
+ * and other writes drop the index from the first changed byte onwards.
+ * Writes from other processes or through an IO::Buffer are not seen; call
+ * build_line_index again after them.
+ *
+ *   mmap.build_line_index("access.log.idx")
+ *   mmap.line_at(1_000_000) # => "GET /index.html ...\n"
  */
 static VALUE
-rb_cMmap_match_m(VALUE self, VALUE pattern)
+rb_cMmap_build_line_index(int argc, VALUE *argv, VALUE self)
 {
-  return mmap_bang_initialize(self, MMAP_RUBY_ORIGIN, rb_intern("match"), 1, &pattern);
+  mmap_t *mmap;
+  mmap_lines_header_t header;
+  VALUE path;
+
+  rb_scan_args(argc, argv, "01", &path);
+  GET_MMAP(self, mmap, 0);
+  if (!NIL_P(path)) {
+    FilePathValue(path);
+    if (mmap->path == (char *)(intptr_t)-1) {
+      rb_raise(rb_eArgError, "an index of an anonymous map can't be persisted");
+    }
+    mmap_lines_header(mmap, &header);
+    if (mmap_lines_load(mmap, RSTRING_PTR(path), &header)) return self;
+  }
+
+  mmap->lines.count = 0;
+  mmap->lines.scanned = 0;
+  mmap_lines_sync(mmap);
+  if (!NIL_P(path)) {
+    mmap_lines_save(mmap, RSTRING_PTR(path), &header);
+  }
+  return self;
 }
 
 /*
  * call-seq:
- *   length -> integer
- *   size -> integer
+ *   line_count -> integer
  *
- * Returns the size of the file.
+ * Returns the number of lines, counting a last line without a newline.
  */
 static VALUE
-rb_cMmap_size(VALUE self)
+rb_cMmap_line_count(VALUE self)
 {
   mmap_t *mmap;
 
   GET_MMAP(self, mmap, 0);
-  return SIZET2NUM(mmap->real);
+  mmap_lines_sync(mmap);
+  return SIZET2NUM(mmap_lines_count(mmap));
 }
 
 /*
  * call-seq:
- *   empty? -> true or false
+ *   line_at(n) -> string or nil
  *
- * Returns +true+ if the file is empty, +false+ otherwise.
+ * Returns line +n+ (negative counts from the end) with its newline, or
+ * +nil+ if there are not that many lines.
  */
 static VALUE
-rb_cMmap_empty(VALUE self)
+rb_cMmap_line_at(VALUE self, VALUE n)
 {
   mmap_t *mmap;
+  long i = NUM2LONG(n), count;
 
   GET_MMAP(self, mmap, 0);
-  if (mmap->real == 0) return Qtrue;
-  return Qfalse;
+  mmap_lines_sync(mmap);
+  count = (long)mmap_lines_count(mmap);
+  if (i < 0) i += count;
+  if (i < 0 || i >= count) return Qnil;
+  return mmap_lines_str(mmap, (size_t)i);
 }
 
 /*
  * call-seq:
- *   [](nth) -> string or nil
- *   [](start, length) -> string or nil
- *   [](start..last) -> string or nil
- *   [](pattern) -> string or nil
- *   slice(nth) -> string or nil
- *   slice(start, length) -> string or nil
- *   slice(start..last) -> string or nil
- *   slice(pattern) -> string or nil
- *
- * Element reference with the following syntax:
- *
- *   self[nth]
- *
- * Retrieves the +nth+ character.
- *
- *   self[start..last]
- *
- * Returns a substring from +start+ to +last+.
- *
- *   self[start, length]
- *
- * Returns a substring of +length+ characters from +start+.
+ *   lines(range) -> array or nil
+ *   lines(start, length) -> array or nil
  *
- *   self[pattern]
+ * Returns the given lines with their newlines, with the semantics of
+ * Array#[].
  *
- * Returns the first match of +pattern+ (String or Regexp).
+ *   mmap.lines(10...20)
+ *   mmap.lines(-5, 5)
  */
 static VALUE
-rb_cMmap_aref(int argc, VALUE *argv, VALUE self)
-{
-  return mmap_bang_initialize(self, MMAP_RUBY_ORIGIN, rb_intern("[]"), argc, argv);
-}
-
-static VALUE
-mmap_aset_m(VALUE self, VALUE indx, VALUE val)
+rb_cMmap_lines(int argc, VALUE *argv, VALUE self)
 {
-  long idx;
   mmap_t *mmap;
+  VALUE ary;
+  long beg, len, count, i;
 
-  GET_MMAP(self, mmap, MMAP_RUBY_MODIFY);
-  switch (TYPE(indx)) {
-    case T_FIXNUM:
-num_index:
-      idx = NUM2INT(indx);
-      if (idx < 0) {
-        idx += mmap->real;
-      }
-      if (idx < 0 || mmap->real <= (size_t)idx) {
-        rb_raise(rb_eIndexError, "index %ld out of string", idx);
-      }
-      if (FIXNUM_P(val)) {
-        if (mmap->real == (size_t)idx) {
-          mmap->real += 1;
-          if (mmap->flag & MMAP_RUBY_FIXED) {
-            rb_raise(rb_eTypeError, "can't change the size of a fixed map");
-          }
-        }
-        ((char *)mmap->addr)[idx] = NUM2INT(val) & 0xff;
-      }
-      else {
-        mmap_update(mmap, idx, 1, val);
-      }
-      return val;
-
-    case T_REGEXP:
-      mmap_subpat_set(self, indx, 0, val);
-      return val;
-
-    case T_STRING:
-      {
-        VALUE res;
-
-        res = rb_cMmap_index(1, &indx, self);
-        if (!NIL_P(res)) {
-          mmap_update(mmap, NUM2LONG(res), RSTRING_LEN(indx), val);
-        }
-        return val;
-      }
+  rb_check_arity(argc, 1, 2);
+  GET_MMAP(self, mmap, 0);
+  mmap_lines_sync(mmap);
+  count = (long)mmap_lines_count(mmap);
+  if (argc == 1) {
+    if (!RTEST(rb_range_beg_len(argv[0], &beg, &len, count, 0))) return Qnil;
+  }
+  else {
+    beg = NUM2LONG(argv[0]);
+    len = NUM2LONG(argv[1]);
+    if (beg < 0) beg += count;
+    if (beg < 0 || beg > count || len < 0) return Qnil;
+    if (len > count - beg) len = count - beg;
+  }
 
-    default:
-      {
-        long beg, len;
-        if (rb_range_beg_len(indx, &beg, &len, mmap->real, 2)) {
-          mmap_update(mmap, beg, len, val);
-          return val;
-        }
-      }
-      idx = NUM2LONG(indx);
-      goto num_index;
+  ary = rb_ary_new_capa(len);
+  for (i = 0; i < len; i++) {
+    rb_ary_push(ary, mmap_lines_str(mmap, (size_t)(beg + i)));
   }
+  return ary;
 }
 
+static VALUE mmap_cMatcher;
+
 static void
-mmap_update(mmap_t *str, long beg, long len, VALUE val)
+mmap_matcher_mark(void *ptr)
 {
-  char *valp;
-  long vall;
+  mmap_matcher_t *m = (mmap_matcher_t *)ptr;
 
-  if (len < 0) rb_raise(rb_eIndexError, "negative length %ld", len);
-  mmap_lock(str, Qtrue);
-  if (beg < 0) {
-    beg += str->real;
-  }
-  if (beg < 0 || str->real < (size_t)beg) {
-    if (beg < 0) {
-      beg -= str->real;
-    }
-    mmap_unlock(str);
-    rb_raise(rb_eIndexError, "index %ld out of string", beg);
-  }
-  if (str->real < (size_t)(beg + len)) {
-    len = str->real - beg;
-  }
+  rb_gc_mark_movable(m->patterns);
+}
 
-  mmap_unlock(str);
-  valp = StringValuePtr(val);
-  vall = RSTRING_LEN(val);
-  mmap_lock(str, Qtrue);
+static void
+mmap_matcher_compact(void *ptr)
+{
+  mmap_matcher_t *m = (mmap_matcher_t *)ptr;
 
-  if ((str->flag & MMAP_RUBY_FIXED) && vall != len) {
-    mmap_unlock(str);
-    rb_raise(rb_eTypeError, "try to change the size of a fixed map");
-  }
-  if (len < vall) {
-    mmap_realloc(str, str->real + vall - len);
-  }
+  m->patterns = rb_gc_location(m->patterns);
+}
 
-  if (vall != len) {
-    memmove((char *)str->addr + beg + vall,
-            (char *)str->addr + beg + len,
-            str->real - (beg + len));
-  }
-  if (str->real < (size_t)beg && len < 0) {
-    MEMZERO((char *)str->addr + str->real, char, -len);
-  }
-  if (vall > 0) {
-    memmove((char *)str->addr + beg, valp, vall);
-  }
-  str->real += vall - len;
-  mmap_unlock(str);
+static void
+mmap_matcher_clear(mmap_matcher_t *m)
+{
+  xfree(m->next);
+  xfree(m->out);
+  xfree(m->dict);
+  xfree(m->dup);
+  xfree(m->plen);
+  m->next = m->out = m->dict = m->dup = NULL;
+  m->plen = NULL;
+  m->nstates = m->npatterns = 0;
 }
 
 static void
-mmap_subpat_set(VALUE obj, VALUE re, int offset, VALUE val)
+mmap_matcher_free(void *ptr)
 {
-  VALUE str, match;
-  OnigPosition start, end;
-  int len;
-  mmap_t *mmap;
-  struct re_registers *regs;
+  mmap_matcher_clear((mmap_matcher_t *)ptr);
+  xfree(ptr);
+}
 
-  str = mmap_str(obj, MMAP_RUBY_MODIFY | MMAP_RUBY_ORIGIN);
-  if (rb_reg_search(re, str, 0, 0) < 0) {
-    rb_raise(rb_eIndexError, "regexp not matched");
-  }
+static size_t
+mmap_matcher_memsize(const void *ptr)
+{
+  const mmap_matcher_t *m = (const mmap_matcher_t *)ptr;
 
-  match = rb_backref_get();
-  regs = RMATCH_REGS(match);
-  if (offset >= regs->num_regs) {
-    rb_raise(rb_eIndexError, "index %d out of regexp", offset);
-  }
+  return sizeof(mmap_matcher_t) + m->nstates * (m->nclasses + 2) * sizeof(int32_t) +
+    m->npatterns * (sizeof(int32_t) + sizeof(size_t));
+}
 
-  start = regs->beg[offset];
-  if (start == -1) {
-    rb_raise(rb_eIndexError, "regexp group %d not matched", offset);
-  }
-  end = regs->end[offset];
-  len = (int)(end - start);
+static const rb_data_type_t mmap_matcher_type = {
+  .wrap_struct_name = "MmapRuby::Mmap::Matcher",
+  .function = {
+    .dmark = mmap_matcher_mark,
+    .dfree = mmap_matcher_free,
+    .dsize = mmap_matcher_memsize,
+    .dcompact = mmap_matcher_compact
+  },
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY
+};
 
-  GET_MMAP(obj, mmap, MMAP_RUBY_MODIFY);
-  mmap_update(mmap, start, len, val);
+static VALUE
+mmap_matcher_allocate(VALUE klass)
+{
+  mmap_matcher_t *m;
+  VALUE obj = TypedData_Make_Struct(klass, mmap_matcher_t, &mmap_matcher_type, m);
+
+  m->patterns = Qnil;
+  return obj;
 }
 
 /*
  * call-seq:
- *   []=(nth, val) -> val
- *   []=(start, length, val) -> val
- *   []=(start..last, val) -> val
- *   []=(pattern, val) -> val
- *   []=(pattern, nth, val) -> val
- *
- * Element assignment with the following syntax:
- *
- *   self[nth] = val
- *
- * Changes the +nth+ character with +val+.
- *
- *   self[start..last] = val
- *
- * Changes substring from +start+ to +last+ with +val+.
- *
- *   self[start, length] = val
- *
- * Replaces +length+ characters from +start+ with +val+.
- *
- *   self[pattern] = val
- *
- * Replaces the first match of +pattern+ with +val+.
+ *   Mmap::Matcher.new(patterns) -> matcher
  *
- *   self[pattern, nth] = val
+ * Compiles +patterns+, an Array of non-empty Strings, for Mmap#find_any
+ * and Mmap#each_match_any. Matches report the index of their pattern in
+ * +patterns+. Compiling once and reusing the matcher saves rebuilding the
+ * automaton on every search.
  *
- * Replaces the +nth+ match of +pattern+ with +val+.
+ *   matcher = Mmap::Matcher.new(%w[ERROR FATAL panic])
+ *   mmap.each_match_any(matcher) { |id, offset| ... }
  */
 static VALUE
-rb_cMmap_aset(int argc, VALUE *argv, VALUE self)
+rb_cMmapMatcher_initialize(VALUE self, VALUE patterns)
 {
-  mmap_t *mmap;
+  mmap_matcher_t *m;
+  VALUE ary, str;
+  const unsigned char *p;
+  unsigned char used[256];
+  int32_t *fail, *queue, s, f, v;
+  size_t n, i, j, total = 0, head = 0, tail = 0, cl, ncl, k;
+
+  TypedData_Get_Struct(self, mmap_matcher_t, &mmap_matcher_type, m);
+  patterns = rb_convert_type(patterns, T_ARRAY, "Array", "to_ary");
+  n = (size_t)RARRAY_LEN(patterns);
+  if (n == 0) {
+    rb_raise(rb_eArgError, "no patterns given");
+  }
+  if (n > INT32_MAX) {
+    rb_raise(rb_eArgError, "too many patterns");
+  }
+
+  ary = rb_ary_new_capa((long)n);
+  MEMZERO(used, unsigned char, 256);
+  for (i = 0; i < n; i++) {
+    str = RARRAY_AREF(patterns, i);
+    str = rb_str_new_frozen(StringValue(str));
+    if (RSTRING_LEN(str) == 0) {
+      rb_raise(rb_eArgError, "pattern %zu is empty", i);
+    }
+    p = (const unsigned char *)RSTRING_PTR(str);
+    for (j = 0; j < (size_t)RSTRING_LEN(str); j++) used[p[j]] = 1;
+    total += RSTRING_LEN(str);
+    rb_ary_push(ary, str);
+  }
+  if (total >= INT32_MAX) {
+    rb_raise(rb_eArgError, "patterns are too long");
+  }
+
+  mmap_matcher_clear(m);
+  MEMZERO(&m->first, mmap_byteset_t, 1);
+  m->maxlen = 0;
+  for (cl = 0, k = 0; k < 256; k++) {
+    m->classes[k] = used[k] ? (unsigned char)++cl : 0;
+  }
+  ncl = cl + 1;
+  m->nclasses = (int)ncl;
+
+  /* The trie: states are numbered as they are created, children are transitions >= 0. */
+  m->next = ALLOC_N(int32_t, (total + 1) * ncl);
+  memset(m->next, 0xff, (total + 1) * ncl * sizeof(int32_t));
+  m->out = ALLOC_N(int32_t, total + 1);
+  memset(m->out, 0xff, (total + 1) * sizeof(int32_t));
+  m->dup = ALLOC_N(int32_t, n);
+  memset(m->dup, 0xff, n * sizeof(int32_t));
+  m->plen = ALLOC_N(size_t, n);
+  m->npatterns = n;
+  m->nstates = 1;
+  for (i = 0; i < n; i++) {
+    str = RARRAY_AREF(ary, i);
+    p = (const unsigned char *)RSTRING_PTR(str);
+    m->plen[i] = (size_t)RSTRING_LEN(str);
+    if (m->plen[i] > m->maxlen) m->maxlen = m->plen[i];
+    if (!m->first.member[p[0]]) {
+      m->first.member[p[0]] = 1;
+      m->first.only = p[0];
+      m->first.size++;
+      if (p[0] < 0x80) m->first.lo_clear[p[0] & 15] |= 1 << (p[0] >> 4);
+      else m->first.lo_set[p[0] & 15] |= 1 << ((p[0] >> 4) - 8);
+    }
+    for (s = 0, j = 0; j < m->plen[i]; j++) {
+      int32_t *t = &m->next[(size_t)s * ncl + m->classes[p[j]]];
 
-  GET_MMAP(self, mmap, MMAP_RUBY_MODIFY);
-  if (argc == 3) {
-    long beg, len;
+      if (*t < 0) *t = (int32_t)m->nstates++;
+      s = *t;
+    }
+    if (m->out[s] < 0) {
+      m->out[s] = (int32_t)i;
+    }
+    else {
+      for (v = m->out[s]; m->dup[v] >= 0; v = m->dup[v]);
+      m->dup[v] = (int32_t)i;
+    }
+  }
 
-    if (TYPE(argv[0]) == T_REGEXP) {
-      mmap_subpat_set(self, argv[0], NUM2INT(argv[1]), argv[2]);
+  /* Breadth first, fill in the missing transitions from the failure links. */
+  m->dict = ALLOC_N(int32_t, m->nstates);
+  fail = ALLOC_N(int32_t, m->nstates);
+  queue = ALLOC_N(int32_t, m->nstates);
+  m->dict[0] = fail[0] = 0;
+  for (cl = 0; cl < ncl; cl++) {
+    v = m->next[cl];
+    if (v < 0) {
+      m->next[cl] = 0;
     }
     else {
-      beg = NUM2INT(argv[0]);
-      len = NUM2INT(argv[1]);
-      mmap_update(mmap, beg, len, argv[2]);
+      fail[v] = m->dict[v] = 0;
+      queue[tail++] = v;
     }
-    return argv[2];
   }
-  if (argc != 2) {
-    rb_raise(rb_eArgError, "wrong # of arguments(%d for 2)", argc);
+  while (head < tail) {
+    s = queue[head++];
+    for (cl = 0; cl < ncl; cl++) {
+      v = m->next[(size_t)s * ncl + cl];
+      f = m->next[(size_t)fail[s] * ncl + cl];
+      if (v < 0) {
+        m->next[(size_t)s * ncl + cl] = f;
+      }
+      else {
+        fail[v] = f;
+        m->dict[v] = m->out[f] >= 0 ? f : m->dict[f];
+        queue[tail++] = v;
+      }
+    }
   }
-  return mmap_aset_m(self, argv[0], argv[1]);
+  xfree(fail);
+  xfree(queue);
+  REALLOC_N(m->next, int32_t, m->nstates * ncl);
+  REALLOC_N(m->out, int32_t, m->nstates);
+
+  RB_OBJ_WRITE(self, &m->patterns, rb_ary_freeze(ary));
+  return self;
 }
 
 /*
  * call-seq:
- *   slice!(nth) -> string or nil
- *   slice!(start, length) -> string or nil
- *   slice!(start..last) -> string or nil
- *   slice!(pattern) -> string or nil
+ *   patterns -> array
  *
- * Deletes the specified portion of the mapped memory and returns it.
- * Returns +nil+ if the portion is not found.
+ * Returns the frozen patterns of the matcher.
  */
 static VALUE
-rb_cMmap_slice_bang(int argc, VALUE *argv, VALUE self)
+rb_cMmapMatcher_patterns(VALUE self)
 {
-  VALUE result;
-  VALUE buf[3];
-  int i;
+  mmap_matcher_t *m;
 
-  if (argc < 1 || 2 < argc) {
-    rb_raise(rb_eArgError, "wrong # of arguments(%d for 1)", argc);
-  }
+  TypedData_Get_Struct(self, mmap_matcher_t, &mmap_matcher_type, m);
+  return m->patterns;
+}
 
-  for (i = 0; i < argc; i++) {
-    buf[i] = argv[i];
+/*
+ * call-seq:
+ *   size -> integer
+ *
+ * Returns the number of patterns.
+ */
+static VALUE
+rb_cMmapMatcher_size(VALUE self)
+{
+  mmap_matcher_t *m;
+
+  TypedData_Get_Struct(self, mmap_matcher_t, &mmap_matcher_type, m);
+  return SIZET2NUM(m->npatterns);
+}
+
+/* Returns +patterns+ as a compiled Mmap::Matcher, compiling an Array. */
+static VALUE
+mmap_matcher_get(VALUE patterns, mmap_matcher_t **pm)
+{
+  if (!rb_typeddata_is_kind_of(patterns, &mmap_matcher_type)) {
+    patterns = rb_class_new_instance(1, &patterns, mmap_cMatcher);
   }
-  buf[i] = rb_str_new(0, 0);
-  result = rb_cMmap_aref(argc, buf, self);
-  if (!NIL_P(result)) {
-    rb_cMmap_aset(argc + 1, buf, self);
+  TypedData_Get_Struct(patterns, mmap_matcher_t, &mmap_matcher_type, *pm);
+  if (!(*pm)->nstates) {
+    rb_raise(rb_eArgError, "uninitialized matcher");
   }
-
-  return result;
+  return patterns;
 }
 
 /*
  * call-seq:
- *   include?(other) -> true or false
+ *   find_any(patterns, offset = 0) -> [id, offset] or nil
  *
- * Returns +true+ if +other+ is found in the mapped memory, +false+ otherwise.
- * The +other+ parameter can be a string or regular expression.
+ * Searches for all of +patterns+, an Array of Strings or an Mmap::Matcher,
+ * in one pass from byte +offset+ and returns the index of the pattern and
+ * the offset of the leftmost match, preferring the longest pattern there.
+ * Returns +nil+ if none of them occurs.
+ *
+ *   mmap.find_any(%w[ERROR FATAL]) # => [1, 5123]
  */
 static VALUE
-rb_cMmap_include(VALUE self, VALUE other)
+rb_cMmap_find_any(int argc, VALUE *argv, VALUE self)
 {
-  return mmap_bang_initialize(self, MMAP_RUBY_ORIGIN, rb_intern("include?"), 1, &other);
+  mmap_t *mmap;
+  mmap_matcher_t *m;
+  mmap_scan scan;
+  VALUE patterns, voffset, matcher;
+  size_t off = 0, i, n, start = SIZE_MAX, stop, id = 0;
+
+  rb_scan_args(argc, argv, "11", &patterns, &voffset);
+  matcher = mmap_matcher_get(patterns, &m);
+  GET_MMAP(self, mmap, 0);
+  if (!NIL_P(voffset)) off = mmap_buffer_offset(mmap, voffset);
+  if (off == mmap->real) return Qnil;
+
+  MEMZERO(&scan, mmap_scan, 1);
+  scan.func = mmap_scan_any_first;
+  scan.ptr = (const char *)mmap->addr + off;
+  scan.len = mmap->real - off;
+  scan.matcher = m;
+  n = mmap_scan_run(mmap, &scan);
+  for (i = 0; i < n && start == SIZE_MAX; i++) {
+    start = scan.results[i];
+  }
+  RB_GC_GUARD(matcher);
+  if (start == SIZE_MAX) return Qnil;
+
+  stop = start + m->maxlen < scan.len ? start + m->maxlen : scan.len;
+  mmap_matcher_run(m, scan.ptr, start, start + 1, stop, NULL, &id);
+  return rb_assoc_new(SIZET2NUM(id), SIZET2NUM(off + start));
 }
 
 /*
- * call-seq:
- *   index(substr) -> integer or nil
- *   index(pattern) -> integer or nil
- *
- * Returns the index of +substr+ or +pattern+, or +nil+ if not found.
+ * Bytes searched per round of #each_match_any, whose matches are buffered
+ * while the GVL is released and yielded afterwards.
  */
+#define MMAP_ANY_SEGMENT ((size_t)64 << 20)
+
+typedef struct {
+  VALUE self;
+  mmap_matcher_t *matcher;
+  mmap_matches_t lists[MMAP_SCAN_MAX_CHUNKS];
+} mmap_any_each_t;
+
 static VALUE
-rb_cMmap_index(int argc, VALUE *argv, VALUE self)
+mmap_any_each(VALUE data)
+{
+  mmap_any_each_t *each = (mmap_any_each_t *)data;
+  mmap_t *mmap;
+  mmap_scan scan;
+  size_t pos = 0, seg = MMAP_ANY_SEGMENT, i, j, n;
+
+  if (mmap_parallel_threads >= 2 && seg < mmap_parallel_threshold) {
+    seg = mmap_parallel_threshold;
+  }
+  for (;;) {
+    GET_MMAP(each->self, mmap, 0);
+    if (pos >= mmap->real) break;
+
+    MEMZERO(&scan, mmap_scan, 1);
+    scan.func = mmap_scan_any_each;
+    scan.ptr = (const char *)mmap->addr + pos;
+    scan.len = mmap->real - pos < seg ? mmap->real - pos : seg;
+    scan.reach = mmap->real - pos;
+    scan.matcher = each->matcher;
+    scan.matches = each->lists;
+    n = mmap_scan_run(mmap, &scan);
+    for (i = 0; i < n; i++) {
+      if (each->lists[i].failed) rb_memerror();
+    }
+    for (i = 0; i < n; i++) {
+      for (j = 0; j < each->lists[i].len; j++) {
+        rb_yield_values(2, SIZET2NUM(each->lists[i].items[2 * j]),
+                        SIZET2NUM(pos + each->lists[i].items[2 * j + 1]));
+      }
+    }
+    pos += scan.len;
+  }
+  return Qnil;
+}
+
+static VALUE
+mmap_any_each_free(VALUE data)
 {
-  return mmap_bang_initialize(self, MMAP_RUBY_ORIGIN, rb_intern("index"), argc, argv);
+  mmap_any_each_t *each = (mmap_any_each_t *)data;
+  int i;
+
+  for (i = 0; i < MMAP_SCAN_MAX_CHUNKS; i++) {
+    free(each->lists[i].items);
+  }
+  xfree(each);
+  return Qnil;
 }
 
 /*
  * call-seq:
- *   rindex(substr, pos = nil) -> integer or nil
- *   rindex(pattern, pos = nil) -> integer or nil
+ *   each_match_any(patterns) {|id, offset| block } -> self
+ *   each_match_any(patterns) -> enumerator
  *
- * Returns the index of the last occurrence of +substr+ or +pattern+, or +nil+ if not found.
+ * Searches for all of +patterns+, an Array of Strings or an Mmap::Matcher,
+ * in one pass and calls the block with the index of the pattern and the
+ * offset of every match, overlapping ones included, in order of offset
+ * then index. Large maps are searched in parallel with the GVL released
+ * (see Mmap.parallel_threads).
+ *
+ *   mmap.each_match_any(tokens) { |id, offset| hits[tokens[id]] += 1 }
  */
 static VALUE
-rb_cMmap_rindex(int argc, VALUE *argv, VALUE self)
+rb_cMmap_each_match_any(VALUE self, VALUE patterns)
+{
+  mmap_any_each_t *each;
+  mmap_matcher_t *m;
+  VALUE matcher;
+
+  RETURN_ENUMERATOR(self, 1, &patterns);
+  matcher = mmap_matcher_get(patterns, &m);
+  each = ZALLOC(mmap_any_each_t);
+  each->self = self;
+  each->matcher = m;
+  rb_ensure(mmap_any_each, (VALUE)each, mmap_any_each_free, (VALUE)each);
+  RB_GC_GUARD(matcher);
+  return self;
+}
+
+typedef struct {
+  VALUE self;
+  VALUE pat;
+  long group;
+  long start;
+  struct re_registers regs;
+} mmap_scan_offsets_t;
+
+static OnigPosition
+mmap_scan_offsets_search(regex_t *reg, VALUE str, struct re_registers *regs, void *args)
+{
+  const OnigUChar *ptr = (const OnigUChar *)RSTRING_PTR(str), *end = ptr + RSTRING_LEN(str);
+
+  return onig_search(reg, ptr, end, ptr + ((mmap_scan_offsets_t *)args)->start, end, regs,
+                     ONIG_OPTION_NONE);
+}
+
+static VALUE
+mmap_scan_offsets(VALUE data)
+{
+  mmap_scan_offsets_t *scan = (mmap_scan_offsets_t *)data;
+  struct re_registers *regs = &scan->regs;
+  mmap_t *mmap;
+  VALUE str;
+  long beg, end;
+
+  GET_MMAP(scan->self, mmap, 0);
+  str = mmap_str(scan->self, MMAP_RUBY_ORIGIN);
+  while (scan->start <= RSTRING_LEN(str)) {
+    if (rb_reg_onig_match(scan->pat, str, mmap_scan_offsets_search, scan, regs) < 0) break;
+    beg = regs->beg[scan->group];
+    end = regs->end[scan->group];
+    if (regs->beg[0] < regs->end[0]) {
+      scan->start = regs->end[0];
+    }
+    else if (regs->end[0] < RSTRING_LEN(str)) {
+      scan->start = regs->end[0] + rb_enc_fast_mbclen(RSTRING_PTR(str) + regs->end[0],
+                                                      RSTRING_END(str), rb_enc_get(str));
+    }
+    else {
+      scan->start = regs->end[0] + 1;
+    }
+    if (beg < 0) rb_yield_values(2, Qnil, Qnil);
+    else rb_yield_values(2, LONG2NUM(beg), LONG2NUM(end));
+
+    /* The block may have resized or remapped the map. */
+    GET_MMAP(scan->self, mmap, 0);
+    if (RSTRING_PTR(str) != (char *)mmap->addr || RSTRING_LEN(str) != (long)mmap->real) {
+      str = mmap_str(scan->self, MMAP_RUBY_ORIGIN);
+    }
+  }
+  RB_GC_GUARD(str);
+  return Qnil;
+}
+
+static VALUE
+mmap_scan_offsets_free(VALUE data)
 {
-  return mmap_bang_initialize(self, MMAP_RUBY_ORIGIN, rb_intern("rindex"), argc, argv);
+  onig_region_free(&((mmap_scan_offsets_t *)data)->regs, 0);
+  return Qnil;
 }
 
 /*
  * call-seq:
- *   count(o1, *args) -> integer
+ *   scan_offsets(pattern, group = 0) {|beg, end| block } -> self
+ *   scan_offsets(pattern, group = 0) -> enumerator
  *
- * Each parameter defines a set of characters to count in the mapped memory.
- * Returns the total count.
+ * Scans the mapped memory for +pattern+ as String#scan does, but calls the
+ * block with the byte offsets where each match of +group+ (a number or a
+ * name) begins and ends instead of building Strings or MatchData. The
+ * offsets are +nil+ when the group took no part in a match. One set of
+ * registers is reused for all matches and $~ is left untouched.
+ *
+ *   mmap.scan_offsets(/\d{3}-\d{4}/) { |b, e| numbers << mmap[b...e] }
+ *   mmap.scan_offsets(/user=(?<id>\w+)/, :id).count
  */
 static VALUE
-rb_cMmap_count(int argc, VALUE *argv, VALUE self)
+rb_cMmap_scan_offsets(int argc, VALUE *argv, VALUE self)
+{
+  mmap_scan_offsets_t scan;
+  VALUE pat, group;
+  regex_t *reg;
+
+  RETURN_ENUMERATOR(self, argc, argv);
+  rb_scan_args(argc, argv, "11", &pat, &group);
+  pat = rb_convert_type(pat, T_REGEXP, "Regexp", "to_regexp");
+  reg = RREGEXP_PTR(pat);
+
+  MEMZERO(&scan, mmap_scan_offsets_t, 1);
+  scan.self = self;
+  scan.pat = pat;
+  if (FIXNUM_P(group)) {
+    scan.group = FIX2LONG(group);
+    if (scan.group < 0 || scan.group > onig_number_of_captures(reg)) {
+      rb_raise(rb_eIndexError, "index %ld out of regexp", scan.group);
+    }
+  }
+  else if (!NIL_P(group)) {
+    VALUE name = rb_sym2str(rb_to_symbol(group));
+
+    scan.group = onig_name_to_backref_number(reg, (const OnigUChar *)RSTRING_PTR(name),
+                                             (const OnigUChar *)RSTRING_END(name), NULL);
+    if (scan.group < 1) {
+      rb_raise(rb_eIndexError, "undefined group name reference: %"PRIsVALUE, name);
+    }
+  }
+  rb_ensure(mmap_scan_offsets, (VALUE)&scan, mmap_scan_offsets_free, (VALUE)&scan);
+  RB_GC_GUARD(pat);
+  return self;
+}
+
+static VALUE
+mmap_unpin(VALUE self)
 {
-  return mmap_bang_initialize(self, MMAP_RUBY_ORIGIN, rb_intern("count"), argc, argv);
+  mmap_t *mmap;
+
+  TypedData_Get_Struct(self, mmap_t, &mmap_type, mmap);
+  mmap->busy--;
+  return Qnil;
 }
 
 /*
- * call-seq:
- *   sum(bits = 16) -> integer
- *
- * Returns a checksum for the mapped memory content.
+ * Yields with the map pinned for #parallel_scan: it can't be resized or
+ * unmapped until the block returns, so #scan_chunk strings stay valid.
+ * Only frozen or read-only maps may be pinned, which keeps the chunks
+ * searched by the workers and the merge pass consistent.
  */
 static VALUE
-rb_cMmap_sum(int argc, VALUE *argv, VALUE self)
+rb_cMmap_pinned(VALUE self)
+{
+  mmap_t *mmap;
+
+  GET_MMAP(self, mmap, 0);
+  if (!OBJ_FROZEN(self) && (mmap->pmode & PROT_WRITE)) {
+    rb_raise(rb_eIOError, "parallel_scan needs a frozen or read-only map");
+  }
+  mmap->busy++;
+  return rb_ensure(rb_yield, self, mmap_unpin, self);
+}
+
+/*
+ * Returns a frozen String over +length+ bytes of the pinned map at
+ * +offset+, without copying them. Being frozen, it is shareable and goes
+ * to a Ractor by reference.
+ */
+static VALUE
+rb_cMmap_scan_chunk(VALUE self, VALUE voffset, VALUE vlength)
 {
-  return mmap_bang_initialize(self, MMAP_RUBY_ORIGIN, rb_intern("sum"), argc, argv);
+  mmap_t *mmap;
+  size_t off = NUM2SIZET(voffset), len = NUM2SIZET(vlength);
+
+  GET_MMAP(self, mmap, 0);
+  if (!mmap->busy) {
+    rb_raise(rb_eIOError, "map is not pinned");
+  }
+  if (off > mmap->real || len > mmap->real - off) {
+    rb_raise(rb_eIndexError, "range %zu, %zu out of map", off, len);
+  }
+  return rb_obj_freeze(rb_str_new_static((const char *)mmap->addr + off, (long)len));
 }
 
 /*
@@ -1261,6 +6493,7 @@ mmap_cat(VALUE self, const char *ptr, long len)
       mmap_unlock(mmap);
       rb_raise(rb_eTypeError, "can't change the size of a fixed map");
     }
+    mmap_check_write(mmap, mmap->real, len);
 
     mmap_realloc(mmap, mmap->real + len);
 
@@ -1269,6 +6502,7 @@ mmap_cat(VALUE self, const char *ptr, long len)
       if (poffset >= 0) ptr = sptr + poffset;
       memcpy(sptr + mmap->real, ptr, len);
     }
+    mmap_touch(mmap, mmap->real, len);
     mmap->real += len;
     mmap_unlock(mmap);
   }
@@ -1313,7 +6547,8 @@ get_pat(VALUE pat)
       break;
 
     case T_STRING:
-      pat = rb_reg_regcomp(pat);
+      /* Strings match literally, as they do for String#sub! and #gsub!. */
+      pat = rb_reg_regcomp(rb_reg_quote(pat));
       break;
 
     default:
@@ -1409,6 +6644,8 @@ mmap_sub_bang_int(VALUE data)
     memcpy(RSTRING_PTR(str) + start + regs->beg[0],
            RSTRING_PTR(repl), RSTRING_LEN(repl));
     mmap->real += RSTRING_LEN(repl) - plen;
+    mmap_touch(mmap, start + regs->beg[0],
+               RSTRING_LEN(repl) != plen ? mmap->real - (start + regs->beg[0]) : (size_t)plen);
 
     res = obj;
   }
@@ -1424,6 +6661,7 @@ mmap_sub_bang_int(VALUE data)
  *
  * Performs substitution on the mapped memory. Returns +self+ if a substitution
  * was made, or +nil+ if no substitution occurred.
+ * A String +pattern+ is matched literally, as String#sub! does.
  */
 static VALUE
 rb_cMmap_sub_bang(int argc, VALUE *argv, VALUE self)
@@ -1437,6 +6675,7 @@ rb_cMmap_sub_bang(int argc, VALUE *argv, VALUE self)
   bang_st.obj = self;
 
   GET_MMAP(self, mmap, MMAP_RUBY_MODIFY);
+  mmap_check_write(mmap, 0, mmap->real);
   if (mmap->flag & MMAP_RUBY_IPC) {
     mmap_lock(mmap, Qtrue);
     res = rb_ensure(mmap_sub_bang_int, (VALUE)&bang_st, mmap_vunlock, self);
@@ -1445,7 +6684,151 @@ rb_cMmap_sub_bang(int argc, VALUE *argv, VALUE self)
     res = mmap_sub_bang_int((VALUE)&bang_st);
   }
 
-  return res;
+  return res;
+}
+
+/*
+ * gsub! runs in two passes. The first one collects the span of every
+ * match and its replacement without touching the map; the second one
+ * rewrites the map in a single forward pass, in place when no replacement
+ * is longer than its match and through an anonymous scratch region
+ * otherwise. The map grows through mmap_realloc like any other write.
+ */
+typedef struct {
+  long beg;
+  long mlen;
+  long rlen;
+} mmap_gsub_span;
+
+typedef struct {
+  VALUE spans;
+  VALUE repl;
+  const char *constant;
+  long count;
+  long delta;
+  int grows;
+} mmap_gsub;
+
+static void
+mmap_gsub_push(mmap_gsub *gsub, long beg, long mlen, const char *rptr, long rlen)
+{
+  mmap_gsub_span span;
+
+  span.beg = beg;
+  span.mlen = mlen;
+  span.rlen = rlen;
+  rb_str_buf_cat(gsub->spans, (const char *)&span, sizeof(span));
+  if (!gsub->constant) {
+    rb_str_buf_cat(gsub->repl, rptr, rlen);
+  }
+  gsub->count++;
+  gsub->delta += rlen - mlen;
+  if (rlen > mlen) gsub->grows = 1;
+}
+
+/* Collects the non-overlapping occurrences of the literal +needle+. */
+static void
+mmap_gsub_literal(mmap_gsub *gsub, const char *ptr, long len, VALUE needle, VALUE repl)
+{
+  const char *n = RSTRING_PTR(needle), *hit;
+  long nlen = RSTRING_LEN(needle), rlen = RSTRING_LEN(repl), pos = 0;
+
+  while (len - pos >= nlen) {
+    hit = mmap_search(ptr + pos, len - pos, n, nlen);
+    if (!hit) break;
+    mmap_gsub_push(gsub, hit - ptr, nlen, NULL, rlen);
+    pos = hit - ptr + nlen;
+  }
+}
+
+/* Collects the matches of +pat+, yielding them to the block when +iter+. */
+static VALUE
+mmap_gsub_regexp(mmap_gsub *gsub, mmap_t *mmap, VALUE str, VALUE pat, VALUE repl, int iter)
+{
+  VALUE match = Qnil, val;
+  struct re_registers *regs;
+  const char *ptr = RSTRING_PTR(str);
+  long beg, offset, len = RSTRING_LEN(str);
+  int start;
+
+  beg = rb_reg_search(pat, str, 0, 0);
+  while (beg >= 0) {
+    start = mmap_correct_backref();
+    match = rb_backref_get();
+    regs = RMATCH_REGS(match);
+
+    if (iter) {
+      rb_match_busy(match);
+      val = rb_obj_as_string(rb_yield(rb_reg_nth_match(0, match)));
+      if (mmap->addr != ptr || (long)mmap->real != len) {
+        rb_raise(rb_eRuntimeError, "mmap modified");
+      }
+      rb_backref_set(match);
+    }
+    else if (gsub->constant) {
+      val = repl;
+    }
+    else {
+      VALUE substr = rb_str_subseq(str, start + regs->beg[0], regs->end[0] - regs->beg[0]);
+      val = rb_reg_regsub(repl, substr, regs, pat);
+    }
+
+    mmap_gsub_push(gsub, start + regs->beg[0], regs->end[0] - regs->beg[0],
+                   RSTRING_PTR(val), RSTRING_LEN(val));
+
+    offset = start + regs->end[0];
+    if (regs->beg[0] == regs->end[0]) offset++;
+    if (offset > len) break;
+    beg = rb_reg_search(pat, str, offset, 0);
+  }
+  return match;
+}
+
+/*
+ * Writes the bytes from the first match on, with every match replaced, to
+ * +dst+. +dst+ may be the map itself when no replacement grows.
+ */
+static void
+mmap_gsub_apply(mmap_gsub *gsub, const char *src, long len, char *dst)
+{
+  const mmap_gsub_span *span = (const mmap_gsub_span *)RSTRING_PTR(gsub->spans);
+  const char *rptr = gsub->constant ? gsub->constant : RSTRING_PTR(gsub->repl);
+  long i, from = span[0].beg, seg;
+
+  for (i = 0; i < gsub->count; i++) {
+    seg = span[i].beg - from;
+    if (seg) {
+      memmove(dst, src + from, seg);
+      dst += seg;
+    }
+    memcpy(dst, rptr, span[i].rlen);
+    dst += span[i].rlen;
+    if (!gsub->constant) rptr += span[i].rlen;
+    from = span[i].beg + span[i].mlen;
+  }
+  if (len > from) {
+    memmove(dst, src + from, len - from);
+  }
+}
+
+static char *
+mmap_gsub_scratch(size_t len)
+{
+  void *scratch = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+
+  if (scratch == MAP_FAILED) {
+    rb_raise(rb_eNoMemError, "can't allocate %zu bytes for gsub!", len);
+  }
+  return scratch;
+}
+
+static VALUE
+mmap_gsub_realloc(VALUE data)
+{
+  mmap_st *st_mm = (mmap_st *)data;
+
+  mmap_realloc(st_mm->mmap, st_mm->len);
+  return Qnil;
 }
 
 static VALUE
@@ -1455,11 +6838,11 @@ mmap_gsub_bang_int(VALUE data)
   int argc = bang_st->argc;
   VALUE *argv = bang_st->argv;
   VALUE obj = bang_st->obj;
-  VALUE pat, val, repl = Qnil, match, str;
-  struct re_registers *regs;
-  long beg, offset;
-  int start, iter = 0;
-  long plen;
+  VALUE pat, repl = Qnil, match = Qnil, str;
+  mmap_gsub gsub;
+  size_t real, newlen, first;
+  char *scratch;
+  int iter = 0;
   mmap_t *mmap;
 
   if (argc == 1 && rb_block_given_p()) {
@@ -1467,6 +6850,8 @@ mmap_gsub_bang_int(VALUE data)
   }
   else if (argc == 2) {
     repl = rb_str_to_str(argv[1]);
+    /* The replacement may live in the map itself. */
+    repl = rb_str_new(RSTRING_PTR(repl), RSTRING_LEN(repl));
   }
   else {
     rb_raise(rb_eArgError, "wrong # of arguments(%d for 2)", argc);
@@ -1475,63 +6860,63 @@ mmap_gsub_bang_int(VALUE data)
   GET_MMAP(obj, mmap, MMAP_RUBY_MODIFY);
   str = mmap_str(obj, MMAP_RUBY_MODIFY | MMAP_RUBY_ORIGIN);
 
-  pat = get_pat(argv[0]);
-  offset = 0;
-  beg = rb_reg_search(pat, str, 0, 0);
-  if (beg < 0) {
+  MEMZERO(&gsub, mmap_gsub, 1);
+  gsub.spans = rb_str_buf_new(0);
+  gsub.repl = rb_str_buf_new(0);
+  if (!iter && !memchr(RSTRING_PTR(repl), '\\', RSTRING_LEN(repl))) {
+    gsub.constant = RSTRING_PTR(repl);
+  }
+
+  pat = argv[0];
+  if (RB_TYPE_P(pat, T_STRING) && gsub.constant && RSTRING_LEN(pat) > 0) {
+    mmap_gsub_literal(&gsub, RSTRING_PTR(str), RSTRING_LEN(str), pat, repl);
+  }
+  else {
+    match = mmap_gsub_regexp(&gsub, mmap, str, get_pat(pat), repl, iter);
+  }
+  if (gsub.count == 0) {
     RB_GC_GUARD(str);
     return Qnil;
   }
 
-  while (beg >= 0) {
-    start = mmap_correct_backref();
-    match = rb_backref_get();
-    regs = RMATCH_REGS(match);
+  real = mmap->real;
+  newlen = real + gsub.delta;
+  first = ((const mmap_gsub_span *)RSTRING_PTR(gsub.spans))->beg;
+  if (gsub.delta && (mmap->flag & MMAP_RUBY_FIXED)) {
+    rb_raise(rb_eTypeError, "can't change the size of a fixed map");
+  }
 
-    if (iter) {
-      rb_match_busy(match);
-      val = rb_obj_as_string(rb_yield(rb_reg_nth_match(0, match)));
-      rb_backref_set(match);
-    }
-    else {
-      VALUE substr = rb_str_subseq(str, start + regs->beg[0], regs->end[0] - regs->beg[0]);
-      val = rb_reg_regsub(repl, substr, regs, match);
+  if (!gsub.grows) {
+    mmap_gsub_apply(&gsub, mmap->addr, real, (char *)mmap->addr + first);
+  }
+  else {
+    if (newlen > real) {
+      mmap_check_write(mmap, real, newlen - real);
     }
-
-    plen = regs->end[0] - regs->beg[0];
-
-    if (RSTRING_LEN(val) != plen) {
-      if (mmap->flag & MMAP_RUBY_FIXED) {
-        rb_raise(rb_eTypeError, "can't change the size of a fixed map");
-      }
-
-      if ((mmap->real + RSTRING_LEN(val) - plen) > mmap->len) {
-        rb_raise(rb_eTypeError, "replacement would exceed mmap size");
+    scratch = mmap_gsub_scratch(newlen - first);
+    mmap_gsub_apply(&gsub, mmap->addr, real, scratch);
+    if (newlen > mmap->len) {
+      int status = 0;
+      mmap_st st_mm;
+
+      st_mm.mmap = mmap;
+      st_mm.len = newlen;
+      rb_protect(mmap_gsub_realloc, (VALUE)&st_mm, &status);
+      if (status) {
+        munmap(scratch, newlen - first);
+        rb_jump_tag(status);
       }
-
-      memmove(RSTRING_PTR(str) + start + regs->beg[0] + RSTRING_LEN(val),
-              RSTRING_PTR(str) + start + regs->beg[0] + plen,
-              RSTRING_LEN(str) - start - regs->beg[0] - plen);
-    }
-
-    memcpy(RSTRING_PTR(str) + start + regs->beg[0],
-           RSTRING_PTR(val), RSTRING_LEN(val));
-    mmap->real += RSTRING_LEN(val) - plen;
-
-    if (regs->beg[0] == regs->end[0]) {
-      offset = start + regs->end[0] + 1;
-      offset += RSTRING_LEN(val) - plen;
-    }
-    else {
-      offset = start + regs->end[0] + RSTRING_LEN(val) - plen;
     }
-
-    if (offset > RSTRING_LEN(str)) break;
-    beg = rb_reg_search(pat, str, offset, 0);
+    memcpy((char *)mmap->addr + first, scratch, newlen - first);
+    munmap(scratch, newlen - first);
   }
+  mmap->real = newlen;
 
-  rb_backref_set(match);
+  if (!NIL_P(match)) rb_backref_set(match);
   RB_GC_GUARD(str);
+  RB_GC_GUARD(repl);
+  RB_GC_GUARD(gsub.spans);
+  RB_GC_GUARD(gsub.repl);
   return obj;
 }
 
@@ -1542,6 +6927,7 @@ mmap_gsub_bang_int(VALUE data)
  *
  * Performs global substitution on the mapped memory. Returns +self+ if any
  * substitutions were made, or +nil+ if no substitutions occurred.
+ * A String +pattern+ is matched literally, as String#gsub! does.
  */
 static VALUE
 rb_cMmap_gsub_bang(int argc, VALUE *argv, VALUE self)
@@ -1555,6 +6941,7 @@ rb_cMmap_gsub_bang(int argc, VALUE *argv, VALUE self)
   bang_st.obj = self;
 
   GET_MMAP(self, mmap, MMAP_RUBY_MODIFY);
+  mmap_check_write(mmap, 0, mmap->real);
   if (mmap->flag & MMAP_RUBY_IPC) {
     mmap_lock(mmap, Qtrue);
     res = rb_ensure(mmap_gsub_bang_int, (VALUE)&bang_st, mmap_vunlock, self);
@@ -1562,6 +6949,9 @@ rb_cMmap_gsub_bang(int argc, VALUE *argv, VALUE self)
   else {
     res = mmap_gsub_bang_int((VALUE)&bang_st);
   }
+  if (!NIL_P(res)) {
+    mmap_touch(mmap, 0, mmap->real);
+  }
 
   return res;
 }
@@ -1614,6 +7004,7 @@ rb_cMmap_upcase_bang(VALUE self)
   bang_st.obj = self;
 
   GET_MMAP(self, mmap, MMAP_RUBY_MODIFY);
+  mmap_check_write(mmap, 0, mmap->real);
   if (mmap->flag & MMAP_RUBY_IPC) {
     mmap_lock(mmap, Qtrue);
     res = rb_ensure(mmap_upcase_bang_int, (VALUE)&bang_st, mmap_vunlock, self);
@@ -1621,6 +7012,9 @@ rb_cMmap_upcase_bang(VALUE self)
   else {
     res = mmap_upcase_bang_int((VALUE)&bang_st);
   }
+  if (!NIL_P(res)) {
+    mmap_touch(mmap, 0, mmap->real);
+  }
 
   return res;
 }
@@ -1673,6 +7067,7 @@ rb_cMmap_downcase_bang(VALUE self)
   bang_st.obj = self;
 
   GET_MMAP(self, mmap, MMAP_RUBY_MODIFY);
+  mmap_check_write(mmap, 0, mmap->real);
   if (mmap->flag & MMAP_RUBY_IPC) {
     mmap_lock(mmap, Qtrue);
     res = rb_ensure(mmap_downcase_bang_int, (VALUE)&bang_st, mmap_vunlock, self);
@@ -1680,6 +7075,9 @@ rb_cMmap_downcase_bang(VALUE self)
   else {
     res = mmap_downcase_bang_int((VALUE)&bang_st);
   }
+  if (!NIL_P(res)) {
+    mmap_touch(mmap, 0, mmap->real);
+  }
 
   return res;
 }
@@ -1739,6 +7137,7 @@ rb_cMmap_capitalize_bang(VALUE self)
   bang_st.obj = self;
 
   GET_MMAP(self, mmap, MMAP_RUBY_MODIFY);
+  mmap_check_write(mmap, 0, mmap->real);
   if (mmap->flag & MMAP_RUBY_IPC) {
     mmap_lock(mmap, Qtrue);
     res = rb_ensure(mmap_capitalize_bang_int, (VALUE)&bang_st, mmap_vunlock, self);
@@ -1746,6 +7145,9 @@ rb_cMmap_capitalize_bang(VALUE self)
   else {
     res = mmap_capitalize_bang_int((VALUE)&bang_st);
   }
+  if (!NIL_P(res)) {
+    mmap_touch(mmap, 0, mmap->real);
+  }
 
   return res;
 }
@@ -1801,6 +7203,7 @@ rb_cMmap_swapcase_bang(VALUE self)
   bang_st.obj = self;
 
   GET_MMAP(self, mmap, MMAP_RUBY_MODIFY);
+  mmap_check_write(mmap, 0, mmap->real);
   if (mmap->flag & MMAP_RUBY_IPC) {
     mmap_lock(mmap, Qtrue);
     res = rb_ensure(mmap_swapcase_bang_int, (VALUE)&bang_st, mmap_vunlock, self);
@@ -1808,6 +7211,9 @@ rb_cMmap_swapcase_bang(VALUE self)
   else {
     res = mmap_swapcase_bang_int((VALUE)&bang_st);
   }
+  if (!NIL_P(res)) {
+    mmap_touch(mmap, 0, mmap->real);
+  }
 
   return res;
 }
@@ -1859,6 +7265,7 @@ rb_cMmap_reverse_bang(VALUE self)
   bang_st.obj = self;
 
   GET_MMAP(self, mmap, MMAP_RUBY_MODIFY);
+  mmap_check_write(mmap, 0, mmap->real);
   if (mmap->flag & MMAP_RUBY_IPC) {
     mmap_lock(mmap, Qtrue);
     res = rb_ensure(mmap_reverse_bang_int, (VALUE)&bang_st, mmap_vunlock, self);
@@ -1866,6 +7273,9 @@ rb_cMmap_reverse_bang(VALUE self)
   else {
     res = mmap_reverse_bang_int((VALUE)&bang_st);
   }
+  if (!NIL_P(res)) {
+    mmap_touch(mmap, 0, mmap->real);
+  }
 
   return res;
 }
@@ -1885,6 +7295,7 @@ rb_cMmap_strip_bang(VALUE self)
 
   GET_MMAP(self, mmap, MMAP_RUBY_MODIFY);
   mmap_lock(mmap, Qtrue);
+  mmap_check_write(mmap, 0, mmap->real);
   s = (char *)mmap->addr;
   e = t = s + mmap->real;
   while (s < t && ISSPACE(*s)) s++;
@@ -1907,6 +7318,9 @@ rb_cMmap_strip_bang(VALUE self)
   else {
     self = Qnil;
   }
+  if (!NIL_P(self)) {
+    mmap_touch(mmap, 0, mmap->real);
+  }
   mmap_unlock(mmap);
   return self;
 }
@@ -2119,6 +7533,7 @@ rb_cMmap_delete_bang(int argc, VALUE *argv, VALUE self)
   bang_st.obj = self;
 
   GET_MMAP(self, mmap, MMAP_RUBY_MODIFY);
+  mmap_check_write(mmap, 0, mmap->real);
   if (mmap->flag & MMAP_RUBY_IPC) {
     mmap_lock(mmap, Qtrue);
     res = rb_ensure(mmap_delete_bang_int, (VALUE)&bang_st, mmap_vunlock, self);
@@ -2126,6 +7541,9 @@ rb_cMmap_delete_bang(int argc, VALUE *argv, VALUE self)
   else {
     res = mmap_delete_bang_int((VALUE)&bang_st);
   }
+  if (!NIL_P(res)) {
+    mmap_touch(mmap, 0, mmap->real);
+  }
 
   return res;
 }
@@ -2206,6 +7624,7 @@ rb_cMmap_squeeze_bang(int argc, VALUE *argv, VALUE self)
   bang_st.obj = self;
 
   GET_MMAP(self, mmap, MMAP_RUBY_MODIFY);
+  mmap_check_write(mmap, 0, mmap->real);
   if (mmap->flag & MMAP_RUBY_IPC) {
     mmap_lock(mmap, Qtrue);
     res = rb_ensure(mmap_squeeze_bang_int, (VALUE)&bang_st, mmap_vunlock, self);
@@ -2213,6 +7632,9 @@ rb_cMmap_squeeze_bang(int argc, VALUE *argv, VALUE self)
   else {
     res = mmap_squeeze_bang_int((VALUE)&bang_st);
   }
+  if (!NIL_P(res)) {
+    mmap_touch(mmap, 0, mmap->real);
+  }
 
   return res;
 }
@@ -2221,116 +7643,558 @@ rb_cMmap_squeeze_bang(int argc, VALUE *argv, VALUE self)
  * call-seq:
  *   split(sep = $/, limit = 0) -> array
  *
- * Splits the mapped memory into an array of strings and returns this array.
- * The +sep+ parameter specifies the separator pattern (String or Regexp).
- * The +limit+ parameter controls the number of splits.
+ * Splits the mapped memory into an array of strings and returns this array.
+ * The +sep+ parameter specifies the separator pattern (String or Regexp).
+ * The +limit+ parameter controls the number of splits.
+ */
+static VALUE
+rb_cMmap_split(int argc, VALUE *argv, VALUE self)
+{
+  return mmap_bang_initialize(self, MMAP_RUBY_ORIGIN, rb_intern("split"), argc, argv);
+}
+
+/*
+ * call-seq:
+ *   crypt(salt) -> string
+ *
+ * Encrypts the mapped memory using the standard Unix crypt function with
+ * the given +salt+. Returns the encrypted string.
+ */
+static VALUE
+rb_cMmap_crypt(VALUE self, VALUE salt)
+{
+  return mmap_bang_initialize(self, MMAP_RUBY_ORIGIN, rb_intern("crypt"), 1, &salt);
+}
+
+/*
+ * Parses the optional range of the ranged madvise, mlock, munlock and
+ * mprotect: nothing, a Range, or an offset and a length. Returns 0 for the
+ * whole map, else 1 with [*beg, *end) widened to page boundaries, relative
+ * to MMAP_BASE.
+ */
+static int
+mmap_page_range(mmap_t *mmap, int argc, VALUE *argv, size_t *beg, size_t *end)
+{
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  long off, len;
+
+  if (argc == 0) return 0;
+  if (argc == 1) {
+    if (!rb_obj_is_kind_of(argv[0], rb_cRange)) {
+      rb_raise(rb_eTypeError, "expected a Range");
+    }
+    rb_range_beg_len(argv[0], &off, &len, (long)mmap->len, 1);
+  }
+  else if (argc == 2) {
+    off = NUM2LONG(argv[0]);
+    len = NUM2LONG(argv[1]);
+    if (off < 0 || len < 0 || (size_t)off > mmap->len || (size_t)len > mmap->len - off) {
+      rb_raise(rb_eIndexError, "range %ld, %ld out of map", off, len);
+    }
+  }
+  else {
+    rb_error_arity(argc, 0, 2);
+  }
+  off += mmap->shift;
+  *beg = (size_t)off & ~(page - 1);
+  *end = ((size_t)(off + len) + page - 1) & ~(page - 1);
+  return 1;
+}
+
+static int
+mmap_mlock_range(void *addr, size_t len, int on_fault)
+{
+  if (on_fault) {
+#if defined(HAVE_MLOCK2) && defined(MLOCK_ONFAULT)
+    return mlock2(addr, len, MLOCK_ONFAULT);
+#else
+    rb_raise(rb_eNotImpError, "mlock2(MLOCK_ONFAULT) is not available");
+#endif
+  }
+  return mlock(addr, len);
+}
+
+static int
+mmap_advice_kind(int advice, int *keep)
+{
+  *keep = 1;
+  switch (advice) {
+    case MADV_NORMAL:
+      *keep = 0;
+      /* fall through */
+    case MADV_RANDOM:
+    case MADV_SEQUENTIAL:
+      return MMAP_RANGE_ACCESS;
+#ifdef MADV_HUGEPAGE
+    case MADV_HUGEPAGE:
+    case MADV_NOHUGEPAGE:
+      return MMAP_RANGE_HUGE;
+#endif
+#ifdef MADV_DONTDUMP
+    case MADV_DODUMP:
+      *keep = 0;
+      /* fall through */
+    case MADV_DONTDUMP:
+      return MMAP_RANGE_DUMP;
+#endif
+#ifdef MADV_DONTFORK
+    case MADV_DOFORK:
+      *keep = 0;
+      /* fall through */
+    case MADV_DONTFORK:
+      return MMAP_RANGE_FORK;
+#endif
+    default:
+      return -1;
+  }
+}
+
+/*
+ * Applies the recorded per-range state again once the mapping has been
+ * resized, so that it survives a move or a fallback remap.
+ */
+static void
+mmap_ranges_apply(mmap_t *mmap)
+{
+  mmap_range_t *r;
+  char *addr;
+  size_t len;
+  long i;
+  int ret;
+
+  for (i = 0; i < mmap->nranges; i++) {
+    r = &mmap->ranges[i];
+    if (r->beg >= MMAP_MAPLEN(mmap)) continue;
+    addr = MMAP_BASE(mmap) + r->beg;
+    len = (r->end < MMAP_MAPLEN(mmap) ? r->end : MMAP_MAPLEN(mmap)) - r->beg;
+    switch (r->kind) {
+      case MMAP_RANGE_LOCK:
+        ret = mmap_mlock_range(addr, len, r->arg);
+        break;
+      case MMAP_RANGE_PROT:
+        ret = mprotect(addr, len, r->arg);
+        break;
+      default:
+        ret = madvise(addr, len, r->arg);
+        break;
+    }
+    if (ret == -1) {
+      rb_raise(rb_eArgError, "can't restore the state of range %zu...%zu (%d)", r->beg, r->end, errno);
+    }
+  }
+}
+
+static int
+mmap_parse_prot(VALUE mode)
+{
+  const char *smode;
+
+  if (TYPE(mode) == T_STRING) {
+    smode = StringValuePtr(mode);
+    if (strcmp(smode, "r") == 0) {
+      return PROT_READ;
+    }
+    else if (strcmp(smode, "w") == 0) {
+      return PROT_WRITE;
+    }
+    else if (strcmp(smode, "rw") == 0 || strcmp(smode, "wr") == 0) {
+      return PROT_READ | PROT_WRITE;
+    }
+    rb_raise(rb_eArgError, "invalid mode %s", smode);
+  }
+  return NUM2INT(mode);
+}
+
+/*
+ * call-seq:
+ *   mprotect(mode) -> self
+ *   mprotect(mode, range) -> self
+ *   mprotect(mode, offset, length) -> self
+ *   protect(...) -> self
+ *
+ * Changes the memory protection mode. The +mode+ value must be "r", "w", "rw",
+ * or an integer representing protection flags. Returns +self+.
+ *
+ * Given a byte +range+, or +offset+ and +length+, only the pages covering it
+ * change protection, and the change is kept when the map is resized. Writes
+ * through this object into a range made read-only raise IOError.
+ */
+static VALUE
+rb_cMmap_mprotect(int argc, VALUE *argv, VALUE self)
+{
+  mmap_t *mmap;
+  int ret, pmode;
+  size_t beg, end;
+
+  rb_check_arity(argc, 1, 3);
+  GET_MMAP(self, mmap, 0);
+  mmap_check_owned(mmap);
+  pmode = mmap_parse_prot(argv[0]);
+
+  if ((pmode & PROT_WRITE) && RB_OBJ_FROZEN(self)) {
+    rb_check_frozen(self);
+  }
+
+  if (mmap_page_range(mmap, argc - 1, argv + 1, &beg, &end)) {
+    if ((ret = mprotect(MMAP_BASE(mmap) + beg, end - beg, pmode | PROT_READ)) != 0) {
+      rb_raise(rb_eArgError, "mprotect(%d)", errno);
+    }
+    mmap_ranges_set(mmap, MMAP_RANGE_PROT, beg, end, pmode | PROT_READ,
+                    (pmode | PROT_READ) != (mmap->pmode | PROT_READ));
+    return self;
+  }
+
+  if ((ret = mprotect(MMAP_BASE(mmap), MMAP_MAPLEN(mmap), pmode | PROT_READ)) != 0) {
+    rb_raise(rb_eArgError, "mprotect(%d)", ret);
+  }
+  mmap_ranges_clear(mmap, MMAP_RANGE_PROT);
+
+  mmap->pmode = pmode;
+  if (pmode & PROT_READ) {
+    if (pmode & PROT_WRITE) {
+      mmap->smode = O_RDWR;
+    }
+    else {
+      mmap->smode = O_RDONLY;
+      self = rb_obj_freeze(self);
+    }
+  }
+  else if (pmode & PROT_WRITE) {
+    mmap->flag |= MMAP_RUBY_FIXED;
+    mmap->smode = O_WRONLY;
+  }
+
+  return self;
+}
+
+/*
+ * call-seq:
+ *   madvise(advice) -> nil
+ *   madvise(advice, range) -> nil
+ *   madvise(advice, offset, length) -> nil
+ *   advise(...) -> nil
+ *
+ * Gives advice to the kernel about how the mapped memory will be accessed.
+ * The +advice+ parameter can be one of the following constants:
+ * MADV_NORMAL, MADV_RANDOM, MADV_SEQUENTIAL, MADV_WILLNEED, MADV_DONTNEED,
+ * and, where the system has them, MADV_COLD, MADV_PAGEOUT, MADV_FREE,
+ * MADV_HUGEPAGE, MADV_NOHUGEPAGE, MADV_DONTDUMP, MADV_DODUMP, MADV_DONTFORK,
+ * MADV_DOFORK, MADV_POPULATE_READ or MADV_POPULATE_WRITE.
+ *
+ * Given a byte +range+, or +offset+ and +length+, the advice only applies
+ * to the pages covering it. Advice that sets a lasting property of the
+ * pages (access pattern, huge pages, core dumps, fork) is kept when the map
+ * is resized; one-shot advice such as MADV_PAGEOUT is not.
+ */
+static VALUE
+rb_cMmap_madvise(int argc, VALUE *argv, VALUE self)
+{
+  mmap_t *mmap;
+  size_t beg, end;
+  int advice, kind, keep;
+
+  rb_check_arity(argc, 1, 3);
+  GET_MMAP(self, mmap, 0);
+  mmap_check_owned(mmap);
+  advice = NUM2INT(argv[0]);
+  kind = mmap_advice_kind(advice, &keep);
+
+  if (mmap_page_range(mmap, argc - 1, argv + 1, &beg, &end)) {
+    if (madvise(MMAP_BASE(mmap) + beg, end - beg, advice) == -1) {
+      rb_raise(rb_eTypeError, "madvise(%d)", errno);
+    }
+    if (kind >= 0) {
+      mmap_ranges_set(mmap, kind, beg, end, advice, keep);
+    }
+    return Qnil;
+  }
+
+  if (madvise(MMAP_BASE(mmap), MMAP_MAPLEN(mmap), advice) == -1) {
+    rb_raise(rb_eTypeError, "madvise(%d)", errno);
+  }
+  mmap->advice = advice;
+  if (kind >= 0) {
+    mmap_ranges_clear(mmap, kind);
+  }
+  return Qnil;
+}
+
+#if defined(__linux__) && !defined(MADV_POPULATE_READ)
+#define MADV_POPULATE_READ  22
+#define MADV_POPULATE_WRITE 23
+#endif
+
+#define MMAP_WARM_CHUNK ((size_t)2 << 20)
+
+/*
+ * Faults +len+ bytes at +addr+ in, a chunk at a time so that +cancel+ is
+ * honoured promptly and +done+ can report progress. MADV_POPULATE_READ and
+ * MADV_POPULATE_WRITE (Linux 5.14) do it in the kernel; elsewhere one byte
+ * per page is read. Runs without the GVL.
+ */
+static void
+mmap_populate(char *addr, size_t len, int write, int *cancel, size_t *done)
+{
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t off, n, i;
+  int advice = 0;
+  volatile char sink;
+
+#ifdef MADV_POPULATE_READ
+  advice = write ? MADV_POPULATE_WRITE : MADV_POPULATE_READ;
+#else
+  (void)write;
+#endif
+  for (off = 0; off < len; off += n) {
+    if (cancel && __atomic_load_n(cancel, __ATOMIC_RELAXED)) break;
+    n = len - off < MMAP_WARM_CHUNK ? len - off : MMAP_WARM_CHUNK;
+    if (advice && madvise(addr + off, n, advice) == -1) {
+      if (errno != EINVAL && errno != ENOSYS) break;
+      advice = 0;
+    }
+    if (!advice) {
+      for (i = 0; i < n; i += page) {
+        sink = addr[off + i];
+      }
+    }
+    if (done) __atomic_store_n(done, off + n, __ATOMIC_RELAXED);
+  }
+  (void)sink;
+}
+
+static void *
+mmap_warm_thread(void *data)
+{
+  mmap_warm_t *warm = (mmap_warm_t *)data;
+
+  mmap_populate(warm->addr, warm->len, warm->write, &warm->cancel, &warm->done);
+  pthread_mutex_lock(&warm->lock);
+  warm->state = MMAP_WARM_FINISHED;
+  pthread_cond_broadcast(&warm->cond);
+  pthread_mutex_unlock(&warm->lock);
+  return NULL;
+}
+
+/*
+ * Cancels and joins the warming thread. Must run before the mapping is
+ * moved or unmapped. A forked child never inherited the thread.
+ */
+static void
+mmap_warm_stop(mmap_t *mmap)
+{
+  mmap_warm_t *warm = &mmap->warm;
+
+  if (warm->state == MMAP_WARM_IDLE) return;
+  if (warm->pid == getpid()) {
+    __atomic_store_n(&warm->cancel, 1, __ATOMIC_RELAXED);
+    pthread_join(warm->thread, NULL);
+  }
+  else {
+    pthread_mutex_init(&warm->lock, NULL);
+    pthread_cond_init(&warm->cond, NULL);
+  }
+  warm->state = MMAP_WARM_IDLE;
+}
+
+static void *
+mmap_warm_nogvl(void *data)
+{
+  mmap_warm_t *warm = (mmap_warm_t *)data;
+
+  mmap_populate(warm->addr, warm->len, warm->write, &warm->cancel, &warm->done);
+  return NULL;
+}
+
+static void
+mmap_warm_ubf(void *data)
+{
+  mmap_warm_t *warm = (mmap_warm_t *)data;
+
+  __atomic_store_n(&warm->cancel, 1, __ATOMIC_RELAXED);
+}
+
+static void *
+mmap_warm_wait_nogvl(void *data)
+{
+  mmap_warm_t *warm = (mmap_warm_t *)data;
+
+  pthread_mutex_lock(&warm->lock);
+  while (warm->state == MMAP_WARM_RUNNING && !warm->wakeup) {
+    pthread_cond_wait(&warm->cond, &warm->lock);
+  }
+  warm->wakeup = 0;
+  pthread_mutex_unlock(&warm->lock);
+  return NULL;
+}
+
+static void
+mmap_warm_wait_ubf(void *data)
+{
+  mmap_warm_t *warm = (mmap_warm_t *)data;
+
+  pthread_mutex_lock(&warm->lock);
+  warm->wakeup = 1;
+  pthread_cond_broadcast(&warm->cond);
+  pthread_mutex_unlock(&warm->lock);
+}
+
+/*
+ * call-seq:
+ *   warm(range = nil, async: true) -> self
+ *
+ * Faults the pages of +range+ (the whole content by default) into memory
+ * ahead of use, so that first accesses do not pay for page faults.
+ *
+ * With <tt>async: true</tt> the work is done on a background native thread;
+ * see #warm_progress, #warming? and #wait_warm. Starting a new warm-up,
+ * resizing or unmapping cancels the one in progress. With
+ * <tt>async: false</tt> the call returns once the pages are resident, with
+ * the GVL released meanwhile.
  */
 static VALUE
-rb_cMmap_split(int argc, VALUE *argv, VALUE self)
+rb_cMmap_warm(int argc, VALUE *argv, VALUE self)
 {
-  return mmap_bang_initialize(self, MMAP_RUBY_ORIGIN, rb_intern("split"), argc, argv);
+  mmap_t *mmap;
+  mmap_warm_t *warm;
+  VALUE range, opts, async = Qtrue;
+  long beg = 0, len;
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  char *start, *end;
+  sigset_t all, old;
+  int rc;
+
+  rb_scan_args(argc, argv, "01:", &range, &opts);
+  if (!NIL_P(opts)) {
+    async = rb_hash_lookup2(opts, ID2SYM(rb_intern("async")), Qtrue);
+  }
+
+  GET_MMAP(self, mmap, 0);
+  mmap_check_busy(mmap);
+  mmap_warm_stop(mmap);
+  warm = &mmap->warm;
+
+  len = (long)mmap->real;
+  if (!NIL_P(range) && !RTEST(rb_range_beg_len(range, &beg, &len, (long)mmap->real, 1))) {
+    rb_raise(rb_eTypeError, "expected a Range");
+  }
+  start = (char *)((uintptr_t)((char *)mmap->addr + beg) & ~(uintptr_t)(page - 1));
+  end = (char *)mmap->addr + beg + len;
+
+  warm->addr = start;
+  warm->len = len ? (size_t)(end - start) : 0;
+  warm->write = (mmap->flag & MMAP_RUBY_ANON) != 0;
+  warm->done = 0;
+  warm->cancel = 0;
+  warm->wakeup = 0;
+
+  if (!RTEST(async)) {
+    mmap->busy++;
+    rb_thread_call_without_gvl(mmap_warm_nogvl, warm, mmap_warm_ubf, warm);
+    mmap->busy--;
+    rb_thread_check_ints();
+    return self;
+  }
+
+  warm->pid = getpid();
+  warm->state = MMAP_WARM_RUNNING;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  rc = pthread_create(&warm->thread, NULL, mmap_warm_thread, warm);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (rc != 0) {
+    warm->state = MMAP_WARM_IDLE;
+    rb_syserr_fail(rc, "pthread_create()");
+  }
+  return self;
 }
 
 /*
  * call-seq:
- *   crypt(salt) -> string
+ *   warm_progress -> float
  *
- * Encrypts the mapped memory using the standard Unix crypt function with
- * the given +salt+. Returns the encrypted string.
+ * Returns the fraction, between 0.0 and 1.0, of the last #warm range that
+ * has been faulted in.
  */
 static VALUE
-rb_cMmap_crypt(VALUE self, VALUE salt)
+rb_cMmap_warm_progress(VALUE self)
 {
-  return mmap_bang_initialize(self, MMAP_RUBY_ORIGIN, rb_intern("crypt"), 1, &salt);
+  mmap_t *mmap;
+  size_t done;
+
+  GET_MMAP(self, mmap, 0);
+  if (!mmap->warm.len) return DBL2NUM(1.0);
+  done = __atomic_load_n(&mmap->warm.done, __ATOMIC_RELAXED);
+  return DBL2NUM((double)done / (double)mmap->warm.len);
 }
 
 /*
  * call-seq:
- *   mprotect(mode) -> self
- *   protect(mode) -> self
+ *   warming? -> true or false
  *
- * Changes the memory protection mode. The +mode+ value must be "r", "w", "rw",
- * or an integer representing protection flags. Returns +self+.
+ * Returns true while an asynchronous #warm is in progress.
  */
 static VALUE
-rb_cMmap_mprotect(VALUE self, VALUE mode)
+rb_cMmap_warming_p(VALUE self)
 {
   mmap_t *mmap;
-  int ret, pmode;
-  const char *smode;
+  int state;
 
   GET_MMAP(self, mmap, 0);
-  if (TYPE(mode) == T_STRING) {
-    smode = StringValuePtr(mode);
-    if (strcmp(smode, "r") == 0) {
-      pmode = PROT_READ;
-    }
-    else if (strcmp(smode, "w") == 0) {
-      pmode = PROT_WRITE;
-    }
-    else if (strcmp(smode, "rw") == 0 || strcmp(smode, "wr") == 0) {
-      pmode = PROT_READ | PROT_WRITE;
-    }
-    else {
-      rb_raise(rb_eArgError, "invalid mode %s", smode);
-    }
-  }
-  else {
-    pmode = NUM2INT(mode);
-  }
-
-  if ((pmode & PROT_WRITE) && RB_OBJ_FROZEN(self)) {
-    rb_check_frozen(self);
-  }
-
-  if ((ret = mprotect(mmap->addr, mmap->len, pmode | PROT_READ)) != 0) {
-    rb_raise(rb_eArgError, "mprotect(%d)", ret);
-  }
-
-  mmap->pmode = pmode;
-  if (pmode & PROT_READ) {
-    if (pmode & PROT_WRITE) {
-      mmap->smode = O_RDWR;
-    }
-    else {
-      mmap->smode = O_RDONLY;
-      self = rb_obj_freeze(self);
-    }
-  }
-  else if (pmode & PROT_WRITE) {
-    mmap->flag |= MMAP_RUBY_FIXED;
-    mmap->smode = O_WRONLY;
-  }
-
-  return self;
+  pthread_mutex_lock(&mmap->warm.lock);
+  state = mmap->warm.state;
+  pthread_mutex_unlock(&mmap->warm.lock);
+  return state == MMAP_WARM_RUNNING && mmap->warm.pid == getpid() ? Qtrue : Qfalse;
 }
 
 /*
  * call-seq:
- *   madvise(advice) -> nil
- *   advise(advice) -> nil
+ *   wait_warm -> self
  *
- * Gives advice to the kernel about how the mapped memory will be accessed.
- * The +advice+ parameter can be one of the following constants:
- * MADV_NORMAL, MADV_RANDOM, MADV_SEQUENTIAL, MADV_WILLNEED, or MADV_DONTNEED.
+ * Waits, without holding the GVL, for an asynchronous #warm to finish.
  */
 static VALUE
-rb_cMmap_madvise(VALUE self, VALUE advice)
+rb_cMmap_wait_warm(VALUE self)
 {
   mmap_t *mmap;
 
   GET_MMAP(self, mmap, 0);
-  if (madvise(mmap->addr, mmap->len, NUM2INT(advice)) == -1) {
-    rb_raise(rb_eTypeError, "madvise(%d)", errno);
+  while (mmap->warm.state == MMAP_WARM_RUNNING && mmap->warm.pid == getpid()) {
+    rb_thread_call_without_gvl(mmap_warm_wait_nogvl, &mmap->warm, mmap_warm_wait_ubf, &mmap->warm);
+    rb_thread_check_ints();
+    pthread_mutex_lock(&mmap->warm.lock);
+    if (mmap->warm.state == MMAP_WARM_FINISHED) {
+      pthread_mutex_unlock(&mmap->warm.lock);
+      break;
+    }
+    pthread_mutex_unlock(&mmap->warm.lock);
   }
-  mmap->advice = NUM2INT(advice);
-  return Qnil;
+  if (mmap->warm.state == MMAP_WARM_FINISHED) {
+    pthread_join(mmap->warm.thread, NULL);
+    mmap->warm.state = MMAP_WARM_IDLE;
+  }
+  return self;
 }
 
+/*
+ * Reserves room for +len+ bytes. Geometric growth over-reserves in
+ * proportion to the current size so that a run of appends remaps only
+ * O(log n) times; real keeps the logical length meanwhile.
+ */
 static void
 mmap_realloc(mmap_t *mmap, size_t len)
 {
+  size_t step;
+
   if (len > mmap->len) {
+    if (mmap->growth == MMAP_GROWTH_GEOMETRIC) {
+      step = (size_t)((double)mmap->len * (mmap->growth_factor - 1.0));
+      if (mmap->growth_cap && step > mmap->growth_cap) {
+        step = mmap->growth_cap;
+      }
+      if ((len - mmap->len) < step) {
+        len = mmap->len + step;
+      }
+    }
     if ((len - mmap->len) < mmap->incr) {
       len = mmap->len + mmap->incr;
     }
@@ -2338,6 +8202,12 @@ mmap_realloc(mmap_t *mmap, size_t len)
   }
 }
 
+/*
+ * Resizes the file and the mapping through the descriptor kept open since
+ * initialize. With mremap the kernel extends the mapping in place when the
+ * address space behind it is free and moves it otherwise, so a resize costs
+ * an ftruncate and an mremap instead of a munmap, an open and a fresh mmap.
+ */
 static VALUE
 mmap_expand_initialize(VALUE data)
 {
@@ -2345,32 +8215,80 @@ mmap_expand_initialize(VALUE data)
   int fd;
   mmap_t *mmap = st_mm->mmap;
   size_t len = st_mm->len;
+  void *addr;
 
-  if (munmap(mmap->addr, mmap->len)) {
-    rb_raise(rb_eArgError, "munmap failed");
+  fd = mmap->fd;
+  if (fd < 0 && (fd = open(mmap->path, mmap->smode | O_CLOEXEC)) == -1) {
+    rb_raise(rb_eArgError, "can't open %s", mmap->path);
   }
 
-  if ((fd = open(mmap->path, mmap->smode)) == -1) {
-    rb_raise(rb_eArgError, "can't open %s", mmap->path);
+  /* Grow the file before the mapping and shrink it after, so that no
+   * mapped page ever lies past the end of the file. */
+  if (len > mmap->len && ftruncate(fd, mmap->offset + len) == -1) {
+    if (fd != mmap->fd) close(fd);
+    rb_raise(rb_eIOError, "can't extend %s", mmap->path);
   }
 
-  if (len > mmap->len) {
-    if (lseek(fd, len - mmap->len - 1, SEEK_END) == -1) {
-      rb_raise(rb_eIOError, "can't lseek %zu", len - mmap->len - 1);
+#ifdef HAVE_MREMAP
+  addr = MAP_FAILED;
+  /* A reopened path may name another file than the one mapped, which
+   * mremap would keep growing: map the file just resized instead. */
+  if (fd == mmap->fd) {
+    if (mmap->huge != MMAP_HUGE_NONE && len > mmap->len) {
+      /* Extend in place, or move onto a huge page boundary. */
+      addr = mremap(mmap->addr, mmap->len, len, 0);
+      if (addr == MAP_FAILED) {
+        void *hint = mmap_reserve_aligned(len, mmap->huge_size);
+
+        if (hint != MAP_FAILED) {
+          addr = mremap(mmap->addr, mmap->len, len, MREMAP_MAYMOVE | MREMAP_FIXED, hint);
+          if (addr == MAP_FAILED) munmap(hint, len);
+        }
+      }
+    }
+    if (addr == MAP_FAILED) {
+      addr = mremap(mmap->addr, mmap->len, len, MREMAP_MAYMOVE);
     }
-    if (write(fd, "\000", 1) != 1) {
-      rb_raise(rb_eIOError, "can't extend %s", mmap->path);
+    /* mremap refuses ranges that span several VMAs, which the ranged
+     * madvise, mlock and mprotect create: map again then. */
+    if (addr == MAP_FAILED && errno != EFAULT) {
+      rb_raise(rb_eArgError, "mremap failed (%d)", errno);
     }
   }
-  else if (len < mmap->len && truncate(mmap->path, len) == -1) {
-    rb_raise(rb_eIOError, "can't truncate %s", mmap->path);
+#else
+  addr = MAP_FAILED;
+#endif
+  if (addr == MAP_FAILED) {
+    if (munmap(mmap->addr, mmap->len)) {
+      if (fd != mmap->fd) close(fd);
+      rb_raise(rb_eArgError, "munmap failed");
+    }
+    addr = mmap_map(mmap, &len, mmap->pmode, mmap->vscope, fd, mmap->offset);
+    if (addr == MAP_FAILED) {
+      if (fd != mmap->fd) close(fd);
+      mmap->path = NULL;
+      rb_raise(rb_eArgError, "mmap failed");
+    }
+  }
+  mmap->addr = addr;
+  mmap->generation++;
+  if (len < mmap->len) {
+    mmap_dirty_clip(mmap, len);
+    mmap_ranges_clip(mmap, len);
   }
 
-  mmap->addr = mmap_func(0, len, mmap->pmode, mmap->vscope, fd, mmap->offset);
-  close(fd);
+  if (len < mmap->len && ftruncate(fd, mmap->offset + len) == -1) {
+    mmap->len = len;
+    if (fd != mmap->fd) close(fd);
+    rb_raise(rb_eIOError, "can't truncate %s", mmap->path);
+  }
+  if (fd != mmap->fd) close(fd);
 
-  if (mmap->addr == MAP_FAILED) {
-    rb_raise(rb_eArgError, "mmap failed");
+  if (len > mmap->len) {
+    mmap_advise_huge(mmap, mmap->addr, len);
+    if (mmap->flag & MMAP_RUBY_POPULATE) {
+      mmap_populate((char *)mmap->addr + mmap->len, len - mmap->len, 0, NULL, NULL);
+    }
   }
 
 #ifdef MADV_NORMAL
@@ -2379,11 +8297,13 @@ mmap_expand_initialize(VALUE data)
   }
 #endif
 
-  if ((mmap->flag & MMAP_RUBY_LOCK) && mlock(mmap->addr, len) == -1) {
+  if ((mmap->flag & MMAP_RUBY_LOCK) &&
+      mmap_mlock_range(mmap->addr, len, mmap->flag & MMAP_RUBY_ONFAULT) == -1) {
     rb_raise(rb_eArgError, "mlock(%d)", errno);
   }
 
   mmap->len = len;
+  mmap_ranges_apply(mmap);
   return Qnil;
 }
 
@@ -2402,6 +8322,8 @@ mmap_expandf(mmap_t *mmap, size_t len)
   if (!mmap->path || mmap->path == (char *)(intptr_t)-1) {
     rb_raise(rb_eTypeError, "expand for an anonymous map");
   }
+  mmap_check_remap(mmap);
+  mmap_warm_stop(mmap);
 
   st_mm.mmap = mmap;
   st_mm.len = len;
@@ -2419,32 +8341,81 @@ mmap_expandf(mmap_t *mmap, size_t len)
   }
 }
 
+static void
+mmap_msync_range(mmap_t *mmap, size_t beg, size_t len, int flag)
+{
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t b = beg & ~(page - 1);
+  int ret;
+
+  if (beg + len > MMAP_MAPLEN(mmap)) len = MMAP_MAPLEN(mmap) - beg;
+  if (!len) return;
+  if ((ret = msync(MMAP_BASE(mmap) + b, beg + len - b, flag)) != 0) {
+    rb_raise(rb_eArgError, "msync(%d)", ret);
+  }
+}
+
 /*
  * call-seq:
  *   msync(flag = MS_SYNC) -> self
- *   sync(flag = MS_SYNC) -> self
- *   flush(flag = MS_SYNC) -> self
+ *   msync(range, flag = MS_SYNC) -> self
+ *   msync(offset, length, flag = MS_SYNC) -> self
+ *   sync(...) -> self
+ *   flush(...) -> self
  *
  * Flushes the mapped memory to the underlying file. The +flag+ parameter
  * controls the synchronization behavior (MS_SYNC, MS_ASYNC, or MS_INVALIDATE).
  * Returns +self+.
+ *
+ * Given a byte +range+, or +offset+ and +length+, only the pages covering
+ * it are flushed. Otherwise the whole map is flushed, unless it was created
+ * with <tt>track_dirty: true</tt>: then only the pages written since the
+ * last flush are (see #dirty_ranges). A flush without a range also trims
+ * the space reserved past the content from the file.
  */
 static VALUE
 rb_cMmap_msync(int argc, VALUE *argv, VALUE self)
 {
   mmap_t *mmap;
-  VALUE oflag;
-  int ret;
-  int flag = MS_SYNC;
+  VALUE a1, a2, a3;
+  long beg, len, i;
+  int flag = MS_SYNC, ranged = 1;
 
-  if (argc) {
-    rb_scan_args(argc, argv, "01", &oflag);
-    flag = NUM2INT(oflag);
-  }
+  rb_scan_args(argc, argv, "03", &a1, &a2, &a3);
 
   GET_MMAP(self, mmap, MMAP_RUBY_MODIFY);
-  if ((ret = msync(mmap->addr, mmap->len, flag)) != 0) {
-    rb_raise(rb_eArgError, "msync(%d)", ret);
+  mmap_check_owned(mmap);
+  if (argc == 0 || (argc == 1 && !rb_obj_is_kind_of(a1, rb_cRange))) {
+    if (argc) flag = NUM2INT(a1);
+    ranged = 0;
+  }
+  else if (rb_obj_is_kind_of(a1, rb_cRange)) {
+    if (argc > 2) rb_error_arity(argc, 0, 2);
+    if (argc == 2) flag = NUM2INT(a2);
+    rb_range_beg_len(a1, &beg, &len, (long)mmap->len, 1);
+  }
+  else {
+    beg = NUM2LONG(a1);
+    len = NUM2LONG(a2);
+    if (argc == 3) flag = NUM2INT(a3);
+    if (beg < 0 || len < 0 || (size_t)beg > mmap->len || (size_t)len > mmap->len - beg) {
+      rb_raise(rb_eIndexError, "range %ld, %ld out of map", beg, len);
+    }
+  }
+
+  if (ranged) {
+    mmap_msync_range(mmap, beg + mmap->shift, len, flag);
+    return self;
+  }
+
+  if (mmap->flag & MMAP_RUBY_DIRTY) {
+    for (i = 0; i < mmap->ndirty; i++) {
+      mmap_msync_range(mmap, mmap->dirty[2 * i], mmap->dirty[2 * i + 1] - mmap->dirty[2 * i], flag);
+    }
+    mmap->ndirty = 0;
+  }
+  else {
+    mmap_msync_range(mmap, 0, MMAP_MAPLEN(mmap), flag);
   }
 
   if (mmap->real < mmap->len && mmap->vscope != MAP_PRIVATE) {
@@ -2456,28 +8427,85 @@ rb_cMmap_msync(int argc, VALUE *argv, VALUE self)
 
 /*
  * call-seq:
- *   lock -> self
- *   mlock -> self
+ *   dirty_ranges -> array
+ *
+ * With <tt>track_dirty: true</tt>, returns the page aligned byte ranges
+ * written since the last plain #msync, as an Array of exclusive Ranges.
+ */
+static VALUE
+rb_cMmap_dirty_ranges(VALUE self)
+{
+  mmap_t *mmap;
+  VALUE ary;
+  long i;
+
+  GET_MMAP(self, mmap, 0);
+  ary = rb_ary_new_capa(mmap->ndirty);
+  for (i = 0; i < mmap->ndirty; i++) {
+    size_t b = mmap->dirty[2 * i], e = mmap->dirty[2 * i + 1];
+
+    b = b > mmap->shift ? b - mmap->shift : 0;
+    rb_ary_push(ary, rb_range_new(SIZET2NUM(b), SIZET2NUM(e - mmap->shift), 1));
+  }
+  return ary;
+}
+
+/*
+ * call-seq:
+ *   lock(on_fault: false) -> self
+ *   mlock(on_fault: false) -> self
+ *   mlock(range, on_fault: false) -> self
+ *   mlock(offset, length, on_fault: false) -> self
  *
  * Disables paging for the mapped memory, locking it in physical memory.
  * Returns +self+.
+ *
+ * Given a byte +range+, or +offset+ and +length+, only the pages covering
+ * it are locked, and they stay locked when the map is resized. With
+ * <tt>on_fault: true</tt> pages are locked as they are faulted in
+ * (mlock2 with MLOCK_ONFAULT) instead of all being loaded up front.
  */
 static VALUE
-rb_cMmap_mlock(VALUE self)
+rb_cMmap_mlock(int argc, VALUE *argv, VALUE self)
 {
   mmap_t *mmap;
+  VALUE opts;
+  size_t beg, end;
+  int on_fault = 0;
 
-  TypedData_Get_Struct(self, mmap_t, &mmap_type, mmap);
-  if (mmap->flag & MMAP_RUBY_LOCK) {
-    return self;
+  argc = rb_scan_args(argc, argv, "02:", NULL, NULL, &opts);
+  if (!NIL_P(opts)) {
+    on_fault = RTEST(rb_hash_lookup2(opts, ID2SYM(rb_intern("on_fault")), Qfalse));
   }
+
+  GET_MMAP(self, mmap, 0);
+  mmap_check_owned(mmap);
   if (mmap->flag & MMAP_RUBY_ANON) {
     rb_raise(rb_eArgError, "mlock(anonymous)");
   }
-  if (mlock(mmap->addr, mmap->len) == -1) {
+
+  if (mmap_page_range(mmap, argc, argv, &beg, &end)) {
+    if (mmap_mlock_range(MMAP_BASE(mmap) + beg, end - beg, on_fault) == -1) {
+      rb_raise(rb_eArgError, "mlock(%d)", errno);
+    }
+    mmap_ranges_set(mmap, MMAP_RANGE_LOCK, beg, end, on_fault, 1);
+    return self;
+  }
+
+  if ((mmap->flag & MMAP_RUBY_LOCK) && on_fault == !!(mmap->flag & MMAP_RUBY_ONFAULT)) {
+    return self;
+  }
+  if (mmap_mlock_range(MMAP_BASE(mmap), MMAP_MAPLEN(mmap), on_fault) == -1) {
     rb_raise(rb_eArgError, "mlock(%d)", errno);
   }
   mmap->flag |= MMAP_RUBY_LOCK;
+  if (on_fault) {
+    mmap->flag |= MMAP_RUBY_ONFAULT;
+  }
+  else {
+    mmap->flag &= ~MMAP_RUBY_ONFAULT;
+  }
+  mmap_ranges_clear(mmap, MMAP_RANGE_LOCK);
   return self;
 }
 
@@ -2485,23 +8513,37 @@ rb_cMmap_mlock(VALUE self)
  * call-seq:
  *   unlock -> self
  *   munlock -> self
+ *   munlock(range) -> self
+ *   munlock(offset, length) -> self
  *
- * Re-enables paging for the mapped memory.
+ * Re-enables paging for the mapped memory, or for the pages covering a byte
+ * +range+ or +offset+ and +length+.
  * Returns +self+.
  */
 static VALUE
-rb_cMmap_munlock(VALUE self)
+rb_cMmap_munlock(int argc, VALUE *argv, VALUE self)
 {
   mmap_t *mmap;
+  size_t beg, end;
 
-  TypedData_Get_Struct(self, mmap_t, &mmap_type, mmap);
-  if (!(mmap->flag & MMAP_RUBY_LOCK)) {
+  GET_MMAP(self, mmap, 0);
+  mmap_check_owned(mmap);
+  if (mmap_page_range(mmap, argc, argv, &beg, &end)) {
+    if (munlock(MMAP_BASE(mmap) + beg, end - beg) == -1) {
+      rb_raise(rb_eArgError, "munlock(%d)", errno);
+    }
+    mmap_ranges_set(mmap, MMAP_RANGE_LOCK, beg, end, 0, 0);
+    return self;
+  }
+
+  if (!(mmap->flag & MMAP_RUBY_LOCK) && !mmap->nranges) {
     return self;
   }
-  if (munlock(mmap->addr, mmap->len) == -1) {
+  if (munlock(MMAP_BASE(mmap), MMAP_MAPLEN(mmap)) == -1) {
     rb_raise(rb_eArgError, "munlock(%d)", errno);
   }
-  mmap->flag &= ~MMAP_RUBY_LOCK;
+  mmap->flag &= ~(MMAP_RUBY_LOCK | MMAP_RUBY_ONFAULT);
+  mmap_ranges_clear(mmap, MMAP_RANGE_LOCK);
   return self;
 }
 
@@ -2538,20 +8580,43 @@ rb_cMmap_unmap(VALUE self)
 {
   mmap_t *mmap;
 
-  GET_MMAP(self, mmap, 0);
+  GET_MMAP(self, mmap, MMAP_RUBY_WINDOWED);
+  mmap_check_remap(mmap);
+  mmap_warm_stop(mmap);
   if (mmap->path) {
     mmap_lock(mmap, Qtrue);
-    munmap(mmap->addr, mmap->len);
+    if (mmap->flag & MMAP_RUBY_WINDOW) {
+      mmap_window_release(mmap);
+    }
+    else if (mmap->flag & MMAP_RUBY_BORROWED) {
+      mmap_io_buffer_release(mmap->buffer);
+      mmap->buffer = Qnil;
+    }
+    else {
+      munmap(MMAP_BASE(mmap), MMAP_MAPLEN(mmap));
+    }
     if (mmap->path != (char *)(intptr_t)-1) {
       if (mmap->real < mmap->len &&
           mmap->vscope != MAP_PRIVATE &&
-          truncate(mmap->path, mmap->real) == -1) {
+          (mmap->fd >= 0 ? ftruncate(mmap->fd, mmap->offset + mmap->real)
+                         : truncate(mmap->path, mmap->real)) == -1) {
         rb_raise(rb_eTypeError, "truncate");
       }
       free(mmap->path);
     }
+    if (mmap->fd >= 0) {
+      close(mmap->fd);
+      mmap->fd = -1;
+    }
     mmap->path = NULL;
+    mmap->generation++;
+    xfree(mmap->lines.offs);
+    MEMZERO(&mmap->lines, mmap_lines_t, 1);
     mmap_unlock(mmap);
+    if (mmap->ipc) {
+      shmdt(mmap->ipc);
+      mmap->ipc = NULL;
+    }
   }
   return Qnil;
 }
@@ -2609,10 +8674,10 @@ rb_cMmap_set_length(VALUE self, VALUE value)
 
   TypedData_Get_Struct(self, mmap_t, &mmap_type, mmap);
 
-  mmap->len = NUM2UINT(value);
-  if (mmap->len == 0) {
-    rb_raise(rb_eArgError, "invalid value for length %zu", mmap->len);
+  if (NUM2LL(value) <= 0) {
+    rb_raise(rb_eArgError, "invalid value for length %lld", NUM2LL(value));
   }
+  mmap->len = (size_t)NUM2LL(value);
   mmap->flag |= MMAP_RUBY_FIXED;
 
   return self;
@@ -2625,9 +8690,9 @@ rb_cMmap_set_offset(VALUE self, VALUE value)
 
   TypedData_Get_Struct(self, mmap_t, &mmap_type, mmap);
 
-  mmap->offset = NUM2INT(value);
+  mmap->offset = NUM2OFFT(value);
   if (mmap->offset < 0) {
-    rb_raise(rb_eArgError, "invalid value for offset %ld", (long)mmap->offset);
+    rb_raise(rb_eArgError, "invalid value for offset %lld", (long long)mmap->offset);
   }
   mmap->flag |= MMAP_RUBY_FIXED;
 
@@ -2651,6 +8716,131 @@ rb_cMmap_set_increment(VALUE self, VALUE value)
   return self;
 }
 
+static VALUE
+rb_cMmap_set_growth(VALUE self, VALUE value)
+{
+  mmap_t *mmap;
+  VALUE factor, cap;
+
+  TypedData_Get_Struct(self, mmap_t, &mmap_type, mmap);
+
+  mmap->growth_factor = MMAP_GROWTH_FACTOR;
+  mmap->growth_cap = MMAP_GROWTH_CAP;
+  if (value == ID2SYM(rb_intern("linear"))) {
+    mmap->growth = MMAP_GROWTH_LINEAR;
+  }
+  else if (value == ID2SYM(rb_intern("geometric"))) {
+    mmap->growth = MMAP_GROWTH_GEOMETRIC;
+  }
+  else if (TYPE(value) == T_HASH) {
+    factor = rb_hash_aref(value, ID2SYM(rb_intern("factor")));
+    cap = rb_hash_aref(value, ID2SYM(rb_intern("cap")));
+    if (!NIL_P(factor)) {
+      mmap->growth_factor = NUM2DBL(factor);
+      if (!(mmap->growth_factor > 1.0)) {
+        rb_raise(rb_eArgError, "invalid growth factor %g", mmap->growth_factor);
+      }
+    }
+    if (!NIL_P(cap)) {
+      mmap->growth_cap = NUM2SIZET(cap);
+    }
+    mmap->growth = MMAP_GROWTH_GEOMETRIC;
+  }
+  else {
+    rb_raise(rb_eArgError, "expected :linear, :geometric or an Hash for :growth");
+  }
+
+  return self;
+}
+
+static VALUE
+rb_cMmap_set_huge_pages(VALUE self, VALUE value)
+{
+  mmap_t *mmap;
+
+  TypedData_Get_Struct(self, mmap_t, &mmap_type, mmap);
+
+  if (!RTEST(value)) {
+    mmap->huge = MMAP_HUGE_NONE;
+  }
+  else if (value == ID2SYM(rb_intern("transparent")) || value == Qtrue) {
+    mmap->huge = MMAP_HUGE_TRANSPARENT;
+  }
+  else if (value == ID2SYM(rb_intern("hugetlb"))) {
+    mmap->huge = MMAP_HUGE_TLB;
+  }
+  else {
+    rb_raise(rb_eArgError, "expected :transparent or :hugetlb for :huge_pages");
+  }
+
+  return self;
+}
+
+static VALUE
+rb_cMmap_set_huge_page_size(VALUE self, VALUE value)
+{
+  mmap_t *mmap;
+  size_t size;
+
+  TypedData_Get_Struct(self, mmap_t, &mmap_type, mmap);
+
+  size = NUM2SIZET(value);
+  if (size < (size_t)sysconf(_SC_PAGESIZE) || (size & (size - 1))) {
+    rb_raise(rb_eArgError, "invalid value for huge_page_size %zu", size);
+  }
+  mmap->huge_size = size;
+
+  return self;
+}
+
+static VALUE
+rb_cMmap_set_populate(VALUE self, VALUE value)
+{
+  mmap_t *mmap;
+
+  TypedData_Get_Struct(self, mmap_t, &mmap_type, mmap);
+  if (RTEST(value)) {
+    mmap->flag |= MMAP_RUBY_POPULATE;
+  }
+  else {
+    mmap->flag &= ~MMAP_RUBY_POPULATE;
+  }
+
+  return self;
+}
+
+static VALUE
+rb_cMmap_set_track_dirty(VALUE self, VALUE value)
+{
+  mmap_t *mmap;
+
+  TypedData_Get_Struct(self, mmap_t, &mmap_type, mmap);
+  if (RTEST(value)) {
+    mmap->flag |= MMAP_RUBY_DIRTY;
+  }
+  else {
+    mmap->flag &= ~MMAP_RUBY_DIRTY;
+  }
+
+  return self;
+}
+
+static VALUE
+rb_cMmap_set_window(VALUE self, VALUE value)
+{
+  mmap_t *mmap;
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+  TypedData_Get_Struct(self, mmap_t, &mmap_type, mmap);
+
+  if (NUM2LL(value) <= 0) {
+    rb_raise(rb_eArgError, "invalid value for window %lld", NUM2LL(value));
+  }
+  mmap->window = ((size_t)NUM2LL(value) + page - 1) & ~(page - 1);
+
+  return self;
+}
+
 static VALUE
 rb_cMmap_set_ipc(VALUE self, VALUE value)
 {
@@ -2660,7 +8850,7 @@ rb_cMmap_set_ipc(VALUE self, VALUE value)
   if (value != Qtrue && TYPE(value) != T_HASH) {
     rb_raise(rb_eArgError, "expected an Hash for :ipc");
   }
-  mmap->shmid = value;
+  mmap->ipc_opts = value;
   mmap->flag |= (MMAP_RUBY_IPC | MMAP_RUBY_TMP);
 
   return self;
@@ -2699,6 +8889,32 @@ Init_mmap_ruby()
   rb_define_const(rb_cMmap, "MADV_SEQUENTIAL", INT2FIX(MADV_SEQUENTIAL));
   rb_define_const(rb_cMmap, "MADV_WILLNEED", INT2FIX(MADV_WILLNEED));
   rb_define_const(rb_cMmap, "MADV_DONTNEED", INT2FIX(MADV_DONTNEED));
+#ifdef MADV_FREE
+  rb_define_const(rb_cMmap, "MADV_FREE", INT2FIX(MADV_FREE));
+#endif
+#ifdef MADV_COLD
+  rb_define_const(rb_cMmap, "MADV_COLD", INT2FIX(MADV_COLD));
+  rb_define_const(rb_cMmap, "MADV_PAGEOUT", INT2FIX(MADV_PAGEOUT));
+#endif
+#ifdef MADV_HUGEPAGE
+  rb_define_const(rb_cMmap, "MADV_HUGEPAGE", INT2FIX(MADV_HUGEPAGE));
+  rb_define_const(rb_cMmap, "MADV_NOHUGEPAGE", INT2FIX(MADV_NOHUGEPAGE));
+#endif
+#ifdef MADV_DONTDUMP
+  rb_define_const(rb_cMmap, "MADV_DONTDUMP", INT2FIX(MADV_DONTDUMP));
+  rb_define_const(rb_cMmap, "MADV_DODUMP", INT2FIX(MADV_DODUMP));
+#endif
+#ifdef MADV_DONTFORK
+  rb_define_const(rb_cMmap, "MADV_DONTFORK", INT2FIX(MADV_DONTFORK));
+  rb_define_const(rb_cMmap, "MADV_DOFORK", INT2FIX(MADV_DOFORK));
+#endif
+#ifdef MADV_POPULATE_READ
+  rb_define_const(rb_cMmap, "MADV_POPULATE_READ", INT2FIX(MADV_POPULATE_READ));
+  rb_define_const(rb_cMmap, "MADV_POPULATE_WRITE", INT2FIX(MADV_POPULATE_WRITE));
+#endif
+#ifdef MLOCK_ONFAULT
+  rb_define_const(rb_cMmap, "MLOCK_ONFAULT", INT2FIX(MLOCK_ONFAULT));
+#endif
 #ifdef MAP_DENYWRITE
   rb_define_const(rb_cMmap, "MAP_DENYWRITE", INT2FIX(MAP_DENYWRITE));
 #endif
@@ -2726,6 +8942,18 @@ Init_mmap_ruby()
   rb_define_singleton_method(rb_cMmap, "lockall", rb_cMmap_mlockall, 1);
   rb_define_singleton_method(rb_cMmap, "munlockall", rb_cMmap_munlockall, 0);
   rb_define_singleton_method(rb_cMmap, "unlockall", rb_cMmap_munlockall, 0);
+  rb_define_singleton_method(rb_cMmap, "parallel_threshold", rb_cMmap_s_parallel_threshold, 0);
+  rb_define_singleton_method(rb_cMmap, "parallel_threshold=", rb_cMmap_s_set_parallel_threshold, 1);
+  rb_define_singleton_method(rb_cMmap, "parallel_threads", rb_cMmap_s_parallel_threads, 0);
+  rb_define_singleton_method(rb_cMmap, "parallel_threads=", rb_cMmap_s_set_parallel_threads, 1);
+  rb_define_singleton_method(rb_cMmap, "from_io_buffer", rb_cMmap_s_from_io_buffer, -1);
+
+  mmap_cpu_init();
+
+  mmap_parallel_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (mmap_parallel_threads < 1) mmap_parallel_threads = 1;
+  if (mmap_parallel_threads > MMAP_POOL_MAX_THREADS) mmap_parallel_threads = MMAP_POOL_MAX_THREADS;
+  pthread_atfork(NULL, NULL, mmap_pool_atfork_child);
 
   rb_define_alloc_func(rb_cMmap, rb_cMmap_allocate);
   rb_define_method(rb_cMmap, "initialize", rb_cMmap_initialize, -1);
@@ -2747,6 +8975,10 @@ Init_mmap_ruby()
   rb_define_method(rb_cMmap, "[]", rb_cMmap_aref, -1);
   rb_define_method(rb_cMmap, "slice", rb_cMmap_aref, -1);
   rb_define_method(rb_cMmap, "[]=", rb_cMmap_aset, -1);
+  rb_define_method(rb_cMmap, "read_into", rb_cMmap_read_into, -1);
+  rb_define_method(rb_cMmap, "write_from", rb_cMmap_write_from, -1);
+  rb_define_method(rb_cMmap, "slice_ref", rb_cMmap_slice_ref, 2);
+  rb_define_method(rb_cMmap, "to_io_buffer", rb_cMmap_to_io_buffer, -1);
   rb_define_method(rb_cMmap, "slice!", rb_cMmap_slice_bang, -1);
 
   rb_define_method(rb_cMmap, "include?", rb_cMmap_include, 1);
@@ -2754,6 +8986,29 @@ Init_mmap_ruby()
   rb_define_method(rb_cMmap, "rindex", rb_cMmap_rindex, -1);
   rb_define_method(rb_cMmap, "count", rb_cMmap_count, -1);
   rb_define_method(rb_cMmap, "sum", rb_cMmap_sum, -1);
+  rb_define_method(rb_cMmap, "checksum", rb_cMmap_checksum, -1);
+
+  mmap_each_line_kwargs[0] = rb_intern("chomp");
+  mmap_each_line_kwargs[1] = rb_intern("offsets");
+
+  mmap_sym_little = ID2SYM(rb_intern("little"));
+  mmap_sym_big = ID2SYM(rb_intern("big"));
+  mmap_sym_native = ID2SYM(rb_intern("native"));
+  mmap_sym_seq_cst = ID2SYM(rb_intern("seq_cst"));
+  mmap_sym_relaxed = ID2SYM(rb_intern("relaxed"));
+  mmap_sym_acquire = ID2SYM(rb_intern("acquire"));
+  mmap_sym_release = ID2SYM(rb_intern("release"));
+  mmap_sym_acq_rel = ID2SYM(rb_intern("acq_rel"));
+  rb_define_method(rb_cMmap, "each_byte", rb_cMmap_each_byte, 0);
+  rb_define_method(rb_cMmap, "each", rb_cMmap_each_byte, 0);
+  rb_define_method(rb_cMmap, "each_line", rb_cMmap_each_line, -1);
+  rb_define_method(rb_cMmap, "build_line_index", rb_cMmap_build_line_index, -1);
+  rb_define_method(rb_cMmap, "line_count", rb_cMmap_line_count, 0);
+  rb_define_method(rb_cMmap, "line_at", rb_cMmap_line_at, 1);
+  rb_define_method(rb_cMmap, "lines", rb_cMmap_lines, -1);
+  rb_define_method(rb_cMmap, "find_any", rb_cMmap_find_any, -1);
+  rb_define_method(rb_cMmap, "each_match_any", rb_cMmap_each_match_any, 1);
+  rb_define_method(rb_cMmap, "scan_offsets", rb_cMmap_scan_offsets, -1);
 
   rb_define_method(rb_cMmap, "insert", rb_cMmap_insert, 2);
   rb_define_method(rb_cMmap, "concat", rb_cMmap_concat, 1);
@@ -2777,28 +9032,85 @@ Init_mmap_ruby()
   rb_define_method(rb_cMmap, "split", rb_cMmap_split, -1);
   rb_define_method(rb_cMmap, "crypt", rb_cMmap_crypt, 1);
 
-  rb_define_method(rb_cMmap, "mprotect", rb_cMmap_mprotect, 1);
-  rb_define_method(rb_cMmap, "protect", rb_cMmap_mprotect, 1);
-  rb_define_method(rb_cMmap, "madvise", rb_cMmap_madvise, 1);
-  rb_define_method(rb_cMmap, "advise", rb_cMmap_madvise, 1);
+  rb_define_method(rb_cMmap, "mprotect", rb_cMmap_mprotect, -1);
+  rb_define_method(rb_cMmap, "protect", rb_cMmap_mprotect, -1);
+  rb_define_method(rb_cMmap, "madvise", rb_cMmap_madvise, -1);
+  rb_define_method(rb_cMmap, "advise", rb_cMmap_madvise, -1);
   rb_define_method(rb_cMmap, "msync", rb_cMmap_msync, -1);
   rb_define_method(rb_cMmap, "sync", rb_cMmap_msync, -1);
   rb_define_method(rb_cMmap, "flush", rb_cMmap_msync, -1);
-  rb_define_method(rb_cMmap, "mlock", rb_cMmap_mlock, 0);
-  rb_define_method(rb_cMmap, "lock", rb_cMmap_mlock, 0);
-  rb_define_method(rb_cMmap, "munlock", rb_cMmap_munlock, 0);
-  rb_define_method(rb_cMmap, "unlock", rb_cMmap_munlock, 0);
+  rb_define_method(rb_cMmap, "dirty_ranges", rb_cMmap_dirty_ranges, 0);
+  rb_define_method(rb_cMmap, "mlock", rb_cMmap_mlock, -1);
+  rb_define_method(rb_cMmap, "lock", rb_cMmap_mlock, -1);
+  rb_define_method(rb_cMmap, "munlock", rb_cMmap_munlock, -1);
+  rb_define_method(rb_cMmap, "unlock", rb_cMmap_munlock, -1);
 
   rb_define_method(rb_cMmap, "extend", rb_cMmap_extend, 1);
   rb_define_method(rb_cMmap, "unmap", rb_cMmap_unmap, 0);
   rb_define_method(rb_cMmap, "munmap", rb_cMmap_unmap, 0);
 
+  rb_define_method(rb_cMmap, "warm", rb_cMmap_warm, -1);
+  rb_define_method(rb_cMmap, "warm_progress", rb_cMmap_warm_progress, 0);
+  rb_define_method(rb_cMmap, "warming?", rb_cMmap_warming_p, 0);
+  rb_define_method(rb_cMmap, "wait_warm", rb_cMmap_wait_warm, 0);
   rb_define_method(rb_cMmap, "semlock", rb_cMmap_semlock, -1);
   rb_define_method(rb_cMmap, "ipc_key", rb_cMmap_ipc_key, 0);
 
+  rb_define_private_method(rb_cMmap, "scalar_get", rb_cMmap_scalar_get, 3);
+  rb_define_private_method(rb_cMmap, "scalar_put", rb_cMmap_scalar_put, 4);
+  rb_define_private_method(rb_cMmap, "atomic_op", rb_cMmap_atomic_op, 6);
+  rb_define_private_method(rb_cMmap, "view_new", rb_cMmap_view_new, 4);
+  rb_define_private_method(rb_cMmap, "batch_write", rb_cMmap_batch_write, 1);
+  rb_define_private_method(rb_cMmap, "pinned", rb_cMmap_pinned, 0);
+  rb_define_private_method(rb_cMmap, "scan_chunk", rb_cMmap_scan_chunk, 2);
+
+  mmap_cView = rb_define_class_under(rb_cMmap, "View", rb_cObject);
+  rb_undef_alloc_func(mmap_cView);
+  rb_define_method(mmap_cView, "size", rb_cMmapView_size, 0);
+  rb_define_method(mmap_cView, "length", rb_cMmapView_size, 0);
+  rb_define_method(mmap_cView, "type", rb_cMmapView_type, 0);
+  rb_define_method(mmap_cView, "offset", rb_cMmapView_offset, 0);
+  rb_define_method(mmap_cView, "[]", rb_cMmapView_aref, -1);
+  rb_define_method(mmap_cView, "each", rb_cMmapView_each, 0);
+  rb_define_method(mmap_cView, "to_a", rb_cMmapView_to_a, 0);
+  rb_define_method(mmap_cView, "sum", rb_cMmapView_sum, 0);
+  rb_define_method(mmap_cView, "mean", rb_cMmapView_mean, 0);
+  rb_define_method(mmap_cView, "min", rb_cMmapView_min, 0);
+  rb_define_method(mmap_cView, "max", rb_cMmapView_max, 0);
+  rb_define_method(mmap_cView, "minmax", rb_cMmapView_minmax, 0);
+
+  mmap_cSlice = rb_define_class_under(rb_cMmap, "Slice", rb_cObject);
+  rb_undef_alloc_func(mmap_cSlice);
+  rb_define_method(mmap_cSlice, "size", rb_cMmapSlice_size, 0);
+  rb_define_method(mmap_cSlice, "length", rb_cMmapSlice_size, 0);
+  rb_define_method(mmap_cSlice, "bytesize", rb_cMmapSlice_size, 0);
+  rb_define_method(mmap_cSlice, "offset", rb_cMmapSlice_offset, 0);
+  rb_define_method(mmap_cSlice, "to_s", rb_cMmapSlice_to_s, 0);
+  rb_define_method(mmap_cSlice, "to_str", rb_cMmapSlice_to_s, 0);
+  rb_define_method(mmap_cSlice, "==", rb_cMmapSlice_equal, 1);
+  rb_define_method(mmap_cSlice, "eql?", rb_cMmapSlice_equal, 1);
+  rb_define_method(mmap_cSlice, "hash", rb_cMmapSlice_hash, 0);
+  rb_define_method(mmap_cSlice, "start_with?", rb_cMmapSlice_start_with, -1);
+  rb_define_method(mmap_cSlice, "end_with?", rb_cMmapSlice_end_with, -1);
+  rb_define_method(mmap_cSlice, "index", rb_cMmapSlice_index, -1);
+  rb_define_method(mmap_cSlice, "include?", rb_cMmapSlice_include, 1);
+  rb_define_method(mmap_cSlice, "inspect", rb_cMmapSlice_inspect, 0);
+
+  mmap_cMatcher = rb_define_class_under(rb_cMmap, "Matcher", rb_cObject);
+  rb_define_alloc_func(mmap_cMatcher, mmap_matcher_allocate);
+  rb_define_method(mmap_cMatcher, "initialize", rb_cMmapMatcher_initialize, 1);
+  rb_define_method(mmap_cMatcher, "patterns", rb_cMmapMatcher_patterns, 0);
+  rb_define_method(mmap_cMatcher, "size", rb_cMmapMatcher_size, 0);
+
   rb_define_private_method(rb_cMmap, "set_length", rb_cMmap_set_length, 1);
   rb_define_private_method(rb_cMmap, "set_offset", rb_cMmap_set_offset, 1);
   rb_define_private_method(rb_cMmap, "set_increment", rb_cMmap_set_increment, 1);
+  rb_define_private_method(rb_cMmap, "set_growth", rb_cMmap_set_growth, 1);
+  rb_define_private_method(rb_cMmap, "set_huge_pages", rb_cMmap_set_huge_pages, 1);
+  rb_define_private_method(rb_cMmap, "set_huge_page_size", rb_cMmap_set_huge_page_size, 1);
+  rb_define_private_method(rb_cMmap, "set_populate", rb_cMmap_set_populate, 1);
+  rb_define_private_method(rb_cMmap, "set_track_dirty", rb_cMmap_set_track_dirty, 1);
+  rb_define_private_method(rb_cMmap, "set_window", rb_cMmap_set_window, 1);
   rb_define_private_method(rb_cMmap, "set_advice", rb_cMmap_set_advice, 1);
   rb_define_private_method(rb_cMmap, "set_ipc", rb_cMmap_set_ipc, 1);
 }
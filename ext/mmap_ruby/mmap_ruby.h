@@ -2,12 +2,20 @@
 #define MMAP_RUBY_H 1
 
 #include "ruby.h"
+#include "ruby/encoding.h"
 #include "ruby/io.h"
+#include "ruby/io/buffer.h"
 #include "ruby/re.h"
+#include "ruby/thread.h"
 #include "ruby/util.h"
 
 #include <ctype.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sys/mman.h>
@@ -15,7 +23,11 @@
 #include <sys/types.h>
 
 #include <sys/ipc.h>
-#include <sys/sem.h>
 #include <sys/shm.h>
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#define MMAP_RUBY_X86 1
+#include <immintrin.h>
+#endif
+
 #endif /* MMAP_RUBY_H */
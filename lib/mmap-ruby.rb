@@ -2,5 +2,6 @@
 
 require "mmap_ruby/mmap_ruby"
 require "mmap-ruby/mmap"
+require "mmap-ruby/log"
 
 Mmap = MmapRuby::Mmap
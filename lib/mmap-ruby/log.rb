@@ -0,0 +1,260 @@
+# frozen_string_literal: true
+
+module MmapRuby
+  class Mmap
+    # An append-only log of records in a preallocated shared file, for
+    # handing events between processes on one host. Appenders reserve space
+    # with a compare-and-swap on the tail, so none of them ever holds a
+    # lock and the file is never remapped. Readers iterate the committed
+    # records concurrently with the appenders.
+    #
+    #   log = Mmap::Log.new("events.log", capacity: 64 << 20)
+    #   log.append("user signed up")
+    #   pos = log.read_from(pos) { |payload| handle(payload) }
+    #
+    # The file starts with a HEADER_SIZE bytes header holding a magic, the
+    # capacity and the tail, the offset where the next record goes. Each
+    # record is 8-byte aligned and made of an 8-byte word holding its state
+    # and payload length, the CRC32C of the payload, 4 reserved bytes and
+    # the payload, padded to 8 bytes. A record is written as PENDING with
+    # its length right after its space is reserved, so that readers and
+    # #recover can step over it, and becomes COMMITTED once its payload and
+    # CRC are in place.
+    class Log
+      include Enumerable
+
+      # Raised when a record doesn't fit in the rest of the log.
+      class FullError < IOError; end
+
+      MAGIC = "MMAPLOG1"
+      HEADER_SIZE = 64
+      RECORD_HEADER_SIZE = 16
+
+      CAPACITY = 8
+      TAIL = 16
+
+      # Record states, in the high half of the first word of a record. A
+      # zero word is space reserved by an appender that has not written
+      # the record yet.
+      PENDING = 1
+      COMMITTED = 2
+      SKIP = 3
+
+      LENGTH_MASK = 0xffffffff
+      private_constant :CAPACITY, :TAIL, :LENGTH_MASK
+
+      # Space reserved for one record by Log#reserve. The payload is written
+      # with #write and published with #commit; #abort turns the record into
+      # one that readers skip.
+      class Reservation
+        attr_reader :offset, :length
+
+        def initialize(mmap, offset, length, finish) # :nodoc:
+          @mmap = mmap
+          @finish = finish
+          @offset = offset
+          @length = length
+          @done = false
+        end
+
+        # Writes +data+ at byte +at+ of the payload.
+        def write(data, at = 0)
+          raise IOError, "record already #{@done}" if @done
+          raise IndexError, "write of #{data.bytesize} bytes at #{at} out of the record" if at.negative? || at + data.bytesize > @length
+
+          @mmap.write_from(data, @offset + RECORD_HEADER_SIZE + at)
+          self
+        end
+
+        def commit
+          finish(:committed)
+        end
+
+        def abort
+          finish(:aborted)
+        end
+
+        private
+
+        def finish(state)
+          raise IOError, "record already #{@done}" if @done
+
+          @finish.call(@offset, @length, state == :committed)
+          @done = state
+          @offset
+        end
+      end
+
+      # Opens the log at +path+, creating it with +capacity+ bytes if it
+      # doesn't exist or is empty. The capacity of an existing log is kept,
+      # and a file that is neither a log nor zeroed is left untouched. With
+      # +recover+, #recover is run once the log is open; only do that when
+      # no other process is appending.
+      def initialize(path, capacity: 64 << 20, recover: false)
+        raise ArgumentError, "capacity must be at least #{HEADER_SIZE + RECORD_HEADER_SIZE}" if capacity < HEADER_SIZE + RECORD_HEADER_SIZE
+
+        File.open(path, File::RDWR | File::CREAT, 0o644) do |file|
+          file.flock(File::LOCK_EX)
+          if file.size.zero?
+            file.truncate(capacity & ~7)
+          else
+            header = file.read(HEADER_SIZE) || ""
+            unless header.start_with?(MAGIC) || header == "\0" * HEADER_SIZE
+              raise ArgumentError, "#{path} is not a log"
+            end
+          end
+          @mmap = Mmap.new(path, "rw")
+          if @mmap[0, MAGIC.bytesize] != MAGIC
+            @mmap.put_u64(CAPACITY, @mmap.size)
+            @mmap.atomic_store(TAIL, HEADER_SIZE)
+            @mmap[0, MAGIC.bytesize] = MAGIC
+          end
+        end
+        @capacity = @mmap.get_u64(CAPACITY)
+        self.recover if recover
+      end
+
+      # Returns the size of the file.
+      attr_reader :capacity
+
+      # Returns the offset where the next record goes.
+      def tail
+        @mmap.atomic_load(TAIL, order: :acquire)
+      end
+
+      # Appends +payload+ as one record and returns its offset.
+      def append(payload)
+        reserve(payload.bytesize) { |record| record.write(payload) }
+      end
+      alias << append
+
+      # Reserves a record of +length+ bytes and returns its Reservation.
+      # With a block, the reservation is yielded, committed when the block
+      # returns and aborted if it raises, and its offset is returned.
+      # Raises FullError, leaving the log as it was, if the record doesn't
+      # fit in the room left.
+      def reserve(length)
+        raise ArgumentError, "record length #{length} out of range" if length.negative? || length > LENGTH_MASK
+
+        size = RECORD_HEADER_SIZE + ((length + 7) & ~7)
+        offset = tail
+        loop do
+          raise FullError, "no room for a record of #{length} bytes" if offset + size > @capacity
+          break if @mmap.compare_and_swap(TAIL, offset, offset + size, order: :acq_rel)
+
+          offset = tail
+        end
+        @mmap.atomic_store(offset, PENDING << 32 | length, order: :release)
+
+        reservation = Reservation.new(@mmap, offset, length, method(:finish))
+        return reservation unless block_given?
+
+        begin
+          yield reservation
+        rescue Exception
+          reservation.abort
+          raise
+        end
+        reservation.commit
+      end
+
+      # Calls the block with the payload and offset of every committed
+      # record from offset +from+, stopping at the first record that is not
+      # committed yet, and returns the offset to resume from. Raises IOError
+      # for a record whose header is corrupt and, with +verify+, for one
+      # whose payload doesn't match its CRC.
+      def read_from(from = HEADER_SIZE, verify: false)
+        return enum_for(__method__, from, verify:) unless block_given?
+
+        pos = from
+        limit = [tail, @capacity].min
+        while pos + RECORD_HEADER_SIZE <= limit
+          word = @mmap.atomic_load(pos, order: :acquire)
+          state = word >> 32
+          length = word & LENGTH_MASK
+          break if state == 0 || state == PENDING
+          raise IOError, "record at #{pos} is corrupt" if state > SKIP || length > @capacity - pos - RECORD_HEADER_SIZE
+
+          if state == COMMITTED
+            payload = @mmap[pos + RECORD_HEADER_SIZE, length]
+            if verify && @mmap.checksum(:crc32c, pos + RECORD_HEADER_SIZE, length) != @mmap.get_u32(pos + 8)
+              raise IOError, "record at #{pos} is corrupt"
+            end
+
+            yield payload, pos
+          end
+          pos += RECORD_HEADER_SIZE + ((length + 7) & ~7)
+        end
+        pos
+      end
+
+      # Calls the block with the payload of every committed record, as
+      # #read_from does from the start.
+      def each(&block)
+        return enum_for(__method__) unless block
+
+        read_from { |payload, _| yield payload }
+        self
+      end
+
+      # Repairs the log after a crash; no other process may be appending.
+      # Committed records whose CRC doesn't match, and records that were
+      # never committed, become records that readers skip. Everything past
+      # the last good committed record, including a reservation whose
+      # length was never written, is cleared and the tail moved back there.
+      # Returns the number of records dropped.
+      def recover
+        dropped = 0
+        pos = good = HEADER_SIZE
+        limit = [tail, @capacity].min
+        while pos + RECORD_HEADER_SIZE <= limit
+          word = @mmap.atomic_load(pos)
+          state = word >> 32
+          length = word & LENGTH_MASK
+          break if state == 0 || state > SKIP || length > @capacity - pos - RECORD_HEADER_SIZE
+
+          if state == COMMITTED && @mmap.checksum(:crc32c, pos + RECORD_HEADER_SIZE, length) == @mmap.get_u32(pos + 8)
+            pos += RECORD_HEADER_SIZE + ((length + 7) & ~7)
+            good = pos
+          else
+            if state != SKIP
+              @mmap.atomic_store(pos, SKIP << 32 | length)
+              dropped += 1
+            end
+            pos += RECORD_HEADER_SIZE + ((length + 7) & ~7)
+          end
+        end
+        dropped += 1 if pos < limit
+
+        zero = "\0" * 65536
+        stop = [tail, @capacity].min
+        (good...stop).step(zero.bytesize) do |at|
+          @mmap.write_from(zero, at, [zero.bytesize, stop - at].min)
+        end
+        @mmap.atomic_store(TAIL, good)
+        dropped
+      end
+
+      # Writes the log to its file.
+      def flush
+        @mmap.msync
+        self
+      end
+
+      def close
+        @mmap.unmap
+      end
+
+      private
+
+      def finish(offset, length, commit)
+        if commit
+          @mmap.put_u32(offset + 8, @mmap.checksum(:crc32c, offset + RECORD_HEADER_SIZE, length))
+          @mmap.atomic_store(offset, COMMITTED << 32 | length, order: :release)
+        else
+          @mmap.atomic_store(offset, SKIP << 32 | length, order: :release)
+        end
+      end
+    end
+  end
+end
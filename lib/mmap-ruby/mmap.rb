@@ -1,5 +1,7 @@
 # frozen_string_literal: true
 
+require "etc"
+
 module MmapRuby
   class Mmap
     include Comparable
@@ -13,24 +15,273 @@ module MmapRuby
       raise TypeError, "can't dup instance of #{self.class}"
     end
 
-    # See https://docs.ruby-lang.org/en/master/String.html#method-i-each_byte
-    def each_byte(...)
-      to_str.each_byte(...)
+    # See https://docs.ruby-lang.org/en/master/String.html#method-i-scan
+    def scan(...)
+      to_str.scan(...)
     end
-    alias :each :each_byte
 
-    # See https://docs.ruby-lang.org/en/master/String.html#method-i-each_line
-    def each_line(...)
-      to_str.each_line(...)
+    PARALLEL_SCAN_CHUNK = 32 << 20
+    private_constant :PARALLEL_SCAN_CHUNK
+
+    # Scans for +pattern+ as #scan_offsets does, with +workers+ Ractors
+    # each searching chunks of +chunk_size+ bytes. Every chunk is searched
+    # with +max_match_length+ bytes of context on both sides, so matches
+    # up to that long are found whole, as are anchors and lookbehinds at
+    # the chunk edges; longer matches may be cut short. Matches are yielded
+    # as begin and end byte offsets, or returned as an Array of pairs, in
+    # order and exactly as a single pass would find them: where a match
+    # runs into the next chunk, that chunk is searched again from its end
+    # until both agree.
+    #
+    # The workers read the chunks in place, so the map must be frozen or
+    # opened read-only, and it can't be resized or unmapped until the scan
+    # returns. Windowed maps are not supported.
+    #
+    #   mmap.parallel_scan(/ERROR \w+/, max_match_length: 256) { |b, e| ... }
+    def parallel_scan(pattern, max_match_length:, chunk_size: PARALLEL_SCAN_CHUNK, workers: Etc.nprocessors)
+      raise ArgumentError, "max_match_length must be positive" unless max_match_length.positive?
+      raise ArgumentError, "chunk_size must be positive" unless chunk_size.positive?
+      unless block_given?
+        pairs = []
+        parallel_scan(pattern, max_match_length:, chunk_size:, workers:) { |b, e| pairs << [b, e] }
+        return pairs
+      end
+
+      pinned do
+        chunks = (size + chunk_size - 1) / chunk_size
+        workers = [workers, chunks].min
+        next scan_offsets(pattern) { |b, e| yield b, e } if workers < 2
+
+        ractors = parallel_scan_workers(pattern, workers)
+        sent = taken = 0
+        dispatch = lambda do
+          from = sent * chunk_size
+          base = [from - max_match_length, 0].max
+          to = [from + chunk_size, size].min
+          text = scan_chunk(base, [to + max_match_length, size].min - base)
+          to += 1 if to == size # an empty match at the very end
+          ractors[sent % workers].send([text, base, from - base, to - base])
+          sent += 1
+        end
+        workers.times { dispatch.call }
+
+        begin
+          resume = 0
+          while taken < chunks
+            offsets = ractors[taken % workers].take
+            taken += 1
+            dispatch.call if sent < chunks
+            limit = taken < chunks ? taken * chunk_size : size + 1
+            resume = parallel_scan_merge(pattern, offsets, resume, limit) { |b, e| yield b, e }
+          end
+        ensure
+          ractors.each(&:close_incoming)
+          # Chunks still being searched point into the map: wait for them
+          # before it is unpinned.
+          (taken...sent).each do |k|
+            ractors[k % workers].take
+          rescue Ractor::Error
+            nil
+          end
+          ractors.each(&:close_outgoing)
+        end
+      end
+      self
     end
 
-    # See https://docs.ruby-lang.org/en/master/String.html#method-i-scan
-    def scan(...)
-      to_str.scan(...)
+    # Searches one chunk: [text, base, from, to] where +text+ holds the bytes
+    # from offset +base+ of the map and matches must start in [from, to).
+    # Replies with the flat begin and end offsets of the matches.
+    PARALLEL_SCAN_WORKER = proc do |pattern|
+      loop do
+        text, base, pos, to = Ractor.receive
+        offsets = []
+        while pos <= text.bytesize && (b = text.byteindex(pattern, pos)) && b < to
+          e = $~.byteoffset(0)[1]
+          offsets << base + b << base + e
+          pos = e > b ? e : e + 1
+        end
+        Ractor.yield offsets
+      end
+    end
+    private_constant :PARALLEL_SCAN_WORKER
+
+    # Typed scalar accessors: get_u8, get_u16, get_u32, get_u64, get_i8 ...
+    # get_i64, get_f32 and get_f64 read a value at a byte offset, and the
+    # matching put_* methods write one, without allocating a String.
+    # Negative offsets count from the end. +endian+ is +:little+ (the
+    # default), +:big+ or +:native+.
+    #
+    #   mmap.get_u32(16)                  # => 3735928559
+    #   mmap.put_i16(4, -2, endian: :big) # => -2
+    SCALAR_TYPES = {
+      u8: 0x01, u16: 0x02, u32: 0x04, u64: 0x08,
+      i8: 0x11, i16: 0x12, i32: 0x14, i64: 0x18,
+      f32: 0x24, f64: 0x28
+    }.freeze
+    private_constant :SCALAR_TYPES
+
+    SCALAR_TYPES.each do |type, code|
+      class_eval <<~RUBY, __FILE__, __LINE__ + 1
+        def get_#{type}(offset, endian: :little)
+          scalar_get(offset, #{code}, endian)
+        end
+
+        def put_#{type}(offset, value, endian: :little)
+          scalar_put(offset, #{code}, endian, value)
+        end
+      RUBY
+    end
+
+    # Writes each string of +writes+, an array of [offset, string] pairs,
+    # at its offset under a single lock, and returns +self+. Negative
+    # offsets count from the end. Writes must not overlap; a batch that
+    # writes past the end grows the map once. With a block, the writes
+    # made through the yielded Mmap::Batch are applied when it returns.
+    #
+    #   mmap.write_batch([[0, header], [4096, record]])
+    #   mmap.write_batch { |batch| records.each { |off, rec| batch[off] = rec } }
+    def write_batch(writes = nil)
+      if block_given?
+        yield batch = Batch.new
+        writes = batch.writes
+      end
+      batch_write(writes || [])
+    end
+
+    # Buffers the writes of a #write_batch block.
+    class Batch
+      attr_reader :writes # :nodoc:
+
+      def initialize # :nodoc:
+        @writes = []
+      end
+
+      # Queues a write of +string+ at +offset+. +string+ is copied, so the
+      # caller may reuse it.
+      def write(offset, string)
+        @writes << [offset, string.dup]
+        self
+      end
+
+      def []=(offset, string)
+        write(offset, string)
+      end
+    end
+
+    VIEW_TYPES = {
+      uint8: 0x01, uint16: 0x02, uint32: 0x04, uint64: 0x08,
+      int8: 0x11, int16: 0x12, int32: 0x14, int64: 0x18,
+      float32: 0x24, float64: 0x28
+    }.freeze
+    private_constant :VIEW_TYPES
+
+    # Returns an Mmap::View of +count+ native endian elements of +type+
+    # (+:int8+ ... +:int64+, +:uint8+ ... +:uint64+, +:float32+ or
+    # +:float64+) starting at byte +offset+, which must be aligned on the
+    # element size. +count+ defaults to as many elements as fit.
+    #
+    #   prices = mmap.view(:float64, offset: 4096, count: 1_000_000)
+    #   prices.minmax # => [0.5, 99.75]
+    def view(type, offset: 0, count: nil)
+      code = VIEW_TYPES.fetch(type) { raise ArgumentError, "unknown view type #{type.inspect}" }
+      view_new(type, code, offset, count)
+    end
+
+    # A typed array over part of a map. Elements are read in place; the
+    # reductions (#sum, #min, #max, #minmax, #mean) run as vectorized
+    # native loops without creating Ruby objects per element.
+    class View
+      include Enumerable
+    end
+
+    # Atomic operations on the signed word of +width+ bytes (1, 2, 4 or 8)
+    # at +offset+, which must be aligned on +width+. They work across
+    # processes sharing a MAP_SHARED map, without #semlock. +order+ is one of
+    # +:seq_cst+ (the default), +:acq_rel+, +:acquire+, +:release+ and
+    # +:relaxed+.
+    #
+    #   counter.atomic_add(0, 1)                # => new value
+    #   counter.compare_and_swap(8, 0, Process.pid)
+
+    # Returns the word at +offset+.
+    def atomic_load(offset, width: 8, order: :seq_cst)
+      atomic_op(0, offset, width, order, nil, nil)
+    end
+
+    # Stores +value+ at +offset+ and returns it.
+    def atomic_store(offset, value, width: 8, order: :seq_cst)
+      atomic_op(1, offset, width, order, value, nil)
+    end
+
+    # Adds +value+ to the word at +offset+ and returns the new value.
+    def atomic_add(offset, value, width: 8, order: :seq_cst)
+      atomic_op(2, offset, width, order, value, nil)
+    end
+
+    # Replaces the word at +offset+ with +desired+ if it equals +expected+.
+    # Returns whether it did.
+    def compare_and_swap(offset, expected, desired, width: 8, order: :seq_cst)
+      atomic_op(3, offset, width, order, expected, desired)
+    end
+
+    # ORs +value+ into the word at +offset+ and returns the previous value.
+    def fetch_or(offset, value, width: 8, order: :seq_cst)
+      atomic_op(4, offset, width, order, value, nil)
+    end
+
+    # ANDs +value+ into the word at +offset+ and returns the previous value.
+    def fetch_and(offset, value, width: 8, order: :seq_cst)
+      atomic_op(5, offset, width, order, value, nil)
     end
 
     private
 
+    # Starts the Ractors of #parallel_scan. They only ever see frozen chunks
+    # and return offsets, so the experimental warning Ruby prints for the
+    # first Ractor is silenced rather than shown to every caller.
+    def parallel_scan_workers(pattern, workers)
+      experimental = Warning[:experimental]
+      Warning[:experimental] = false
+      Array.new(workers) { Ractor.new(pattern, &PARALLEL_SCAN_WORKER) }
+    ensure
+      Warning[:experimental] = experimental
+    end
+
+    # Yields the matches of one chunk that a single pass would find, given
+    # that the pass resumes at +resume+. A chunk whose first matches start
+    # before +resume+ overlapped a match of the previous one; it is searched
+    # again from +resume+ until a match agrees with +offsets+, after which
+    # both find the same ones. Returns where the pass resumes next.
+    def parallel_scan_merge(pattern, offsets, resume, limit)
+      i = 0
+      i += 2 while i < offsets.size && offsets[i] < resume
+      if i > 0
+        str = to_str
+        loop do
+          b = resume <= str.bytesize && str.byteindex(pattern, resume)
+          if !b || b >= limit
+            i = offsets.size
+            break
+          end
+          e = $~.byteoffset(0)[1]
+          i += 2 while i < offsets.size && offsets[i] < b
+          break if offsets[i] == b && offsets[i + 1] == e
+
+          yield b, e
+          resume = e > b ? e : e + 1
+        end
+      end
+      while i < offsets.size
+        b = offsets[i]
+        e = offsets[i + 1]
+        yield b, e
+        resume = e > b ? e : e + 1
+        i += 2
+      end
+      resume
+    end
+
     def process_options(options)
       options.each do |key, value|
         key_str = key.to_s
@@ -40,6 +291,12 @@ module MmapRuby
         when "offset" then set_offset value
         when "advice" then set_advice value
         when "increment" then set_increment value
+        when "growth" then set_growth value
+        when "huge_pages" then set_huge_pages value
+        when "huge_page_size" then set_huge_page_size value
+        when "populate" then set_populate value
+        when "track_dirty" then set_track_dirty value
+        when "window" then set_window value
         when "ipc" then set_ipc value
         else raise TypeError, "unknown option #{key_str}"
         end
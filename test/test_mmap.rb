@@ -170,6 +170,94 @@ class TestMmap < Minitest::Test
     end
   end
 
+  def test_growth
+    path = File.join(@tmp, "aa")
+    File.write(path, "")
+    mmap = Mmap.new(path, "rw", growth: { factor: 1.5, cap: 1 << 20 })
+    str = +""
+    2000.times do |i|
+      chunk = "line #{i}\n" * (i % 7)
+      mmap << chunk
+      str << chunk
+    end
+    mmap.insert(10, "inserted")
+    str.insert(10, "inserted")
+    assert_equal(str, mmap.to_str)
+    assert_operator(File.size(path), :>, str.bytesize)
+    mmap.unmap
+    assert_equal(str, File.read(path))
+
+    assert_raises(ArgumentError) { Mmap.new(path, "rw", growth: :cubic) }
+    assert_raises(ArgumentError) { Mmap.new(path, "rw", growth: { factor: 1 }) }
+  end
+
+  def test_expand_after_rename
+    aa = File.join(@tmp, "aa")
+    bb = File.join(@tmp, "bb")
+    { "rw" => "abc", "a" => "abc", "w" => "" }.each do |mode, kept|
+      File.write(aa, "abc")
+      mmap = Mmap.new(aa, mode)
+      File.rename(aa, bb)
+      mmap << "x" * 10_000
+      mmap.extend(4096)
+      mmap.msync
+      assert_equal(kept + ("x" * 10_000), mmap.to_str, "<#{mode}>")
+      mmap.unmap
+      refute(File.exist?(aa), "<#{mode}>")
+      assert_equal(kept + ("x" * 10_000), File.read(bb), "<#{mode}>")
+    end
+  end
+
+  def test_huge_pages
+    size = (3 << 20) + 17
+    _, err = capture_io do
+      mmap = Mmap.new(nil, length: size, huge_pages: :hugetlb, initialize: "a")
+      assert_equal(size, mmap.size)
+      mmap[size - 1] = "b"
+      assert_equal("ab", mmap[size - 2, 2])
+      mmap.unmap
+    end
+    assert(err.empty? || err.include?("MAP_HUGETLB"))
+
+    path = File.join(@tmp, "aa")
+    File.write(path, "x" * 1000)
+    mmap = Mmap.new(path, "rw", huge_pages: :transparent, growth: :geometric)
+    mmap << "y" * (5 << 20)
+    assert_equal(1000 + (5 << 20), mmap.size)
+    assert_equal("xy", mmap[999, 2])
+    mmap.unmap
+
+    assert_raises(ArgumentError) { Mmap.new(nil, length: 4096, huge_pages: :huge) }
+    assert_raises(ArgumentError) { Mmap.new(nil, length: 4096, huge_page_size: 3 << 20) }
+  end
+
+  def test_warm
+    assert_same(@mmap, @mmap.warm(async: false))
+    assert_equal(1.0, @mmap.warm_progress)
+    @mmap.warm(100..5000).wait_warm
+    refute_predicate(@mmap, :warming?)
+    assert_equal(1.0, @mmap.warm_progress)
+    assert_raises(TypeError) { @mmap.warm(12) }
+
+    mmap = Mmap.new(nil, length: 64 << 20, populate: true)
+    mmap.warm
+    mmap.unmap
+    mmap = Mmap.new(nil, length: 64 << 20)
+    mmap.warm(async: true)
+    mmap.wait_warm
+    assert_equal(1.0, mmap.warm_progress)
+    assert_equal("\0\0", mmap[(64 << 20) - 2, 2])
+    mmap.unmap
+
+    path = File.join(@tmp, "aa")
+    File.write(path, "a")
+    mmap = Mmap.new(path, "rw", populate: true)
+    mmap.warm
+    mmap << "b" * 100_000
+    assert_equal(100_001, mmap.size)
+    mmap.unmap
+  end
+
   def test_each
     assert_equal @str.bytes, @mmap.to_a
   end
@@ -186,6 +274,75 @@ class TestMmap < Minitest::Test
     @mmap.each_line("in") { |line| actual << line }
     @str.each_line("in") { |line| expected << line }
     assert_equal expected, actual
+
+    assert_equal @str.each_line(chomp: true).to_a, @mmap.each_line(chomp: true).to_a
+    assert_equal @str.each_line("in", chomp: true).to_a, @mmap.each_line("in", chomp: true).to_a
+    assert_equal @str.each_line(nil).to_a, @mmap.each_line(nil).to_a
+    assert_equal @str.each_line("").to_a, @mmap.each_line("").to_a
+  end
+
+  def test_each_line_offsets
+    lines = []
+    @mmap.each_line(offsets: true) { |offset, length| lines << @str.byteslice(offset, length) }
+    assert_equal @str.each_line.to_a, lines
+
+    lines = []
+    @mmap.each_line("in", chomp: true, offsets: true) { |offset, length| lines << @str.byteslice(offset, length) }
+    assert_equal @str.each_line("in", chomp: true).to_a, lines
+
+    mmap = Mmap.new(nil, length: 12, initialize: "a")
+    mmap[3] = "\r"
+    mmap[4] = "\n"
+    assert_equal ["aaa", "aaaaaaa"], mmap.each_line(chomp: true).to_a
+    assert_equal 12, mmap.each_byte.size
+    mmap.munmap
+  end
+
+  def test_line_index
+    lines = @str.lines
+    assert_same(@mmap, @mmap.build_line_index)
+    assert_equal(lines.size, @mmap.line_count)
+    assert_equal(lines[0], @mmap.line_at(0))
+    assert_equal(lines[123], @mmap.line_at(123))
+    assert_equal(lines[-1], @mmap.line_at(-1))
+    assert_nil(@mmap.line_at(lines.size))
+    assert_equal(lines[10...20], @mmap.lines(10...20))
+    assert_equal(lines[-3, 5], @mmap.lines(-3, 5))
+    assert_nil(@mmap.lines(lines.size + 1, 1))
+
+    @mmap << "tail\nend"
+    lines = @mmap.to_str.lines
+    assert_equal(lines.size, @mmap.line_count)
+    assert_equal("end", @mmap.line_at(-1))
+    @mmap[lines[0].size - 1, 1] = " "
+    assert_equal(lines[0].chomp + " " + lines[1], @mmap.line_at(0))
+    assert_equal(lines.size - 1, @mmap.line_count)
+
+    index = File.join(@tmp, "bb")
+    path = File.join(@tmp, "aa")
+    File.write(path, @str)
+    mmap = Mmap.new(path, "r")
+    mmap.build_line_index(index)
+    mmap.unmap
+    mmap = Mmap.new(path, "r")
+    assert_equal(@str.lines, mmap.build_line_index(index).lines(0..))
+    mmap.unmap
+    File.write(path, "a\nb\n")
+    mmap = Mmap.new(path, "r")
+    assert_equal(2, mmap.build_line_index(index).line_count)
+    mmap.unmap
+    [[1, 1 << 30], [3, 1]].each do |offsets|
+      File.open(index, "r+b") { |f| f.pwrite(offsets.pack("L*"), 64) }
+      mmap = Mmap.new(path, "r")
+      assert_equal(["a\n", "b\n"], mmap.build_line_index(index).lines(0..))
+      mmap.unmap
+    end
+    assert_equal([1, 3], File.binread(index, 8, 64).unpack("L*"))
+
+    mmap = Mmap.new(path, "r")
+    mmap.to_io_buffer { assert_equal("b\n", mmap.line_at(1)) }
+    mmap.unmap
+    assert_raises(ArgumentError) { Mmap.new(nil, length: 8).build_line_index(index) }
   end
 
   def test_iterate
@@ -222,8 +379,302 @@ class TestMmap < Minitest::Test
     assert_equal(@mmap.crypt("abc"), @str.crypt("abc"), "<crypt>")
   end
 
+  def test_gsub
+    [
+      ["mmap", "m"], ["mmap", "memory_map"], ["rb_", ""], ["a.", "??"],
+      [/mmap_(\w+)/, "<\\1>"], [/\s+/, " "], [/x*/, "-"]
+    ].each do |pat, repl|
+      File.write(@mmap_c, @str)
+      mmap = Mmap.new(@mmap_c, "rw")
+      str = @str.dup
+      assert_equal(str.gsub!(pat, repl).nil?, mmap.gsub!(pat, repl).nil?, "<gsub! #{pat.inspect}>")
+      assert_equal(str, mmap.to_str, "<gsub! #{pat.inspect}>")
+      mmap.unmap
+      assert_equal(str, File.read(@mmap_c), "<file #{pat.inspect}>") if str.size >= @str.size
+    end
+
+    File.write(@mmap_c, @str)
+    mmap = Mmap.new(@mmap_c, "rw")
+    str = @str.dup
+    str.gsub!(/rb_\w+/) { |m| m.upcase * 2 }
+    mmap.gsub!(/rb_\w+/) { |m| m.upcase * 2 }
+    assert_equal(str, mmap.to_str, "<gsub! block>")
+    assert_raises(RuntimeError) { mmap.gsub!(/VALUE/) { mmap << "x" } }
+    mmap.unmap
+
+    mmap = Mmap.new(nil, length: 8, initialize: "a")
+    assert_raises(TypeError) { mmap.gsub!("a", "bb") }
+    assert_equal(mmap, mmap.gsub!("aa", "bc"))
+    assert_equal("bcbcbcbc", mmap.to_str)
+    mmap.munmap
+  end
+
+  def test_write_batch
+    str = @str.dup
+    records = Array.new(200) { |i| [i * 97, "rec#{i}"] }
+    records.each { |off, rec| str[off, rec.size] = rec }
+    assert_equal(@mmap, @mmap.write_batch(records))
+    assert_equal(str, @mmap.to_str)
+
+    buf = +""
+    @mmap.write_batch do |batch|
+      buf.replace("head")
+      batch[0] = buf
+      buf.replace("last")
+      batch.write(-4, buf)
+    end
+    str[0, 4] = "head"
+    str[-4, 4] = "last"
+    assert_equal(str, @mmap.to_str)
+
+    size = @mmap.size
+    @mmap.write_batch([[size + 4, "end"], [size, "x"]])
+    assert_equal(str + "x\0\0\0end", @mmap.to_str)
+    assert_raises(ArgumentError) { @mmap.write_batch([[0, "abc"], [2, "x"]]) }
+    assert_raises(IndexError) { @mmap.write_batch([[-@mmap.size - 1, "x"]]) }
+
+    mmap = Mmap.new(nil, length: 4)
+    assert_raises(TypeError) { mmap.write_batch([[3, "xy"]]) }
+    mmap.write_batch([[1, "xy"]])
+    assert_equal("\0xy\0", mmap.to_str)
+    mmap.munmap
+  end
+
+  def test_read_into_write_from
+    buf = String.new(capacity: 64)
+    assert_equal(20, @mmap.read_into(buf, 100, 20))
+    assert_equal(@str[100, 20], buf)
+    assert_equal(5, @mmap.read_into(buf, -5, 20))
+    assert_equal(@str[-5..], buf)
+    assert_equal(0, @mmap.read_into(buf, @str.size))
+    assert_equal("", buf)
+    assert_raises(IndexError) { @mmap.read_into(buf, @str.size + 1) }
+    assert_raises(TypeError) { @mmap.read_into(:buf) }
+
+    io = IO::Buffer.new(16)
+    assert_equal(16, @mmap.read_into(io, 10))
+    assert_equal(@str[10, 16], io.get_string)
+    assert_equal(4, @mmap.read_into(io, 0, 4))
+    assert_raises(ArgumentError) { @mmap.read_into(io, 0, 17) }
+
+    assert_equal(4, @mmap.write_from("ABCD", 8))
+    assert_equal(2, @mmap.write_from(io, 20, 2))
+    @str[8, 4] = "ABCD"
+    @str[20, 2] = @str[0, 2]
+    assert_equal(@str, @mmap.to_str)
+    assert_equal(16, @mmap.write_from(io, @str.size - 4))
+    assert_equal(@str[0..-5] + io.get_string, @mmap.to_str)
+    assert_raises(ArgumentError) { @mmap.write_from("ab", 0, 3) }
+  end
+
+  def test_io_buffer
+    buf = @mmap.to_io_buffer(10, 16)
+    assert_equal(@str[10, 16], buf.get_string)
+    buf.set_string("ABCD")
+    assert_equal("ABCD", @mmap[10, 4])
+    @mmap[14, 2] = "ef"
+    assert_equal("ABCDef", buf.get_string(0, 6))
+    assert_raises(IOError) { @mmap << "x" }
+    assert_same(@mmap, @mmap.warm(async: false))
+    assert_equal(@str.index("static"), @mmap.index("static"))
+    buf.free
+    @mmap << "x"
+    assert_raises(IndexError) { @mmap.to_io_buffer(0, @mmap.size + 1) }
+
+    path = File.join(@tmp, "aa")
+    size = @mmap.to_io_buffer { |b| File.open(path, "wb") { |f| b.write(f) } }
+    assert_equal(@mmap.size, size)
+    assert_equal(@mmap.to_str, File.binread(path))
+    @mmap << "y"
+
+    @mmap.freeze
+    @mmap.to_io_buffer { |b| assert_predicate(b, :readonly?) }
+
+    io = IO::Buffer.for(+"hello world")
+    io = io.dup if io.readonly?
+    mmap = Mmap.from_io_buffer(io, 6)
+    assert_equal("world", mmap.to_str)
+    mmap[0, 5] = "WORLD"
+    assert_equal("hello WORLD", io.get_string)
+    assert_raises(TypeError) { mmap << "!" }
+    assert_raises(NotImplementedError) { mmap.msync }
+    assert_predicate(io, :locked?)
+    mmap.unmap
+    refute_predicate(io, :locked?)
+    assert_equal("WORLD", Mmap.from_io_buffer(io, 6) { |m| assert_predicate(io, :locked?) && m.to_str.dup })
+    refute_predicate(io, :locked?)
+    Mmap.from_io_buffer(io) { |m| m.unmap }
+    Thread.new { Mmap.from_io_buffer(io) }.join
+    GC.start
+    refute_predicate(io, :locked?)
+    assert_predicate(Mmap.from_io_buffer(IO::Buffer.for("abc")), :frozen?)
+  end
+
+  def test_find_any
+    patterns = ["mmap", "rb_", "static VALUE", "VALUE"]
+    expected = []
+    patterns.each_with_index do |pattern, id|
+      offset = -1
+      expected << [id, offset] while (offset = @str.index(pattern, offset + 1))
+    end
+    expected.sort_by! { |id, offset| [offset, id] }
+    matcher = Mmap::Matcher.new(patterns)
+    assert_equal(4, matcher.size)
+    assert_equal(expected, @mmap.each_match_any(matcher).to_a)
+    assert_equal(expected, @mmap.each_match_any(patterns).to_a)
+
+    assert_equal(expected.first, @mmap.find_any(matcher))
+    offset = @str.index("static VALUE")
+    assert_equal([1, offset], @mmap.find_any(["VALUE", "static VALUE", "tic"], offset))
+    assert_nil(@mmap.find_any(["\0\0\0"]))
+    assert_raises(ArgumentError) { Mmap::Matcher.new([]) }
+    assert_raises(ArgumentError) { Mmap::Matcher.new(["a", ""]) }
+  end
+
+  def test_scan_offsets
+    expected = []
+    @str.scan(/static (\w+)/) { expected << [$~.begin(0), $~.end(0)] }
+    assert_equal(expected, @mmap.scan_offsets(/static (\w+)/).to_a)
+    expected = []
+    @str.scan(/(?<ret>VALUE|void)\n(?<name>\w+)/) { expected << [$~.begin(:name), $~.end(:name)] }
+    assert_equal(expected, @mmap.scan_offsets(/(?<ret>VALUE|void)\n(?<name>\w+)/, :name).to_a)
+
+    mmap = Mmap.new(nil, length: 2, initialize: "a")
+    mmap[1] = "b"
+    assert_equal([[nil, nil], [1, 2]], mmap.scan_offsets(/a|(b)/, 1).to_a)
+    assert_equal([[0, 0], [1, 1], [2, 2]], mmap.scan_offsets(//).to_a)
+    mmap.munmap
+    assert_raises(IndexError) { @mmap.scan_offsets(/a/, 1).first }
+    assert_raises(IndexError) { @mmap.scan_offsets(/a/, :name).first }
+  end
+
+  def test_parallel_scan_regexp
+    mmap = Mmap.new(@mmap_c, "r")
+    _, err = capture_io do
+      [/static (\w+)/, /^\w+\(/, /(?<=\n)\n*/, /x*/].each do |pattern|
+        expected = mmap.scan_offsets(pattern).to_a
+        assert_equal(expected, mmap.parallel_scan(pattern, max_match_length: 64, chunk_size: 4096, workers: 3))
+        assert_equal(expected, mmap.parallel_scan(pattern, max_match_length: 64, workers: 1))
+      end
+    end
+    assert_empty(err)
+
+    offsets = []
+    mmap.parallel_scan(/VALUE/, max_match_length: 5, chunk_size: 1000, workers: 2) { |b, e| offsets << b << e }
+    assert_equal(mmap.scan_offsets(/VALUE/).to_a.flatten, offsets)
+    first = nil
+    mmap.parallel_scan(/VALUE/, max_match_length: 5, chunk_size: 1000, workers: 2) do |b, _|
+      first = b
+      assert_raises(IOError) { mmap.unmap }
+      break
+    end
+    assert_equal(offsets.first, first)
+    mmap.unmap
+    assert_raises(ArgumentError) { @mmap.parallel_scan(/a/, max_match_length: 0) }
+    assert_raises(IOError) { @mmap.parallel_scan(/a/, max_match_length: 1) }
+    @mmap.freeze
+    assert_equal(@mmap.scan_offsets(/VALUE/).to_a, @mmap.parallel_scan(/VALUE/, max_match_length: 5, chunk_size: 1000, workers: 2))
+    window = Mmap.new(@mmap_c, window: 8192)
+    assert_raises(NotImplementedError) { window.parallel_scan(/a/, max_match_length: 1) }
+    window.unmap
+  end
+
+  def test_search
+    str = @str.b
+    ["rb_raise", "mmap", "\n}\n", "static VALUE\nrb_cMmap", "x", "", "zzzzzz", str[-40..]].each do |pat|
+      assert_same_result(str.index(pat), @mmap.index(pat), "<index #{pat.inspect}>")
+      assert_same_result(str.rindex(pat), @mmap.rindex(pat), "<rindex #{pat.inspect}>")
+      assert_equal(str.include?(pat), @mmap.include?(pat), "<include? #{pat.inspect}>")
+      [0, 1, 1000, -1000, -1, str.size, str.size + 1, -str.size - 1].each do |pos|
+        assert_same_result(str.index(pat, pos), @mmap.index(pat, pos), "<index #{pat.inspect}, #{pos}>")
+        assert_same_result(str.rindex(pat, pos), @mmap.rindex(pat, pos), "<rindex #{pat.inspect}, #{pos}>")
+      end
+    end
+
+    ["a", "\\-a", "a-", "^a-z", "^", "a-cx-z", "\\\\", "\x00-\xff".b].each do |set|
+      assert_equal(str.count(set), @mmap.count(set), "<count #{set.inspect}>")
+    end
+    assert_equal(str.count("a-z", "^aeiou"), @mmap.count("a-z", "^aeiou"), "<count intersection>")
+    assert_raises(ArgumentError) { @mmap.count("z-a") }
+    assert_raises(ArgumentError) { @mmap.count }
+  end
+
+  def test_parallel_scan
+    threshold, threads = Mmap.parallel_threshold, Mmap.parallel_threads
+    Mmap.parallel_threshold = 0
+    Mmap.parallel_threads = 4
+
+    size = (4 << 20) + 123
+    str = "a" * size
+    mmap = Mmap.new(nil, length: size, initialize: "a")
+    other = Mmap.new(nil, length: size, initialize: "a")
+    [(1 << 20) - 2, (2 << 20) - 1, size - 4].each do |pos|
+      str[pos, 4] = mmap[pos, 4] = other[pos, 4] = "xyzw"
+    end
+
+    assert_equal(str.index("xyzw"), mmap.index("xyzw"), "<index>")
+    assert_equal(str.index("xyzw", 1 << 20), mmap.index("xyzw", 1 << 20), "<index offset>")
+    assert_equal(str.rindex("xyzw"), mmap.rindex("xyzw"), "<rindex>")
+    assert_equal(str.rindex("xyzw", 2 << 20), mmap.rindex("xyzw", 2 << 20), "<rindex offset>")
+    assert_nil(mmap.index("xyzwxyzw"), "<index>")
+    assert_equal(str.count("x-z"), mmap.count("x-z"), "<count>")
+    assert_equal(str.sum, mmap.sum, "<sum>")
+    assert_equal(str.sum(64), mmap.sum(64), "<sum 64>")
+    assert_equal(true, mmap == other, "==")
+    other[3 << 20] = "b"
+    assert_equal(false, mmap == other, "==")
+    assert_equal(false, mmap.eql?(other), "eql?")
+    mmap.munmap
+    other.munmap
+  ensure
+    Mmap.parallel_threshold = threshold
+    Mmap.parallel_threads = threads
+  end
+
+  def test_ipc_lock
+    mmap = Mmap.new(@mmap_c, "rw", ipc: true)
+    assert_operator(mmap.ipc_key, :>, 0)
+    mmap.semlock { mmap.semlock { mmap[0] = "x" } }
+    assert_equal("x", mmap[0])
+
+    reader, writer = IO.pipe
+    pid = fork do
+      reader.close
+      mmap.semlock do
+        writer.write("locked")
+        sleep 0.3
+      end
+      exit!(0)
+    end
+    writer.close
+    assert_equal("locked", reader.read(6))
+    assert_raises(Errno::EAGAIN) { mmap.semlock(false) {} }
+    started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    mmap.semlock { mmap[0] = "w" }
+    assert_operator(Process.clock_gettime(Process::CLOCK_MONOTONIC) - started, :<, 1)
+    Process.wait(pid)
+
+    pid = fork { mmap.semlock { exit!(0) } }
+    Process.wait(pid)
+    assert_output(nil, /recovered an ipc lock held by a dead process/) do
+      mmap.semlock(false) { mmap[0] = "y" }
+    end
+    assert_equal("y", mmap[0])
+  ensure
+    mmap&.unmap
+  end
+
   def test_easy_sub!
     assert_equal(@mmap.index("rb_raise"), @mmap.index("rb_raise"), "<index>")
+    mmap = Mmap.new(nil, length: 7, initialize: " ")
+    mmap[0, 7] = "abc a.c"
+    assert_same(mmap, mmap.sub!("a.c", "XYZ"))
+    assert_equal("abc XYZ", mmap.to_str)
+    assert_nil(mmap.sub!("a.c", "XYZ"))
+    mmap[0, 7] = "abc a.c"
+    mmap.gsub!("a.c", "XYZ")
+    assert_equal("abc XYZ", mmap.to_str)
+    mmap.unmap
   end
 
   def test_modify
@@ -307,6 +758,422 @@ class TestMmap < Minitest::Test
     end
   end
 
+  def test_msync_ranges
+    assert_same(@mmap, @mmap.msync(0, 10))
+    assert_same(@mmap, @mmap.msync(100..200, Mmap::MS_ASYNC))
+    assert_same(@mmap, @mmap.msync(5000, 10, Mmap::MS_SYNC))
+    assert_raises(IndexError) { @mmap.msync(0, @mmap.size + 1) }
+
+    page = 4096
+    path = File.join(@tmp, "aa")
+    File.write(path, "a" * (page * 100))
+    mmap = Mmap.new(path, "rw", track_dirty: true)
+    assert_empty(mmap.dirty_ranges)
+    mmap[10] = "b"
+    mmap[page * 50 + 1, 2] = "cc"
+    mmap[page * 50 + 4096 * 2] = "d"
+    mmap[page * 3, 1] = "e"
+    assert_equal([0...page, page * 3...page * 4, page * 50...page * 51, page * 52...page * 53],
+                 mmap.dirty_ranges)
+    mmap[page * 51, 1] = "f"
+    assert_equal(3, mmap.dirty_ranges.size)
+    mmap.msync
+    assert_empty(mmap.dirty_ranges)
+    300.times { |i| mmap[i * 200] = "g" }
+    assert_equal([0...page * 15], mmap.dirty_ranges)
+    mmap.upcase!
+    assert_equal([0...page * 100], mmap.dirty_ranges)
+    mmap.flush
+    assert_equal(mmap.to_str, File.read(path))
+    mmap.unmap
+  end
+
+  def test_ranged_protection
+    page = 4096
+    path = File.join(@tmp, "aa")
+    File.write(path, "a" * (page * 4))
+    mmap = Mmap.new(path, "rw", growth: :geometric)
+    assert_nil(mmap.madvise(Mmap::MADV_RANDOM, page, page))
+    assert_nil(mmap.madvise(Mmap::MADV_WILLNEED, 0...10))
+    assert_nil(mmap.madvise(Mmap::MADV_COLD, page * 3, page)) if defined?(Mmap::MADV_COLD)
+    assert_same(mmap, mmap.mlock(0, 100))
+    assert_same(mmap, mmap.munlock(0...100))
+    begin
+      mmap.mlock(0, page, on_fault: true)
+    rescue NotImplementedError, ArgumentError
+      # no mlock2 or RLIMIT_MEMLOCK too low
+    end
+    mmap.munlock
+
+    if File.readable?("/proc/self/smaps")
+      # A map whose offset is not page aligned starts 100 bytes into its
+      # first page: ranged calls must still act on the pages they cover.
+      bb = File.join(@tmp, "bb")
+      File.write(bb, "b" * (page * 4))
+      locked = lambda do
+        File.read("/proc/self/smaps").split(/^(?=\h+-\h+ )/).sum do |vma|
+          vma.lines.first.end_with?(" #{File.realpath(bb)}\n") ? vma[/^Locked: +(\d+)/, 1].to_i : 0
+        end
+      end
+      shifted = Mmap.new(bb, "rw", offset: 100)
+      begin
+        shifted.mlock
+        assert_equal(16, locked.call)
+        shifted.munlock(page, page)
+        assert_equal(8, locked.call)
+      rescue ArgumentError
+        # RLIMIT_MEMLOCK too low
+      end
+      shifted.unmap
+    end
+
+    assert_same(mmap, mmap.mprotect("r", page + 10, 20))
+    assert_raises(IOError) { mmap[page + 4000] = "b" }
+    assert_raises(IOError) { mmap[page * 2 - 1, 2] = "bb" }
+    assert_raises(IOError) { mmap.upcase! }
+    assert_equal("a", mmap[page + 4000])
+    mmap[page * 2] = "c"
+    mmap[10] = "c"
+    mmap << "d" * (page * 8)
+    assert_raises(IOError) { mmap[page] = "e" }
+    mmap.mprotect("rw", page, page)
+    mmap[page] = "e"
+    assert_equal("e", mmap[page])
+    assert_raises(IndexError) { mmap.madvise(Mmap::MADV_NORMAL, 0, page * 100) }
+    mmap.unmap
+  end
+
+  def test_window
+    path = File.join(@tmp, "aa")
+    str = Array.new(20_000) { |i| "line #{i} #{"x" * (i % 37)}\n" }.join
+    File.write(path, str)
+    mmap = Mmap.new(path, window: 8000)
+    assert_equal(str.size, mmap.size)
+    [0, 8191, 8192, 100_000, str.size - 1, str.size, -5].each do |i|
+      str[i] ? assert_equal(str[i], mmap[i], "[#{i}]") : assert_nil(mmap[i], "[#{i}]")
+      assert_equal(str[i, 20_000], mmap[i, 20_000], "[#{i}, 20000]")
+    end
+    assert_equal(str[8000..70_000], mmap[8000..70_000])
+    assert_equal(str.index("line 19999"), mmap.index("line 19999"))
+    assert_equal(str.index("line 1", 50_000), mmap.index("line 1", 50_000))
+    assert_nil(mmap.index("nothere"))
+    assert(mmap.include?("line 7777 "))
+    assert_equal(str.count("x"), mmap.count("x"))
+    assert_equal(str.sum(32), mmap.sum(32))
+    assert_equal(str.each_line.to_a, mmap.each_line.to_a)
+    assert_equal(str.each_line(chomp: true).first(3), mmap.each_line(chomp: true).first(3))
+    assert_equal(str.bytes.first(9000), mmap.each_byte.first(9000))
+    assert_raises(NotImplementedError) { mmap.to_str }
+    assert_raises(NotImplementedError) { mmap[/line/] }
+    assert_raises(NotImplementedError) { mmap.rindex("line") }
+    assert_raises(ArgumentError) { mmap.index("x" * 100_000) }
+    mmap.unmap
+
+    mmap = Mmap.new(path, offset: 12_345, length: 100)
+    assert_equal(str[12_345, 100], mmap.to_str)
+    mmap.unmap
+    mmap = Mmap.new(path, "rw", offset: 5000, track_dirty: true)
+    assert_equal(str[5000..], mmap.to_str)
+    mmap[0] = "L"
+    assert_equal([0...4096 - 5000 % 4096], mmap.dirty_ranges)
+    mmap.msync
+    mmap.unmap
+    assert_equal("L", File.read(path)[5000])
+    assert_raises(ArgumentError) { Mmap.new(path, window: 4096, offset: (1 << 33) - 1) }
+    assert_raises(ArgumentError) { Mmap.new(nil, length: 4096, window: 4096) }
+  end
+
+  def test_scalars
+    path = File.join(@tmp, "aa")
+    data = [0xdeadbeef, -2, 1.5, 2**64 - 1, -3.25].pack("L<s>eQ<G") + "x" * 10
+    File.write(path, data)
+    mmap = Mmap.new(path, "rw", track_dirty: true)
+    assert_equal(0xdeadbeef, mmap.get_u32(0))
+    assert_equal(0xefbeadde, mmap.get_u32(0, endian: :big))
+    assert_equal(0xef, mmap.get_u8(0))
+    assert_equal(-17, mmap.get_i8(0))
+    assert_equal(-2, mmap.get_i16(4, endian: :big))
+    assert_equal(1.5, mmap.get_f32(6))
+    assert_equal(2**64 - 1, mmap.get_u64(10))
+    assert_equal(-1, mmap.get_i64(10))
+    assert_equal(-3.25, mmap.get_f64(18, endian: :big))
+    assert_equal("x".ord, mmap.get_u8(-1))
+    assert_raises(IndexError) { mmap.get_u16(-1) }
+    assert_raises(IndexError) { mmap.get_u64(mmap.size - 7) }
+    assert_raises(ArgumentError) { mmap.get_u16(0, endian: :middle) }
+
+    assert_equal(-1, mmap.put_i32(0, -1))
+    assert_equal(0xffffffff, mmap.get_u32(0))
+    mmap.put_u16(26, 0x1234, endian: :big)
+    assert_equal("\x12\x34".b, mmap[26, 2])
+    mmap.put_f64(10, 0.1)
+    assert_equal(0.1, mmap.get_f64(10))
+    mmap.put_u64(18, 2**64 - 1)
+    assert_equal(-1, mmap.get_i64(18))
+    assert_raises(RangeError) { mmap.put_u8(0, 256) }
+    assert_raises(RangeError) { mmap.put_u64(0, -1) }
+    assert_raises(RangeError) { mmap.put_i8(0, -129) }
+    assert_equal([0...4096], mmap.dirty_ranges)
+    mmap.unmap
+    assert_equal("\x12\x34".b, File.binread(path)[26, 2])
+
+    mmap = Mmap.new(path, window: 4096)
+    assert_equal(0x1234, mmap.get_u16(26, endian: :big))
+    assert_raises(NotImplementedError) { mmap.put_u8(0, 1) }
+    mmap.unmap
+    assert_raises(FrozenError) { Mmap.new(path).put_u8(0, 1) }
+  end
+
+  def test_atomics
+    mmap = Mmap.new(nil, length: 4096)
+    assert_equal(0, mmap.atomic_load(0))
+    assert_equal(5, mmap.atomic_add(0, 5))
+    assert_equal(3, mmap.atomic_add(0, -2, order: :relaxed))
+    assert_equal(7, mmap.atomic_store(8, 7, width: 4, order: :release))
+    assert_equal(7, mmap.atomic_load(8, width: 4, order: :acquire))
+    assert(mmap.compare_and_swap(8, 7, 9, width: 4))
+    refute(mmap.compare_and_swap(8, 7, 11, width: 4))
+    assert_equal(9, mmap.get_u32(8))
+    assert_equal(0, mmap.fetch_or(16, 0b1010, width: 2))
+    assert_equal(0b1010, mmap.fetch_and(16, 0b0011, width: 2, order: :acq_rel))
+    assert_equal(0b0010, mmap.atomic_load(16, width: 2))
+    mmap.atomic_store(24, 0xff, width: 1)
+    assert_equal(-1, mmap.atomic_load(24, width: 1))
+    assert_raises(ArgumentError) { mmap.atomic_load(4) }
+    assert_raises(ArgumentError) { mmap.atomic_add(0, 1, width: 3) }
+    assert_raises(ArgumentError) { mmap.atomic_load(0, order: :release) }
+    assert_raises(ArgumentError) { mmap.atomic_store(0, 1, order: :consume) }
+    assert_raises(RangeError) { mmap.atomic_add(0, 1 << 16, width: 2) }
+    assert_raises(IndexError) { mmap.atomic_load(4096) }
+
+    pids = Array.new(4) do
+      fork do
+        1000.times { mmap.atomic_add(0, 1) }
+        exit!(0)
+      end
+    end
+    pids.each { |pid| Process.wait(pid) }
+    assert_equal(4003, mmap.atomic_load(0))
+    mmap.unmap
+  end
+
+  def test_log
+    path = File.join(@tmp, "aa")
+    log = Mmap::Log.new(path, capacity: 1 << 16)
+    assert_equal(1 << 16, log.capacity)
+    assert_equal(Mmap::Log::HEADER_SIZE, log.tail)
+    assert_equal(Mmap::Log::HEADER_SIZE, log.append("first"))
+    pos = log.read_from { |payload, offset| assert_equal(["first", Mmap::Log::HEADER_SIZE], [payload, offset]) }
+    assert_equal(Mmap::Log::HEADER_SIZE + 24, pos)
+
+    pids = Array.new(4) do |w|
+      fork do
+        child = Mmap::Log.new(path)
+        200.times { |i| child << "#{w}:#{i}" * (i % 5) }
+        exit!(0)
+      end
+    end
+    pids.each { |pid| Process.wait(pid) }
+    records = log.to_a
+    assert_equal(801, records.size)
+    4.times do |w|
+      mine = records.select { |r| r.start_with?("#{w}:") }
+      assert_equal(Array.new(200) { |i| "#{w}:#{i}" * (i % 5) }.reject(&:empty?), mine)
+    end
+    assert_equal(records.drop(1), log.read_from(pos, verify: true).map { |payload, _| payload })
+
+    pending = log.reserve(3)
+    log.reserve(2) { |r| r.write("ok") }
+    assert_raises(RuntimeError) { log.reserve(1) { raise "boom" } }
+    assert_equal(records.size, log.count)
+    pending.write("abc").commit
+    assert_equal(["abc", "ok"], log.to_a.last(2))
+    assert_raises(IOError) { pending.commit }
+    assert_raises(IndexError) { log.reserve(2).write("abc") }
+
+    torn = log.reserve(4)
+    torn.write("torn")
+    after = log.append("after the torn record")
+    log.reserve(10) # a reservation whose header was never written
+    last = log.tail - 32
+    log.close
+    raw = Mmap.new(path, "rw")
+    raw.atomic_store(last, 0)
+    raw.put_u8(after + Mmap::Log::RECORD_HEADER_SIZE, 0)
+    raw.unmap
+
+    log = Mmap::Log.new(path, capacity: 4096, recover: true)
+    assert_equal(1 << 16, log.capacity)
+    assert_equal(records + ["abc", "ok"], log.to_a)
+    assert_equal(0, log.recover)
+    tail = log.tail
+    assert_equal(tail, log.append("x"))
+    assert_raises(Mmap::Log::FullError) { log.reserve(1 << 16) }
+    assert_equal(tail + 24, log.tail)
+    assert_equal(records + ["abc", "ok", "x"], log.to_a)
+    log.flush.close
+    File.delete(path)
+    log = Mmap::Log.new(path, capacity: 4096)
+    assert_raises(Mmap::Log::FullError) { log.reserve(8000) }
+    offsets = []
+    offsets << log.append("b" * 100) while log.tail + 120 <= 4096
+    assert_raises(Mmap::Log::FullError) { log.append("b" * 100) }
+    last = log.tail
+    assert_equal(last, log.append("c"))
+    assert_equal(["b" * 100] * offsets.size + ["c"], log.to_a)
+    log.close
+    raw = Mmap.new(path, "rw")
+    raw.atomic_store(last, Mmap::Log::COMMITTED << 32 | 4096)
+    raw.unmap
+    log = Mmap::Log.new(path)
+    assert_raises(IOError) { log.to_a }
+    log.close
+
+    ["not a log", "not a log" * 100].each do |data|
+      File.write(path, data)
+      assert_raises(ArgumentError) { Mmap::Log.new(path) }
+      assert_equal(data, File.read(path))
+    end
+  end
+
+  def test_view
+    path = File.join(@tmp, "aa")
+    ints = Array.new(1003) { |i| (i * 7919 % 2001) - 1000 }
+    floats = Array.new(517) { |i| Math.sin(i) * 100 }
+    File.binwrite(path, "hdr!" + ints.pack("l*") + floats.pack("d*") + [2**63 - 1, 2**63 - 1].pack("q*"))
+    mmap = Mmap.new(path, "rw")
+
+    view = mmap.view(:int32, offset: 4, count: ints.size)
+    assert_equal(:int32, view.type)
+    assert_equal(ints.size, view.size)
+    assert_equal(ints.sum, view.sum)
+    assert_equal(ints.min, view.min)
+    assert_equal(ints.max, view.max)
+    assert_equal(ints.minmax, view.minmax)
+    assert_in_delta(ints.sum.fdiv(ints.size), view.mean)
+    assert_equal(ints, view.to_a)
+    assert_equal(ints.first(10), view.first(10))
+    assert_equal(ints[-1], view[-1])
+    assert_equal(ints[5, 3], view[5, 3])
+    assert_equal(ints[990..], view[990..])
+    assert_nil(view[ints.size])
+    assert_equal(ints.count(&:negative?), view.count(&:negative?))
+
+    off = 4 + ints.size * 4
+    view = mmap.view(:float64, offset: off, count: floats.size)
+    assert_in_delta(floats.sum, view.sum, 1e-9)
+    assert_equal(floats.minmax, view.minmax)
+    assert_equal(floats, view.to_a)
+    view = mmap.view(:int64, offset: off + floats.size * 8)
+    assert_equal(2, view.size)
+    assert_equal(2 * (2**63 - 1), view.sum)
+    assert_equal(ints.first(2).pack("l*").bytes, mmap.view(:uint8, offset: 4, count: 8).to_a)
+    assert_equal(ints.pack("l*").bytes.sum, mmap.view(:uint8, offset: 4, count: ints.size * 4).sum)
+
+    count = (3 << 20) + 5
+    wide = Mmap.new(nil, length: count * 4, initialize: "\xff")
+    assert_equal(count * 0xffffffff, wide.view(:uint32).sum)
+    assert_equal(-count, wide.view(:int32).sum)
+    assert_in_delta(0xffffffff, wide.view(:uint32).mean, 1e-3)
+    wide.unmap
+
+    assert_raises(ArgumentError) { mmap.view(:int32, offset: 2) }
+    assert_raises(ArgumentError) { mmap.view(:int128) }
+    assert_raises(IndexError) { mmap.view(:int32, offset: 0, count: mmap.size) }
+    assert_nil(mmap.view(:int32, offset: 4, count: 0).min)
+
+    view = mmap.view(:int32, offset: 4, count: 4)
+    mmap << "x" * 100_000
+    assert_equal(ints.first(4).sum, view.sum)
+    mmap.unmap
+    assert_raises(IOError) { view.sum }
+  end
+
+  def test_checksum
+    path = File.join(@tmp, "aa")
+    File.binwrite(path, Array.new(5000) { |i| (i * 31 + 7) % 251 }.pack("C*"))
+    mmap = Mmap.new(path, "r")
+    {
+      0 => [17241709254077376921, 3244421341483603138],
+      3 => [6261856666793576441, 1582743943441612892],
+      8 => [4442176141076628448, 16052704444545341486],
+      16 => [1382684913868184704, 12062957049132636838],
+      100 => [17344095063963169133, 7398874497090830788],
+      200 => [3066755708499685412, 17633084426012460677],
+      240 => [3200719663229436331, 2518229880650351743],
+      5000 => [1220661337900223636, 9424317569546284488]
+    }.each do |len, (xxh64, xxh3)|
+      assert_equal(xxh64, mmap.checksum(:xxh64, 0, len), "<xxh64 #{len}>")
+      assert_equal(xxh3, mmap.checksum(:xxh3, 0, len), "<xxh3 #{len}>")
+    end
+    assert_equal(6816827487666457287, mmap.checksum(:xxh64, 1000, 777))
+    assert_equal(3221885467379392027, mmap.checksum(:xxh3, 1000, 777))
+    assert_equal(759115607, mmap.checksum(:crc32c))
+    assert_equal(3353149565, mmap.checksum(:crc32c, 1000, 777))
+    assert_equal(3353149565, mmap.checksum(:crc32c, -4000, 777))
+    assert_equal(mmap.checksum(:xxh3, 4000), mmap.checksum(:xxh3, -1000))
+    assert_raises(IndexError) { mmap.checksum(:crc32c, -5001) }
+    assert_equal(mmap.hash, Mmap.new(path, "r").hash)
+    assert_raises(ArgumentError) { mmap.checksum(:md5) }
+    assert_raises(IndexError) { mmap.checksum(:crc32c, 4000, 1001) }
+    mmap.unmap
+
+    mmap = Mmap.new(nil, length: 9)
+    mmap[0, 9] = "123456789"
+    assert_equal(0xE3069283, mmap.checksum(:crc32c))
+    mmap.munmap
+
+    threshold, threads = Mmap.parallel_threshold, Mmap.parallel_threads
+    str = Array.new(300_000) { |i| "line #{i}\n" }.join
+    File.write(path, str)
+    mmap = Mmap.new(path, "r")
+    serial = [mmap.checksum(:crc32c), mmap.checksum(:xxh3, 5)]
+    Mmap.parallel_threshold = 0
+    Mmap.parallel_threads = 4
+    assert_equal(serial, [mmap.checksum(:crc32c), mmap.checksum(:xxh3, 5)])
+    mmap.unmap
+    Mmap.parallel_threshold = threshold
+    Mmap.parallel_threads = threads
+    assert_equal(serial[0], Mmap.new(path, window: 8000).checksum(:crc32c))
+  ensure
+    Mmap.parallel_threshold = threshold if threshold
+    Mmap.parallel_threads = threads if threads
+  end
+
+  def test_slice_ref
+    path = File.join(@tmp, "aa")
+    File.write(path, "alpha,beta,gamma,beta\n")
+    mmap = Mmap.new(path, "rw")
+    beta = mmap.slice_ref(6, 4)
+    assert_equal(4, beta.size)
+    assert_equal(6, beta.offset)
+    assert_equal("beta", beta.to_s)
+    assert_equal("beta", beta)
+    assert_equal(beta, "beta")
+    assert_equal(beta, mmap.slice_ref(17, 4))
+    refute_equal(beta, mmap.slice_ref(0, 4))
+    assert_equal("beta".hash, beta.hash)
+    assert_equal(1, { "beta" => 1 }[beta])
+    counts = Hash.new(0)
+    [6, 17, 0].each { |off| counts[mmap.slice_ref(off, 4)] += 1 }
+    assert_equal(2, counts[beta])
+    assert(beta.start_with?("x", "be"))
+    assert(beta.end_with?("ta"))
+    assert_equal(2, beta.index("t"))
+    assert_nil(beta.index("t", 3))
+    assert(beta.include?("et"))
+    assert_equal(21, mmap.slice_ref(-1, 1).offset)
+    assert_raises(IndexError) { mmap.slice_ref(20, 5) }
+
+    mmap << "x" * 100_000
+    assert_equal("beta", beta.to_s)
+    last = mmap.slice_ref(mmap.size - 4, 4)
+    mmap.gsub!("x" * 4, "")
+    assert_raises(IndexError) { last.to_s }
+    mmap.unmap
+    assert_raises(IOError) { beta.to_s }
+  end
+
   def test_frozen
     @mmap.freeze
     assert_raises FrozenError do